@@ -3,6 +3,14 @@ import ssl
 import asyncio
 import json
 
+try:
+    import msgpack
+except ImportError:
+    msgpack = None
+
+# Binary WebSocket subprotocol, see server_msgpack.h
+WS_PROTO_MSGPACK = "chitychat.msgpack"
+
 do_session = False
 commands = {}
 
@@ -127,11 +135,15 @@ class Bot:
         self.got_client_info = False
         self.got_client_groups = False
         self.uri: str = "wss://" + self.host + ":" + str(self.port)
+        self.binary = msgpack is not None
+
 
     async def send(self, cmd, **kwargs):
         kwargs["cmd"] = cmd
         print("SENDING:", str(kwargs))
-        return await self.ws.send(str(kwargs))
+        if self.binary:
+            return await self.ws.send(msgpack.packb(kwargs))
+        return await self.ws.send(json.dumps(kwargs))
     
     async def handle_packet(self, packet: dict):
             callback = commands.get(packet["cmd"])
@@ -146,7 +158,12 @@ class Bot:
             await self.handle_packet(packet)
     
     async def recv(self) -> dict:
-        ret = json.loads(await self.ws.recv())
+        data = await self.ws.recv()
+        # Server still sends some (pre-built JSON) messages as text
+        if isinstance(data, bytes):
+            ret = msgpack.unpackb(data)
+        else:
+            ret = json.loads(data)
         print("RECV", ret)
         return ret
     
@@ -155,7 +172,10 @@ class Bot:
         ssl_context.check_hostname = False
         ssl_context.verify_mode = ssl.CERT_NONE
 
-        self.ws = await websockets.connect(self.uri, ssl=ssl_context, ping_interval=None) 
+        subprotocols = [WS_PROTO_MSGPACK] if self.binary else None
+        self.ws = await websockets.connect(self.uri, ssl=ssl_context, ping_interval=None,
+                                           subprotocols=subprotocols) 
+        self.binary = self.ws.subprotocol == WS_PROTO_MSGPACK
     
     async def register(self) -> bool:
         await self.send("register",
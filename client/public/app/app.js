@@ -11,6 +11,10 @@ class Attach
         this.type = file.type;
         this.size = file.size;
         
+        /* Only images get a preview, don't read a whole video */
+        if (!file.type.startsWith("image/"))
+            return;
+
         const reader = new FileReader();
         reader.onload = (e) => {
             this.src = e.target.result;
@@ -426,12 +430,6 @@ export class App
 
     add_attachment(file)
     {
-        if (!file.type.startsWith("image/"))
-        {
-            console.log(file.name + " - is not image.");
-            return;
-        }
-
         let attach_con = document.createElement("div");
         attach_con.className = "input_attachment_con";
         attach_con.setAttribute("title", file.name);
@@ -21,20 +21,11 @@ export class Group
         this.div_list.className = "group";
         this.div_list.id = "group_" + this.id;
         this.div_list.innerHTML = this.name;
-        this.msg_offset = 0;
+        this.oldest_msg_id = 0;
+        this.requested_before = 0;
         this.get_scroll_messages = () => {
             if (app.messages_container.scrollTop === 0)
-            {
-                const packet = {
-                    cmd: "get_group_msgs",
-                    group_id: this.id,
-                    limit: 15,
-                    offset: this.msg_offset
-                };
-                this.msg_offset += packet.limit;
-
-                app.server.ws_send(packet);
-            }
+                this.get_msgs();
         };
         this.div_list.addEventListener("click", () => {
             this.select();
@@ -77,6 +68,9 @@ export class Group
         const content = msg.content;
         const attachments = msg.attachments;
 
+        if (!this.oldest_msg_id || msg.msg_id < this.oldest_msg_id)
+            this.oldest_msg_id = msg.msg_id;
+
         let div_msg = document.createElement("div");
         div_msg.className = "msg";
         div_msg.setAttribute("msg_user_id", user.id);
@@ -174,6 +168,24 @@ export class Group
                 attach_con.appendChild(div);
                 // div_msg.appendChild(img);
             }
+            else if (attch.type.startsWith("video/"))
+            {
+                let video = document.createElement("video");
+                video.src = location.protocol + "//" + location.host + "/upload/vids/" + attch.hash;
+                video.controls = true;
+                video.preload = "metadata";
+                video.title = attch.name;
+                video.style.maxWidth = "450px";
+                attach_con.appendChild(video);
+            }
+            else
+            {
+                let link = document.createElement("a");
+                link.href = location.protocol + "//" + location.host + "/upload/files/" + attch.hash;
+                link.download = attch.name;
+                link.innerText = attch.name;
+                attach_con.appendChild(link);
+            }
         }
 
         div_msg.appendChild(attach_con);
@@ -225,10 +237,15 @@ export class Group
         const packet = {
             cmd: "get_group_msgs",
             group_id: this.id,
-            limit: 15,
-            offset: this.msg_offset
+            limit: 15
         };
-        this.msg_offset += packet.limit;
+        // Page before the oldest one we have, new messages don't shift it
+        if (this.oldest_msg_id)
+        {
+            if (this.oldest_msg_id === this.requested_before)
+                return;
+            packet.before_msg_id = this.requested_before = this.oldest_msg_id;
+        }
 
         app.server.ws_send(packet);
     }
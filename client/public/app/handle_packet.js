@@ -315,36 +315,105 @@ function edit_account(packet)
     reader.readAsArrayBuffer(file);
 }
 
+const UPLOAD_CHUNK = 4 * 1024 * 1024;
+const UPLOAD_RESUMABLE_MIN = 8 * 1024 * 1024;
+
+/* Create, PUT chunks, finalize. A failed chunk asks the server where to continue. */
+async function upload_resumable(token, index, file)
+{
+    let resp = await fetch("/upload/session", {
+        method: 'POST',
+        headers: {
+            "Upload-Token": token,
+            "Attach-Index": index,
+            "Upload-Length": file.size
+        }
+    });
+    if (resp.status !== 201)
+        throw new Error("Upload create: " + resp.status);
+
+    const url = "/upload/session/" + resp.headers.get("Upload-Id");
+    let offset = 0;
+    let retries = 0;
+
+    while (offset < file.size)
+    {
+        const end = Math.min(offset + UPLOAD_CHUNK, file.size);
+        try 
+        {
+            resp = await fetch(url, {
+                method: 'PUT',
+                headers: {
+                    "Content-Range": "bytes " + offset + "-" + (end - 1) + "/" + file.size
+                },
+                body: file.slice(offset, end)
+            });
+            if (resp.ok)
+            {
+                offset = parseInt(resp.headers.get("Upload-Offset"));
+                retries = 0;
+                continue;
+            }
+        }
+        catch (error) 
+        {
+            console.warn("Upload chunk:", error);
+        }
+
+        if (++retries > 5)
+            throw new Error("Upload failed at " + offset);
+        await new Promise(r => setTimeout(r, 1000 * retries));
+
+        resp = await fetch(url, { method: 'HEAD' });
+        if (!resp.ok)
+            throw new Error("Upload lost: " + resp.status);
+        offset = parseInt(resp.headers.get("Upload-Offset"));
+    }
+
+    resp = await fetch(url, { method: 'POST' });
+    if (!resp.ok)
+        throw new Error("Upload finalize: " + resp.status);
+}
+
 function send_attachments(packet)
 {
     const token = packet.upload_token;
     const attachs = app.current_attachments;
 
+    const form = new FormData();
+    let n_form = 0;
+
+    /* Small images in one request, the rest resumable */
     for (let i = 0; i < attachs.length; i++)
     {
         const file = attachs[i].file;
-        const reader = new FileReader();
-
-        reader.onload = (ev) => {
-            const data = ev.target.result;
-
-            fetch("/upload/imgs", {
-                method: 'POST',
-                headers: {
-                    "Upload-Token": token,
-                    "Attach-Index": i
-                },
-                body: data
-            }).then(response => {
-                console.log(response);
-            })
-            .catch(error => {
-                console.error("POST error:", error);
+        if (file.type.startsWith("image/") && file.size < UPLOAD_RESUMABLE_MIN)
+        {
+            form.append("file" + i, file, file.name);
+            n_form++;
+        }
+        else
+        {
+            upload_resumable(token, i, file).catch(error => {
+                console.error("Upload error:", error);
             });
+        }
+    }
 
-            app.current_attachments.splice(i, 1);
-        };
-        reader.readAsArrayBuffer(file);
+    if (n_form)
+    {
+        fetch("/upload/imgs", {
+            method: 'POST',
+            headers: {
+                "Upload-Token": token
+            },
+            body: form
+        }).then(response => {
+            console.log(response);
+        })
+        .catch(error => {
+            console.error("POST error:", error);
+        });
     }
     
     let attachments = document.getElementById("input_attachments");
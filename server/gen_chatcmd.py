@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+
+#                                                          #
+#  gen_chatcmd - Generate chat command dispatch/decoders  #
+#                                                          #
+
+"""
+Reads chatcmd.def and writes chatcmd_gen.c and chatcmd_gen.h.
+
+Dispatch is a switch on command length, then on a character
+position that tells the same length commands apart (picked here),
+then one memcmp(). No string hashing at runtime.
+
+Usage:
+    gen_chatcmd.py <chatcmd.def> <chatcmd_gen.c> <chatcmd_gen.h>
+"""
+
+import sys
+
+TYPES = {
+    # type: (C decl, json_type, getter)
+    "int":    ("i32",          "json_type_int",     "json_object_get_int"),
+    "int64":  ("i64",          "json_type_int",     "json_object_get_int64"),
+    "bool":   ("bool",         "json_type_boolean", "json_object_get_boolean"),
+    "string": ("const char*",  "json_type_string",  "json_object_get_string"),
+    "array":  ("json_object*", "json_type_array",   None),
+}
+
+PERMS = ("NONE", "LOGGED_IN")
+
+HEADER = "/* Generated by gen_chatcmd.py from chatcmd.def, do not edit. */\n"
+
+class Field:
+    def __init__(self, spec: str, where: str):
+        name, _, type = spec.partition(":")
+        self.optional = name.endswith("?")
+        self.name = name.rstrip("?")
+        self.type = type
+        if not self.name.isidentifier() or type not in TYPES:
+            raise SystemExit(f"{where}: bad field '{spec}'")
+
+class Cmd:
+    def __init__(self, line: str, where: str):
+        parts = line.split()
+        if len(parts) < 3:
+            raise SystemExit(f"{where}: need <cmd> <handler> <perm>")
+        self.name = parts[0]
+        self.handler = parts[1]
+        self.perm = parts[2]
+        self.fields = [Field(f, where) for f in parts[3:]]
+        if not self.name.isidentifier() or not self.handler.isidentifier():
+            raise SystemExit(f"{where}: bad command '{self.name}'")
+        if self.perm not in PERMS:
+            raise SystemExit(f"{where}: bad perm '{self.perm}'")
+        self.id = "CHATCMD_" + self.name.upper()
+        self.struct = f"cmd_{self.name}_t"
+
+def parse(path: str) -> list:
+    cmds = []
+    names = set()
+    with open(path) as f:
+        for i, line in enumerate(f, 1):
+            line = line.split("#", 1)[0].strip()
+            if not line:
+                continue
+            cmd = Cmd(line, f"{path}:{i}")
+            if cmd.name in names:
+                raise SystemExit(f"{path}:{i}: duplicate command '{cmd.name}'")
+            names.add(cmd.name)
+            cmds.append(cmd)
+    return cmds
+
+def handler_proto(cmd: Cmd) -> str:
+    if cmd.fields:
+        return (f"const char* {cmd.handler}(eworker_t* ew, client_t* client, "
+                f"const {cmd.struct}* args, json_object* resp)")
+    return f"const char* {cmd.handler}(eworker_t* ew, client_t* client, json_object* resp)"
+
+def gen_header(cmds: list) -> str:
+    out = [HEADER, "#ifndef _CHATCMD_GEN_H_", "#define _CHATCMD_GEN_H_", "",
+           '#include "common.h"', '#include "server_tm.h"', '#include "server_client.h"', ""]
+
+    out.append("enum chatcmd_id\n{")
+    for cmd in cmds:
+        out.append(f"    {cmd.id},")
+    out.append("    CHATCMD_COUNT\n};\n")
+
+    for cmd in cmds:
+        if not cmd.fields:
+            continue
+        out.append("typedef struct\n{")
+        for field in cmd.fields:
+            out.append(f"    {TYPES[field.type][0]} {field.name};")
+            if field.type == "string":
+                out.append(f"    size_t {field.name}_len;")
+            if field.optional:
+                out.append(f"    bool has_{field.name};")
+        out.append(f"}} {cmd.struct};\n")
+
+    for cmd in cmds:
+        out.append(handler_proto(cmd) + ";")
+
+    out.append("\n#endif // _CHATCMD_GEN_H_\n")
+    return "\n".join(out)
+
+def gen_decoder(cmd: Cmd) -> list:
+    out = ["static const char*",
+           f"chatcmd_{cmd.name}(eworker_t* ew, client_t* client, "
+           f"{'json_object* payload' if cmd.fields else 'UNUSED json_object* payload'}, json_object* resp)",
+           "{"]
+    if not cmd.fields:
+        out += [f"    return {cmd.handler}(ew, client, resp);", "}", ""]
+        return out
+
+    out += [f"    {cmd.struct} args;", "    json_object* val;", ""]
+    for field in cmd.fields:
+        _, jtype, getter = TYPES[field.type]
+        getter = f"{getter}(val)" if getter else "val"
+        out.append(f'    val = json_object_object_get(payload, "{field.name}");')
+        if field.optional:
+            out += [f"    args.has_{field.name} = (val != NULL);",
+                    f"    if (val && json_bad(val, {jtype}))",
+                    f'        return JSON_INVALID_STR("{field.name}");',
+                    f"    args.{field.name} = (val) ? {getter} : 0;"]
+        else:
+            out += [f"    if (json_bad(val, {jtype}))",
+                    f'        return JSON_INVALID_STR("{field.name}");',
+                    f"    args.{field.name} = {getter};"]
+        if field.type == "string":
+            len_getter = "json_object_get_string_len(val)"
+            if field.optional:
+                len_getter = f"(val) ? {len_getter} : 0"
+            out.append(f"    args.{field.name}_len = {len_getter};")
+        out.append("")
+    out += [f"    return {cmd.handler}(ew, client, &args, resp);", "}", ""]
+    return out
+
+def c_char(c: str) -> str:
+    return "'\\''" if c == "'" else f"'{c}'"
+
+def gen_lookup(cmds: list) -> list:
+    by_len = {}
+    for cmd in cmds:
+        by_len.setdefault(len(cmd.name), []).append(cmd)
+
+    out = ["const server_chatcmd_t*",
+           "server_get_chatcmd(const char* cmd, size_t len)",
+           "{",
+           "    const server_chatcmd_t* chatcmd;",
+           "",
+           "    switch (len)",
+           "    {"]
+    for length in sorted(by_len):
+        group = by_len[length]
+        out.append(f"        case {length}:")
+        if len(group) == 1:
+            out += [f"            chatcmd = &chatcmds[{group[0].id}];", "            break;"]
+            continue
+
+        # Find a character position that is unique across the group
+        pos = next((i for i in range(length)
+                    if len({c.name[i] for c in group}) == len(group)), None)
+        if pos is None:
+            for c in group:
+                out += [f'            if (!memcmp(cmd, "{c.name}", {length}))',
+                        f"                return &chatcmds[{c.id}];"]
+            out.append("            return NULL;")
+            continue
+
+        out.append(f"            switch (cmd[{pos}])")
+        out.append("            {")
+        for c in group:
+            out += [f"                case {c_char(c.name[pos])}:",
+                    f"                    chatcmd = &chatcmds[{c.id}];",
+                    "                    break;"]
+        out += ["                default:", "                    return NULL;", "            }",
+                "            break;"]
+    out += ["        default:", "            return NULL;", "    }", "",
+            "    if (memcmp(cmd, chatcmd->cmd, len))",
+            "        return NULL;",
+            "    return chatcmd;",
+            "}", ""]
+    return out
+
+def gen_source(cmds: list, header_name: str) -> str:
+    out = [HEADER, f'#include "{header_name}"', '#include "chat/cmd.h"',
+           '#include "chat/ws_text_frame.h"', ""]
+
+    for cmd in cmds:
+        out += gen_decoder(cmd)
+
+    out.append("static const server_chatcmd_t chatcmds[CHATCMD_COUNT] = {")
+    for cmd in cmds:
+        out += [f"    [{cmd.id}] = {{",
+                f'        .cmd = "{cmd.name}",',
+                f"        .id = {cmd.id},",
+                f"        .perms = CHATCMD_PERM_{cmd.perm},",
+                f"        .exec = chatcmd_{cmd.name}",
+                "    },"]
+    out += ["};", ""]
+
+    out += gen_lookup(cmds)
+    return "\n".join(out)
+
+def main() -> int:
+    if len(sys.argv) != 4:
+        print(__doc__)
+        return -1
+    cmds = parse(sys.argv[1])
+    header_name = sys.argv[3].replace("\\", "/").rsplit("/", 1)[-1]
+    with open(sys.argv[2], "w") as f:
+        f.write(gen_source(cmds, header_name))
+    with open(sys.argv[3], "w") as f:
+        f.write(gen_header(cmds))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -5,29 +5,28 @@
 #include "common.h"
 #include "server_tm.h"
 #include "server_client.h"
+#include "chatcmd_gen.h"
 
 #define CHATCMD_PERM_LOGGED_IN CLIENT_STATE_LOGGED_IN
 #define CHATCMD_PERM_NONE      CLIENT_STATE_WEBSOCKET
 
-#define CMD_STR_MAX 32
-
-typedef const char* (*chatcmd_callback_t)(eworker_t* th, client_t* client, 
-                                          json_object* payload, json_object* resp);
+/* Decodes payload into cmd_<name>_t and calls the handler */
+typedef const char* (*chatcmd_exec_t)(eworker_t* th, client_t* client, 
+                                      json_object* payload, json_object* resp);
 
 typedef struct 
 {
-    u64                 cmd_hash;
-    char                cmd[CMD_STR_MAX];
-    chatcmd_callback_t  callback;
+    const char*         cmd;
+    enum chatcmd_id     id;
     i32                 perms;
+    chatcmd_exec_t      exec;
 } server_chatcmd_t;
 
-bool    server_init_chatcmd(server_t* server);
-bool    server_new_chatcmd(server_t* server, 
-                           const char* cmd, 
-                           chatcmd_callback_t callback, 
-                           i32 perms);
+/* Generated from chatcmd.def, see gen_chatcmd.py */
+const server_chatcmd_t* server_get_chatcmd(const char* cmd, size_t len);
+
 const char* server_exec_chatcmd(const char* cmd, 
+                                size_t cmd_len,
                                 eworker_t* th, 
                                 client_t* client, 
                                 json_object* payload, 
@@ -4,17 +4,23 @@
 #include "common.h"
 #include "chat/group.h"
 #include "chat/user_login.h"
+#include "chat/db_array.h"
 
 #define DB_DEFAULT      0x00
 #define DB_PIPELINE     0x01
 #define DB_NONBLOCK     0x02
+#define DB_PREPARE      0x04    /* Prepare all statements in `server_db_commands_t` */
 
 #define DB_ASYNC_BUSY   0
 #define DB_ASYNC_OK     1
 #define DB_ASYNC_ERROR -1
 
-#define DB_CTX_NO_JSON   0x01
-#define DB_CTX_DONT_FREE 0x02
+#define DB_PG_EPOCH_OFFSET  946684800LL  /* 2000-01-01 - 1970-01-01 in seconds */
+#define DB_USEC             1000000LL
+
+#define DB_CTX_NO_JSON    0x01
+#define DB_CTX_DONT_FREE  0x02
+#define DB_CTX_SINGLE_ROW 0x04  /* PQsetSingleRowMode(), exec_res gets PGRES_SINGLE_TUPLE per row */
 
 typedef struct 
 {
@@ -22,12 +28,6 @@ typedef struct
     const char* ids_json;
 } member_ids_param_t;
 
-typedef struct 
-{
-    u32 group_id; 
-    const char* msgs_json;
-} group_msgs_param_t;
-
 typedef struct 
 {
     u32 msg_id;
@@ -48,6 +48,13 @@ typedef struct
     u32 user_id;
 } group_owner_param_t;
 
+/* Frame built with ws_send_reserved() in mind */
+typedef struct 
+{
+    char*  buf;
+    size_t len;
+} frame_param_t;
+
 typedef struct
 {
     u32 user_id;
@@ -60,11 +67,11 @@ union cmd_param
 {
     user_login_param_t user_login;
     member_ids_param_t member_ids;
-    group_msgs_param_t group_msgs;
     get_group_codes_param_t group_codes;
     delete_msg_param_t del_msg;
     group_owner_param_t group_owner;
     rtusm_param_t rtusm;
+    frame_param_t frame;
     session_t*  session;
     json_object* json;
     const char* str;
@@ -73,11 +80,17 @@ union cmd_param
     u32         user_id;
 };
 
+/*
+ * `client` is only valid in the eworker loop iteration that set it,
+ * the pipeline keeps `client_hd` and resolves `client` again right
+ * before exec_res() and exec(). NULL there if the client is gone.
+ */
 typedef struct dbcmd_ctx
 {
     i32       ret;
     i32       flags;
     client_t* client;
+    client_hd_t client_hd;
     void*     data;
     size_t    data_size;
     dbexec_t     exec;
@@ -86,14 +99,25 @@ typedef struct dbcmd_ctx
     struct dbcmd_ctx* next;
 } dbcmd_ctx_t;
 
+#define DB_PIPELINE_QUEUE_SIZE  128  /* Initial size, doubles when full */
+#define DB_PIPELINE_BACKPRESSURE 512  /* In-flight count where eworker stops taking new events */
+
 typedef struct 
 {
-    dbcmd_ctx_t* begin;
-    dbcmd_ctx_t* end;
-    dbcmd_ctx_t* read;
-    dbcmd_ctx_t* write;
+    size_t high_water;  /* Max in-flight count */
+    size_t grows;       /* Times the queue grew */
+    size_t backpressure;/* Loop iterations spent over DB_PIPELINE_BACKPRESSURE */
+    u64    total;       /* Total enqueued */
+} plq_metrics_t;
+
+/* Growable ring buffer */
+typedef struct 
+{
+    dbcmd_ctx_t* buf;
+    size_t read;
     size_t size;
     size_t count;
+    plq_metrics_t metrics;
 } pipeline_queue_t, plq_t;
 
 typedef struct 
@@ -104,6 +128,26 @@ typedef struct
     dbcmd_ctx_t*  tail;
 } dbctx_t;
 
+#define DB_MSG_BATCH_MAX    128     /* Rows per INSERT, the rest go in another */
+#define DB_MSG_BATCH_COLS   4       /* insert_msg_batch.sql: $1..$4 */
+
+/* A group_msg waiting for the end of the eworker loop iteration */
+typedef struct
+{
+    dbmsg_t*    msg;
+    dbcmd_ctx_t ctx;    /* Caller's, exec'd as if it was its own INSERT */
+} db_msg_row_t;
+
+typedef struct
+{
+    db_msg_row_t*   rows;
+    size_t          n;
+    size_t          size;
+    db_array_t      cols[DB_MSG_BATCH_COLS];
+    u64             batches;
+    u64             total;
+} db_msg_batch_t;
+
 typedef struct server_db
 {
     i32     fd;
@@ -112,6 +156,7 @@ typedef struct server_db
     plq_t   queue;
     dbctx_t ctx;
     const server_db_commands_t* cmd;
+    db_msg_batch_t msg_batch;  /* See db_async_insert_group_msg() */
 } server_db_t;
 
 bool        server_init_db(server_t* server);
@@ -123,4 +168,11 @@ void        server_db_close(server_db_t* db);
 void db_row_to_user(dbuser_t* user, PGresult* res, i32 row);
 void db_row_to_group(dbgroup_t* group, PGresult* res, i32 row);
 
+/* Binary format (DB_FMT_BINARY) getters */
+i64     db_get_int(const PGresult* res, i32 row, i32 col);
+bool    db_get_bool(const PGresult* res, i32 row, i32 col);
+size_t  db_get_timestamp(const PGresult* res, i32 row, i32 col, char* buf, size_t size);
+/* `usec` since 2000-01-01 (PostgreSQL's epoch) -> its text format */
+size_t  db_timestamp_str(i64 usec, char* buf, size_t size);
+
 #endif // _SERVER_DB_
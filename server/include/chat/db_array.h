@@ -0,0 +1,29 @@
+#ifndef _SERVER_CHAT_DB_ARRAY_H_
+#define _SERVER_CHAT_DB_ARRAY_H_
+
+/*
+ * Array literals for text array parameters, e.g. $1::int[] or $2::text[].
+ *
+ *  {1,2,3} or {"a","b \"c\""}, strings are always quoted.
+ *  Lets one statement take many rows through unnest(). The buffer is
+ *  kept between uses, db_array_begin() only rewinds it.
+ */
+
+#include "common.h"
+
+typedef struct 
+{
+    char*   data;
+    size_t  len;
+    size_t  size;
+    bool    err;    /* Out of memory somewhere along the way */
+} db_array_t;
+
+void    db_array_begin(db_array_t* arr);
+void    db_array_int(db_array_t* arr, i64 val);
+void    db_array_str(db_array_t* arr, const char* str, size_t len);
+/* NUL-terminated in arr->data, false if it ran out of memory */
+bool    db_array_end(db_array_t* arr);
+void    db_array_free(db_array_t* arr);
+
+#endif // _SERVER_CHAT_DB_ARRAY_H_
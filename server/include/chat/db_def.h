@@ -12,6 +12,7 @@
 #define DB_DISPLAYNAME_MAX  50
 #define DB_MESSAGE_MAX      4096
 #define DB_TIMESTAMP_MAX    64
+#define DB_MSG_TIMESTAMP_MAX 32     /* db_get_timestamp(): "YYYY-MM-DD HH:MM:SS.ffffff" */
 #define DB_BIO_MAX          256
 #define DB_DESC_MAX         256
 #define DB_PASSWORD_MAX     50
@@ -24,62 +25,97 @@
 
 #define DB_INTSTR_MAX       30
 
+#define DB_SQL_DIR "server/sql/"
+
+/* libpq param/result formats */
+#define DB_FMT_TEXT     0
+#define DB_FMT_BINARY   1
+
+/* 
+ * Column order expected by db_row_to_user() and db_row_to_group().
+ * Keep select_user.sql and select_user_groups.sql in sync.
+ */
+#define DB_USER_COLS  "user_id, username, displayname, bio, hash, salt, created_at, pfp"
+#define DB_GROUP_COLS "group_id, owner_id, name, \"desc\", public, created_at"
+
+/*
+ * Prepared statements registry.
+ *
+ * Every statement listed here gets loaded in server_init_db() 
+ * and prepared on each eworker's connection (see DB_PREPARE), 
+ * then executed by name with db_async_prepared().
+ * New queries only need to be added here to be prepared.
+ *
+ * X(id, sql_file, inline_sql, result_format)
+ *      One of `sql_file` or `inline_sql` is NULL.
+ *      `result_format` TEXT or BINARY, see DB_FMT_*.
+ */
+#define DB_STMT_LIST(X)\
+    /* Users */\
+    X(INSERT_USER,              DB_SQL_DIR "insert_user.sql",               NULL, BINARY)\
+    X(SELECT_USER,              DB_SQL_DIR "select_user.sql",               NULL, BINARY)\
+    X(SELECT_USER_ID,           NULL, "SELECT " DB_USER_COLS " FROM Users WHERE user_id = $1::int;", BINARY)\
+    X(SELECT_USER_USERNAME,     NULL, "SELECT " DB_USER_COLS " FROM Users WHERE username = $1::varchar(50);", BINARY)\
+    X(SELECT_CONNECTED_USERS,   DB_SQL_DIR "select_connected_users.sql",    NULL, BINARY)\
+    X(SELECT_USER_JSON,         DB_SQL_DIR "select_user_json.sql",          NULL, TEXT)\
+    X(UPDATE_USER,              DB_SQL_DIR "update_user.sql",               NULL, TEXT)\
+    /* Groups */\
+    X(INSERT_GROUP,             DB_SQL_DIR "insert_group.sql",              NULL, BINARY)\
+    X(SELECT_GROUP,             NULL, "SELECT " DB_GROUP_COLS " FROM Groups WHERE group_id = $1::int;", BINARY)\
+    X(SELECT_GROUP_OWNER,       NULL, "SELECT owner_id FROM Groups WHERE group_id = $1::int;", BINARY)\
+    X(SELECT_USER_GROUPS,       DB_SQL_DIR "select_user_groups.sql",        NULL, BINARY)\
+    X(SELECT_PUB_GROUP,         DB_SQL_DIR "select_public_group.sql",       NULL, TEXT)\
+    X(DELETE_GROUP,             NULL, "DELETE FROM Groups WHERE group_id = $1::int;", TEXT)\
+    X(DELETE_GROUP_MSGS,        NULL, "DELETE FROM Messages WHERE group_id = $1::int;", TEXT)\
+    X(DELETE_GROUP_MEMBERS,     NULL, "DELETE FROM GroupMembers WHERE group_id = $1::int;", TEXT)\
+    X(DELETE_GROUP_CODES,       NULL, "DELETE FROM GroupCodes WHERE group_id = $1::int;", TEXT)\
+    X(SELECT_GROUP_ATTACHS,     NULL, "SELECT attachments FROM Messages WHERE group_id = $1::int AND json_array_length(attachments) > 0;", TEXT)\
+    /* Group Members */\
+    X(SELECT_GROUPMEMBER,       DB_SQL_DIR "select_groupmember.sql",        NULL, BINARY)\
+    X(SELECT_MEMBER_IDS,        NULL, "SELECT user_id FROM GroupMembers WHERE group_id = $1::int;", BINARY)\
+    X(SELECT_MEMBER_IDS_JSON,   NULL, "SELECT json_agg(user_id) FROM GroupMembers WHERE group_id = $1::int;", TEXT)\
+    X(INSERT_PUB_GROUPMEMBER,   DB_SQL_DIR "join_pub_group.sql",            NULL, TEXT)\
+    X(INSERT_GROUPMEMBER_CODE,  DB_SQL_DIR "insert_groupmember_code.sql",   NULL, BINARY)\
+    /* Messages */\
+    X(INSERT_MSG,               DB_SQL_DIR "insert_msg.sql",                NULL, BINARY)\
+    X(INSERT_MSG_BATCH,         DB_SQL_DIR "insert_msg_batch.sql",          NULL, BINARY)\
+    X(INSERT_MSGS,              DB_SQL_DIR "insert_msgs.sql",               NULL, TEXT)\
+    X(SELECT_MSG,               DB_SQL_DIR "select_msg.sql",                NULL, TEXT)\
+    X(SELECT_GROUP_MSGS,        DB_SQL_DIR "select_group_msgs.sql",         NULL, TEXT)\
+    X(SELECT_GROUP_MSGS_BEFORE, DB_SQL_DIR "select_group_msgs_before.sql",  NULL, TEXT)\
+    X(DELETE_MSG,               DB_SQL_DIR "delete_msg.sql",                NULL, BINARY)\
+    /* User Files */\
+    X(INSERT_USERFILES,         DB_SQL_DIR "insert_userfiles.sql",          NULL, TEXT)\
+    X(DELETE_USERFILE,          NULL, "UPDATE UserFiles SET ref_count = ref_count  - 1 WHERE hash = $1::text;", TEXT)\
+    /* Group Codes */\
+    X(CREATE_GROUP_CODE,        DB_SQL_DIR "create_group_code.sql",         NULL, BINARY)\
+    X(GET_GROUP_CODES,          DB_SQL_DIR "get_group_codes.sql",           NULL, TEXT)\
+    X(DELETE_GROUP_CODE,        DB_SQL_DIR "delete_group_code.sql",         NULL, TEXT)
+
+#define DB_STMT_ENUM(id, file, sql, fmt) DB_STMT_##id,
+
+enum db_stmt
+{
+    DB_STMT_LIST(DB_STMT_ENUM)
+
+    DB_STMT_LEN
+};
+
+typedef struct 
+{
+    const char* name;   /* Prepared statement name */
+    const char* path;   /* SQL file path; NULL if inline */
+    char*       sql;
+    size_t      sql_len;
+    i32         result_format;
+} db_stmt_t;
+
 typedef struct 
 {
-    char*   schema;
-    size_t  schema_len;
-
-    char*   insert_user;
-    size_t  insert_user_len;
-    char*   select_user;
-    size_t  select_user_len;
-    char*   select_connected_users;
-    size_t  select_connected_users_len;
-    char*   select_user_json;
-    size_t  select_user_json_len;
-    char*   delete_user;
-    size_t  delete_user_len;
-
-    char*   insert_group;
-    size_t  insert_group_len;
-    char*   select_user_groups;
-    size_t  select_user_groups_len;
-    char*   select_pub_group;
-    size_t  select_pub_group_len;
-    char*   delete_group;
-    size_t  delete_group_len;
-
-    char*   select_groupmember;
-    size_t  select_groupmember_len;
-    char*   insert_pub_groupmember;
-    size_t  insert_pub_groupmember_len;
-    char*   delete_groupmember;
-    size_t  delete_groupmember_len;
-
-    char*   insert_msg;
-    size_t  insert_msg_len;
-    char*   select_msg;
-    size_t  select_msg_len;
-    char*   select_group_msgs_json;
-    size_t  select_group_msgs_json_len;
-    char*   delete_msg;
-    size_t  delete_msg_len;
-
-    char*   update_user;
-    size_t  update_user_len;
-
-    char*   insert_userfiles;
-    size_t  insert_userfiles_len;
-
-    char*   insert_groupmember_code;
-    size_t  insert_groupmember_code_len;
-
-    char*   create_group_code;
-    size_t  create_group_code_len;
-    char*   get_group_code;
-    size_t  get_group_code_len;
-    char*   delete_group_code;
-    size_t  delete_group_code_len;
+    char*       schema;
+    size_t      schema_len;
+
+    db_stmt_t   stmts[DB_STMT_LEN];
 } server_db_commands_t;
 
 typedef struct eworker eworker_t;
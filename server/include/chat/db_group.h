@@ -10,13 +10,21 @@ typedef struct dbmsg dbmsg_t;
 bool db_async_get_group(server_db_t* db, u32 group_id, dbcmd_ctx_t* ctx);
 bool db_async_get_user_groups(server_db_t* db, u32 user_id, dbcmd_ctx_t* ctx);
 bool db_async_get_group_member_ids(server_db_t* db, u32 group_id, dbcmd_ctx_t* ctx);
-bool db_async_get_group_msgs(server_db_t* db, u32 group_id, u32 limit, u32 offset, dbcmd_ctx_t* ctx);
+/* `before_msg_id` 0: page by `offset`, else the page before it (keyset) */
+bool db_async_get_group_msgs(server_db_t* db, u32 group_id, u32 limit, u32 offset, 
+                             u32 before_msg_id, dbcmd_ctx_t* ctx);
 
 /*
  * `msg` param must be allocated on heap.
  * It will be freed if it was succesful.
+ *
+ * Held until the end of the eworker loop iteration, then everything 
+ * that came in meanwhile goes in one multi-row INSERT (DB_MSG_BATCH_MAX
+ * rows each). ctx->exec() still gets called per message.
  */
 bool db_async_insert_group_msg(server_db_t* db, dbmsg_t* msg, dbcmd_ctx_t* ctx);
+/* Eworker: end of the loop iteration, sends the held group_msg inserts */
+void db_flush_group_msgs(eworker_t* ew);
 bool db_async_delete_msg(server_db_t* db, u32 msg_id, u32 user_id, dbcmd_ctx_t* ctx);
 
 bool db_async_get_public_groups(server_db_t* db, u32 user_id, dbcmd_ctx_t* ctx);
@@ -3,17 +3,25 @@
 
 #include "chat/db_def.h"
 #include "chat/user.h"
+#include "server_websocket.h"
+
+/*
+ * Stream single-row JSON results straight to the client,
+ * one row per array element: <prefix written by caller>row,row,...<suffix>
+ */
+typedef struct 
+{
+    ws_stream_t ws;
+    size_t      rows;
+    const char* suffix;
+} db_stream_t;
 
 /**
- * Potential Issue:
- *  If a client disconnects immediately after making a request,
- *  it could result in a use-after-free scenario.
- *
- * Consideration:
- *  Implementing a reference counting mechanism for client requests in the pipeline
- *  could mitigate this issue. With this approach, any operations triggered by a disconnected
- *  client would be disregarded, and the client would only be freed once all asynchronous
- *  operations have concluded.
+ * Client lifetime:
+ *  Commands keep a client_hd_t, not the client_t*. If the client disconnected
+ *  before the results came, ctx->client is NULL in exec_res()/exec(), 
+ *  the callback still runs (to free its data) but has nobody to answer.
+ *  db_stream_t holds a client reference until the stream ends.
  */
 
 /* Async operations */
@@ -26,6 +34,13 @@ i32 db_async_params(server_db_t* db,
                     const dbcmd_ctx_t* cmd);
 i32 db_async_exec(server_db_t* db, const char* query,
                   const dbcmd_ctx_t* cmd);
+i32 db_async_prepared(server_db_t* db, 
+                      enum db_stmt stmt, 
+                      size_t n, 
+                      const char* const vals[], 
+                      const i32* lens, 
+                      const i32* formats,
+                      const dbcmd_ctx_t* cmd);
 
 /* Transactions */
 i32 db_async_begin(server_db_t* db, dbcmd_ctx_t* ctx);
@@ -44,5 +59,12 @@ void db_pipeline_current_done(server_db_t* db);     /* Enqueue current cmd to pi
 void db_pipeline_set_ctx(server_db_t* db, client_t* client);
 
 void db_process_results(eworker_t* ew);
+/* Resolve the client, cmd->exec(), send its error & enqueue what it queued */
+void db_pipeline_exec(eworker_t* ew, dbcmd_ctx_t* cmd);
+
+/* Stream */
+db_stream_t* db_stream_new(client_t* client, const char* suffix);
+void db_stream_rows_result(eworker_t* ew, PGresult* res, 
+                           ExecStatusType status, dbcmd_ctx_t* ctx);
 
 #endif // _SERVER_DB_PIPELINE_H_
@@ -7,6 +7,5 @@
 
 bool db_async_insert_userfile(server_db_t* db, dbuser_file_t* file, dbcmd_ctx_t* ctx);
 bool db_async_delete_userfile(server_db_t* db, const char* hash, dbcmd_ctx_t* ctx);
-bool db_async_userfile_refcount(server_db_t* db, const char* hash, dbcmd_ctx_t* ctx);
 
 #endif // _SERVER_DB_USERFILE_H_
@@ -0,0 +1,72 @@
+#ifndef _SERVER_FILE_STORE_H_
+#define _SERVER_FILE_STORE_H_
+
+/*
+ * Content-addressed file store
+ *
+ *  Files are named by their SHA-256 and fanned out two levels deep,
+ *  `<dir>/ab/cd/abcd...`, so no directory grows past a few hundred
+ *  entries. The hash -> ref_count index mirrors UserFiles (loaded at
+ *  startup, updated with every insert/delete), so whether to write,
+ *  skip or unlink a file is known without asking the DB. So are the
+ *  bytes each user stored (as the first uploader), for the upload quota.
+ */
+
+#include "common.h"
+#include "server_ht.h"
+#include "server_crypt.h"
+#include "chat/db_def.h"
+
+#define STORE_FANOUT_LEN    2   /* Hex chars per level */
+#define STORE_HASH_LEN      (SERVER_HASH256_STR_SIZE - 1)
+
+typedef struct store_entry
+{
+    char    hash[SERVER_HASH256_STR_SIZE];
+    char    mime_type[DB_MIME_TYPE_LEN];
+    i32     ref_count;
+    size_t  size;
+    u32     owner_id;
+    struct store_entry* next;   /* Same 64-bit key */
+} store_entry_t;
+
+typedef struct 
+{
+    server_ght_t    index;
+    server_ght_t    usage;      /* owner_id -> store_usage_t */
+    pthread_mutex_t mutex;
+    bool            loaded;
+} file_store_t;
+
+typedef struct server server_t;
+
+/* Loads the index from UserFiles, moves flat `<dir>/<hash>` files in place */
+bool    server_store_init(server_t* server);
+void    server_store_free(file_store_t* store);
+
+/* New ref_count, 1 means it has to be written (and it's `owner_id`'s) */
+i32     server_store_ref(file_store_t* store, const char* hash, const char* mime_type,
+                         size_t size, u32 owner_id);
+/* New ref_count, 0 means it has to be unlinked, -1 if unknown */
+i32     server_store_unref(file_store_t* store, const char* hash);
+/* 
+ * I/O thread: unlink `path` unless `hash` was referenced again since,
+ * under the index lock so nothing can ref it in between.
+ */
+bool    server_store_unlink(file_store_t* store, const char* hash, const char* path);
+
+/* `base`/ab/cd and `base`/ab/cd/abcd..., `out` is PATH_MAX */
+void    server_store_dir(const char* base, const char* hash, char* out);
+void    server_store_path(const char* base, const char* hash, char* out);
+/* Bytes of the files `owner_id` stored first */
+size_t  server_store_usage(file_store_t* store, u32 owner_id);
+/* False if unknown, `out` is DB_MIME_TYPE_LEN */
+bool    server_store_mime_type(file_store_t* store, const char* hash, char* out);
+
+/* 
+ * GET path `<dir>/<hash>` of a store dir -> its fanned out path.
+ * Returns the hash (in `path`) or NULL if it's not an upload.
+ */
+const char* server_store_resolve(const server_t* server, char* path);
+
+#endif // _SERVER_FILE_STORE_H_
@@ -23,18 +23,23 @@ typedef struct
     i32     flags;
 } dbgroup_member_t;
 
+/*
+ * Sized to the message, content is inline after the struct.
+ * Allocated from server->msg_pool with server_new_msg().
+ */
 typedef struct dbmsg
 {
     u32     msg_id;
     u32     user_id;
     u32     group_id;
-    char    content[DB_MESSAGE_MAX];
-    char    timestamp[DB_TIMESTAMP_MAX];
+    i32     flags;
+    i32     parent_msg_id;
+    char    timestamp[DB_MSG_TIMESTAMP_MAX];
     char*           attachments;
     bool            attachments_inheap;
     json_object*    attachments_json;
-    i32     flags;
-    i32     parent_msg_id;
+    u32     content_len;
+    char    content[];      /* content_len + NUL */
 } dbmsg_t;
 
 typedef struct 
@@ -45,72 +50,20 @@ typedef struct
     i32     max_uses;
 } dbgroup_code_t;
 
-const char* server_group_create(eworker_t* ew, 
-                                client_t* client, 
-                                json_object* payload, 
-                                json_object* respond_json);
-
-const char* server_client_groups(eworker_t* ew, 
-                                 client_t* client, 
-                                 json_object* payload,
-                                 json_object* respond_json);
-
-const char* server_get_all_groups(eworker_t* ew, 
-                                  client_t* client, 
-                                  json_object* payload,
-                                  json_object* respond_json);
-
-const char* server_join_group(eworker_t* ew, 
-                              client_t* client, 
-                              json_object* payload, 
-                              json_object* respond_json);
-
 const char* server_get_send_group_msg(eworker_t* ew,
                                       const dbmsg_t* msg);
-
-const char* server_group_msg(eworker_t* ew, 
-                             client_t* client, 
-                             json_object* payload, 
-                             json_object* respond_json);
-
-const char* server_get_group_msgs(eworker_t* ew, 
-                           client_t* client, 
-                           json_object* payload, 
-                           json_object* respond_json);
-
-const char* server_create_group_code(eworker_t* ew, 
-                                     client_t* client,
-                                     json_object* payload, 
-                                     json_object* respond_json);
-
-const char* server_join_group_code(eworker_t* ew,
-                                   client_t* client,
-                                   json_object* payload,
-                                   json_object* respond_json);
-
-const char* server_get_group_codes(eworker_t* ew,
-                                   client_t* client,
-                                   json_object* payload,
-                                   json_object* respond_json);
-
-const char* server_delete_group_code(eworker_t* ew,
-                                     client_t* client, 
-                                     json_object* payload,
-                                     json_object* resp);
-
-const char* server_delete_group_msg(eworker_t* ew,
-                                    client_t* client,
-                                    json_object* payload,
-                                    json_object* respond_json);
-
-const char* server_delete_group(eworker_t* ew,
-                                client_t* client, 
-                                json_object* payload,
-                                json_object* resp_json);
-
-const char* server_get_group_member_ids(eworker_t* ew,
-                                  client_t* client, 
-                                  json_object* payload, 
-                                  json_object* resp_json);
+/* `group_msg` frame for ws_send_reserved(), malloc'd */
+char*       server_msg_to_frame(const dbmsg_t* msg, size_t* len);
+/* Every one of `user_ids` who is online, doesn't take `buf` */
+void        server_group_send_frame(eworker_t* ew, const u32* user_ids, size_t n, 
+                                    char* buf, size_t len);
+
+/* NULL if content_len >= DB_MESSAGE_MAX or out of memory */
+dbmsg_t*    server_new_msg(eworker_t* ew, u32 user_id, u32 group_id, 
+                           const char* content, size_t content_len);
+void        server_free_msg(eworker_t* ew, dbmsg_t* msg);
+
+/* delete_msg's DELETE, for a message that's in the database */
+const char* server_delete_group_msg_db(eworker_t* ew, u32 msg_id, u32 user_id);
 
 #endif // _SERVER_USER_GROUP_H_
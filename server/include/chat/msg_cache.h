@@ -0,0 +1,92 @@
+#ifndef _SERVER_CHAT_MSG_CACHE_H_
+#define _SERVER_CHAT_MSG_CACHE_H_
+
+/*
+ * Recent messages per group, for get_group_msgs
+ *
+ *  Each cached group keeps its newest MSG_CACHE_DEPTH messages as the
+ *  JSON select_group_msgs.sql would return for them, newest first.
+ *  A group's ring is seeded by the first history miss at offset 0,
+ *  new messages are pushed as they're inserted (or logged, write-behind).
+ *  delete_msg throws a group's messages away, delete_group the group.
+ *
+ *  A ring is `complete` when every message from its oldest one on is in
+ *  it, only then are pages served from it. Pushes that race a seed are
+ *  merged into it, a delete bumps `gen` so a seed from before is dropped.
+ *
+ *  Shared by the eworkers, least recently used groups go first.
+ */
+
+#include "common.h"
+#include "server_ht.h"
+#include "server_client.h"
+#include "chat/group.h"
+
+#define MSG_CACHE_DEPTH     128     /* Newest messages kept per group */
+#define MSG_CACHE_GROUPS    1024    /* Groups kept */
+
+typedef struct
+{
+    u32     msg_id;
+    u32     len;
+    char    json[];     /* row_to_json(msg), no NUL */
+} cache_msg_t;
+
+typedef struct msg_ring
+{
+    u32     group_id;
+    u32     gen;        /* New one on every delete */
+    u32     seeding;    /* Seeds in flight, not evicted meanwhile */
+    bool    complete;   /* Nothing missing from the oldest message on */
+    bool    has_all;    /* ...and there's nothing older */
+    u32     n;
+    cache_msg_t* msgs[MSG_CACHE_DEPTH];     /* Newest first */
+
+    struct msg_ring* prev;  /* LRU, most recent at head */
+    struct msg_ring* next;
+} msg_ring_t;
+
+typedef struct
+{
+    server_ght_t    rings;
+    msg_ring_t*     head;
+    msg_ring_t*     tail;
+    size_t          count;
+    u32             next_gen;
+    pthread_mutex_t mutex;
+
+    u64             hits;
+    u64             misses;
+    u64             evicted;
+} msg_cache_t;
+
+bool    server_msg_cache_init(msg_cache_t* cache);
+void    server_msg_cache_free(msg_cache_t* cache);
+/* Log the hits and misses so far */
+void    server_msg_cache_stats(msg_cache_t* cache);
+
+/* 
+ * Sends the page if the group's ring covers it. False is a miss.
+ * `before_msg_id` 0: by `offset`, else the page before it.
+ */
+bool    server_msg_cache_send(msg_cache_t* cache, client_t* client, u32 group_id, 
+                              u32 limit, u32 offset, u32 before_msg_id);
+
+/* A miss at offset 0 is about to go to the DB, returns the ring's gen */
+u32     server_msg_cache_seed_begin(msg_cache_t* cache, u32 group_id);
+/*
+ * The rows it got, newest first, takes them. `has_all` when the DB
+ * returned fewer than asked for. `rows` NULL: the query failed.
+ */
+void    server_msg_cache_seed(msg_cache_t* cache, u32 group_id, u32 gen,
+                              cache_msg_t** rows, u32 n, bool has_all);
+cache_msg_t* server_msg_cache_entry(u32 msg_id, const char* json, size_t len);
+
+/* Inserted message */
+void    server_msg_cache_push(msg_cache_t* cache, const dbmsg_t* msg);
+/* delete_msg */
+void    server_msg_cache_invalidate(msg_cache_t* cache, u32 group_id);
+/* delete_group */
+void    server_msg_cache_drop(msg_cache_t* cache, u32 group_id);
+
+#endif // _SERVER_CHAT_MSG_CACHE_H_
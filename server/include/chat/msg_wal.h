@@ -0,0 +1,119 @@
+#ifndef _SERVER_CHAT_MSG_WAL_H_
+#define _SERVER_CHAT_MSG_WAL_H_
+
+/*
+ * Write-behind messages (conf.write_behind)
+ *
+ *  Instead of waiting on INSERT ... RETURNING, the server assigns the
+ *  msg_id (one sequence, seeded from Messages at startup) and timestamp
+ *  itself. The message is appended to a local write-ahead log and
+ *  fdatasync'd on the I/O stage, then fanned out to the group right away.
+ *  A writer thread with its own connection inserts logged messages in
+ *  batches of whatever queued up while the last INSERT ran.
+ *
+ *  The log is segmented, `<conf.wal_dir>/<seq>.wal`. A segment is
+ *  unlinked once every message in it is in the database. At startup
+ *  whatever segments are left are replayed before anything is accepted.
+ *
+ *  A delete_msg of a message the writer hasn't inserted yet waits on its
+ *  record and runs once it's in, a DELETE before that would find nothing
+ *  and the message would come back with the INSERT.
+ */
+
+#include "common.h"
+#include "server_ht.h"
+#include "server_client.h"
+#include "chat/db.h"
+#include "chat/group.h"
+#include <pthread.h>
+
+#define WAL_SEGMENT_MAX     (16 * KIB * KIB)    /* Roll over to a new segment past it */
+#define WAL_BATCH_MAX       512                 /* Rows per INSERT */
+#define WAL_RETRY_SEC       1                   /* Database is gone, try again after */
+
+typedef struct wal_segment
+{
+    u32     seq;
+    i32     fd;
+    size_t  size;
+    size_t  pending;    /* Records not in the database yet */
+    struct wal_segment* next;
+} wal_segment_t;
+
+/* On disk, followed by content & attachments */
+typedef struct
+{
+    u32     size;       /* Whole record */
+    u32     sum;        /* FNV-1a of everything after it */
+    u32     msg_id;
+    u32     user_id;
+    u32     group_id;
+    u32     content_len;
+    u32     attachments_len;
+    char    timestamp[DB_MSG_TIMESTAMP_MAX];
+} wal_hdr_t;
+
+typedef struct wal_rec
+{
+    struct wal_rec* next;
+    wal_segment_t*  seg;    /* NULL when replayed */
+    struct wal_delete* deletes; /* Waiting for it to be inserted */
+    wal_hdr_t       hdr;
+    char            data[];
+} wal_rec_t;
+
+typedef struct
+{
+    bool            enabled;
+    const char*     dir;
+    _Atomic u32     next_id;
+    _Atomic size_t  unpersisted;    /* Given an id, not in the database yet */
+
+    /* Segments, oldest first, appended to the last one */
+    wal_segment_t*  segs;
+    wal_segment_t*  seg_tail;
+    u32             next_seq;
+    pthread_mutex_t log_mutex;
+
+    /* Logged, waiting for the writer */
+    wal_rec_t*      head;
+    wal_rec_t*      tail;
+    wal_rec_t*      batch;  /* Being inserted */
+    server_ght_t    groups; /* group_id -> wal_group_t, unpersisted per group */
+    size_t          count;
+    size_t          high_water;
+    bool            stop;
+    pthread_t       pth;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    server_db_t     db;     /* Writer's, blocking */
+
+    /* Writer only */
+    u64             n_persisted;
+    u64             n_batches;
+    u64             n_dropped;  /* The database refused them (e.g. left the group) */
+} msg_wal_t;
+
+typedef struct server server_t;
+
+/* Replays what's left, seeds the msg_id sequence, starts the writer */
+bool    server_wal_init(server_t* server);
+/* Eworkers are stopped, writes out what's queued */
+void    server_wal_free(server_t* server);
+
+/*
+ * Instead of db_async_insert_group_msg(), takes `msg`.
+ * The sender has to be a member, the frame goes out once it's logged.
+ */
+bool    server_wal_group_msg(eworker_t* ew, dbmsg_t* msg);
+
+/*
+ * delete_msg: false if `msg_id` isn't waiting for the writer (in the database
+ * already, or never was), else the delete goes to the database once it's in.
+ */
+bool    server_wal_delete_msg(eworker_t* ew, client_t* client, u32 msg_id, u32 user_id);
+
+/* Whether the database has every message of `group_id` that went out */
+bool    server_wal_group_settled(server_t* server, u32 group_id);
+
+#endif // _SERVER_CHAT_MSG_WAL_H_
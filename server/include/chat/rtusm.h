@@ -10,7 +10,7 @@
 
 #include "server_tm.h"
 
-typedef struct dbuser dbuser_t;
+typedef struct user user_t;
 
 enum rtusm_status 
 {
@@ -37,11 +37,11 @@ typedef struct
     bool    pfp:1;
 } rtusm_new_t;
 
-void    server_rtusm_set_user_status(eworker_t* ew, dbuser_t* user, 
+void    server_rtusm_set_user_status(eworker_t* ew, user_t* user, 
                                      enum rtusm_status status);
-void    server_rtusm_user_connect(eworker_t* ew, dbuser_t* user);
-void    server_rtusm_user_disconnect(eworker_t* ew, dbuser_t* user);
-void    server_rtusm_user_pfp_change(eworker_t* ew, dbuser_t* user);
+void    server_rtusm_user_connect(eworker_t* ew, user_t* user);
+void    server_rtusm_user_disconnect(eworker_t* ew, user_t* user);
+void    server_rtusm_user_pfp_change(eworker_t* ew, user_t* user);
 
 const char* rtusm_get_status_str(enum rtusm_status status);
 
@@ -0,0 +1,71 @@
+#ifndef _SERVER_CHAT_UPLOAD_SESSION_H_
+#define _SERVER_CHAT_UPLOAD_SESSION_H_
+
+/*
+ * Resumable uploads - Large attachments (videos, files) in chunks
+ *
+ *  POST /upload/session         Upload-Token, Attach-Index, Upload-Length
+ *                               -> 201, Upload-Id
+ *  PUT  /upload/session/<id>    Content-Range: bytes a-b/length, a = offset
+ *                               -> 200, Upload-Offset
+ *  HEAD /upload/session/<id>    -> 200, Upload-Offset & Upload-Length
+ *  POST /upload/session/<id>    Finalize, once offset = length -> 200
+ *
+ *  Chunks are written at their offset into a temp file and hashed on the
+ *  I/O stage, one in flight per upload. The session isn't tied to a
+ *  connection, a client that lost it asks HEAD where to continue from.
+ *  Finalizing sniffs the first bytes on the compute pool, then renames
+ *  the temp file into the file store and attaches it to the message.
+ *
+ *  Unfinished uploads count against the user's conf.upload_quota along
+ *  with the files they stored (file store index), unfinished ones go away
+ *  with the upload token (which they keep alive).
+ */
+
+#include "common.h"
+#include "server_ht.h"
+#include "server_client.h"
+#include "server_crypt.h"
+#include "server_http.h"
+#include "chat/db_def.h"
+
+#define UPLOAD_DIR          ".uploads"      /* In conf.file_dir */
+#define UPLOAD_TIMEOUT      MINUTES(10)     /* Upload token's, idle */
+#define UPLOAD_CHUNK_MAX    (8 * KIB * KIB)
+
+typedef struct upload_session
+{
+    u64         id;
+    u32         token;      /* Upload token of the message */
+    u32         index;      /* Attachment index */
+    u32         user_id;
+    size_t      length;     /* Upload-Length */
+    size_t      offset;     /* Written & hashed */
+    i32         fd;         /* Opened by the first chunk */
+    bool        busy;       /* Chunk or finalize in flight */
+    bool        dropped;    /* Gone from the table while busy, last job frees it */
+    SHA256_CTX  sha256;
+    u8          head[HTTP_SNIFF_LEN];   /* Sniffed when finalized */
+    size_t      head_len;
+    char        path[PATH_MAX];
+    struct upload_session* next;    /* Being dropped */
+} upload_session_t;
+
+typedef struct 
+{
+    server_ght_t    ht;
+    pthread_mutex_t mutex;
+} upload_table_t;
+
+bool    server_upload_init(server_t* server);
+void    server_upload_free(eworker_t* ew, upload_table_t* table);
+
+/* /upload/session requests */
+void    server_upload_session_post(eworker_t* ew, client_t* client, http_t* http);
+void    server_upload_session_put(eworker_t* ew, client_t* client, http_t* http);
+void    server_upload_session_head(eworker_t* ew, client_t* client, http_t* http);
+
+/* Upload token is gone, so are its unfinished uploads */
+void    server_upload_drop_token(eworker_t* ew, u32 token);
+
+#endif // _SERVER_CHAT_UPLOAD_SESSION_H_
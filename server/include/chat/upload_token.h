@@ -13,7 +13,7 @@ enum upload_token_type
 
 typedef struct 
 {
-    dbmsg_t msg;
+    dbmsg_t* msg;
     u32 token;
     u32 total;
     u32 current;
@@ -36,5 +36,7 @@ upload_token_t* server_new_upload_token_attach(eworker_t* th);
 upload_token_t* server_get_upload_token(server_t* server, u32 token);
 ssize_t         server_send_upload_token(client_t* client, const char* packet_type, upload_token_t* ut);
 void            server_del_upload_token(eworker_t* th, upload_token_t* upload_token);
+/* Restart its timer, an upload is still coming in */
+void            server_touch_upload_token(server_t* server, upload_token_t* ut);
 
 #endif // _SERVER_UPLOAD_TOKEN_H_
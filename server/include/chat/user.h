@@ -21,19 +21,26 @@ typedef struct dbuser
     rtusm_t rtusm;
 } dbuser_t;
 
-const char* server_client_user_info(eworker_t* ew, 
-                                    client_t* client, 
-                                    json_object* payload,
-                                    json_object* respond_json);
-
-const char* server_get_user(eworker_t* ew, 
-                            client_t* client, 
-                            json_object* payload, 
-                            json_object* respond_json);
+/*
+ * Online user, the shared entry in server->user_ht.
+ * Built from the dbuser_t row on login, which is then freed:
+ * strings are sized to fit and hash/salt don't stay in memory.
+ */
+typedef struct user
+{
+    u32         user_id;
+    i32         flags;
+    rtusm_t     rtusm;
+    client_t*   client;         /* Logged-in connection */
+    char*       pfp_hash;       /* Own allocation, can change */
+    const char* username;       /* Rest point into strs[] */
+    const char* displayname;
+    const char* bio;
+    const char* created_at;
+    char        strs[];
+} user_t;
 
-const char* server_user_edit_account(eworker_t* ew, 
-                                     client_t* client, 
-                                     json_object* payload, 
-                                     json_object* respond_json);
+user_t* server_new_user(const dbuser_t* dbuser, client_t* client);
+void    server_free_user(user_t* user);
 
 #endif // _SERVER_CHAT_USER_H_
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "server_tm.h"
+#include "server_http.h"
 #include "chat/db_def.h"
 
 typedef struct 
@@ -13,20 +14,49 @@ typedef struct
     size_t  size;
     i32     ref_count;
     i32     flags;
+    u32     owner_id;   /* Uploader, 0 if unknown */
 } dbuser_file_t;
 
-bool            server_init_magic(server_t* server);
-void            server_close_magic(server_t* server);
-const char*     server_mime_type(server_t* server, const void* data, 
-                                                        size_t size);
+typedef struct img_saved_cb img_saved_cb_t;
+
+/* `file` is NULL if it wasn't an image or couldn't be saved */
+typedef void (*img_saved_t)(eworker_t* ew, client_t* client, 
+                            dbuser_file_t* file, const img_saved_cb_t* cb);
+
+/* `data` is NULL on error, the callback owns `data` & `file` */
+typedef void (*file_read_t)(eworker_t* ew, client_t* client, 
+                            dbuser_file_t* file, void* data);
+
+typedef struct img_saved_cb
+{
+    img_saved_t func;
+    u64         id;     /* Caller's, e.g. user_id or upload token */
+    size_t      index;
+} img_saved_cb_t;
+
+/* conf.img_dir, vid_dir or file_dir */
+const char*     server_mime_type_dir(server_t* server, const char* mime_type);
 bool            server_save_file(eworker_t* th, const void* data, 
                         size_t size, const char* name);
+/*
+ * MIME check & hash on the compute pool, then saved like before and
+ * cb->func() is called back on `th`. On true `data` is owned (and freed)
+ * by the save, `file` too unless !free_file (then cb->func() owns it).
+ * With a complete `digest` (may be NULL) the pool is skipped and cb->func()
+ * may be called before this returns.
+ */
 bool            server_save_file_img(eworker_t* th, 
-                                     const void* data, 
+                                     client_t* client,
+                                     void* data, 
                                      size_t size, 
-                                     dbuser_file_t** file_output,
-                                     bool free_file);
-void*           server_get_file(eworker_t* th, dbuser_file_t* file);
+                                     const http_digest_t* digest,
+                                     bool free_file,
+                                     u32 owner_id,
+                                     const img_saved_cb_t* cb);
+/* Read on the I/O stage, func() is called back on `th` */
+bool            server_get_file(eworker_t* th, client_t* client, 
+                                dbuser_file_t* file, file_read_t func);
 bool            server_delete_file(eworker_t* th, dbuser_file_t* file);
+dbuser_file_t*  server_attach_json_to_file(json_object* attach_json); /* {hash, type, name} */
 
 #endif // _SERVER_FILE_H_
@@ -4,7 +4,15 @@
 #include "chat/upload_token.h"
 #include "server_tm.h"
 #include "server_client.h"
+#include "server_multipart.h"
+#include "chat/user_file.h"
 
-void server_handle_user_upload(eworker_t* th, client_t* client, const http_t* http);
+upload_token_t* server_check_upload_token(server_t* server, const http_t* http, u32* user_id);
+/* File of attachment `index` is saved, the message is inserted with the last one */
+bool            server_msg_attach_file(eworker_t* ew, u32 token, size_t index, 
+                                       const dbuser_file_t* file);
+void            server_handle_user_upload(eworker_t* th, client_t* client, const http_t* http);
+/* multipart/form-data attachments, parsed as the body streams in */
+multipart_t*    server_user_upload_stream(eworker_t* ew, client_t* client, const http_t* http);
 
 #endif // _SERVER_CHAT_USER_UPLOAD_H_
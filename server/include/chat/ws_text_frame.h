@@ -13,5 +13,8 @@ bool json_bad(json_object* json, json_type type);
 
 enum client_recv_status server_ws_handle_text_frame(eworker_t* th, client_t* client, 
                                                     char* buf, size_t buf_len);
+/* WS_PROTO_MSGPACK clients, same commands as MessagePack maps */
+enum client_recv_status server_ws_handle_binary_frame(eworker_t* th, client_t* client, 
+                                                      u8* buf, size_t buf_len);
 
 #endif // _SERVER_WS_PLD_HDLR_H_
@@ -14,9 +14,17 @@
 #include "server_websocket.h"
 #include "server_ht.h"
 #include "server_signal.h"
+#include "server_pool.h"
+#include "server_mailbox.h"
+#include "server_compute.h"
+#include "server_io.h"
 #include "chat/user_file.h"
+#include "chat/file_store.h"
 #include "chat/db.h"
 #include "chat/upload_token.h"
+#include "chat/upload_session.h"
+#include "chat/msg_wal.h"
+#include "chat/msg_cache.h"
 #include "chat/user_session.h"
 
 #define SERVER_NAME "ChityChat"
@@ -48,23 +56,18 @@ typedef struct
     char database[CONFIG_PATH_LEN];
     bool fork;
     i32  thread_pool;
+    i32  compute_threads;   /* Compute pool (hashing, MIME sniffing) */
+    i32  io_threads;        /* File I/O stage */
+    bool fsync_files;       /* fsync() uploads before they're renamed in place */
+    bool footprint;     /* Trade some CPU for less memory per connection */
+    size_t upload_max;      /* Largest resumable upload */
+    size_t upload_quota;    /* Stored + unfinished upload bytes per user */
+    size_t ws_frame_max;    /* Largest WebSocket frame taken, past it: 1009 close */
+    bool write_behind;      /* Fan messages out before they're inserted, see msg_wal.h */
+    char wal_dir[CONFIG_PATH_LEN];
+    i32  stats_interval;    /* Seconds between metrics logs, 0: only at exit */
 
     const char* sql_schema;
-    const char* sql_insert_user;
-    const char* sql_select_user;
-
-    const char* sql_insert_group;
-    const char* sql_select_group;
-
-    const char* sql_insert_groupmember_code;
-    const char* sql_select_groupmember;
-
-    const char* sql_insert_msg;
-    const char* sql_select_msg;
-
-    const char* sql_update_user;
-
-    const char* sql_insert_userfiles;
 } server_config_t;
  
 typedef struct server
@@ -79,7 +82,12 @@ typedef struct server
     server_db_commands_t db_commands;
     server_tm_t tm;
     eworker_t main_ew;
-    magic_t magic_cookie;
+    compute_pool_t compute;
+    compute_pool_t io;
+    file_store_t store;
+    upload_table_t uploads;     /* Resumable uploads */
+    msg_wal_t wal;              /* Write-behind messages */
+    msg_cache_t msg_cache;      /* Recent messages per group */
     SSL_CTX* ssl_ctx;
 
     struct sockaddr* addr;
@@ -94,7 +102,9 @@ typedef struct server
     server_ght_t user_ht;
     server_ght_t session_ht;
     server_ght_t upload_token_ht;
-    server_ght_t chat_cmd_ht;
+    server_pool_t msg_pool;     /* dbmsg_t */
+    client_table_t clients;     /* client_hd_t slots */
+    _Atomic u64 epoch;          /* Client reclamation epoch, starts at 1 */
     bool running;
 } server_t;
 
@@ -102,7 +112,13 @@ void server_run(server_t* server);
 void server_cleanup(server_t* server);
 i32  server_print_sockerr(i32 fd);
 
+/* From any thread, see server_mailbox.h */
 ssize_t     server_send(client_t* client, const void* buf, size_t len);
+/* Fragment of the owner's own ws_stream_t, ignores client->streams */
+ssize_t     server_send_stream(client_t* client, const void* buf, size_t len);
+/* Owner only */
+ssize_t     server_ssl_send(client_t* client, const void* buf, size_t len);
 ssize_t     server_recv(client_t* client, void* buf, size_t len);
+bool        server_recv_pending(client_t* client);
 
 #endif // _SERVER_H_
@@ -3,6 +3,8 @@
 
 #include "common.h"
 #include "server_net.h"
+#include "server_mailbox.h"
+#include <stdatomic.h>
 #include "chat/user_session.h"
 #include "chat/user.h"
 
@@ -14,39 +16,111 @@
 #define CLIENT_STATE_WEBSOCKET       0x0002
 #define CLIENT_STATE_KEEP_ALIVE      0x0004
 #define CLIENT_STATE_LOGGED_IN       0x0008
+#define CLIENT_STATE_WS_MSGPACK      0x0010  /* Negotiated WS_PROTO_MSGPACK */
 
 #define CLIENT_ERR_NONE  00
 #define CLIENT_ERR_SSL   01
+#define CLIENT_ERR_CLOSED 02    /* server_free_client()'d, waiting for reclamation */
+#define CLIENT_ERR_WS    03     /* Sent it a close frame (ws_stream_fail(), too big) */
 
-#define CLIENT_RECV_PAGE             4096
 #define CLIENT_MAX_ERRORS 3
 
+/*
+ * Client handle: generation << 32 | slot.
+ *
+ * Safe to keep across event loop iterations (e.g. in dbcmd_ctx_t),
+ * server_client_get() gives the live client_t or NULL once it's gone,
+ * even if the slot was reused by a new client.
+ */
+typedef u64 client_hd_t;
+#define CLIENT_HD_NONE 0
+
+#define CLIENT_SLOT_CHUNK   4096
+#define CLIENT_SLOT_CHUNKS  1024    /* Max 4M clients */
+#define CLIENT_SLOT_NONE    UINT32_MAX
+
+typedef struct 
+{
+    _Atomic(client_t*)  client;
+    _Atomic u32         gen;        /* Odd: in use */
+    u32                 next_free;
+} client_slot_t;
+
+typedef struct 
+{
+    _Atomic(client_slot_t*) chunks[CLIENT_SLOT_CHUNKS];
+    u32             n_slots;        /* Slots ever handed out */
+    u32             free_head;
+    pthread_mutex_t mutex;          /* Alloc/release only, lookups are lock-free */
+} client_table_t;
+
+/*
+ * Carry buffer, only holds the leftover partial WebSocket frame 
+ * between reads, everything else is read into eworker's recv_buf.
+ * NULL for idle clients.
+ */
 typedef struct 
 {
     u8*     data;
-    size_t  data_size;
-    size_t  offset;
-    bool    busy;
+    size_t  len;        /* Bytes in data */
+    size_t  need;       /* Full frame size, 0 if frame header is incomplete */
     http_t* http;
 } recv_buf_t;
 
+/*
+ * Deferred reclamation:
+ *  server_free_client() only unpublishes the client (tables, slot) and 
+ *  shuts down the connection. The memory, SSL and socket fd are freed once
+ *  every eworker has passed a quiescent state (waiting in epoll_wait()),
+ *  so a client_t* found by a lookup stays valid until the end of the 
+ *  current event loop iteration. Keeping it longer needs 
+ *  server_client_ref() or a client_hd_t.
+ *
+ * Owner:
+ *  Only `owner` reads from and writes to the connection, so `ssl`, `err`,
+ *  `recv` and `streams` need no lock. server_send() from any other thread
+ *  goes through the mailbox (see server_mailbox.h).
+ */
 typedef struct client
 {
     net_addr_t  addr;
     u16         state;
     u16         err;
     SSL*        ssl;
-    dbuser_t*   dbuser;
+    user_t*     user;       /* In server->user_ht, freed with the client */
     session_t*  session;
     recv_buf_t  recv;
-    pthread_mutex_t ssl_mutex;
+    client_hd_t hd;
+    _Atomic u32 refs;
+    u64         retired_epoch;
+    struct client* retired_next;
+    eworker_t*  owner;
+    u32         streams;    /* Open ws_stream_t's, other frames wait in mailbox */
+    _Atomic(client_mail_t*) mail;
+    _Atomic bool mail_queued;   /* In owner->mail */
+    struct client* mail_next;
 } client_t;
 
 client_t*   server_accept_client(eworker_t* ew);
 int         server_client_ssl_handsake(server_t* server, client_t* client);
 client_t*   server_get_client_fd(server_t* server, i32 fd);
 client_t*   server_get_client_user_id(server_t* server, u64 id);
+user_t*     server_get_online_user(server_t* server, u64 id);
 void        server_free_client(eworker_t* ew, client_t* client);
+
+/* Handles */
+bool        server_init_client_table(client_table_t* table);
+void        server_client_table_destroy(client_table_t* table);
+client_t*   server_client_get(server_t* server, client_hd_t hd);
+
+/* Keep `client` memory alive past the current loop iteration */
+void        server_client_ref(client_t* client);
+void        server_client_unref(client_t* client);
+
+/* Reclamation (quiescent-state based), see client_t */
+void        server_client_online(eworker_t* ew);
+void        server_client_quiescent(eworker_t* ew);
+void        server_client_reclaim_all(eworker_t* ew);
 void        server_get_client_info(client_t* client);
 void        server_set_client_err(client_t* client, u16 err);
 
@@ -0,0 +1,123 @@
+#ifndef _SERVER_COMPUTE_H_
+#define _SERVER_COMPUTE_H_
+
+/*
+ * Compute pool - CPU-heavy jobs off the eworkers
+ *
+ *  Password hashing, file hashing and MIME sniffing run here instead of
+ *  stalling every connection an eworker serves. An eworker submits a job,
+ *  a compute thread calls job->run(), then job->done() is called back on
+ *  the same eworker from its event loop (woken through ew->done_fd).
+ *
+ *  The queue is bounded, server_compute_submit() fails when it's full.
+ *  Each compute thread has its own libmagic cookie (they aren't thread-safe).
+ *
+ *  The same pool type runs blocking file I/O (server->io, see server_io.h),
+ *  without libmagic and finishing queued jobs at shutdown.
+ *
+ *  Jobs submitted with a key all go to the same thread's own queue, in
+ *  order, so jobs on one thing (e.g. a file) never overtake each other.
+ */
+
+#include "common.h"
+#include "server_client.h"
+#include <pthread.h>
+
+#define COMPUTE_QUEUE_MAX   1024
+#define COMPUTE_NAME_LEN    32
+
+#define COMPUTE_POOL_MAGIC  0x01    /* libmagic cookie per thread */
+#define COMPUTE_POOL_DRAIN  0x02    /* Shutdown runs queued jobs instead of cancelling */
+
+enum compute_status
+{
+    COMPUTE_PENDING,
+    COMPUTE_DONE,
+    COMPUTE_CANCELLED,  /* Shutting down, run() may not have been called */
+};
+
+typedef struct compute_thread compute_thread_t;
+typedef struct compute_job compute_job_t;
+
+/* Compute thread, touches nothing but the job */
+typedef void (*compute_run_t)(compute_thread_t* ct, compute_job_t* job);
+/*
+ * Back on `ew` (client is NULL if it left), frees the job.
+ * COMPUTE_CANCELLED: Only free it, eworkers are stopped.
+ */
+typedef void (*compute_done_t)(eworker_t* ew, client_t* client, compute_job_t* job);
+
+/* Embed as the first member of the job's own struct */
+typedef struct compute_job
+{
+    compute_run_t   run;
+    compute_done_t  done;
+    eworker_t*      ew;
+    client_hd_t     client_hd;
+    enum compute_status status;
+    u64             queued_ns;
+    struct compute_job* next;
+} compute_job_t;
+
+typedef struct compute_thread
+{
+    pthread_t   pth;
+    magic_t     magic;
+    char        name[COMPUTE_NAME_LEN];
+    struct compute_pool* pool;
+    compute_job_t*  head;   /* Keyed jobs, before the shared queue */
+    compute_job_t*  tail;
+} compute_thread_t;
+
+typedef struct compute_pool
+{
+    const char*     name;
+    u32             flags;
+    compute_thread_t* threads;
+    size_t          n_threads;
+    compute_job_t*  head;
+    compute_job_t*  tail;
+    size_t          count;          /* Queue depth */
+    size_t          high_water;
+    size_t          rejected;
+    bool            stop;
+
+    /* Queued -> run() returned */
+    _Atomic u64     n_done;
+    _Atomic u64     latency_ns;     /* Sum */
+    _Atomic u64     latency_max_ns;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} compute_pool_t;
+
+bool    server_compute_init(compute_pool_t* pool, const char* name, 
+                            i32 n_threads, u32 flags);
+/* Eworkers are stopped: joins the threads, cancels what's left */
+void    server_compute_shutdown(compute_pool_t* pool);
+
+/* From an eworker, `client` may be NULL. False if the queue is full. */
+bool    server_compute_submit(eworker_t* ew, client_t* client, compute_job_t* job);
+bool    server_compute_submit_to(compute_pool_t* pool, eworker_t* ew, 
+                                 client_t* client, compute_job_t* job);
+/* 
+ * Runs after every job submitted before it with the same `key`.
+ * Not rejected for a full queue (running it elsewhere could reorder it),
+ * false only if the pool is stopped.
+ */
+bool    server_compute_submit_key(compute_pool_t* pool, eworker_t* ew, 
+                                  client_t* client, compute_job_t* job, u64 key);
+/* Log the pool's metrics so far */
+void    server_compute_stats(compute_pool_t* pool);
+
+/* Any thread, job->ew & client_hd set: job->done() on job->ew, as if it ran */
+void    server_compute_post(compute_job_t* job);
+
+/* Eworker: ew->done_fd is readable */
+void    server_compute_complete(eworker_t* ew);
+/* Eworkers are stopped, cancel finished jobs waiting on `ew` */
+void    server_compute_cancel_done(eworker_t* ew);
+
+const char* server_compute_mime_type(compute_thread_t* ct, const void* data, size_t size);
+
+#endif // _SERVER_COMPUTE_H_
@@ -24,6 +24,7 @@ typedef enum se_status (*se_close_callback_t)(eworker_t* ew, server_event_t* ev)
 
 typedef struct server_event
 {
+    i32 epfd;       /* server->epfd, or owner's ew->client_epfd */
     i32 fd;
     i32 err;
     u32 ep_events;
@@ -37,14 +38,18 @@ typedef struct server_event
 server_event_t* server_new_event(server_t* server, i32 fd, void* data, 
                                 se_read_callback_t read_callback, 
                                 se_close_callback_t close_callback);
+/* Only `ew` gets its events */
+server_event_t* server_new_owned_event(eworker_t* ew, i32 fd, void* data, 
+                                      se_read_callback_t read_callback, 
+                                      se_close_callback_t close_callback);
 server_event_t* server_get_event(server_t* server, i32 fd);
 void            server_del_event(eworker_t* ew, server_event_t* se);
 void            server_process_event(eworker_t* ew, server_event_t* se);
 void            server_wait_for_events(eworker_t* ew);
 
-i32 server_event_add(const server_t* server, server_event_t* ev);
-i32 server_event_remove(const server_t* server, const server_event_t* ev);
-i32 server_event_rearm(const server_t* server, const server_event_t* ev);
+i32 server_event_add(server_event_t* ev);
+i32 server_event_remove(const server_event_t* ev);
+i32 server_event_rearm(const server_event_t* ev);
 
 // Handlers 
 enum se_status se_accept_conn(eworker_t* ew, server_event_t* ev);
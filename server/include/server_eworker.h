@@ -8,12 +8,14 @@
 #define _SERVER_EVENT_WORKER_H_
 
 #include "chat/db.h"
+#include <stdatomic.h>
 
 typedef struct client client_t;
 typedef struct eworker eworker_t;
 
 #define THREAD_NAME_LEN 32
 #define EWORKER_MAX_EVENTS 16
+#define EWORKER_RECV_BUF_SIZE (64 * KIB)
 
 typedef void (*ew_callback_t)(eworker_t* ew, client_t* client, PGresult* res, void* data);
 
@@ -24,12 +26,30 @@ typedef struct eworker
     server_db_t db;
     char        name[THREAD_NAME_LEN];
     server_t*   server;
+    i32         epfd;           /* Own epoll: server->epfd, client_epfd, mail_fd, done_fd, stats_fd & db.fd */
+    i32         client_epfd;    /* Clients we own, see server_mailbox.h */
+    i32         mail_fd;        /* eventfd, wakes us up for `mail` */
+    _Atomic(client_t*) mail;    /* Clients with posted frames (MPSC) */
+    i32         done_fd;        /* eventfd, wakes us up for `done` */
+    i32         stats_fd;       /* timerfd, metrics every conf.stats_interval, -1: off */
+    _Atomic(struct compute_job*) done;  /* Finished compute jobs (MPSC) */
+    u32         db_events;      /* Current db.fd epoll events */
+    bool        backpressure;   /* server->epfd & client_epfd removed from `epfd` */
     struct epoll_event ep_events[EWORKER_MAX_EVENTS];
+    u8*         recv_buf;       /* Reused for every client read */
+    size_t      recv_buf_size;
+    _Atomic u64 qs_epoch;       /* server->epoch seen when woke up, 0: quiescent */
+    client_t*   retired;        /* Freed clients waiting for reclamation */
 } server_eworker_t, eworker_t;
 
+/* Eworker of the calling thread, NULL on main thread */
+extern _Thread_local eworker_t* eworker_self;
+
 bool server_create_eworker(server_t* server, eworker_t* ew, size_t i);
 bool server_eworker_init(eworker_t* ew);
 void server_eworker_async_run(eworker_t* ew);
 void server_eworker_cleanup(eworker_t* ew);
+/* Logs pipeline metrics, every conf.stats_interval and at exit */
+void server_eworker_stats(eworker_t* ew);
 
 #endif // _SERVER_EVENT_WORKER_H_
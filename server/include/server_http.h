@@ -4,6 +4,8 @@
 #include "common.h"
 #include "server_client.h"
 #include "server_tm.h"
+#include "server_crypt.h"
+#include "server_multipart.h"
 
 #define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
@@ -23,14 +25,25 @@
 #define HTTP_MAX_HEADERS    20
 #define HTTP_MAX_PARAMS     10
 
+#define HTTP_BODY_MAX       (64 * KIB * KIB)   /* Buffered whole, streamed multipart only a part at a time */
+#define HTTP_SNIFF_LEN      4096
+#define HTTP_MIME_TYPE_LEN  128
+
 #define HTTP_CODE_SW_PROTO      101
 #define HTTP_CODE_OK            200
+#define HTTP_CODE_CREATED       201
+#define HTTP_CODE_PARTIAL       206
+#define HTTP_CODE_NOT_MODIFIED  304
 #define HTTP_CODE_BAD_REQ       400
 #define HTTP_CODE_NOT_FOUND     404
+#define HTTP_CODE_CONFLICT      409
+#define HTTP_CODE_TOO_LARGE     413
+#define HTTP_CODE_RANGE_NOT_SAT 416
 #define HTTP_CODE_INTERAL_ERROR 500
 
 #define HTTP_HEAD_CONTENT_LEN "Content-Length"
 #define HTTP_HEAD_WS_ACCEPT   "Sec-WebSocket-Accept"
+#define HTTP_HEAD_WS_PROTO    "Sec-WebSocket-Protocol"
 #define HTTP_HEAD_CONN_UPGRADE "Upgrade"
 #define HTTP_HEAD_CONTENT_TYPE "Content-Type"
 
@@ -67,6 +80,22 @@ typedef struct
     char val[HTTP_HEAD_VAL_LEN];
 } http_header_t;
 
+typedef struct body_sniff_job body_sniff_job_t;
+
+/*
+ * POST body that didn't fit in the first read, hashed as it arrives
+ * and its first HTTP_SNIFF_LEN bytes sniffed on the compute pool.
+ * Both are ready once the last byte is in (mime_type may stay empty).
+ */
+typedef struct 
+{
+    SHA256_CTX          sha256;
+    char                hash[SERVER_HASH256_STR_SIZE];  /* Set when complete */
+    char                mime_type[HTTP_MIME_TYPE_LEN];
+    body_sniff_job_t*   sniff;                          /* In flight */
+    bool                sniff_sent;
+} http_digest_t;
+
 typedef struct http
 {
     enum http_type type;
@@ -91,6 +120,9 @@ typedef struct http
     struct {
         bool missing;
         size_t total_recv;
+        http_digest_t* digest;
+        bool stream;                /* Body isn't buffered, fed to `multipart` */
+        multipart_t* multipart;
     } buf;
 } http_t;
 
@@ -105,6 +137,7 @@ enum client_recv_status server_http_parse(eworker_t* ew, client_t* client, u8* b
                                           size_t buf_len);
 enum client_recv_status server_handle_http(eworker_t* ew, client_t* client, http_t* http);
 http_header_t*          http_get_header(const http_t* http, const char* name);
+void                    http_add_header(http_t* http, const char* name, const char* val);
 http_t*                 http_new_resp(u16 code, const char* status_msg, const char* body, 
                                       size_t body_len);
 ssize_t                 http_send(client_t* client, http_t* http);
@@ -116,9 +149,18 @@ void                    server_http_resp_404_not_found(client_t* client);
 void                    server_http_resp_ok(client_t* client, char* content, 
                                             size_t content_len, const char* content_type);
 
-enum client_recv_status server_handle_http_get(server_t* server, client_t* client, http_t* http);
+enum client_recv_status server_handle_http_get(eworker_t* ew, client_t* client, http_t* http);
 
 void                    server_handle_http_post(eworker_t* ew, client_t* client, 
-                                                const http_t* http);
+                                                http_t* http);
+void                    server_handle_http_put(eworker_t* ew, client_t* client, http_t* http);
+void                    server_handle_http_head(eworker_t* ew, client_t* client, http_t* http);
+/* False if the request was refused (and responded to) */
+bool                    server_http_body_begin(eworker_t* ew, client_t* client, http_t* http);
+void                    server_http_body_recv(eworker_t* ew, client_t* client, http_t* http,
+                                              const void* data, size_t len);
+/* Last byte is in, handled now or once the sniff is back */
+void                    server_http_body_complete(eworker_t* ew, client_t* client, 
+                                                  http_t* http);
 
 #endif // _SERVER_HTTP_H_
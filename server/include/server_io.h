@@ -0,0 +1,67 @@
+#ifndef _SERVER_IO_H_
+#define _SERVER_IO_H_
+
+/*
+ * File I/O stage - Blocking disk work off the eworkers
+ *
+ *  Uploaded files are written to a temp file, fsync'd (conf.fsync_files)
+ *  and renamed in place on server->io, a compute_pool_t without libmagic.
+ *  Unlinks and reads go there too, completions come back on the eworker
+ *  like compute jobs do.
+ *
+ *  If the queue is full or the pool is stopped, the job runs inline on
+ *  the eworker instead; a file write is never dropped.
+ *
+ *  Writes and unlinks of one name go to the same I/O thread, in order.
+ *  Stored files are only unlinked if nothing referenced them again by then.
+ */
+
+#include "common.h"
+#include "server_compute.h"
+
+typedef struct io_read io_read_t;
+
+/* 
+ * Back on `ew`, `rd->data` is NULL on error (rd->err), callback owns it.
+ * ERANGE: `offset` is past the end (rd->file_size is set).
+ */
+typedef void (*io_read_done_t)(eworker_t* ew, client_t* client, io_read_t* rd);
+
+typedef struct io_read
+{
+    compute_job_t   job;
+    io_read_done_t  func;
+    char            path[PATH_MAX];
+    char*           data;
+    size_t          size;
+    i32             err;
+    void*           arg;    /* Caller's */
+
+    /* 
+     * Part to read, `offset` < 0 is the last -offset bytes (from their start), 
+     * `len` 0 to the end
+     */
+    i64             offset;
+    size_t          len;
+    size_t          file_size;
+} io_read_t;
+
+/* Submit or run inline, `job` as in server_compute_submit() */
+void        server_io_submit(eworker_t* ew, client_t* client, compute_job_t* job);
+
+/* Owns `data`, written to `dir`/`name` through a temp file */
+void        server_io_write_file(eworker_t* ew, void* data, size_t size, 
+                                 const char* dir, const char* name);
+void        server_io_unlink(eworker_t* ew, const char* dir, const char* name);
+/* File store's `dir`/`hash`, see server_store_unlink() */
+void        server_io_unlink_stored(eworker_t* ew, const char* dir, const char* hash);
+/* `path` is read whole, func() is called back with the data */
+bool        server_io_read_file(eworker_t* ew, client_t* client, const char* path, 
+                                io_read_done_t func, void* arg);
+/* Only `offset` & `len` of it, rd->offset & rd->size are what was read */
+bool        server_io_read_range(eworker_t* ew, client_t* client, const char* path, 
+                                 i64 offset, size_t len, io_read_done_t func, void* arg);
+/* Blocking `mkdir -p` */
+bool        server_io_mkdirs(const char* path);
+
+#endif // _SERVER_IO_H_
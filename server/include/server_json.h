@@ -0,0 +1,54 @@
+#ifndef _SERVER_JSON_H_
+#define _SERVER_JSON_H_
+
+/*
+ * jw - JSON Writer
+ *
+ * Writes JSON straight into a caller provided buffer,
+ * no allocations. For hot server->client messages where
+ * building a json_object tree is overkill.
+ *
+ *  jw_init(&jw, buf, size);
+ *  jw_obj_begin(&jw);
+ *  jw_key_str(&jw, "cmd", "group_msg");
+ *  jw_key_int(&jw, "msg_id", 69);
+ *  jw_obj_end(&jw);
+ *  if (jw.overflow) ...
+ */
+
+#include "common.h"
+
+typedef struct
+{
+    char*   buf;
+    size_t  len;
+    size_t  size;
+    bool    overflow;   /* Didn't fit, output is truncated */
+    bool    comma;      /* Next value needs a ',' */
+    bool    after_key;  /* Value follows a key, no ',' */
+} json_writer_t;
+
+/* Worst case size of an escaped string: "\u00XX" for each byte + quotes */
+#define JW_STR_MAX(len) ((len) * 6 + 2)
+
+void jw_init(json_writer_t* jw, char* buf, size_t size);
+
+void jw_obj_begin(json_writer_t* jw);
+void jw_obj_end(json_writer_t* jw);
+void jw_arr_begin(json_writer_t* jw);
+void jw_arr_end(json_writer_t* jw);
+
+void jw_key(json_writer_t* jw, const char* key);
+void jw_str(json_writer_t* jw, const char* str);
+void jw_str_len(json_writer_t* jw, const char* str, size_t len);
+void jw_int(json_writer_t* jw, i64 val);
+void jw_bool(json_writer_t* jw, bool val);
+void jw_raw(json_writer_t* jw, const char* json, size_t len); /* Already valid JSON */
+
+/* Key-value shortcuts */
+void jw_key_str(json_writer_t* jw, const char* key, const char* str);
+void jw_key_int(json_writer_t* jw, const char* key, i64 val);
+void jw_key_bool(json_writer_t* jw, const char* key, bool val);
+void jw_key_raw(json_writer_t* jw, const char* key, const char* json, size_t len);
+
+#endif // _SERVER_JSON_H_
@@ -0,0 +1,42 @@
+#ifndef _SERVER_MAILBOX_H_
+#define _SERVER_MAILBOX_H_
+
+/*
+ * Outbound mailboxes - Cross-eworker delivery
+ *
+ *  A client is owned by the eworker that accepted it, its fd is only
+ *  in that eworker's epoll set and only the owner touches client->ssl.
+ *  Other threads post complete frames to the client's mailbox (lock-free
+ *  MPSC stack), the first post since the last delivery queues the client
+ *  on the owner (another MPSC stack) and wakes it through ew->mail_fd.
+ *  The owner writes the frames out in order.
+ */
+
+#include "common.h"
+
+typedef struct client client_t;
+typedef struct eworker eworker_t;
+
+typedef struct client_mail
+{
+    struct client_mail* next;
+    size_t  len;
+    u8      data[];
+} client_mail_t;
+
+/* Copies `buf`, any thread */
+bool    server_mailbox_post(client_t* client, const void* buf, size_t len);
+
+/* Owner: ew->mail_fd is readable */
+void    server_mailbox_deliver(eworker_t* ew);
+
+/* Owner: write out everything posted so far */
+void    server_mailbox_flush(client_t* client);
+
+/* Free undelivered frames, client is being reclaimed */
+void    server_mailbox_discard(client_t* client);
+
+/* Eworkers are stopped, release the clients queued on `ew` */
+void    server_mailbox_drop_all(eworker_t* ew);
+
+#endif // _SERVER_MAILBOX_H_
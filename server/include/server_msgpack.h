@@ -0,0 +1,41 @@
+#ifndef _SERVER_MSGPACK_H_
+#define _SERVER_MSGPACK_H_
+
+/*
+ * MessagePack <-> json_object
+ *
+ * For the binary WebSocket subprotocol, commands decode
+ * into the same json_object payloads the JSON handlers use.
+ * https://github.com/msgpack/msgpack/blob/master/spec.md
+ */
+
+#include "common.h"
+
+#define WS_PROTO_MSGPACK    "chitychat.msgpack"
+#define MSGPACK_MAX_DEPTH   32
+#define MSGPACK_KEY_MAX     256
+#define MP_LEN_HDR_MAX      5       /* Type + 32-bit length */
+
+typedef struct
+{
+    u8*     data;       /* Payload at data + reserved */
+    size_t  len;
+    size_t  size;
+    size_t  reserved;   /* Bytes kept free in front of payload, for WS header */
+    bool    err;
+} mp_buf_t;
+
+json_object*    msgpack_to_json(const u8* buf, size_t len);
+
+/*
+ * Encode `json` into `mp`, payload starts at mp->data + reserved.
+ * On success caller free()'s mp->data.
+ */
+bool            json_to_msgpack(json_object* json, mp_buf_t* mp, size_t reserved);
+/* 
+ * Same, from JSON text (DB json, json_writer_t), transcoded as it's read.
+ * `json` needn't be NUL-terminated.
+ */
+bool            json_text_to_msgpack(const char* json, size_t len, mp_buf_t* mp, size_t reserved);
+
+#endif // _SERVER_MSGPACK_H_
@@ -0,0 +1,77 @@
+#ifndef _SERVER_MULTIPART_H_
+#define _SERVER_MULTIPART_H_
+
+/*
+ * Incremental multipart/form-data parser
+ *
+ *  Fed the POST body as it's received, calls back per part with its
+ *  headers and data, so no part (let alone the whole body) has to be
+ *  buffered here. Only a delimiter's worth of bytes is carried between
+ *  feeds, in case one is split across reads.
+ */
+
+#include "common.h"
+
+#define MULTIPART_BOUNDARY_MAX  70      /* RFC 2046 */
+#define MULTIPART_DELIM_MAX     (MULTIPART_BOUNDARY_MAX + 4)
+#define MULTIPART_HEADERS_MAX   4096
+#define MULTIPART_NAME_LEN      256
+#define MULTIPART_TYPE_LEN      128
+
+typedef struct eworker eworker_t;
+typedef struct client client_t;
+typedef struct multipart multipart_t;
+
+enum multipart_state
+{
+    MP_PREAMBLE,
+    MP_DELIM_END,   /* After a delimiter, "--" or CRLF */
+    MP_HEADERS,
+    MP_DATA,
+    MP_EPILOGUE,    /* Closing delimiter seen */
+    MP_ERROR,
+};
+
+typedef struct 
+{
+    char    name[MULTIPART_NAME_LEN];
+    char    filename[MULTIPART_NAME_LEN];   /* Empty if not a file */
+    char    content_type[MULTIPART_TYPE_LEN];
+} multipart_part_t;
+
+typedef struct 
+{
+    void (*part_begin)(eworker_t* ew, client_t* client, multipart_t* mp);
+    void (*part_data)(eworker_t* ew, client_t* client, multipart_t* mp, 
+                      const u8* data, size_t len);
+    void (*part_end)(eworker_t* ew, client_t* client, multipart_t* mp);
+    /* Body is complete, `ok` if it was well-formed */
+    void (*finish)(eworker_t* ew, client_t* client, multipart_t* mp, bool ok);
+    void (*free)(void* user);
+} multipart_cb_t;
+
+typedef struct multipart
+{
+    enum multipart_state state;
+    char        delim[MULTIPART_DELIM_MAX + 1];     /* CRLF "--" boundary */
+    size_t      delim_len;
+    u8*         buf;        /* Carry + what's being fed */
+    size_t      len;
+    size_t      cap;
+    multipart_part_t part;  /* Current one */
+    size_t      n_parts;
+    const multipart_cb_t* cb;
+    void*       user;
+} multipart_t;
+
+/* Boundary from a "multipart/form-data; boundary=..." Content-Type, false if it isn't */
+bool            server_multipart_boundary(const char* content_type, char* boundary);
+multipart_t*    server_multipart_new(const char* boundary, const multipart_cb_t* cb, void* user);
+void            server_multipart_feed(multipart_t* mp, eworker_t* ew, client_t* client,
+                                      const void* data, size_t len);
+void            server_multipart_end(multipart_t* mp, eworker_t* ew, client_t* client);
+/* From a callback: the rest of the body is dropped, finish() gets `ok` false */
+void            server_multipart_fail(multipart_t* mp);
+void            server_multipart_free(multipart_t* mp);
+
+#endif // _SERVER_MULTIPART_H_
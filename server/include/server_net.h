@@ -16,19 +16,21 @@ enum ip_version
     IPv6,
 };
 
+/*
+ * Kept small, there is one per connection.
+ * Host and service are numeric anyway, ip_str + port cover them.
+ */
 typedef struct 
 {
     i32 sock;
     enum ip_version version;
-    struct sockaddr* addr_ptr;
     union {
         struct sockaddr_in ipv4;
         struct sockaddr_in6 ipv6;
     };
     socklen_t len;
+    u16  port;
     char ip_str[INET6_ADDRSTRLEN];
-    char host[NI_MAXHOST];
-    char serv[NI_MAXSERV];
 } net_addr_t;
 
 #endif // _SERVER_NET_H_
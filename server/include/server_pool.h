@@ -0,0 +1,42 @@
+#ifndef _SERVER_POOL_H_
+#define _SERVER_POOL_H_
+
+#include "common.h"
+#include <pthread.h>
+
+/*
+ * Size-class pool for variable-length objects (e.g. messages).
+ *
+ * Classes are powers of two from POOL_MIN_SIZE to POOL_MAX_SIZE,
+ * blocks carry their class in a small header so server_pool_free()
+ * needs no size. Freed blocks are kept on a per-class free list
+ * (up to `max_free` per class) instead of going back to malloc().
+ * Bigger requests fall through to malloc().
+ *
+ * Thread-Safe.
+ */
+
+#define POOL_MIN_SHIFT  6                   /* 64 B */
+#define POOL_CLASSES    8                   /* .. 8 KiB */
+#define POOL_MIN_SIZE   (1 << POOL_MIN_SHIFT)
+#define POOL_MAX_SIZE   (POOL_MIN_SIZE << (POOL_CLASSES - 1))
+#define POOL_MAX_FREE   1024
+
+typedef struct pool_block pool_block_t;
+
+typedef struct 
+{
+    pool_block_t*   free[POOL_CLASSES];
+    u32             n_free[POOL_CLASSES];
+    u32             max_free;           /* Per class */
+    pthread_mutex_t mutex;
+} server_pool_t;
+
+void    server_pool_init(server_pool_t* pool, u32 max_free);
+void    server_pool_destroy(server_pool_t* pool);
+
+/* Returns at least `size` bytes, NULL if out of memory */
+void*   server_pool_alloc(server_pool_t* pool, size_t size);
+void    server_pool_free(server_pool_t* pool, void* ptr);
+
+#endif // _SERVER_POOL_H_
@@ -2,9 +2,11 @@
 #define _SERVER_WEBSOCKET_H_
 
 #include "common.h"
+#include <endian.h>
 #include "server_eworker.h"
 #include "server_tm.h"
 #include "server_client.h"
+#include "server_msgpack.h"
                                     //      Opcode
                                     //      |ONLY|
 #define WS_CONTINUE_FRAME   0x00    // 0b000|0000|
@@ -14,6 +16,9 @@
 #define WS_PING_FRAME       0x09    // 0b000|1001|
 #define WS_PONG_FRAME       0x0A    // 0b000|1010|
 
+#define WS_CLOSE_TOO_BIG      1009  /* Close status codes */
+#define WS_CLOSE_INTERNAL_ERR 1011
+
 #define WS_FIN_BIT          0x80
 #define WS_MASK_BIT         0x80
 #define WS_OPCODE_BITS      0x0F
@@ -24,7 +29,7 @@
 #define WS_OPCODE(frame)        frame[0] & WS_OPCODE_BITS       // 0b00001111
 #define WS_PAYLOAD_LEN(frame)   frame[1] & WS_PAYLOAD_LEN_BITS  // 0b01111111
 #define WS_PAYLOAD_LEN16(frame) (frame[2] << 8) | frame[3];
-#define WS_PAYLOAD_LEN64(frame) (uint64_t)frame[2];
+#define WS_PAYLOAD_LEN64(frame) ({ u64 __len; memcpy(&__len, &frame[2], sizeof(u64)); be64toh(__len); })
 
 /*
  * ws_frame_t - Web Socket Frame
@@ -96,9 +101,74 @@ typedef struct
     char* payload;
 } ws_t;
 
+#define WS_STREAM_CHUNK (16 * KIB)
+#define WS_STREAM_WHOLE_MAX (8 * KIB * KIB)  /* MessagePack client's whole message */
+
+/*
+ * ws_stream_t - Fragmented message, for large payloads.
+ *
+ *  Writes are buffered and sent as fragments of WS_STREAM_CHUNK.
+ *  From the owner eworker, other messages to the client wait in its 
+ *  mailbox from the first fragment until ws_stream_end(), so nothing 
+ *  gets in between the fragments. Other threads shouldn't stream.
+ *  MessagePack clients get it whole in one frame at ws_stream_end(),
+ *  it's JSON until then. Past WS_STREAM_WHOLE_MAX they're closed (1009).
+ *  Holds a client reference (may span loop iterations) until 
+ *  ws_stream_end() or ws_stream_abort().
+ */
+typedef struct 
+{
+    client_t* client;
+    u8      opcode;     /* WS_TEXT_FRAME then WS_CONTINUE_FRAME */
+    bool    err;
+    bool    owned;      /* Started on client->owner */
+    size_t  len;
+    size_t  total;      /* Bytes sent as fragments */
+    char*   whole;      /* MessagePack client: all of it, from whole + WS_HDR_MAX */
+    size_t  whole_len;
+    size_t  whole_size;
+    char    buf[WS_STREAM_CHUNK];
+} ws_stream_t;
+
+void    ws_stream_init(ws_stream_t* stream, client_t* client);
+void    ws_stream_write(ws_stream_t* stream, const char* buf, size_t len);
+ssize_t ws_stream_end(ws_stream_t* stream);
+void    ws_stream_abort(ws_stream_t* stream);     /* Nothing was sent */
+/* 
+ * Failed after fragments went out: the message can't be finished or
+ * interrupted, closes the connection instead (the client drops the partial one).
+ */
+void    ws_stream_fail(ws_stream_t* stream);
+
 enum client_recv_status server_ws_parse(eworker_t* ew, client_t* client, u8* buf, size_t buf_len);
 ssize_t ws_send(client_t* client, const char* buf, size_t len);
 ssize_t ws_send_adv(client_t* client, u8 opcode, const char* buf, size_t len, const u8* maskkey);
+ssize_t ws_sendv(client_t* client, u8 opcode, const struct iovec* payload, size_t n);
 ssize_t ws_json_send(client_t* client, json_object* json);
+ssize_t ws_json_send_error(client_t* client, const char* errmsg);   /* {"cmd": "error", "error_msg": errmsg} */
+
+/* 
+ * Max frame header size sent by server: 2 + 64-bit payload length.
+ * `buf` must have WS_HDR_MAX bytes free before the payload (buf + WS_HDR_MAX),
+ * the header is written there and sent with the payload in one go.
+ */
+#define WS_HDR_MAX 10
+ssize_t ws_send_reserved(client_t* client, u8 opcode, char* buf, size_t len);
+
+/*
+ * Pre-serialized JSON at buf + WS_HDR_MAX, as a text frame or, to 
+ * MessagePack clients, encoded to a binary one. For broadcasts `mp` 
+ * (zeroed by caller) keeps the encoding for the next client, caller 
+ * free()'s mp->data after. NULL: encode every time.
+ */
+ssize_t ws_send_json_reserved(client_t* client, char* buf, size_t len, mp_buf_t* mp);
+
+/*
+ * Send JSON built elsewhere (e.g. json_agg() from DB) as is, without parsing it.
+ * `prefix` opens the object up to the value's key, e.g. {"cmd":"x","key":
+ * Sends: <prefix><raw_json>}
+ */
+ssize_t ws_json_splice(client_t* client, const char* prefix, size_t prefix_len, 
+                       const char* raw_json, size_t raw_json_len);
 
 #endif // _SERVER_WEBSOCKET_H_
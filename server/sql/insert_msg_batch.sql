@@ -0,0 +1,19 @@
+WITH rows AS (
+    SELECT nextval('messages_msg_id_seq')::int AS msg_id, r.*
+    FROM unnest(
+        $1::int[], 
+        $2::int[], 
+        $3::text[], 
+        $4::json[]
+    ) WITH ORDINALITY AS r(user_id, group_id, content, attachments, n)
+    WHERE EXISTS (
+        SELECT 1 FROM GroupMembers gm
+        WHERE gm.user_id = r.user_id AND gm.group_id = r.group_id
+    )
+), ins AS (
+    INSERT INTO Messages (msg_id, user_id, group_id, content, attachments)
+    SELECT msg_id, user_id, group_id, content, attachments FROM rows
+    RETURNING msg_id, timestamp
+)
+SELECT rows.n::int, ins.msg_id, ins.timestamp
+FROM rows JOIN ins USING (msg_id);
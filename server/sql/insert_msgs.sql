@@ -0,0 +1,16 @@
+WITH ins AS (
+    INSERT INTO Messages (msg_id, user_id, group_id, content, attachments, timestamp)
+    SELECT * FROM unnest(
+        $1::int[], 
+        $2::int[], 
+        $3::int[], 
+        $4::text[], 
+        $5::json[], 
+        $6::timestamp[]
+    )
+    ON CONFLICT(msg_id) DO NOTHING
+    RETURNING msg_id
+)
+SELECT setval('messages_msg_id_seq', 
+              GREATEST(MAX(ins.msg_id), (SELECT last_value FROM messages_msg_id_seq)))
+FROM ins;
@@ -1,8 +1,9 @@
-INSERT INTO UserFiles(hash, size, mime_type)
+INSERT INTO UserFiles(hash, size, mime_type, owner_id)
 VALUES (
     $1::text, 
-    $2::int, 
-    $3::text
+    $2::bigint, 
+    $3::text,
+    NULLIF($4::int, 0)
 )
 ON CONFLICT(hash) DO UPDATE 
 SET ref_count = UserFiles.ref_count + 1;
@@ -1,4 +1,4 @@
 INSERT INTO GroupMembers(user_id, group_id)
-SELECT $1, $2 
+SELECT $1::int, $2::int
 FROM Groups g
-WHERE g.group_id = $2 AND g.public = true;
+WHERE g.group_id = $2::int AND g.public = true;
@@ -21,6 +21,9 @@ CREATE TABLE IF NOT EXISTS Users(
     FOREIGN KEY (pfp) REFERENCES UserFiles(hash)
 );
 
+-- Who stored it first, counts against their upload quota
+ALTER TABLE UserFiles ADD COLUMN IF NOT EXISTS owner_id int REFERENCES Users(user_id);
+
 CREATE TABLE IF NOT EXISTS Groups(
     group_id        SERIAL PRIMARY KEY,
     owner_id        int,
@@ -56,6 +59,10 @@ CREATE TABLE IF NOT EXISTS Messages(
     CHECK (parent_msg_id != msg_id)
 );
 
+-- History pages (select_group_msgs*.sql) and the per-message member checks
+CREATE INDEX IF NOT EXISTS messages_group_id_msg_id ON Messages(group_id, msg_id);
+CREATE INDEX IF NOT EXISTS groupmembers_group_id ON GroupMembers(group_id);
+
 CREATE TABLE IF NOT EXISTS GroupCodes(
     invite_code VARCHAR(8) PRIMARY KEY DEFAULT ENCODE(gen_random_bytes(4), 'hex'),
     group_id    int NOT null,
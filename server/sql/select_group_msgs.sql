@@ -0,0 +1,10 @@
+-- One JSON message per row, streamed to client (single-row mode).
+-- msg_id is for the recent message cache.
+SELECT row_to_json(msg), msg.msg_id
+FROM (
+    SELECT *
+    FROM Messages
+    WHERE group_id = $1::int
+    ORDER BY msg_id DESC
+    LIMIT $2::int OFFSET $3::int
+) msg;
@@ -0,0 +1,10 @@
+-- select_group_msgs.sql by keyset: the page before msg_id $3,
+-- an index range scan on Messages(group_id, msg_id) however deep it is.
+SELECT row_to_json(msg), msg.msg_id
+FROM (
+    SELECT *
+    FROM Messages
+    WHERE group_id = $1::int AND msg_id < $3::int
+    ORDER BY msg_id DESC
+    LIMIT $2::int
+) msg;
@@ -1,5 +1,5 @@
 -- Select Group Members as Users
-SELECT DISTINCT u.*
+SELECT DISTINCT u.user_id, u.username, u.displayname, u.bio, u.hash, u.salt, u.created_at, u.pfp
 FROM Users u 
 JOIN GroupMembers gm ON u.user_id = gm.user_id
 WHERE gm.group_id = $1::int;
\ No newline at end of file
@@ -1,4 +1,5 @@
-SELECT json_agg(g.*)
+-- One JSON group per row, streamed to client (single-row mode).
+SELECT row_to_json(g.*)
 FROM Groups g
 LEFT JOIN GroupMembers gm ON g.group_id = gm.group_id AND gm.user_id = $1::int
 WHERE g.public = true AND gm.group_id IS NULL;
@@ -1,2 +1,3 @@
-SELECT * FROM Users 
+SELECT user_id, username, displayname, bio, hash, salt, created_at, pfp 
+FROM Users 
 WHERE user_id = $1::int OR username = LOWER($2::varchar(50));
@@ -1,4 +1,4 @@
-SELECT g.*
+SELECT g.group_id, g.owner_id, g.name, g."desc", g.public, g.created_at
 FROM Groups g 
 JOIN GroupMembers gm ON g.group_id = gm.group_id
 WHERE gm.user_id = $1::int;
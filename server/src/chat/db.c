@@ -1,19 +1,18 @@
 #include "server.h"
 #include "chat/db.h"
-
-#define DB_PIPELINE_QUEUE_SIZE 128
+#include "chat/db_def.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <time.h>
 
 static void
 db_init_queue(server_db_t* db, size_t size)
 {
     plq_t* q = &db->queue;
 
-    q->begin = calloc(size, sizeof(dbcmd_ctx_t));
-    q->end = q->begin + size - 1;
-    q->read = q->begin;
-    q->write = q->begin;
+    memset(q, 0, sizeof(plq_t));
+    q->buf = calloc(size, sizeof(dbcmd_ctx_t));
     q->size = size;
-    q->count = 0;
 }
 
 static char* 
@@ -103,53 +102,73 @@ db_exec_schema(server_t* server)
     return ret;
 }
 
+#define DB_STMT_INIT(id, file, inline_sql, fmt)\
+    [DB_STMT_##id] = { .name = #id, .path = file, .sql = inline_sql,\
+                       .result_format = DB_FMT_##fmt },
+
 bool 
 server_init_db(server_t* server)
 {
     server_db_commands_t* cmd;
+    db_stmt_t* stmt;
+    const db_stmt_t stmts[DB_STMT_LEN] = {
+        DB_STMT_LIST(DB_STMT_INIT)
+    };
 
     cmd = &server->db_commands;
 
     cmd->schema = server_db_load_sql(server->conf.sql_schema, &cmd->schema_len);
 
-    cmd->insert_user = server_db_load_sql(server->conf.sql_insert_user, &cmd->insert_user_len);
-    cmd->select_user = server_db_load_sql(server->conf.sql_select_user, &cmd->select_user_len);
-    cmd->select_connected_users = server_db_load_sql("server/sql/select_connected_users.sql",
-                                                     &cmd->select_connected_users_len);
-    cmd->select_user_json = server_db_load_sql("server/sql/select_user_json.sql",
-                                               &cmd->select_user_json_len);
-
-    cmd->insert_group = server_db_load_sql(server->conf.sql_insert_group, &cmd->insert_group_len);
-    cmd->select_user_groups = server_db_load_sql("server/sql/select_user_groups.sql", 
-                                                 &cmd->select_user_groups_len);
-    cmd->select_pub_group = server_db_load_sql("server/sql/select_public_group.sql",
-                                               &cmd->select_pub_group_len);
-
-    cmd->insert_groupmember_code = server_db_load_sql(server->conf.sql_insert_groupmember_code, &cmd->insert_groupmember_code_len);
-    cmd->select_groupmember = server_db_load_sql(server->conf.sql_select_groupmember, &cmd->select_groupmember_len);
-    cmd->insert_pub_groupmember = server_db_load_sql("server/sql/join_pub_group.sql",
-                                                     &cmd->insert_pub_groupmember_len);
-
-    cmd->insert_msg = server_db_load_sql(server->conf.sql_insert_msg, &cmd->insert_msg_len);
-    cmd->select_msg = server_db_load_sql(server->conf.sql_select_msg, &cmd->select_msg_len);
-    cmd->select_group_msgs_json = server_db_load_sql("server/sql/select_group_msgs_json.sql",
-                                                     &cmd->select_group_msgs_json_len);
-    cmd->delete_msg = server_db_load_sql("server/sql/delete_msg.sql",
-                                         &cmd->delete_msg_len);
-
-    cmd->update_user = server_db_load_sql(server->conf.sql_update_user, &cmd->delete_msg_len);
-    cmd->insert_userfiles = server_db_load_sql(server->conf.sql_insert_userfiles, &cmd->insert_userfiles_len);
-
-    cmd->create_group_code = server_db_load_sql("server/sql/create_group_code.sql",
-                                                &cmd->create_group_code_len);
-    cmd->get_group_code = server_db_load_sql("server/sql/get_group_codes.sql",
-                                             &cmd->get_group_code_len);
-    cmd->delete_group_code = server_db_load_sql("server/sql/delete_group_code.sql",
-                                                &cmd->delete_group_code_len);
+    memcpy(cmd->stmts, stmts, sizeof(stmts));
+    for (size_t i = 0; i < DB_STMT_LEN; i++)
+    {
+        stmt = cmd->stmts + i;
+        if (stmt->path)
+            stmt->sql = server_db_load_sql(stmt->path, &stmt->sql_len);
+        else
+            stmt->sql_len = strlen(stmt->sql);
+
+        if (stmt->sql == NULL)
+        {
+            fatal("Failed to load SQL statement: %s (%s)\n", 
+                  stmt->name, stmt->path);
+            return false;
+        }
+    }
 
     return db_exec_schema(server);
 }
 
+static bool
+db_prepare_stmts(server_db_t* db)
+{
+    PGresult* res;
+    const db_stmt_t* stmt;
+    bool ret = true;
+
+    if (db->cmd == NULL)
+    {
+        error("db_prepare_stmts(): db->cmd is NULL!\n");
+        return false;
+    }
+
+    for (size_t i = 0; i < DB_STMT_LEN && ret; i++)
+    {
+        stmt = db->cmd->stmts + i;
+
+        res = PQprepare(db->conn, stmt->name, stmt->sql, 0, NULL);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        {
+            error("Prepare statement %s failed: %s\n",
+                  stmt->name, PQresultErrorMessage(res));
+            ret = false;
+        }
+        PQclear(res);
+    }
+
+    return ret;
+}
+
 bool
 server_db_open(server_db_t* db, const char* dbname, i32 flags)
 {
@@ -171,6 +190,10 @@ server_db_open(server_db_t* db, const char* dbname, i32 flags)
     PQsetNoticeProcessor(db->conn, db_notice_processor, NULL);
     db->flags = flags;
 
+    /* Must be done before entering pipeline & non-blocking mode. */
+    if (flags & DB_PREPARE && !db_prepare_stmts(db))
+        goto err;
+
     if (flags & DB_PIPELINE)
     {
         if (PQenterPipelineMode(db->conn) != 1)
@@ -206,33 +229,12 @@ server_db_free(server_t* server)
 
     free(cmd->schema);
 
-    free(cmd->insert_user);
-    free(cmd->select_user);
-    free(cmd->select_user_json);
-    free(cmd->select_connected_users);
-    free(cmd->delete_user);
-
-    free(cmd->insert_group);
-    free(cmd->select_user_groups);
-    free(cmd->select_pub_group);
-    free(cmd->delete_group);
-
-    free(cmd->insert_groupmember_code);
-    free(cmd->insert_pub_groupmember);
-    free(cmd->select_groupmember);
-    free(cmd->delete_groupmember);
-
-    free(cmd->insert_msg);
-    free(cmd->select_msg);
-    free(cmd->select_group_msgs_json);
-    free(cmd->delete_msg);
-
-    free(cmd->update_user);
-    free(cmd->insert_userfiles);
-
-    free(cmd->create_group_code);
-    free(cmd->get_group_code);
-    free(cmd->delete_group_code);
+    for (size_t i = 0; i < DB_STMT_LEN; i++)
+    {
+        db_stmt_t* stmt = cmd->stmts + i;
+        if (stmt->path)
+            free(stmt->sql);
+    }
 }
 
 void 
@@ -242,26 +244,102 @@ server_db_close(server_db_t* db)
         return;
 
     if (db->flags & DB_PIPELINE)
-        free(db->queue.begin);
+        free(db->queue.buf);
+    free(db->msg_batch.rows);
+    for (i32 i = 0; i < DB_MSG_BATCH_COLS; i++)
+        db_array_free(db->msg_batch.cols + i);
     PQfinish(db->conn);
 }
 
-void 
-db_row_to_group(dbgroup_t* group, PGresult* res, i32 row)
+/*
+ * Binary result getters. 
+ * Integers are network byte order, timestamps are i64 microseconds since 2000-01-01.
+ */
+
+i64 
+db_get_int(const PGresult* res, i32 row, i32 col)
 {
-    char* endptr;
+    const char* val;
+    u16 v16;
+    u32 v32;
+    u64 v64;
 
-    const char* group_id_str = PQgetvalue(res, row, 0);
-    if (group_id_str)
-        group->group_id = strtoul(group_id_str, &endptr, 10);
-    else
-        warn("group_id_str is NULL\n");
+    if (PQgetisnull(res, row, col))
+        return 0;
 
-    const char* owner_id_str = PQgetvalue(res, row, 1);
-    if (owner_id_str)
-        group->owner_id = strtoul(owner_id_str, &endptr, 10);
-    else
-        warn("owner_id_str is NULL!\n");
+    val = PQgetvalue(res, row, col);
+
+    switch (PQgetlength(res, row, col))
+    {
+        case sizeof(u16):
+            memcpy(&v16, val, sizeof(u16));
+            return (i16)ntohs(v16);
+        case sizeof(u32):
+            memcpy(&v32, val, sizeof(u32));
+            return (i32)ntohl(v32);
+        case sizeof(u64):
+            memcpy(&v64, val, sizeof(u64));
+            return (i64)be64toh(v64);
+        default:
+            warn("db_get_int(): Unexpected length %d for column %d\n",
+                 PQgetlength(res, row, col), col);
+            return 0;
+    }
+}
+
+bool 
+db_get_bool(const PGresult* res, i32 row, i32 col)
+{
+    if (PQgetisnull(res, row, col))
+        return false;
+    return *PQgetvalue(res, row, col) != 0;
+}
+
+size_t
+db_timestamp_str(i64 usec, char* buf, size_t size)
+{
+    time_t sec;
+    struct tm tm;
+    size_t len;
+    i32 frac;
+
+    sec = usec / DB_USEC;
+    frac = usec % DB_USEC;
+    if (frac < 0)
+    {
+        frac += DB_USEC;
+        sec--;
+    }
+    sec += DB_PG_EPOCH_OFFSET;
+    gmtime_r(&sec, &tm);
+
+    /* Same format as the PostgreSQL text output */
+    len = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+    if (frac && len < size)
+    {
+        len += snprintf(buf + len, size - len, ".%06d", frac);
+        while (buf[len - 1] == '0')
+            buf[--len] = 0x00;
+    }
+
+    return len;
+}
+
+size_t
+db_get_timestamp(const PGresult* res, i32 row, i32 col, char* buf, size_t size)
+{
+    *buf = 0x00;
+    if (PQgetisnull(res, row, col))
+        return 0;
+
+    return db_timestamp_str(db_get_int(res, row, col), buf, size);
+}
+
+void 
+db_row_to_group(dbgroup_t* group, PGresult* res, i32 row)
+{
+    group->group_id = db_get_int(res, row, 0);
+    group->owner_id = db_get_int(res, row, 1);
 
     const char* name = PQgetvalue(res, row, 2);
     if (name)
@@ -275,29 +353,15 @@ db_row_to_group(dbgroup_t* group, PGresult* res, i32 row)
     else
         warn("group desc is NULL!\n");
 
-    const char* public_str = PQgetvalue(res, row, 4);
-    if (public_str && *public_str == 't')
-        group->public = true;
-    else
-        group->public = false;
+    group->public = db_get_bool(res, row, 4);
 
-    const char* created_at = PQgetvalue(res, row, 5);
-    if (created_at)
-        strncpy(group->created_at, created_at, DB_TIMESTAMP_MAX);
-    else
-        warn("group created_at is NULL!\n");
+    db_get_timestamp(res, row, 5, group->created_at, DB_TIMESTAMP_MAX);
 }
 
 void 
 db_row_to_user(dbuser_t* user, PGresult* res, i32 row)
 {
-    char* endptr;
-
-    const char* id_str = PQgetvalue(res, row, 0);
-    if (id_str)
-        user->user_id = strtoul(id_str, &endptr, 10);
-    else
-        warn("id_str is NULL!\n");
+    user->user_id = db_get_int(res, row, 0);
     
     const char* username = PQgetvalue(res, row, 1);
     if (username)
@@ -315,29 +379,19 @@ db_row_to_user(dbuser_t* user, PGresult* res, i32 row)
     if (bio)
         strncpy(user->bio, bio, DB_BIO_MAX);
 
-    const void* hash_str = PQgetvalue(res, row, 4);
-    size_t hash_size = PQgetlength(res, row, 4);
-
-    hexstr_to_u8(hash_str, hash_size, user->hash);
-
-    const void* salt_str = PQgetvalue(res, row, 5);
-    size_t salt_size = PQgetlength(res, row, 5);
-
-    hexstr_to_u8(salt_str, salt_size, user->salt);
-
-    const char* flags_str = PQgetvalue(res, row, 6);
-    if (flags_str)
-        user->flags = atoi(flags_str);
+    if (PQgetlength(res, row, 4) == SERVER_HASH_SIZE)
+        memcpy(user->hash, PQgetvalue(res, row, 4), SERVER_HASH_SIZE);
     else
-        warn("flags is NULL!\n");
+        warn("user hash size %d\n", PQgetlength(res, row, 4));
 
-    const char* created_at = PQgetvalue(res, row, 7);
-    if (created_at)
-        strncpy(user->created_at, created_at, DB_TIMESTAMP_MAX);
+    if (PQgetlength(res, row, 5) == SERVER_SALT_SIZE)
+        memcpy(user->salt, PQgetvalue(res, row, 5), SERVER_SALT_SIZE);
     else
-        warn("created_at is NULL!\n");
+        warn("user salt size %d\n", PQgetlength(res, row, 5));
+
+    db_get_timestamp(res, row, 6, user->created_at, DB_TIMESTAMP_MAX);
 
-    const char* pfp_hash = PQgetvalue(res, row, 8);
+    const char* pfp_hash = PQgetvalue(res, row, 7);
     if (pfp_hash)
         strncpy(user->pfp_hash, pfp_hash, DB_PFP_HASH_MAX);
 }
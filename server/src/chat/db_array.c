@@ -0,0 +1,84 @@
+#include "chat/db_array.h"
+
+static void
+db_array_put(db_array_t* arr, const char* str, size_t len)
+{
+    size_t size;
+    char* data;
+
+    if (arr->len + len + 1 > arr->size)
+    {
+        size = (arr->size) ? arr->size : 4096;
+        while (arr->len + len + 1 > size)
+            size *= 2;
+        if ((data = realloc(arr->data, size)) == NULL)
+        {
+            arr->err = true;
+            return;
+        }
+        arr->data = data;
+        arr->size = size;
+    }
+    memcpy(arr->data + arr->len, str, len);
+    arr->len += len;
+    arr->data[arr->len] = 0x00;
+}
+
+static void
+db_array_sep(db_array_t* arr)
+{
+    if (arr->len > 1)
+        db_array_put(arr, ",", 1);
+}
+
+void
+db_array_begin(db_array_t* arr)
+{
+    arr->len = 0;
+    arr->err = false;
+    db_array_put(arr, "{", 1);
+}
+
+void
+db_array_int(db_array_t* arr, i64 val)
+{
+    char num[24];
+    i32 len;
+
+    db_array_sep(arr);
+    len = snprintf(num, sizeof(num), "%ld", val);
+    db_array_put(arr, num, len);
+}
+
+void
+db_array_str(db_array_t* arr, const char* str, size_t len)
+{
+    size_t start = 0;
+
+    db_array_sep(arr);
+    db_array_put(arr, "\"", 1);
+    for (size_t i = 0; i < len; i++)
+    {
+        if (str[i] != '"' && str[i] != '\\')
+            continue;
+        db_array_put(arr, str + start, i - start);
+        db_array_put(arr, "\\", 1);
+        start = i;
+    }
+    db_array_put(arr, str + start, len - start);
+    db_array_put(arr, "\"", 1);
+}
+
+bool
+db_array_end(db_array_t* arr)
+{
+    db_array_put(arr, "}", 1);
+    return !arr->err;
+}
+
+void
+db_array_free(db_array_t* arr)
+{
+    free(arr->data);
+    memset(arr, 0, sizeof(db_array_t));
+}
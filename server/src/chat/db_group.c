@@ -3,8 +3,10 @@
 #include "chat/db_def.h"
 #include "chat/db.h"
 #include "chat/group.h"
+#include "chat/user_file.h"
 #include <libpq-fe.h>
 #include <stdio.h>
+#include <arpa/inet.h>
 
 static void
 db_get_groups_result(UNUSED eworker_t* ew, PGresult* res, ExecStatusType status, dbcmd_ctx_t* ctx)
@@ -36,18 +38,17 @@ db_get_groups_result(UNUSED eworker_t* ew, PGresult* res, ExecStatusType status,
 bool 
 db_async_get_group(server_db_t* db, u32 group_id, dbcmd_ctx_t* ctx)
 {
-    const char* sql = "SELECT * FROM Groups WHERE group_id = $1::int;";
     i32 ret;
-    char group_id_str[DB_INTSTR_MAX];
+    const u32 group_id_be = htonl(group_id);
     const char* vals[1] = {
-        group_id_str
+        (const char*)&group_id_be
     };
     const i32 lens[1] = {
-        snprintf(group_id_str, DB_INTSTR_MAX, "%u", group_id)
+        sizeof(u32)
     };
-    const i32 formats[1] = {0};
+    const i32 formats[1] = {DB_FMT_BINARY};
     ctx->exec_res = db_get_groups_result;
-    ret = db_async_params(db, sql, 1, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_SELECT_GROUP, 1, vals, lens, formats, ctx);
     
     return ret == 1;
 }
@@ -56,16 +57,16 @@ bool
 db_async_get_user_groups(server_db_t* db, u32 user_id, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char user_id_str[DB_INTSTR_MAX];
+    const u32 user_id_be = htonl(user_id);
     const char* vals[1] = {
-        user_id_str
+        (const char*)&user_id_be
     };
     const i32 lens[1] = {
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", user_id)
+        sizeof(u32)
     };
-    const i32 formats[1] = {0};
+    const i32 formats[1] = {DB_FMT_BINARY};
     ctx->exec_res = db_get_groups_result;
-    ret = db_async_params(db, db->cmd->select_user_groups, 1, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_SELECT_USER_GROUPS, 1, vals, lens, formats, ctx);
     return ret == 1;
 }
 
@@ -84,20 +85,17 @@ db_get_group_member_ids_result(UNUSED eworker_t* ew, PGresult* res, ExecStatusTy
             user_ids = calloc(rows, sizeof(u32));
 
             for (size_t i = 0; i < rows; i++)
-            {
-                char* endptr;
-                const char* user_id_str = PQgetvalue(res, i, 0);
-                u32 user_id = strtoul(user_id_str, &endptr, 10);
-                user_ids[i] = user_id;
-            }
+                user_ids[i] = db_get_int(res, i, 0);
             ctx->data = user_ids;
             ctx->data_size = rows;
         }
         else
         {
-            member_ids_str = PQgetvalue(res, 0, 0);
-            if (member_ids_str == NULL)
+            /* json_agg() of no rows is NULL */
+            if (PQgetisnull(res, 0, 0))
                 member_ids_str = "[]";
+            else
+                member_ids_str = PQgetvalue(res, 0, 0);
             ctx->param.member_ids.ids_json = member_ids_str;
         }
         ctx->ret = DB_ASYNC_OK;
@@ -113,70 +111,59 @@ db_get_group_member_ids_result(UNUSED eworker_t* ew, PGresult* res, ExecStatusTy
 bool 
 db_async_get_group_member_ids(server_db_t* db, u32 group_id, dbcmd_ctx_t* ctx)
 {
-    const char* sql;
+    enum db_stmt stmt;
     if (ctx->flags & DB_CTX_NO_JSON)
-        sql = "SELECT user_id FROM GroupMembers WHERE group_id = $1::int;";
+        stmt = DB_STMT_SELECT_MEMBER_IDS;
     else
-        sql = "SELECT json_agg(user_id) FROM GroupMembers WHERE group_id = $1::int;";
+        stmt = DB_STMT_SELECT_MEMBER_IDS_JSON;
 
     i32 ret;
-    char group_id_str[DB_INTSTR_MAX];
+    const u32 group_id_be = htonl(group_id);
     const char* vals[1] = {
-        group_id_str
+        (const char*)&group_id_be
     };
     const i32 lens[1] = {
-        snprintf(group_id_str, DB_INTSTR_MAX, "%u", group_id)
+        sizeof(u32)
     };
-    const i32 formats[1] = {0};
+    const i32 formats[1] = {DB_FMT_BINARY};
     ctx->exec_res = db_get_group_member_ids_result;
-    ret = db_async_params(db, sql, 1, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, stmt, 1, vals, lens, formats, ctx);
 
     return ret == 1;
 }
 
-static void
-do_get_group_msgs(UNUSED eworker_t* ew, PGresult* res, ExecStatusType status, dbcmd_ctx_t* ctx)
-{
-    const char* msgs_json_str;
-
-    if (status == PGRES_TUPLES_OK)
-    {
-        msgs_json_str = PQgetvalue(res, 0, 0);
-        if (!msgs_json_str || *msgs_json_str == 0x00)
-            msgs_json_str = "[]";
-
-        ctx->param.group_msgs.msgs_json = msgs_json_str;
-        ctx->ret = DB_ASYNC_OK;
-    }
-    else
-    {
-        error("get_group_msgs not PGRES_TUPLES_OK: %s\n",
-              PQresultErrorMessage(res));
-        ctx->ret = DB_ASYNC_ERROR;
-    }
-}
-
 bool 
-db_async_get_group_msgs(server_db_t* db, u32 group_id, u32 limit, u32 offset, dbcmd_ctx_t* ctx)
+db_async_get_group_msgs(server_db_t* db, u32 group_id, u32 limit, u32 offset, 
+                        u32 before_msg_id, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char group_id_str[DB_INTSTR_MAX];
-    char limit_str[DB_INTSTR_MAX];
-    char offset_str[DB_INTSTR_MAX];
+    const u32 group_id_be = htonl(group_id);
+    const u32 limit_be = htonl(limit);
+    /* $3 is either */
+    const u32 page_be = htonl((before_msg_id) ? before_msg_id : offset);
     const char* vals[3] = {
-        group_id_str,
-        limit_str,
-        offset_str
+        (const char*)&group_id_be,
+        (const char*)&limit_be,
+        (const char*)&page_be
     };
     const i32 lens[3] = {
-        snprintf(group_id_str, DB_INTSTR_MAX, "%u", group_id),
-        snprintf(limit_str, DB_INTSTR_MAX, "%u", limit),
-        snprintf(offset_str, DB_INTSTR_MAX, "%u", offset)
+        sizeof(u32),
+        sizeof(u32),
+        sizeof(u32)
+    };
+    const i32 formats[3] = {
+        DB_FMT_BINARY,
+        DB_FMT_BINARY,
+        DB_FMT_BINARY
     };
-    const i32 formats[3] = {0};
 
-    ctx->exec_res = do_get_group_msgs;
-    ret = db_async_params(db, db->cmd->select_group_msgs_json, 3, vals, lens, formats, ctx);
+    /* Caller may look at the rows on the way (ctx->data starts with a db_stream_t) */
+    if (ctx->exec_res == NULL)
+        ctx->exec_res = db_stream_rows_result;
+    ctx->flags |= DB_CTX_SINGLE_ROW;
+    ret = db_async_prepared(db, (before_msg_id) ? DB_STMT_SELECT_GROUP_MSGS_BEFORE 
+                                                : DB_STMT_SELECT_GROUP_MSGS, 
+                            3, vals, lens, formats, ctx);
 
     return ret == 1;
 }
@@ -184,26 +171,20 @@ db_async_get_group_msgs(server_db_t* db, u32 group_id, u32 limit, u32 offset, db
 static void 
 insert_group_msg_result(UNUSED eworker_t* ew, PGresult* res, ExecStatusType status, dbcmd_ctx_t* ctx)
 {
-    const char* msg_id_str;
-    const char* timestamp;
-    char* endptr;
     dbmsg_t* msg;
 
     if (status == PGRES_TUPLES_OK)
     {
         msg = ctx->data;
-        msg_id_str = PQgetvalue(res, 0, 0);
-        if ((msg->msg_id = strtoul(msg_id_str, &endptr, 10)) == 0)
+        if ((msg->msg_id = db_get_int(res, 0, 0)) == 0)
         {
-            error("msg_id is 0: %s\n", msg_id_str);
+            error("msg_id is 0\n");
             ctx->ret = DB_ASYNC_ERROR;
             return;
         }
 
-        if ((timestamp = PQgetvalue(res, 0, 1)) == NULL)
+        if (db_get_timestamp(res, 0, 1, msg->timestamp, DB_MSG_TIMESTAMP_MAX) == 0)
             error("timestamp is NULL!\n");
-        else
-            strncpy(msg->timestamp, timestamp, DB_TIMESTAMP_MAX);
         ctx->ret = DB_ASYNC_OK;
     }
     else
@@ -214,40 +195,257 @@ insert_group_msg_result(UNUSED eworker_t* ew, PGresult* res, ExecStatusType stat
     }
 }
 
-bool 
-db_async_insert_group_msg(server_db_t* db, dbmsg_t* msg, dbcmd_ctx_t* ctx)
+/* Its own INSERT, when a batch failed */
+static bool 
+db_insert_group_msg_one(server_db_t* db, dbmsg_t* msg, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char user_id_str[DB_INTSTR_MAX];
-    char group_id_str[DB_INTSTR_MAX];
-    if (!msg->attachments)
-        msg->attachments = "[]";
+    const u32 user_id_be = htonl(msg->user_id);
+    const u32 group_id_be = htonl(msg->group_id);
 
     const char* vals[4] = {
-        user_id_str,
-        group_id_str,
+        (const char*)&user_id_be,
+        (const char*)&group_id_be,
         msg->content,
         msg->attachments
     };
     const i32 lens[4] = {
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", msg->user_id),
-        snprintf(group_id_str, DB_INTSTR_MAX, "%u", msg->group_id),
-        strnlen(msg->content, DB_MESSAGE_MAX),
+        sizeof(u32),
+        sizeof(u32),
+        msg->content_len,
         strlen(msg->attachments)
     };
-    const i32 formats[4] = {0};
+    const i32 formats[4] = {
+        DB_FMT_BINARY,
+        DB_FMT_BINARY,
+        DB_FMT_TEXT,
+        DB_FMT_TEXT
+    };
 
     ctx->exec_res = insert_group_msg_result;
     ctx->data = msg;
-    ret = db_async_params(db, db->cmd->insert_msg, 4, vals, lens, formats, ctx);
+    /* Pool allocated, exec callback frees it */
+    ctx->flags |= DB_CTX_DONT_FREE;
+    ret = db_async_prepared(db, DB_STMT_INSERT_MSG, 4, vals, lens, formats, ctx);
     return ret == 1;
 }
 
+/* The batch's rows, insert_msg_batch.sql returns `n` (1-based) with each */
+typedef struct
+{
+    size_t          n;
+    db_msg_row_t    rows[];
+} db_msg_rows_t;
+
+static void
+db_msg_row_exec(eworker_t* ew, db_msg_row_t* row)
+{
+    db_pipeline_exec(ew, &row->ctx);
+    if ((row->ctx.flags & DB_CTX_DONT_FREE) == 0)
+        free(row->ctx.data);
+}
+
+static void
+insert_msg_batch_result(UNUSED eworker_t* ew, PGresult* res, 
+                        ExecStatusType status, dbcmd_ctx_t* ctx)
+{
+    db_msg_rows_t* batch = ctx->data;
+    db_msg_row_t* row;
+    i32 rows;
+    i64 n;
+
+    if (status != PGRES_TUPLES_OK)
+    {
+        error("insert_msg_batch (%zu rows): %s\n",
+              batch->n, PQresultErrorMessage(res));
+        ctx->ret = DB_ASYNC_ERROR;
+        return;
+    }
+
+    /* Missing ones aren't members, like the foreign key would've said */
+    rows = PQntuples(res);
+    for (i32 i = 0; i < rows; i++)
+    {
+        n = db_get_int(res, i, 0);
+        if (n < 1 || (size_t)n > batch->n)
+            continue;
+        row = batch->rows + n - 1;
+        row->msg->msg_id = db_get_int(res, i, 1);
+        db_get_timestamp(res, i, 2, row->msg->timestamp, DB_MSG_TIMESTAMP_MAX);
+        row->ctx.ret = DB_ASYNC_OK;
+    }
+    ctx->ret = DB_ASYNC_OK;
+}
+
+static const char*
+do_insert_msg_batch(eworker_t* ew, dbcmd_ctx_t* ctx)
+{
+    db_msg_rows_t* batch = ctx->data;
+    db_msg_row_t* row;
+
+    for (size_t i = 0; i < batch->n; i++)
+    {
+        row = batch->rows + i;
+        if (ctx->ret == DB_ASYNC_OK)
+        {
+            db_msg_row_exec(ew, row);
+            continue;
+        }
+
+        /* One bad row fails them all (e.g. left the group just now), one by one then */
+        row->ctx.client = server_client_get(ew->server, row->ctx.client_hd);
+        if (!db_insert_group_msg_one(&ew->db, row->msg, &row->ctx))
+            db_msg_row_exec(ew, row);
+    }
+    free(batch);
+    return NULL;
+}
+
+static void
+db_send_msg_batch(eworker_t* ew, db_msg_row_t* rows, size_t n)
+{
+    server_db_t* db = &ew->db;
+    db_array_t* cols = db->msg_batch.cols;
+    db_msg_rows_t* batch;
+    const dbmsg_t* msg;
+    const char* vals[DB_MSG_BATCH_COLS];
+    const i32 formats[DB_MSG_BATCH_COLS] = {
+        DB_FMT_TEXT,
+        DB_FMT_TEXT,
+        DB_FMT_TEXT,
+        DB_FMT_TEXT
+    };
+
+    if ((batch = malloc(sizeof(db_msg_rows_t) + n * sizeof(db_msg_row_t))) == NULL)
+    {
+        error("malloc msg batch: %s\n", ERRSTR);
+        goto err;
+    }
+    batch->n = n;
+    memcpy(batch->rows, rows, n * sizeof(db_msg_row_t));
+
+    for (i32 c = 0; c < DB_MSG_BATCH_COLS; c++)
+        db_array_begin(cols + c);
+    for (size_t i = 0; i < n; i++)
+    {
+        msg = rows[i].msg;
+        db_array_int(cols + 0, msg->user_id);
+        db_array_int(cols + 1, msg->group_id);
+        db_array_str(cols + 2, msg->content, msg->content_len);
+        db_array_str(cols + 3, msg->attachments, strlen(msg->attachments));
+    }
+    for (i32 c = 0; c < DB_MSG_BATCH_COLS; c++)
+    {
+        if (!db_array_end(cols + c))
+        {
+            error("msg batch array: out of memory\n");
+            goto err;
+        }
+        vals[c] = cols[c].data;
+    }
+
+    dbcmd_ctx_t ctx = {
+        .exec = do_insert_msg_batch,
+        .exec_res = insert_msg_batch_result,
+        .data = batch,
+        .flags = DB_CTX_DONT_FREE
+    };
+
+    /* Its own chain, between events */
+    db_pipeline_set_ctx(db, NULL);
+    if (db_async_prepared(db, DB_STMT_INSERT_MSG_BATCH, DB_MSG_BATCH_COLS, 
+                          vals, NULL, formats, &ctx) != 1)
+        goto err;
+    db_pipeline_current_done(db);
+    db->msg_batch.batches++;
+    db->msg_batch.total += n;
+    return;
+err:
+    free(batch);
+    for (size_t i = 0; i < n; i++)
+    {
+        rows[i].ctx.ret = DB_ASYNC_ERROR;
+        db_msg_row_exec(ew, rows + i);
+    }
+}
+
+bool 
+db_async_insert_group_msg(server_db_t* db, dbmsg_t* msg, dbcmd_ctx_t* ctx)
+{
+    db_msg_batch_t* batch = &db->msg_batch;
+    db_msg_row_t* rows;
+    db_msg_row_t* row;
+    client_t* client;
+    size_t size;
+
+    if (batch->n == batch->size)
+    {
+        size = (batch->size) ? batch->size * 2 : DB_MSG_BATCH_MAX;
+        if ((rows = realloc(batch->rows, size * sizeof(db_msg_row_t))) == NULL)
+        {
+            error("realloc msg batch: %s\n", ERRSTR);
+            return false;
+        }
+        batch->rows = rows;
+        batch->size = size;
+    }
+
+    if (!msg->attachments)
+        msg->attachments = "[]";
+
+    row = batch->rows + batch->n++;
+    row->msg = msg;
+    row->ctx = *ctx;
+    row->ctx.ret = DB_ASYNC_ERROR;
+    row->ctx.exec_res = insert_group_msg_result;
+    row->ctx.data = msg;
+    /* Pool allocated, exec callback frees it */
+    row->ctx.flags |= DB_CTX_DONT_FREE;
+    row->ctx.next = NULL;
+    /* Like db_pipeline_enqueue_current(), it's exec'd in a later iteration */
+    client = (row->ctx.client) ? row->ctx.client : db->ctx.client;
+    row->ctx.client_hd = (client) ? client->hd : CLIENT_HD_NONE;
+    row->ctx.client = NULL;
+    return true;
+}
+
+void
+db_flush_group_msgs(eworker_t* ew)
+{
+    db_msg_batch_t* batch = &ew->db.msg_batch;
+    db_msg_row_t* rows = batch->rows;
+    const size_t n_rows = batch->n;
+    const size_t size = batch->size;
+    size_t n;
+
+    if (n_rows == 0)
+        return;
+
+    /* An exec() on error could hold new ones meanwhile */
+    batch->rows = NULL;
+    batch->n = batch->size = 0;
+
+    for (size_t i = 0; i < n_rows; i += n)
+    {
+        n = n_rows - i;
+        if (n > DB_MSG_BATCH_MAX)
+            n = DB_MSG_BATCH_MAX;
+        db_send_msg_batch(ew, rows + i, n);
+    }
+
+    if (batch->rows == NULL)
+    {
+        batch->rows = rows;
+        batch->size = size;
+    }
+    else
+        free(rows);
+}
+
 static void
 db_delete_msg_result(UNUSED eworker_t* ew,
                      PGresult* res, ExecStatusType status, dbcmd_ctx_t* ctx)
 {
-    const char* group_id_str;
     const char* attachments_str;
 
     if (status == PGRES_TUPLES_OK)
@@ -258,8 +456,7 @@ db_delete_msg_result(UNUSED eworker_t* ew,
             return;
         }
 
-        group_id_str = PQgetvalue(res, 0, 0);
-        ctx->param.del_msg.group_id = strtoul(group_id_str, NULL, 0);
+        ctx->param.del_msg.group_id = db_get_int(res, 0, 0);
 
         attachments_str = PQgetvalue(res, 0, 1);
         ctx->param.del_msg.attachments_json = attachments_str;
@@ -277,58 +474,40 @@ bool
 db_async_delete_msg(server_db_t* db, u32 msg_id, u32 user_id, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char msg_id_str[DB_INTSTR_MAX];
-    char user_id_str[DB_INTSTR_MAX];
+    const u32 msg_id_be = htonl(msg_id);
+    const u32 user_id_be = htonl(user_id);
     const char* vals[2] = {
-        msg_id_str,
-        user_id_str
+        (const char*)&msg_id_be,
+        (const char*)&user_id_be
     };
     const i32 lens[2] = {
-        snprintf(msg_id_str, DB_INTSTR_MAX, "%u", msg_id),
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", user_id),
+        sizeof(u32),
+        sizeof(u32),
+    };
+    const i32 formats[2] = {
+        DB_FMT_BINARY,
+        DB_FMT_BINARY
     };
-    const i32 formats[2] = {0, 0};
     ctx->exec_res = db_delete_msg_result;
-    ret = db_async_params(db, db->cmd->delete_msg, 2, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_DELETE_MSG, 2, vals, lens, formats, ctx);
     return ret;
 }
 
-static void
-get_public_groups_result(UNUSED eworker_t* ew,
-                         PGresult* res, ExecStatusType status, dbcmd_ctx_t* ctx)
-{
-    const char* groups_array_json;
-
-    if (status == PGRES_TUPLES_OK)
-    {
-        groups_array_json = PQgetvalue(res, 0, 0);
-        if (groups_array_json == NULL)
-            groups_array_json = "[]";
-        ctx->param.str = groups_array_json;
-        ctx->ret = DB_ASYNC_OK;
-    }
-    else
-    {
-        error("Async get public groups: %s\n",
-              PQresultErrorMessage(res));
-        ctx->ret = DB_ASYNC_ERROR;
-    }
-}
-
 bool 
 db_async_get_public_groups(server_db_t* db, u32 user_id, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char user_id_str[DB_INTSTR_MAX];
+    const u32 user_id_be = htonl(user_id);
     const char* vals[1] = {
-        user_id_str
+        (const char*)&user_id_be
     };
     const i32 lens[1] = {
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", user_id)
+        sizeof(u32)
     };
-    const i32 formats[1] = {0};
-    ctx->exec_res = get_public_groups_result;
-    ret = db_async_params(db, db->cmd->select_pub_group, 1, vals, lens, formats, ctx);
+    const i32 formats[1] = {DB_FMT_BINARY};
+    ctx->exec_res = db_stream_rows_result;
+    ctx->flags |= DB_CTX_SINGLE_ROW;
+    ret = db_async_prepared(db, DB_STMT_SELECT_PUB_GROUP, 1, vals, lens, formats, ctx);
     return ret == 1;
 }
 
@@ -350,19 +529,22 @@ bool
 db_async_user_join_pub_group(server_db_t* db, u32 user_id, u32 group_id, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char user_id_str[DB_INTSTR_MAX];
-    char group_id_str[DB_INTSTR_MAX];
+    const u32 user_id_be = htonl(user_id);
+    const u32 group_id_be = htonl(group_id);
     const char* vals[2] = {
-        user_id_str,
-        group_id_str
+        (const char*)&user_id_be,
+        (const char*)&group_id_be
     };
     const i32 lens[2] = {
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", user_id),
-        snprintf(group_id_str, DB_INTSTR_MAX, "%u", group_id),
+        sizeof(u32),
+        sizeof(u32),
+    };
+    const i32 formats[2] = {
+        DB_FMT_BINARY,
+        DB_FMT_BINARY
     };
-    const i32 formats[2] = {0};
     ctx->exec_res = join_pub_group_result;
-    ret = db_async_params(db, db->cmd->insert_pub_groupmember, 2, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_INSERT_PUB_GROUPMEMBER, 2, vals, lens, formats, ctx);
     return ret == 1;
 }
 
@@ -370,13 +552,11 @@ static void
 create_group_result(UNUSED eworker_t* ew, 
                     PGresult* res, ExecStatusType status, dbcmd_ctx_t* ctx)
 {
-    const char* group_id_str;
     dbgroup_t* group = ctx->data;
 
     if (status == PGRES_TUPLES_OK)
     {
-        group_id_str = PQgetvalue(res, 0, 0);
-        group->group_id = strtoul(group_id_str, NULL, 0);
+        group->group_id = db_get_int(res, 0, 0);
         ctx->ret = DB_ASYNC_OK;
     }
     else
@@ -391,22 +571,26 @@ bool
 db_async_create_group(server_db_t* db, dbgroup_t* group, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char owner_id_str[DB_INTSTR_MAX];
-    const char* public_str = (group->public) ? "true" : "false";
+    const u32 owner_id_be = htonl(group->owner_id);
+    const u8 public = group->public;
     const char* vals[3] = {
         group->displayname,
-        owner_id_str,
-        public_str
+        (const char*)&owner_id_be,
+        (const char*)&public
     };
     const i32 lens[3] = {
         strnlen(group->displayname, DB_DISPLAYNAME_MAX),
-        snprintf(owner_id_str, DB_INTSTR_MAX, "%u", group->owner_id),
-        strlen(public_str)
+        sizeof(u32),
+        sizeof(u8)
+    };
+    const i32 formats[3] = {
+        DB_FMT_TEXT,
+        DB_FMT_BINARY,
+        DB_FMT_BINARY
     };
-    const i32 formats[3] = {0};
     ctx->exec_res = create_group_result;
     ctx->data = group;
-    ret = db_async_params(db, db->cmd->insert_group, 3, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_INSERT_GROUP, 3, vals, lens, formats, ctx);
     return ret;
 }
 
@@ -442,23 +626,27 @@ db_async_create_group_code(server_db_t* db,
                            dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char group_id_str[DB_INTSTR_MAX];
-    char max_uses_str[DB_INTSTR_MAX];
-    char user_id_str[DB_INTSTR_MAX];
+    const u32 group_id_be = htonl(group_code->group_id);
+    const u32 max_uses_be = htonl((u32)group_code->max_uses);
+    const u32 user_id_be = htonl(user_id);
     const char* vals[3] = {
-        group_id_str,
-        max_uses_str,
-        user_id_str
+        (const char*)&group_id_be,
+        (const char*)&max_uses_be,
+        (const char*)&user_id_be
     };
     const i32 lens[3] = {
-        snprintf(group_id_str, DB_INTSTR_MAX, "%u", group_code->group_id),
-        snprintf(max_uses_str, DB_INTSTR_MAX, "%d", group_code->max_uses),
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", user_id),
+        sizeof(u32),
+        sizeof(u32),
+        sizeof(u32),
+    };
+    const i32 formats[3] = {
+        DB_FMT_BINARY,
+        DB_FMT_BINARY,
+        DB_FMT_BINARY
     };
-    const i32 formats[3] = {0, 0, 0};
     ctx->exec_res = create_group_code_result;
     ctx->data = group_code;
-    ret = db_async_params(db, db->cmd->create_group_code, 3, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_CREATE_GROUP_CODE, 3, vals, lens, formats, ctx);
     return ret;
 }
 
@@ -470,9 +658,10 @@ get_group_codes_result(UNUSED eworker_t* ew,
 
     if (status == PGRES_TUPLES_OK)
     {
-        group_codes_array_json = PQgetvalue(res, 0, 0);
-        if (group_codes_array_json == NULL)
+        if (PQgetisnull(res, 0, 0))
             group_codes_array_json = "[]";
+        else
+            group_codes_array_json = PQgetvalue(res, 0, 0);
         ctx->param.group_codes.array_json = group_codes_array_json;
         ctx->ret = DB_ASYNC_OK;
     }
@@ -488,20 +677,23 @@ bool
 db_async_get_group_codes(server_db_t* db, u32 group_id, u32 user_id, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char group_id_str[DB_INTSTR_MAX];
-    char user_id_str[DB_INTSTR_MAX];
+    const u32 group_id_be = htonl(group_id);
+    const u32 user_id_be = htonl(user_id);
     const char* vals[2] = {
-        group_id_str,
-        user_id_str
+        (const char*)&group_id_be,
+        (const char*)&user_id_be
     };
     const i32 lens[2] = {
-        snprintf(group_id_str, DB_INTSTR_MAX, "%u", group_id),
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", user_id),
+        sizeof(u32),
+        sizeof(u32),
+    };
+    const i32 formats[2] = {
+        DB_FMT_BINARY,
+        DB_FMT_BINARY
     };
-    const i32 formats[2] = {0, 0};
     ctx->exec_res = get_group_codes_result;
     ctx->param.group_codes.group_id = group_id;
-    ret = db_async_params(db, db->cmd->get_group_code, 2, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_GET_GROUP_CODES, 2, vals, lens, formats, ctx);
     return ret;
 }
 
@@ -509,15 +701,11 @@ static void
 user_join_group_code_result(UNUSED eworker_t* ew,
                             PGresult* res, ExecStatusType status, dbcmd_ctx_t* ctx)
 {
-    const char* group_id_str;
-    u32 group_id;
-
     if (status == PGRES_TUPLES_OK)
     {
-        if ((group_id_str = PQgetvalue(res, 0, 0)) == NULL)
+        if (PQntuples(res) == 0)
             goto err;
-        group_id = strtoul(group_id_str, NULL, 0);
-        ctx->param.group_id = group_id;
+        ctx->param.group_id = db_get_int(res, 0, 0);
         ctx->ret = DB_ASYNC_OK;
         return;
     }
@@ -533,18 +721,21 @@ db_async_user_join_group_code(server_db_t* db,
                               const char* code, u32 user_id, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char user_id_str[DB_INTSTR_MAX];
+    const u32 user_id_be = htonl(user_id);
     const char* vals[2] = {
-        user_id_str,
+        (const char*)&user_id_be,
         code
     };
     const i32 lens[2] = {
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", user_id),
+        sizeof(u32),
         strnlen(code, DB_GROUP_CODE_MAX)
     };
-    const i32 formats[2] = {0, 0};
+    const i32 formats[2] = {
+        DB_FMT_BINARY,
+        DB_FMT_TEXT
+    };
     ctx->exec_res = user_join_group_code_result;
-    ret = db_async_params(db, db->cmd->insert_groupmember_code, 2, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_INSERT_GROUPMEMBER_CODE, 2, vals, lens, formats, ctx);
     return ret;
 }
 
@@ -568,18 +759,21 @@ db_async_delete_group_code(server_db_t* db,
                            const char* invite_code, u32 user_id, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char user_id_str[DB_INTSTR_MAX];
+    const u32 user_id_be = htonl(user_id);
     const char* vals[2] = {
         invite_code,
-        user_id_str
+        (const char*)&user_id_be
     };
     const i32 lens[2] = {
         strnlen(invite_code, DB_GROUP_CODE_MAX),
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", user_id)
+        sizeof(u32)
+    };
+    const i32 formats[2] = {
+        DB_FMT_TEXT,
+        DB_FMT_BINARY
     };
-    const i32 formats[2] = {0, 0};
     ctx->exec_res = db_delete_group_code_result;
-    ret = db_async_params(db, db->cmd->delete_group_code, 2, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_DELETE_GROUP_CODE, 2, vals, lens, formats, ctx);
     return ret;
 }
 
@@ -601,31 +795,49 @@ static void
 get_all_attachs_result(UNUSED eworker_t* ew, 
                        PGresult* res, ExecStatusType status, dbcmd_ctx_t* ctx)
 {
-    i32 rows;
-    json_object** attachs_array;
+    json_object* attachs_json;
+    dbuser_file_t** files;
+    size_t n;
 
-    if (status == PGRES_TUPLES_OK)
-    {
-        ctx->ret = DB_ASYNC_OK;
-        rows = PQntuples(res);
-        if (rows == 0)
-            return;
-
-        attachs_array = calloc(rows, sizeof(void*));
-        for (i32 i = 0; i < rows; i++)
-        {
-            json_object** json_obj = attachs_array + i;
-            const char* attach = PQgetvalue(res, i, 0);
-            *json_obj = json_tokener_parse(attach);
-        }
-        ctx->data = attachs_array;
-        ctx->data_size = rows;
-    }
-    else
+    switch (status)
     {
-        error("Get all attachs: %s\n",
-              PQresultErrorMessage(res));
-        ctx->ret = DB_ASYNC_ERROR;
+        case PGRES_SINGLE_TUPLE:
+            if (ctx->ret == DB_ASYNC_ERROR)
+                break;
+            /* Only keep the files, not the whole JSON tree */
+            attachs_json = json_tokener_parse(PQgetvalue(res, 0, 0));
+            n = (attachs_json) ? json_object_array_length(attachs_json) : 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                /* Grow on power of 2 */
+                if ((ctx->data_size & (ctx->data_size - 1)) == 0)
+                {
+                    files = realloc(ctx->data, 
+                                    (ctx->data_size ? ctx->data_size * 2 : 1) * sizeof(void*));
+                    if (files == NULL)
+                    {
+                        error("Get all attachs realloc: %s\n", ERRSTR);
+                        ctx->ret = DB_ASYNC_ERROR;
+                        break;
+                    }
+                    ctx->data = files;
+                }
+                files = ctx->data;
+                files[ctx->data_size++] = server_attach_json_to_file(
+                                json_object_array_get_idx(attachs_json, i));
+            }
+            json_object_put(attachs_json);
+            break;
+        case PGRES_TUPLES_OK:
+            /* A file missing from the list would never be unlinked */
+            if (ctx->ret != DB_ASYNC_ERROR)
+                ctx->ret = DB_ASYNC_OK;
+            break;
+        default:
+            error("Get all attachs: %s\n",
+                  PQresultErrorMessage(res));
+            ctx->ret = DB_ASYNC_ERROR;
+            break;
     }
 }
 
@@ -641,30 +853,28 @@ get_all_attachs_result(UNUSED eworker_t* ew,
 bool
 db_async_delete_group(server_db_t* db, u32 group_id, dbcmd_ctx_t* ctx)
 {
-    const char* get_all_attachs     = "SELECT attachments FROM Messages WHERE group_id = $1::int AND json_array_length(attachments) > 0;";
-    const char* del_group_msg       = "DELETE FROM Messages WHERE group_id = $1::int;";
-    const char* del_group_members   = "DELETE FROM GroupMembers WHERE group_id = $1::int;";
-    const char* del_group_codes     = "DELETE FROM GroupCodes WHERE group_id = $1::int;";
-    const char* del_group           = "DELETE FROM Groups WHERE group_id = $1::int;";
     i32 ret;
-    char group_id_str[DB_INTSTR_MAX];
+    const u32 group_id_be = htonl(group_id);
     const char* vals[1] = {
-        group_id_str,
+        (const char*)&group_id_be,
     };
     const i32 lens[1] = {
-        snprintf(group_id_str, DB_INTSTR_MAX, "%u", group_id),
+        sizeof(u32),
     };
-    const i32 formats[1] = {0};
+    const i32 formats[1] = {DB_FMT_BINARY};
 
     /* Begin transaction */
     if (!(ret = db_async_begin(db, ctx)))
         return false;
     ctx->exec = NULL;
+    ctx->flags &= ~DB_CTX_DONT_FREE;
 
     /* Get all messages with atttachments */
     ctx->exec_res = get_all_attachs_result;
-    if (!(ret = db_async_params(db, get_all_attachs, 1, vals, lens, formats, ctx)))
+    ctx->flags |= DB_CTX_SINGLE_ROW;
+    if (!(ret = db_async_prepared(db, DB_STMT_SELECT_GROUP_ATTACHS, 1, vals, lens, formats, ctx)))
         goto rollback;
+    ctx->flags &= ~DB_CTX_SINGLE_ROW;
 
     /* Get all (former) member IDs */
     ctx->flags |= DB_CTX_NO_JSON;
@@ -673,19 +883,19 @@ db_async_delete_group(server_db_t* db, u32 group_id, dbcmd_ctx_t* ctx)
     ctx->exec_res = del_group_result;
 
     /* Delete all messages */
-    if (!(ret = db_async_params(db, del_group_msg, 1, vals, lens, formats, ctx)))
+    if (!(ret = db_async_prepared(db, DB_STMT_DELETE_GROUP_MSGS, 1, vals, lens, formats, ctx)))
         goto rollback;
 
     /* Delete all group members */
-    if (!(ret = db_async_params(db, del_group_members, 1, vals, lens, formats, ctx)))
+    if (!(ret = db_async_prepared(db, DB_STMT_DELETE_GROUP_MEMBERS, 1, vals, lens, formats, ctx)))
         goto rollback;
     
     /* Delete all group codes */
-    if (!(ret = db_async_params(db, del_group_codes, 1, vals, lens, formats, ctx)))
+    if (!(ret = db_async_prepared(db, DB_STMT_DELETE_GROUP_CODES, 1, vals, lens, formats, ctx)))
         goto rollback;
 
     /* Delete group */
-    if (!(ret = db_async_params(db, del_group, 1, vals, lens, formats, ctx)))
+    if (!(ret = db_async_prepared(db, DB_STMT_DELETE_GROUP, 1, vals, lens, formats, ctx)))
         goto rollback;
 
     ret = db_async_commit(db);
@@ -699,9 +909,6 @@ static void
 get_group_owner_result(UNUSED eworker_t* ew, 
                        PGresult* res, ExecStatusType status, dbcmd_ctx_t* ctx)
 {
-    const char* owner_id_str;
-    u32 owner_id;
-
     if (status == PGRES_TUPLES_OK)
     {
         if (PQntuples(res) == 0)
@@ -710,10 +917,7 @@ get_group_owner_result(UNUSED eworker_t* ew,
             ctx->ret = DB_ASYNC_ERROR;
             return;
         }
-        owner_id_str = PQgetvalue(res, 0, 0);
-        owner_id = strtoul(owner_id_str, NULL, 0);
-        printf("owner_id_str: %s\n", owner_id_str);
-        ctx->param.group_owner.owner_id = owner_id;
+        ctx->param.group_owner.owner_id = db_get_int(res, 0, 0);
         ctx->ret = DB_ASYNC_OK;
         return;
     }
@@ -726,17 +930,16 @@ get_group_owner_result(UNUSED eworker_t* ew,
 bool 
 db_async_get_group_owner(server_db_t* db, u32 group_id, dbcmd_ctx_t* ctx)
 {
-    const char* sql = "SELECT owner_id FROM Groups WHERE group_id = $1::int;";
     i32 ret;
-    char group_id_str[DB_INTSTR_MAX];
+    const u32 group_id_be = htonl(group_id);
     const char* vals[1] = {
-        group_id_str
+        (const char*)&group_id_be
     };
     const i32 lens[1] = {
-        snprintf(group_id_str, DB_INTSTR_MAX, "%u", group_id)
+        sizeof(u32)
     };
-    const i32 formats[1] = {0};
+    const i32 formats[1] = {DB_FMT_BINARY};
     ctx->exec_res = get_group_owner_result;
-    ret = db_async_params(db, sql, 1, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_SELECT_GROUP_OWNER, 1, vals, lens, formats, ctx);
     return ret;
 }
@@ -49,6 +49,36 @@ err:
     return ret;
 }
 
+i32 
+db_async_prepared(server_db_t* db, 
+                  enum db_stmt stmt,
+                  size_t n,
+                  const char* const vals[], 
+                  const i32* lens, 
+                  const i32* formats, 
+                  const dbcmd_ctx_t* cmd)
+{
+    i32 ret;
+    i32 result_format;
+    const char* stmt_name;
+    if (!cmd)
+        return 0;
+
+    stmt_name = db->cmd->stmts[stmt].name;
+    result_format = db->cmd->stmts[stmt].result_format;
+
+    if ((ret = PQsendQueryPrepared(db->conn, stmt_name, n, vals, lens, formats, result_format)) != 1)
+    {
+        error("Async prepared %s send: %s\n",
+              stmt_name, PQerrorMessage(db->conn));
+        goto err;
+    }
+    PQpipelineSync(db->conn);
+    db_pipeline_enqueue_current(db, cmd);
+err:
+    return ret;
+}
+
 i32 
 db_async_exec(server_db_t* db, const char* query,
               const dbcmd_ctx_t* cmd)
@@ -102,23 +132,15 @@ db_async_rollback(server_db_t* db)
     return ret;
 }
 
-static void
-db_exec_cmd(eworker_t* ew, dbcmd_ctx_t* cmd)
+void
+db_pipeline_exec(eworker_t* ew, dbcmd_ctx_t* cmd)
 {
     const char* errmsg;
-    json_object* resp;
 
+    cmd->client = server_client_get(ew->server, cmd->client_hd);
     errmsg = cmd->exec(ew, cmd);
-    if (errmsg && cmd->client)
-    {
-        resp = json_object_new_object();
-        json_object_object_add(resp, "cmd",
-                               json_object_new_string("error"));
-        json_object_object_add(resp, "error_msg",
-                               json_object_new_string(errmsg));
-        ws_json_send(cmd->client, resp);
-        json_object_put(resp);
-    }
+    if (errmsg)
+        ws_json_send_error(cmd->client, errmsg);
     db_pipeline_current_done(&ew->db);
 }
 
@@ -147,12 +169,25 @@ db_exec_cmd_chain(eworker_t* ew, dbcmd_ctx_t* cmd)
     while (cmd)
     {
         if (cmd->exec)
-            db_exec_cmd(ew, cmd);
+            db_pipeline_exec(ew, cmd);
         cmd = cmd->next;
     }
     db_cmd_free(base);
 }
 
+/* First cmd in the oldest chain still waiting for results */
+static dbcmd_ctx_t*
+db_pipeline_peek_busy(const server_db_t* db)
+{
+    dbcmd_ctx_t* ctx = db_pipeline_peek(db);
+
+    if (ctx == NULL)
+        return NULL;
+    while (ctx->next && ctx->ret != DB_ASYNC_BUSY)
+        ctx = ctx->next;
+    return ctx;
+}
+
 void 
 db_process_results(eworker_t* ew)
 {
@@ -162,25 +197,53 @@ db_process_results(eworker_t* ew)
     ExecStatusType status;
     dbcmd_ctx_t* ctx_peek;
     dbcmd_ctx_t* cmd;
+    i32 nulls = 0;
 
-    while ((res = PQgetResult(db->conn)))
+    if (PQconsumeInput(db->conn) == 0)
     {
+        error("PQconsumeInput: %s\n", 
+              PQerrorMessage(db->conn));
+        return;
+    }
+
+    /*
+     * Never block: Stop when libpq needs more data from the socket.
+     * Each query's results end with NULL, two in a row means 
+     * nothing more is buffered.
+     */
+    for (;;)
+    {
+        /* Must be set before libpq parses the query's first row. */
+        if ((ctx_peek = db_pipeline_peek_busy(db)) && 
+            ctx_peek->flags & DB_CTX_SINGLE_ROW)
+            PQsetSingleRowMode(db->conn);
+
+        if (PQisBusy(db->conn))
+            break;
+
+        if ((res = PQgetResult(db->conn)) == NULL)
+        {
+            if (++nulls == 2)
+                break;
+            continue;
+        }
+        nulls = 0;
+
         status = PQresultStatus(res);
         // debug("> %zu: %s\n", count, pgres_status_str[status]);
         if (status == PGRES_PIPELINE_SYNC)
             goto clear;
-        ctx_peek = db_pipeline_peek(db);
+        ctx_peek = db_pipeline_peek_busy(db);
         if (!ctx_peek)
         {
             error("> %zu: Nothing in pipeline!\n", count);
             goto clear;
         }
-        while (ctx_peek->next && ctx_peek->ret != DB_ASYNC_BUSY)
-            if (ctx_peek->next)
-                ctx_peek = ctx_peek->next;
+        ctx_peek->client = server_client_get(ew->server, ctx_peek->client_hd);
         ctx_peek->exec_res(ew, res, status, ctx_peek);
 
-        if (ctx_peek->next == NULL)
+        /* Single-row results keep it busy until the last one */
+        if (ctx_peek->next == NULL && ctx_peek->ret != DB_ASYNC_BUSY)
         {
             cmd = malloc(sizeof(dbcmd_ctx_t));
             db_pipeline_dequeue(db, cmd);
@@ -192,16 +255,53 @@ db_process_results(eworker_t* ew)
     }
 }
 
+static i32
+db_pipeline_grow(plq_t* q)
+{
+    dbcmd_ctx_t* new_buf;
+    size_t new_size = q->size * 2;
+    size_t first;
+
+    if ((new_buf = calloc(new_size, sizeof(dbcmd_ctx_t))) == NULL)
+    {
+        error("Pipeline queue grow to %zu: %s\n", 
+              new_size, ERRSTR);
+        return -1;
+    }
+
+    /* Unwrap ring into the start of the new buffer */
+    first = q->size - q->read;
+    if (first > q->count)
+        first = q->count;
+    memcpy(new_buf, q->buf + q->read, first * sizeof(dbcmd_ctx_t));
+    memcpy(new_buf + first, q->buf, (q->count - first) * sizeof(dbcmd_ctx_t));
+
+    free(q->buf);
+    q->buf = new_buf;
+    q->read = 0;
+    q->size = new_size;
+    q->metrics.grows++;
+
+    verbose("Pipeline queue grew to %zu\n", new_size);
+
+    return 0;
+}
+
 i32
 db_pipeline_enqueue(server_db_t* db, const dbcmd_ctx_t* cmd)
 {
     plq_t* q = &db->queue;
-    if (q->write->client != NULL)
+    dbcmd_ctx_t* write;
+
+    if (q->count == q->size && db_pipeline_grow(q) == -1)
         return -1;
-    memcpy(q->write, cmd, sizeof(dbcmd_ctx_t));
-    if ((q->write++ >= q->end))
-        q->write = q->begin;
+
+    write = q->buf + ((q->read + q->count) % q->size);
+    memcpy(write, cmd, sizeof(dbcmd_ctx_t));
     q->count++;
+    q->metrics.total++;
+    if (q->count > q->metrics.high_water)
+        q->metrics.high_water = q->count;
     return 0;
 }
 
@@ -219,6 +319,9 @@ db_pipeline_enqueue_current(server_db_t* db, const dbcmd_ctx_t* cmd)
     next_cmd->next = NULL;
     if (next_cmd->client == NULL)
         next_cmd->client = db->ctx.client;
+    /* Results come in a later iteration, client may be gone by then */
+    next_cmd->client_hd = (next_cmd->client) ? next_cmd->client->hd : CLIENT_HD_NONE;
+    next_cmd->client = NULL;
 
     if (db->ctx.head == NULL)
     {
@@ -235,21 +338,23 @@ dbcmd_ctx_t*
 db_pipeline_peek(const server_db_t* db)
 {
     const plq_t* q = &db->queue;
-    if (q->read->exec == NULL)
+    if (q->count == 0)
         return NULL;
-    return q->read;
+    return q->buf + q->read;
 }
 
 i32
 db_pipeline_dequeue(server_db_t* db, dbcmd_ctx_t* cmd)
 {
     plq_t* q = &db->queue;
-    if (q->read->exec == NULL)
+    dbcmd_ctx_t* read;
+
+    if (q->count == 0)
         return 0;
-    memcpy(cmd, q->read, sizeof(dbcmd_ctx_t));
-    memset(q->read, 0, sizeof(dbcmd_ctx_t));
-    if ((q->read++ >= q->end))
-        q->read = q->begin;
+    read = q->buf + q->read;
+    memcpy(cmd, read, sizeof(dbcmd_ctx_t));
+    memset(read, 0, sizeof(dbcmd_ctx_t));
+    q->read = (q->read + 1) % q->size;
     q->count--;
     return 1;
 }
@@ -266,7 +371,16 @@ db_pipeline_current_done(server_db_t* db)
     // debug("db->ctx.head: %p\n", db->ctx.head);
     if (db->ctx.head == NULL)
         return;
-    db_pipeline_enqueue(db, db->ctx.head);
+    if (db_pipeline_enqueue(db, db->ctx.head) == -1)
+    {
+        /* 
+         * Should never happen unless out of memory. 
+         * Results are already in flight, so we can't recover this pipeline.
+         */
+        fatal("Pipeline enqueue failed, queue: %zu/%zu\n",
+              db->queue.count, db->queue.size);
+        abort();
+    }
     free(db->ctx.head);
     db_pipeline_reset_current(db);
 }
@@ -276,3 +390,49 @@ db_pipeline_set_ctx(server_db_t* db, client_t* client)
 {
     db->ctx.client = client;
 }
+
+db_stream_t* 
+db_stream_new(client_t* client, const char* suffix)
+{
+    db_stream_t* stream;
+
+    stream = malloc(sizeof(db_stream_t));
+    ws_stream_init(&stream->ws, client);
+    stream->rows = 0;
+    stream->suffix = suffix;
+
+    return stream;
+}
+
+void 
+db_stream_rows_result(UNUSED eworker_t* ew, PGresult* res, 
+                      ExecStatusType status, dbcmd_ctx_t* ctx)
+{
+    db_stream_t* stream = ctx->data;
+
+    switch (status)
+    {
+        case PGRES_SINGLE_TUPLE:
+            if (stream->rows++)
+                ws_stream_write(&stream->ws, ",", 1);
+            ws_stream_write(&stream->ws, PQgetvalue(res, 0, 0), 
+                            PQgetlength(res, 0, 0));
+            return;
+        case PGRES_TUPLES_OK:
+            ctx->ret = DB_ASYNC_OK;
+            break;
+        default:
+            error("Stream rows (%zu sent): %s\n",
+                  stream->rows, PQresultErrorMessage(res));
+            ctx->ret = DB_ASYNC_ERROR;
+            /* 
+             * Nothing sent yet, let exec() send the error instead.
+             * Otherwise don't close the array, a truncated one would look whole.
+             */
+            ws_stream_fail(&stream->ws);
+            return;
+    }
+
+    ws_stream_write(&stream->ws, stream->suffix, strlen(stream->suffix));
+    ws_stream_end(&stream->ws);
+}
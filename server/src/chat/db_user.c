@@ -2,6 +2,7 @@
 #include "chat/db_def.h"
 #include "chat/db_pipeline.h"
 #include <libpq-fe.h>
+#include <arpa/inet.h>
 
 static void 
 db_get_user_result(UNUSED eworker_t* ew, PGresult* res, ExecStatusType status, dbcmd_ctx_t* ctx)
@@ -29,13 +30,10 @@ db_insert_user_result(UNUSED eworker_t* ew, PGresult* res, ExecStatusType status
 {
     dbuser_t* user = ctx->data;
     ctx->ret = DB_ASYNC_ERROR;
-    const char* user_id_str;
-    char* endptr;
 
     if (status == PGRES_TUPLES_OK)
     {
-        user_id_str = PQgetvalue(res, 0, 0);
-        user->user_id = strtoul(user_id_str, &endptr, 10);
+        user->user_id = db_get_int(res, 0, 0);
         ctx->ret = DB_ASYNC_OK;
     }
     else
@@ -49,17 +47,16 @@ bool
 db_async_get_user(server_db_t* db, u32 user_id, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    const char* sql = "SELECT * FROM Users WHERE user_id = $1::int;";
-    char user_id_str[DB_INTSTR_MAX];
+    const u32 user_id_be = htonl(user_id);
     const char* vals[1] = {
-        user_id_str
+        (const char*)&user_id_be
     };
     const i32 lens[1] = {
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", user_id)
+        sizeof(u32)
     };
-    const i32 formats[1] = {0};
+    const i32 formats[1] = {DB_FMT_BINARY};
     ctx->exec_res = db_get_user_result;
-    ret = db_async_params(db, sql, 1, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_SELECT_USER_ID, 1, vals, lens, formats, ctx);
     return ret == 1;    
 }
 
@@ -67,17 +64,16 @@ bool
 db_async_get_user_username(server_db_t* db, const char* username, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    const char* sql = "SELECT * FROM Users WHERE username = $1::varchar(50);";
     const char* const vals[1] = {
         username
     };
     const i32 lens[1] = {
         strnlen(username, DB_USERNAME_MAX)
     };
-    const i32 formats[1] = {0};
+    const i32 formats[1] = {DB_FMT_TEXT};
     ctx->exec_res = db_get_user_result;
 
-    ret = db_async_params(db, sql, 1, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_SELECT_USER_USERNAME, 1, vals, lens, formats, ctx);
     return ret == 1;
 }
 
@@ -88,13 +84,13 @@ db_get_user_json_result(UNUSED eworker_t* ew, PGresult* res, ExecStatusType stat
 
     if (status == PGRES_TUPLES_OK)    
     {
-        user_array_json = PQgetvalue(res, 0, 0);
-        if (user_array_json)
-        {
-            ctx->param.str = user_array_json;
-            ctx->ret = DB_ASYNC_OK;
-            return;
-        }
+        if (PQgetisnull(res, 0, 0))
+            user_array_json = "[]";
+        else
+            user_array_json = PQgetvalue(res, 0, 0);
+        ctx->param.str = user_array_json;
+        ctx->ret = DB_ASYNC_OK;
+        return;
     }
     else if (status == PGRES_FATAL_ERROR)
         error("get_user_json_array: %s\n",
@@ -113,10 +109,10 @@ db_async_get_user_array(server_db_t* db, const char* json_array, dbcmd_ctx_t* ct
     const i32 lens[1] = {
         strlen(json_array)
     };
-    const i32 formats[1] = {0};
+    const i32 formats[1] = {DB_FMT_TEXT};
     ctx->exec_res = db_get_user_json_result;
 
-    ret = db_async_params(db, db->cmd->select_user_json, 1, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_SELECT_USER_JSON, 1, vals, lens, formats, ctx);
     return ret == 1;
 }
 
@@ -131,10 +127,10 @@ db_async_insert_user(server_db_t* db, const dbuser_t* user, dbcmd_ctx_t* ctx)
         (const char*)user->salt
     };
     const i32 formats[4] = {
-        0, 
-        0,
-        1,
-        1
+        DB_FMT_TEXT, 
+        DB_FMT_TEXT,
+        DB_FMT_BINARY,
+        DB_FMT_BINARY
     };
     const i32 lens[4] = {
         strnlen(user->username, DB_USERNAME_MAX),
@@ -144,7 +140,7 @@ db_async_insert_user(server_db_t* db, const dbuser_t* user, dbcmd_ctx_t* ctx)
     };
     ctx->exec_res = db_insert_user_result;
     ctx->data = (void*)user;
-    ret = db_async_params(db, db->cmd->insert_user, 4, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_INSERT_USER, 4, vals, lens, formats, ctx);
     return ret == 1;
 }
 
@@ -152,7 +148,6 @@ static void
 get_connected_users_result(UNUSED eworker_t* ew,
                            PGresult* res, ExecStatusType status, dbcmd_ctx_t* ctx)
 {
-    const char* user_id_str;
     u32* user_ids;
     i32  rows;
 
@@ -162,10 +157,7 @@ get_connected_users_result(UNUSED eworker_t* ew,
             goto err;
         user_ids = calloc(rows, sizeof(u32));
         for (i32 i = 0; i < rows; i++)
-        {
-            user_id_str = PQgetvalue(res, i, 0);
-            user_ids[i] = strtoul(user_id_str, NULL, 0);
-        }
+            user_ids[i] = db_get_int(res, i, 0);
         ctx->data = user_ids;
         ctx->data_size = rows;
         ctx->ret = DB_ASYNC_OK;
@@ -182,16 +174,16 @@ bool
 db_async_get_connected_users(server_db_t* db, u32 user_id, dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char user_id_str[DB_INTSTR_MAX];
+    const u32 user_id_be = htonl(user_id);
     const char* vals[1] = {
-        user_id_str
+        (const char*)&user_id_be
     };
     const i32 lens[1] = {
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", user_id)
+        sizeof(u32)
     };
-    const i32 formats[1] = {0};
+    const i32 formats[1] = {DB_FMT_BINARY};
     ctx->exec_res = get_connected_users_result;
-    ret = db_async_params(db, db->cmd->select_connected_users, 1, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_SELECT_CONNECTED_USERS, 1, vals, lens, formats, ctx);
     return ret;
 }
 
@@ -219,27 +211,38 @@ db_async_update_user(server_db_t* db,
                      dbcmd_ctx_t* ctx)
 {
     i32 ret;
-    char user_id_str[DB_INTSTR_MAX];
+    const u32 user_id_be = htonl(user_id);
+    const u8 set_username = username != NULL;
+    const u8 set_displayname = displayname != NULL;
+    const u8 set_pfp = pfp_hash != NULL;
     const char* vals[7] = {
-        (username) ? "true" : "false",
+        (const char*)&set_username,
         username,
-        (displayname) ? "true" : "false",
+        (const char*)&set_displayname,
         displayname,
-        (pfp_hash) ? "true" : "false",
+        (const char*)&set_pfp,
         pfp_hash,
-        user_id_str
+        (const char*)&user_id_be
     };
     const int lens[7] = {
-        strlen(vals[0]),
+        sizeof(u8),
         (username) ?    strnlen(username, DB_USERNAME_MAX) : 0,
-        strlen(vals[2]),
+        sizeof(u8),
         (displayname) ? strnlen(displayname, DB_DISPLAYNAME_MAX) : 0,
-        strlen(vals[4]),
+        sizeof(u8),
         (pfp_hash) ?   strnlen(pfp_hash, DB_PFP_HASH_MAX) : 0,
-        snprintf(user_id_str, DB_INTSTR_MAX, "%u", user_id)
+        sizeof(u32)
+    };
+    const int formats[7] = {
+        DB_FMT_BINARY,
+        DB_FMT_TEXT,
+        DB_FMT_BINARY,
+        DB_FMT_TEXT,
+        DB_FMT_BINARY,
+        DB_FMT_TEXT,
+        DB_FMT_BINARY
     };
-    const int formats[7] = {0};
     ctx->exec_res = update_user_result;
-    ret = db_async_params(db, db->cmd->update_user, 7, vals, lens, formats, ctx);
+    ret = db_async_prepared(db, DB_STMT_UPDATE_USER, 7, vals, lens, formats, ctx);
     return ret;
 }
@@ -0,0 +1,388 @@
+#include "chat/file_store.h"
+#include "chat/db.h"
+#include "server.h"
+#include <libpq-fe.h>
+#include <dirent.h>
+
+static u64
+store_key(const char* hash)
+{
+    /* Already uniformly distributed, the first 16 hex chars will do (GHT can't take 0) */
+    char prefix[17];
+
+    memcpy(prefix, hash, 16);
+    prefix[16] = 0x00;
+    return strtoull(prefix, NULL, 16) | 1;
+}
+
+static bool
+store_is_hash(const char* name)
+{
+    size_t i;
+
+    for (i = 0; name[i]; i++)
+        if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f')))
+            return false;
+    return i == STORE_HASH_LEN;
+}
+
+static store_entry_t*
+store_find(file_store_t* store, const char* hash, store_entry_t** head)
+{
+    store_entry_t* entry;
+
+    *head = server_ght_get(&store->index, store_key(hash));
+    for (entry = *head; entry; entry = entry->next)
+        if (strncmp(entry->hash, hash, STORE_HASH_LEN) == 0)
+            return entry;
+    return NULL;
+}
+
+typedef struct 
+{
+    size_t bytes;
+} store_usage_t;
+
+static void
+store_usage_add(file_store_t* store, u32 owner_id, size_t size, bool add)
+{
+    store_usage_t* usage;
+
+    if (owner_id == 0)
+        return;
+    if ((usage = server_ght_get(&store->usage, owner_id)) == NULL)
+    {
+        if (!add || (usage = calloc(1, sizeof(store_usage_t))) == NULL)
+            return;
+        if (!server_ght_insert(&store->usage, owner_id, usage))
+        {
+            free(usage);
+            return;
+        }
+    }
+    if (add)
+        usage->bytes += size;
+    else
+        usage->bytes -= (size < usage->bytes) ? size : usage->bytes;
+}
+
+static store_entry_t*
+store_add(file_store_t* store, const char* hash, const char* mime_type, i32 ref_count,
+          size_t size, u32 owner_id)
+{
+    store_entry_t* head;
+    store_entry_t* entry;
+
+    if ((entry = store_find(store, hash, &head)))
+    {
+        entry->ref_count += ref_count;
+        return entry;
+    }
+    if ((entry = calloc(1, sizeof(store_entry_t))) == NULL)
+    {
+        error("store entry calloc: %s\n", ERRSTR);
+        return NULL;
+    }
+    strncpy(entry->hash, hash, STORE_HASH_LEN);
+    strncpy(entry->mime_type, mime_type, DB_MIME_TYPE_LEN - 1);
+    entry->ref_count = ref_count;
+    entry->size = size;
+    entry->owner_id = owner_id;
+    store_usage_add(store, owner_id, size, true);
+
+    if (head)
+    {
+        entry->next = head->next;
+        head->next = entry;
+    }
+    else
+        server_ght_insert(&store->index, store_key(hash), entry);
+    return entry;
+}
+
+static void
+store_remove(file_store_t* store, store_entry_t* entry)
+{
+    store_entry_t* head;
+    store_entry_t** prev;
+
+    store_usage_add(store, entry->owner_id, entry->size, false);
+    store_find(store, entry->hash, &head);
+    if (head == entry)
+    {
+        server_ght_del(&store->index, store_key(entry->hash));
+        if (entry->next)
+            server_ght_insert(&store->index, store_key(entry->hash), entry->next);
+    }
+    else
+    {
+        for (prev = &head->next; *prev != entry; prev = &(*prev)->next)
+            ;
+        *prev = entry->next;
+    }
+    free(entry);
+}
+
+static void
+store_free_entries(store_entry_t* entry)
+{
+    store_entry_t* next;
+
+    for (; entry; entry = next)
+    {
+        next = entry->next;
+        free(entry);
+    }
+}
+
+void
+server_store_dir(const char* base, const char* hash, char* out)
+{
+    snprintf(out, PATH_MAX, "%s/%.*s/%.*s", base, 
+             STORE_FANOUT_LEN, hash, 
+             STORE_FANOUT_LEN, hash + STORE_FANOUT_LEN);
+}
+
+void
+server_store_path(const char* base, const char* hash, char* out)
+{
+    snprintf(out, PATH_MAX, "%s/%.*s/%.*s/%s", base, 
+             STORE_FANOUT_LEN, hash, 
+             STORE_FANOUT_LEN, hash + STORE_FANOUT_LEN, 
+             hash);
+}
+
+/* Files from before the fan-out: `<dir>/<hash>` -> `<dir>/ab/cd/<hash>` */
+static void
+store_migrate_dir(const char* base)
+{
+    DIR* dir;
+    struct dirent* ent;
+    char old_path[PATH_MAX];
+    char new_path[PATH_MAX];
+    size_t n_moved = 0;
+
+    if ((dir = opendir(base)) == NULL)
+    {
+        if (errno != ENOENT)
+            warn("opendir %s: %s\n", base, ERRSTR);
+        return;
+    }
+
+    while ((ent = readdir(dir)))
+    {
+        if (ent->d_type != DT_REG || !store_is_hash(ent->d_name))
+            continue;
+
+        server_store_dir(base, ent->d_name, old_path);
+        if (!server_io_mkdirs(old_path))
+            continue;
+
+        snprintf(old_path, PATH_MAX, "%s/%s", base, ent->d_name);
+        server_store_path(base, ent->d_name, new_path);
+        if (rename(old_path, new_path) == -1)
+            error("rename %s -> %s failed: %s\n", old_path, new_path, ERRSTR);
+        else
+            n_moved++;
+    }
+    closedir(dir);
+
+    if (n_moved)
+        info("File store: moved %zu files in %s\n", n_moved, base);
+}
+
+static bool
+store_load(server_t* server, file_store_t* store)
+{
+    server_db_t db;
+    PGresult* res;
+    bool ret = false;
+    i32 rows;
+
+    if (!server_db_open(&db, server->conf.database, DB_DEFAULT))
+        return false;
+
+    res = PQexec(db.conn, "SELECT hash, ref_count, mime_type, size, "
+                          "COALESCE(owner_id, 0) FROM UserFiles;");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+        error("Load file store index: %s\n", PQresultErrorMessage(res));
+        goto out;
+    }
+
+    rows = PQntuples(res);
+    for (i32 i = 0; i < rows; i++)
+    {
+        if (PQgetisnull(res, i, 0))
+            continue;
+        store_add(store, PQgetvalue(res, i, 0), PQgetvalue(res, i, 2), 
+                  atoi(PQgetvalue(res, i, 1)), strtoull(PQgetvalue(res, i, 3), NULL, 10),
+                  strtoul(PQgetvalue(res, i, 4), NULL, 10));
+    }
+    info("File store: %d files indexed\n", rows);
+    ret = true;
+out:
+    PQclear(res);
+    server_db_close(&db);
+    return ret;
+}
+
+bool
+server_store_init(server_t* server)
+{
+    file_store_t* store = &server->store;
+
+    if (server_ght_init(&store->index, 1024, NULL) == false ||
+        server_ght_init(&store->usage, 64, free) == false)
+        return false;
+    pthread_mutex_init(&store->mutex, NULL);
+
+    store_migrate_dir(server->conf.img_dir);
+    store_migrate_dir(server->conf.vid_dir);
+    store_migrate_dir(server->conf.file_dir);
+
+    store->loaded = store_load(server, store);
+    return store->loaded;
+}
+
+void
+server_store_free(file_store_t* store)
+{
+    server_ght_t* index = &store->index;
+    store_entry_t* entry;
+
+    if (!store->loaded)
+        return;
+    GHT_FOREACH(entry, index, {
+        store_free_entries(entry);
+    });
+    server_ght_destroy(index);
+    server_ght_destroy(&store->usage);
+    pthread_mutex_destroy(&store->mutex);
+    store->loaded = false;
+}
+
+i32
+server_store_ref(file_store_t* store, const char* hash, const char* mime_type,
+                 size_t size, u32 owner_id)
+{
+    store_entry_t* entry;
+    i32 ref_count = -1;
+
+    pthread_mutex_lock(&store->mutex);
+    if ((entry = store_add(store, hash, mime_type, 1, size, owner_id)))
+        ref_count = entry->ref_count;
+    pthread_mutex_unlock(&store->mutex);
+
+    return ref_count;
+}
+
+i32
+server_store_unref(file_store_t* store, const char* hash)
+{
+    store_entry_t* head;
+    store_entry_t* entry;
+    i32 ref_count = -1;
+
+    pthread_mutex_lock(&store->mutex);
+    if ((entry = store_find(store, hash, &head)))
+    {
+        /* Like delete_userfiles_if_ref_is_zero() */
+        if (entry->ref_count <= 1)
+        {
+            ref_count = 0;
+            store_remove(store, entry);
+        }
+        else
+            ref_count = --entry->ref_count;
+    }
+    pthread_mutex_unlock(&store->mutex);
+
+    return ref_count;
+}
+
+size_t
+server_store_usage(file_store_t* store, u32 owner_id)
+{
+    store_usage_t* usage;
+    size_t bytes = 0;
+
+    if (!store->loaded)
+        return 0;
+
+    pthread_mutex_lock(&store->mutex);
+    if ((usage = server_ght_get(&store->usage, owner_id)))
+        bytes = usage->bytes;
+    pthread_mutex_unlock(&store->mutex);
+
+    return bytes;
+}
+
+bool
+server_store_unlink(file_store_t* store, const char* hash, const char* path)
+{
+    store_entry_t* head;
+    bool unlinked = false;
+
+    pthread_mutex_lock(&store->mutex);
+    if (store_find(store, hash, &head))
+        debug("Not unlinking %s, referenced again\n", path);
+    else if (unlink(path) == -1)
+        error("unlink %s failed: %s\n", path, ERRSTR);
+    else
+        unlinked = true;
+    pthread_mutex_unlock(&store->mutex);
+
+    return unlinked;
+}
+
+bool
+server_store_mime_type(file_store_t* store, const char* hash, char* out)
+{
+    store_entry_t* head;
+    store_entry_t* entry;
+
+    if (!store->loaded)
+        return false;
+
+    pthread_mutex_lock(&store->mutex);
+    if ((entry = store_find(store, hash, &head)))
+        memcpy(out, entry->mime_type, DB_MIME_TYPE_LEN);
+    pthread_mutex_unlock(&store->mutex);
+
+    return entry != NULL;
+}
+
+/* conf->*_dir has no trailing '/', see config_trim_dir() */
+static bool
+store_dir_eq(const char* dir, const char* path, size_t path_len)
+{
+    return strnlen(dir, CONFIG_PATH_LEN) == path_len && 
+           strncmp(dir, path, path_len) == 0;
+}
+
+const char*
+server_store_resolve(const server_t* server, char* path)
+{
+    const server_config_t* conf = &server->conf;
+    char* name = strrchr(path, '/');
+    char dir[PATH_MAX];
+    char out[PATH_MAX];
+    size_t dir_len;
+
+    if (name == NULL || !store_is_hash(name + 1))
+        return NULL;
+    dir_len = name - path;
+
+    if (!store_dir_eq(conf->img_dir, path, dir_len) &&
+        !store_dir_eq(conf->vid_dir, path, dir_len) &&
+        !store_dir_eq(conf->file_dir, path, dir_len))
+        return NULL;
+
+    memcpy(dir, path, dir_len);
+    dir[dir_len] = 0x00;
+    server_store_path(dir, name + 1, out);
+    memcpy(path, out, PATH_MAX);
+
+    return strrchr(path, '/') + 1;
+}
@@ -2,42 +2,93 @@
 #include "chat/db.h"
 #include "chat/db_def.h"
 #include "chat/db_group.h"
+#include "chat/db_pipeline.h"
+#include "chat/cmd.h"
 #include "chat/ws_text_frame.h"
+#include "chat/msg_cache.h"
 #include "json_object.h"
 #include "server_websocket.h"
+#include "server_json.h"
 
-static const char*
-do_group_broadcast(eworker_t* ew, dbcmd_ctx_t* ctx)
+void
+server_group_send_frame(eworker_t* ew, const u32* user_ids, size_t n, 
+                        char* buf, size_t len)
 {
-    json_object* json = ctx->param.json;
-    const i32* member_ids = ctx->data;
     client_t* member_client;
-    size_t n_members = ctx->data_size;
+    mp_buf_t mp = {0};
 
-    for (size_t i = 0; i < n_members; i++)
+    for (size_t i = 0; i < n; i++)
     {
-        member_client = server_get_client_user_id(ew->server, member_ids[i]);
+        member_client = server_get_client_user_id(ew->server, user_ids[i]);
         if (member_client)
-            ws_json_send(member_client, json);
+            ws_send_json_reserved(member_client, buf, len, &mp);
     }
+    free(mp.data);
+}
 
-    json_object_put(json);
+static const char*
+do_group_broadcast(eworker_t* ew, dbcmd_ctx_t* ctx)
+{
+    char* buf = ctx->param.frame.buf;
+
+    server_group_send_frame(ew, ctx->data, ctx->data_size, buf, ctx->param.frame.len);
+    free(buf);
 
     return NULL;
 }
 
+/*
+ * `buf` is a malloc'd jw buffer with the JSON at buf + WS_HDR_MAX.
+ * Takes ownership of `buf`.
+ */
 static void 
-server_group_broadcast(eworker_t* ew, u32 group_id, json_object* json)
+server_group_broadcast(eworker_t* ew, u32 group_id, char* buf, size_t len)
 {
     dbcmd_ctx_t ctx = {
         .exec = do_group_broadcast,
         .client = NULL,
         .flags = DB_CTX_NO_JSON,
-        .param.json = json
+        .param.frame.buf = buf,
+        .param.frame.len = len
     };
 
     if (!db_async_get_group_member_ids(&ew->db, group_id, &ctx))
-        json_object_put(json);
+        free(buf);
+}
+
+/*
+ * Allocate a broadcast frame and start a JSON object in it.
+ * `size` is the max JSON size.
+ */
+static char*
+server_frame_begin(json_writer_t* jw, size_t size, const char* cmd)
+{
+    char* buf;
+
+    buf = malloc(WS_HDR_MAX + size);
+    if (buf == NULL)
+    {
+        error("malloc frame: %s\n", ERRSTR);
+        return NULL;
+    }
+    jw_init(jw, buf + WS_HDR_MAX, size);
+    jw_obj_begin(jw);
+    jw_key_str(jw, "cmd", cmd);
+
+    return buf;
+}
+
+static bool
+server_frame_end(json_writer_t* jw, char* buf)
+{
+    jw_obj_end(jw);
+    if (jw->overflow)
+    {
+        error("JSON frame overflow (%zu bytes)\n", jw->size);
+        free(buf);
+        return false;
+    }
+    return true;
 }
 
 static void 
@@ -50,37 +101,14 @@ server_delete_attachments_json(eworker_t* ew, json_object* msg_attachs_json)
     }
 
     json_object* attach_json;
-    json_object* hash_json;
-    json_object* type_json;
-    json_object* name_json;
-    dbuser_file_t* file;
-    const char* hash;
-    const char* type;
-    const char* name;
     size_t n;
 
     n = json_object_array_length(msg_attachs_json);
 
     for (size_t i = 0; i < n; i++)
     {
-        file = calloc(1, sizeof(dbuser_file_t));
-
         attach_json = json_object_array_get_idx(msg_attachs_json, i);
-        memset(file, 0, sizeof(dbuser_file_t));
-
-        hash_json = json_object_object_get(attach_json, "hash");
-        hash = json_object_get_string(hash_json);
-        strncpy(file->hash, hash, DB_PFP_HASH_MAX);
-
-        type_json = json_object_object_get(attach_json, "type");
-        type = json_object_get_string(type_json);
-        strncpy(file->mime_type, type, DB_MIME_TYPE_LEN);
-
-        name_json = json_object_object_get(attach_json, "name");
-        name = json_object_get_string(name_json);
-        strncpy(file->name, name, DB_PFP_NAME_MAX);
-
-        server_delete_file(ew, file);
+        server_delete_file(ew, server_attach_json_to_file(attach_json));
     }
 
     json_object_put(msg_attachs_json);
@@ -96,26 +124,41 @@ server_delete_msg_attachments(eworker_t* ew, const char* attachments_str)
     server_delete_attachments_json(ew, msg_attachs_json);
 }
 
-static void
-server_msg_to_json(const dbmsg_t* dbmsg, json_object* json)
-{
-    json_object* attachments_json;
-
-    attachments_json = json_tokener_parse(dbmsg->attachments);
+/* Max JSON size of the fixed fields of a broadcast, ints and keys. */
+#define GROUP_FRAME_BASE 256
+
+char*
+server_msg_to_frame(const dbmsg_t* dbmsg, size_t* len)
+{
+    json_writer_t jw;
+    char* buf;
+    size_t content_len = dbmsg->content_len;
+    size_t timestamp_len = strnlen(dbmsg->timestamp, DB_MSG_TIMESTAMP_MAX);
+    size_t attachments_len = (dbmsg->attachments) ? strlen(dbmsg->attachments) : 0;
+
+    buf = server_frame_begin(&jw, GROUP_FRAME_BASE + JW_STR_MAX(content_len)
+                                + attachments_len + JW_STR_MAX(timestamp_len), 
+                             "group_msg");
+    if (buf == NULL)
+        return NULL;
+
+    jw_key_int(&jw, "msg_id", dbmsg->msg_id);
+    jw_key_int(&jw, "group_id", dbmsg->group_id);
+    jw_key_int(&jw, "user_id", dbmsg->user_id);
+    jw_key(&jw, "content");
+    jw_str_len(&jw, dbmsg->content, content_len);
+    /* Attachments is JSON made by the server, no need to re-parse */
+    if (attachments_len)
+        jw_key_raw(&jw, "attachments", dbmsg->attachments, attachments_len);
+    else
+        jw_key_raw(&jw, "attachments", "[]", 2);
+    jw_key(&jw, "timestamp");
+    jw_str_len(&jw, dbmsg->timestamp, timestamp_len);
 
-    json_object_object_add(json, "cmd", 
-                           json_object_new_string("group_msg"));
-    json_object_object_add(json, "msg_id", 
-                           json_object_new_int(dbmsg->msg_id));
-    json_object_object_add(json, "group_id", 
-                           json_object_new_int(dbmsg->group_id));
-    json_object_object_add(json, "user_id", 
-                           json_object_new_int(dbmsg->user_id));
-    json_object_object_add(json, "content", 
-                           json_object_new_string(dbmsg->content));
-    json_object_object_add(json, "attachments", attachments_json);
-    json_object_object_add(json, "timestamp", 
-                           json_object_new_string(dbmsg->timestamp));
+    if (!server_frame_end(&jw, buf))
+        return NULL;
+    *len = jw.len;
+    return buf;
 }
 
 static void 
@@ -207,22 +250,15 @@ do_client_groups(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
 const char* 
 server_group_create(eworker_t* ew, 
                     client_t* client, 
-                    json_object* payload, 
+                    const cmd_group_create_t* args, 
                     UNUSED json_object* respond_json)
 {
-    json_object* name_json;
-    json_object* public_json;
-    const char* name;
-    bool public_group;
+    const char* name = args->name;
+    bool public_group = args->public;
     u32 owner_id;
     dbgroup_t* group;
-    
-    RET_IF_JSON_BAD(name_json, payload, "name", json_type_string);
-    RET_IF_JSON_BAD(public_json, payload, "public", json_type_boolean);
 
-    name = json_object_get_string(name_json);
-    public_group = json_object_get_boolean(public_json);
-    owner_id = client->dbuser->user_id;
+    owner_id = client->user->user_id;
     group = calloc(1, sizeof(dbgroup_t));
 
     group->owner_id = owner_id;
@@ -240,13 +276,12 @@ server_group_create(eworker_t* ew,
 
 const char* 
 server_client_groups(eworker_t* ew, client_t* client, 
-                     UNUSED json_object* payload, 
                      UNUSED json_object* respond_json) 
 {
     dbcmd_ctx_t ctx = {
         .exec = do_client_groups,
     };
-    if (db_async_get_user_groups(&ew->db, client->dbuser->user_id, &ctx) == false)
+    if (db_async_get_user_groups(&ew->db, client->user->user_id, &ctx) == false)
         return "Internal error: async-get-user-groups";
     return NULL;
 }
@@ -254,38 +289,33 @@ server_client_groups(eworker_t* ew, client_t* client,
 static const char* 
 get_all_groups_result(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
 {
-    const char* group_array_json;
-    json_object* resp;
-
-    if (ctx->ret == DB_ASYNC_ERROR)
+    /* Already streamed to client by db_stream_rows_result() */
+    if (ctx->ret == DB_ASYNC_ERROR && ((db_stream_t*)ctx->data)->ws.total == 0)
         return "Failed to get public groups";
-
-    group_array_json = ctx->param.str;
-    resp = json_object_new_object();
-
-    json_object_object_add(resp, "cmd",
-                           json_object_new_string("get_all_groups"));
-    json_object_object_add(resp, "groups",
-                           json_tokener_parse(group_array_json));
-
-    ws_json_send(ctx->client, resp);
-    json_object_put(resp);
-
     return NULL;
 }
 
 const char* 
 server_get_all_groups(eworker_t* ew, 
-                      UNUSED client_t* client, 
-                      UNUSED json_object* payload, 
+                      client_t* client, 
                       UNUSED json_object* respond_json)
 {
     // TODO: Limit getting public groups.
+    static const char prefix[] = "{\"cmd\":\"get_all_groups\",\"groups\":[";
+    db_stream_t* stream;
+
+    stream = db_stream_new(client, "]}");
+    ws_stream_write(&stream->ws, prefix, sizeof(prefix) - 1);
+
     dbcmd_ctx_t ctx = {
-        .exec = get_all_groups_result
+        .exec = get_all_groups_result,
+        .data = stream
     };
-    if (!db_async_get_public_groups(&ew->db, client->dbuser->user_id, &ctx))
+    if (!db_async_get_public_groups(&ew->db, client->user->user_id, &ctx))
+    {
+        free(stream);
         return "Internal error: async-get-public-groups";
+    }
 
     return NULL;
 }
@@ -293,7 +323,12 @@ server_get_all_groups(eworker_t* ew,
 static void
 on_user_group_join(eworker_t* ew, client_t* client, u32 group_id)
 {
-    json_object* online_clients_respond;
+    json_writer_t jw;
+    char* buf;
+
+    /* Left before the join completed */
+    if (client == NULL)
+        return;
 
     dbcmd_ctx_t ctx = {
         .exec = do_client_groups,
@@ -301,15 +336,15 @@ on_user_group_join(eworker_t* ew, client_t* client, u32 group_id)
     };
     db_async_get_group(&ew->db, group_id, &ctx);
     
-    online_clients_respond = json_object_new_object();
-    json_object_object_add(online_clients_respond, "cmd",
-                           json_object_new_string("join_group"));
-    json_object_object_add(online_clients_respond, "user_id", 
-                           json_object_new_int(client->dbuser->user_id));
-    json_object_object_add(online_clients_respond, "group_id", 
-                           json_object_new_int(group_id));    
+    buf = server_frame_begin(&jw, GROUP_FRAME_BASE, "join_group");
+    if (buf == NULL)
+        return;
+    jw_key_int(&jw, "user_id", client->user->user_id);
+    jw_key_int(&jw, "group_id", group_id);
+    if (!server_frame_end(&jw, buf))
+        return;
 
-    server_group_broadcast(ew, group_id, online_clients_respond);
+    server_group_broadcast(ew, group_id, buf, jw.len);
 }
 
 static const char*
@@ -330,21 +365,17 @@ join_group_result(eworker_t* ew, dbcmd_ctx_t* ctx)
 const char* 
 server_join_group(eworker_t* ew, 
                   client_t* client, 
-                  json_object* payload, 
+                  const cmd_join_group_t* args, 
                   UNUSED json_object* respond_json)
 {
-    json_object* group_id_json;
-    u32 group_id;
-
-    RET_IF_JSON_BAD(group_id_json, payload, "group_id", json_type_int);
-    group_id = json_object_get_int(group_id_json);
+    const u32 group_id = args->group_id;
 
     dbcmd_ctx_t ctx = {
         .exec = join_group_result,
         .param.group_id = group_id
     };
 
-    if (!db_async_user_join_pub_group(&ew->db, client->dbuser->user_id, group_id, &ctx))
+    if (!db_async_user_join_pub_group(&ew->db, client->user->user_id, group_id, &ctx))
         return "Internal error: async-user-join-pub-group";
 
     return NULL;
@@ -354,14 +385,17 @@ const char*
 server_get_send_group_msg(eworker_t* ew, 
                           const dbmsg_t* dbmsg)
 {
-    json_object* respond_json;
+    char* buf;
+    size_t len;
 
-    respond_json = json_object_new_object();
+    server_msg_cache_push(&ew->server->msg_cache, dbmsg);
 
-    server_msg_to_json(dbmsg, respond_json);
+    buf = server_msg_to_frame(dbmsg, &len);
+    if (buf == NULL)
+        return "Internal error: group_msg frame";
 
     // Update all online group members
-    server_group_broadcast(ew, dbmsg->group_id, respond_json);
+    server_group_broadcast(ew, dbmsg->group_id, buf, len);
 
     return NULL;
 }
@@ -372,71 +406,84 @@ server_verify_msg_attachments(json_object* attachments_json, size_t n)
     json_object* attach;
     json_object* name_json;
     json_object* type_json;
-    const char*  type;
 
+    /* Any type, images may be POSTed, the rest come as resumable uploads */
     for (size_t i = 0; i < n; i++)
     {
         attach = json_object_array_get_idx(attachments_json, i);
 
         RET_IF_JSON_BAD(name_json, attach, "name", json_type_string);
         RET_IF_JSON_BAD(type_json, attach, "type", json_type_string);
-
-        type = json_object_get_string(type_json);
-        if (!str_startwith(type, "image/"))
-            return "Attachment type is not image.";
     }
 
     return NULL;
 }
 
-static void
-set_msg(dbmsg_t* msg, u32 user_id, u32 group_id, const char* content)
+dbmsg_t*
+server_new_msg(eworker_t* ew, u32 user_id, u32 group_id, 
+               const char* content, size_t content_len)
 {
-    if (!msg)
-        return;
+    dbmsg_t* msg;
+
+    if (content_len >= DB_MESSAGE_MAX)
+        return NULL;
 
+    msg = server_pool_alloc(&ew->server->msg_pool, sizeof(dbmsg_t) + content_len + 1);
+    if (msg == NULL)
+        return NULL;
+    memset(msg, 0, sizeof(dbmsg_t));
     msg->user_id = user_id;
     msg->group_id = group_id;
-    strncpy(msg->content, content, DB_MESSAGE_MAX);
+    msg->content_len = content_len;
+    memcpy(msg->content, content, content_len);
+    msg->content[content_len] = 0x00;
+
+    return msg;
 }
 
-static const char*
-do_group_msg(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
+void
+server_free_msg(eworker_t* ew, dbmsg_t* msg)
 {
-    dbmsg_t* msg;
+    if (msg == NULL)
+        return;
 
-    if (ctx->ret == DB_ASYNC_ERROR)
-        return "Failed to insert message";
+    if (msg->attachments && msg->attachments_inheap)
+        free(msg->attachments);
+    if (msg->attachments_json)
+        json_object_put(msg->attachments_json);
+    server_pool_free(&ew->server->msg_pool, msg);
+}
 
-    msg = ctx->data;
+static const char*
+do_group_msg(eworker_t* ew, dbcmd_ctx_t* ctx)
+{
+    dbmsg_t* msg = ctx->data;
+    const char* errmsg = NULL;
 
-    server_get_send_group_msg(ew, msg);
+    if (ctx->ret == DB_ASYNC_ERROR)
+        errmsg = "Failed to insert message";
+    else
+        server_get_send_group_msg(ew, msg);
 
-    return NULL;
+    server_free_msg(ew, msg);
+    return errmsg;
 }
 
 const char* 
 server_group_msg(eworker_t* ew, client_t* client, 
-                 json_object* payload, UNUSED json_object* respond_json)
+                 const cmd_group_msg_t* args, UNUSED json_object* respond_json)
 {
-    json_object* group_id_json;
-    json_object* content_json;
-    json_object* attachments_json;
-    u32 group_id;
-    const char* content;
+    json_object* attachments_json = args->attachments;
+    const u32 group_id = args->group_id;
+    const char* content = args->content;
+    const size_t content_len = args->content_len;
     u32 user_id;
     size_t n_attachments;
     const char* errmsg = NULL;
     dbmsg_t* msg;
     upload_token_t* ut;
 
-    RET_IF_JSON_BAD(group_id_json, payload, "group_id", json_type_int);
-    RET_IF_JSON_BAD(content_json, payload, "content", json_type_string);
-    RET_IF_JSON_BAD(attachments_json, payload, "attachments", json_type_array);
-
-    group_id = json_object_get_int(group_id_json);
-    content = json_object_get_string(content_json);
-    user_id = client->dbuser->user_id;
+    user_id = client->user->user_id;
     n_attachments = json_object_array_length(attachments_json);
 
     if (n_attachments == 0)
@@ -445,8 +492,16 @@ server_group_msg(eworker_t* ew, client_t* client,
          *  If Message has no attachments insert message into database,
          *  and send message to all clients in group.
          */
-        msg = calloc(1, sizeof(dbmsg_t));
-        set_msg(msg, user_id, group_id, content);
+        if ((msg = server_new_msg(ew, user_id, group_id, content, content_len)) == NULL)
+            return "Message too long";
+
+        /* Fanned out before it's in the database, see msg_wal.h */
+        if (ew->server->conf.write_behind)
+        {
+            if (!server_wal_group_msg(ew, msg))
+                errmsg = "Internal error: wal-group-msg";
+            return errmsg;
+        }
 
         dbcmd_ctx_t ctx = {
             .exec = do_group_msg
@@ -454,7 +509,7 @@ server_group_msg(eworker_t* ew, client_t* client,
 
         if (!db_async_insert_group_msg(&ew->db, msg, &ctx))
         {
-            free(msg);
+            server_free_msg(ew, msg);
             errmsg = "Internal error: async-group-msg-insert";
         }
     }
@@ -469,9 +524,10 @@ server_group_msg(eworker_t* ew, client_t* client,
          * and wait for client to send attachments via HTTP POST,
          * ewen insert the message into database.
          */
+        if ((msg = server_new_msg(ew, user_id, group_id, content, content_len)) == NULL)
+            return "Message too long";
         ut = server_new_upload_token_attach(ew);
-        msg = &ut->msg_state.msg;
-        set_msg(msg, user_id, group_id, content);
+        ut->msg_state.msg = msg;
         msg->attachments_json = json_object_get(attachments_json);
         ut->msg_state.total = n_attachments;
 
@@ -480,62 +536,112 @@ server_group_msg(eworker_t* ew, client_t* client,
     return errmsg;
 }
 
-static const char*
-do_get_group_msgs(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
+/* db_stream_t first, db_stream_rows_result() takes it as one */
+typedef struct 
 {
-    json_object* resp;
-    u32 group_id;
-    const char* msgs_array_json;
-
-    if (ctx->ret == DB_ASYNC_ERROR)
-        return "Failed to get group messages";
+    db_stream_t     stream;
+    u32             group_id;
+    u32             limit;
+    u32             gen;    /* 0: not seeding the cache */
+    u32             n;
+    cache_msg_t**   rows;
+} group_history_t;
 
-    resp = json_object_new_object();
-    group_id = ctx->param.group_msgs.group_id;
-    msgs_array_json = ctx->param.group_msgs.msgs_json;
+static void
+get_group_msgs_result(eworker_t* ew, PGresult* res, 
+                      ExecStatusType status, dbcmd_ctx_t* ctx)
+{
+    group_history_t* hist = ctx->data;
+    cache_msg_t* row;
 
-    json_object_object_add(resp, "cmd",
-                           json_object_new_string("get_group_msgs"));
-    json_object_object_add(resp, "group_id",
-                           json_object_new_int(group_id));
-    json_object_object_add(resp, "messages",
-                           json_tokener_parse(msgs_array_json));
+    if (status == PGRES_SINGLE_TUPLE && hist->rows && hist->n < MSG_CACHE_DEPTH)
+    {
+        row = server_msg_cache_entry(strtoul(PQgetvalue(res, 0, 1), NULL, 10),
+                                     PQgetvalue(res, 0, 0), PQgetlength(res, 0, 0));
+        if (row)
+            hist->rows[hist->n++] = row;
+    }
+    db_stream_rows_result(ew, res, status, ctx);
+}
 
-    ws_json_send(ctx->client, resp);
+static const char*
+do_get_group_msgs(eworker_t* ew, dbcmd_ctx_t* ctx)
+{
+    group_history_t* hist = ctx->data;
+    msg_cache_t* cache = &ew->server->msg_cache;
 
-    json_object_put(resp);
+    if (hist->gen && ctx->ret == DB_ASYNC_ERROR)
+    {
+        server_msg_cache_seed(cache, hist->group_id, hist->gen, NULL, 0, false);
+        for (u32 i = 0; i < hist->n; i++)
+            free(hist->rows[i]);
+        free(hist->rows);
+    }
+    else if (hist->gen) /* Fewer rows than asked for (all of them kept) is the whole history */
+        server_msg_cache_seed(cache, hist->group_id, hist->gen, hist->rows, hist->n, 
+                              hist->stream.rows < hist->limit && hist->stream.rows == hist->n);
 
+    /* Already streamed to client by db_stream_rows_result() */
+    if (ctx->ret == DB_ASYNC_ERROR && hist->stream.ws.total == 0)
+        return "Failed to get group messages";
     return NULL;
 }
 
 const char* 
-server_get_group_msgs(UNUSED eworker_t* ew, 
-                      UNUSED client_t* client, 
-                      json_object* payload, 
+server_get_group_msgs(eworker_t* ew, 
+                      client_t* client, 
+                      const cmd_get_group_msgs_t* args, 
                       UNUSED json_object* respond_json)
 {
-    json_object* limit_json;
-    json_object* group_id_json;
-    json_object* offset_json;
-    u64 group_id;
-    u32 limit;
-    u32 offset;
-
-    RET_IF_JSON_BAD(group_id_json, payload, "group_id", json_type_int);
-    RET_IF_JSON_BAD(limit_json, payload, "limit", json_type_int);
-    RET_IF_JSON_BAD(offset_json, payload, "offset", json_type_int);
+    const u32 group_id = args->group_id;
+    const u32 limit = args->limit;
+    const u32 offset = (args->has_offset) ? args->offset : 0;
+    const u32 before_msg_id = (args->has_before_msg_id) ? args->before_msg_id : 0;
+    msg_cache_t* cache = &ew->server->msg_cache;
+
+    char prefix[64];
+    i32 prefix_len;
+    group_history_t* hist;
+
+    if (server_msg_cache_send(cache, client, group_id, limit, offset, before_msg_id))
+        return NULL;
+
+    hist = calloc(1, sizeof(group_history_t));
+    ws_stream_init(&hist->stream.ws, client);
+    hist->stream.suffix = "]}";
+    hist->group_id = group_id;
+    hist->limit = limit;
+    /* 
+     * The newest page seeds the group's ring. Not while one of the group's
+     * write-behind messages isn't in yet, it went out before the ring was there.
+     */
+    if (offset == 0 && before_msg_id == 0 && server_wal_group_settled(ew->server, group_id) &&
+        (hist->rows = calloc(MSG_CACHE_DEPTH, sizeof(cache_msg_t*))) &&
+        (hist->gen = server_msg_cache_seed_begin(cache, group_id)) == 0)
+    {
+        free(hist->rows);
+        hist->rows = NULL;
+    }
 
-    group_id = json_object_get_int(group_id_json);
-    limit = json_object_get_int(limit_json);
-    offset = json_object_get_int(offset_json);
+    prefix_len = snprintf(prefix, sizeof(prefix), 
+                          "{\"cmd\":\"get_group_msgs\",\"group_id\":%u,\"messages\":[", 
+                          (u32)group_id);
+    ws_stream_write(&hist->stream.ws, prefix, prefix_len);
 
     dbcmd_ctx_t ctx = {
+        .exec_res = get_group_msgs_result,
         .exec = do_get_group_msgs,
-        .param.group_id = group_id
+        .data = hist
     };
 
-    if (!db_async_get_group_msgs(&ew->db, group_id, limit, offset, &ctx))
+    if (!db_async_get_group_msgs(&ew->db, group_id, limit, offset, before_msg_id, &ctx))
+    {
+        if (hist->gen)
+            server_msg_cache_seed(cache, group_id, hist->gen, NULL, 0, false);
+        free(hist->rows);
+        free(hist);
         return "Internal error: async-get-group-msgs";
+    }
 
     return NULL;
 }
@@ -560,20 +666,13 @@ create_group_code_result(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
 const char* 
 server_create_group_code(eworker_t* ew, 
                          client_t* client,
-                         json_object* payload, 
+                         const cmd_create_group_code_t* args, 
                          UNUSED json_object* respond_json)
 {
-    json_object* group_id_json;
-    json_object* max_uses_json;
     dbgroup_code_t* group_code;
-    u32 group_id;
-    i32 max_uses;
+    const u32 group_id = args->group_id;
+    i32 max_uses = args->max_uses;
 
-    RET_IF_JSON_BAD(group_id_json, payload, "group_id", json_type_int);
-    RET_IF_JSON_BAD(max_uses_json, payload, "max_uses", json_type_int);
-
-    group_id = json_object_get_int(group_id_json);
-    max_uses = json_object_get_int(max_uses_json);
     if (max_uses == 0)
         max_uses = 1;
     group_code = calloc(1, sizeof(dbgroup_code_t));
@@ -584,7 +683,7 @@ server_create_group_code(eworker_t* ew,
         .exec = create_group_code_result,
     };
 
-    if (!db_async_create_group_code(&ew->db, group_code, client->dbuser->user_id, &ctx))
+    if (!db_async_create_group_code(&ew->db, group_code, client->user->user_id, &ctx))
         return "Error: async-create-group-code";
     return NULL;
 }
@@ -603,17 +702,13 @@ join_group_code_result(eworker_t* ew, dbcmd_ctx_t* ctx)
 }
 
 const char* 
-server_join_group_code(UNUSED eworker_t* ew, 
-                       UNUSED client_t* client,
-                       UNUSED json_object* payload, 
+server_join_group_code(eworker_t* ew, 
+                       client_t* client,
+                       const cmd_join_group_code_t* args, 
                        UNUSED json_object* respond_json)
 {
-    json_object* code_json;
-    const char* code;
-    const u32 user_id = client->dbuser->user_id;
-    
-    RET_IF_JSON_BAD(code_json, payload, "code", json_type_string);
-    code = json_object_get_string(code_json);
+    const char* code = args->code;
+    const u32 user_id = client->user->user_id;
 
     dbcmd_ctx_t ctx = {
         .exec = join_group_code_result
@@ -627,47 +722,35 @@ server_join_group_code(UNUSED eworker_t* ew,
 static const char*
 get_group_codes_result(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
 {
-    u32 group_id;
-    const char* group_codes_array_json;
-    json_object* resp;
+    char prefix[64];
+    i32 prefix_len;
+    const char* codes_json;
 
     if (ctx->ret == DB_ASYNC_ERROR)
         return "Failed to get group codes";
 
-    group_id = ctx->param.group_codes.group_id;
-    group_codes_array_json = ctx->param.group_codes.array_json;
-    resp = json_object_new_object();
-
-    json_object_object_add(resp, "cmd", 
-                           json_object_new_string("group_codes"));
-    json_object_object_add(resp, "group_id",
-                           json_object_new_int(group_id));
-    json_object_object_add(resp, "codes",
-                           json_tokener_parse(group_codes_array_json));
+    codes_json = ctx->param.group_codes.array_json;
+    prefix_len = snprintf(prefix, sizeof(prefix), 
+                          "{\"cmd\":\"group_codes\",\"group_id\":%u,\"codes\":",
+                          ctx->param.group_codes.group_id);
 
-    ws_json_send(ctx->client, resp);
-     
-    json_object_put(resp);
+    ws_json_splice(ctx->client, prefix, prefix_len, codes_json, strlen(codes_json));
     return NULL;
 }
 
 const char* 
 server_get_group_codes(eworker_t* ew, 
                        client_t* client,
-                       json_object* payload, 
+                       const cmd_get_group_codes_t* args, 
                        UNUSED json_object* respond_json)
 {
-    json_object* group_id_json;
-    u32 group_id;
-
-    RET_IF_JSON_BAD(group_id_json, payload, "group_id", json_type_int);
-    group_id = json_object_get_int(group_id_json);
+    const u32 group_id = args->group_id;
 
     dbcmd_ctx_t ctx = {
         .exec = get_group_codes_result,
     };
 
-    if (!db_async_get_group_codes(&ew->db, group_id, client->dbuser->user_id, &ctx))
+    if (!db_async_get_group_codes(&ew->db, group_id, client->user->user_id, &ctx))
         return "Error: async-get-group-codes";
 
     return NULL;
@@ -683,14 +766,10 @@ delete_group_code_result(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
 
 const char* 
 server_delete_group_code(eworker_t* ew, client_t* client, 
-                         json_object* payload, UNUSED json_object* resp)
+                         const cmd_delete_group_code_t* args, UNUSED json_object* resp)
 {
-    json_object* code_json;
-    u32 user_id = client->dbuser->user_id;
-    const char* code;
-
-    RET_IF_JSON_BAD(code_json, payload, "code", json_type_string);
-    code = json_object_get_string(code_json);
+    const u32 user_id = client->user->user_id;
+    const char* code = args->code;
 
     dbcmd_ctx_t ctx = {
         .exec = delete_group_code_result
@@ -705,7 +784,8 @@ delete_msg_result(eworker_t* ew, dbcmd_ctx_t* ctx)
 {
     u32 msg_id;
     u32 group_id;
-    json_object* resp;
+    json_writer_t jw;
+    char* buf;
     const char* attachments;
 
     if (ctx->ret == DB_ASYNC_ERROR)
@@ -716,32 +796,23 @@ delete_msg_result(eworker_t* ew, dbcmd_ctx_t* ctx)
     attachments = ctx->param.del_msg.attachments_json;
 
     server_delete_msg_attachments(ew, attachments);
+    server_msg_cache_invalidate(&ew->server->msg_cache, group_id);
 
-    resp = json_object_new_object();
-    json_object_object_add(resp, "cmd",
-                           json_object_new_string("delete_msg"));
-    json_object_object_add(resp, "msg_id",
-                           json_object_new_int(msg_id));
-    json_object_object_add(resp, "group_id",
-                           json_object_new_int(group_id));
-    server_group_broadcast(ew, group_id, resp);
+    buf = server_frame_begin(&jw, GROUP_FRAME_BASE, "delete_msg");
+    if (buf == NULL)
+        return "Internal error: delete_msg frame";
+    jw_key_int(&jw, "msg_id", msg_id);
+    jw_key_int(&jw, "group_id", group_id);
+    if (!server_frame_end(&jw, buf))
+        return "Internal error: delete_msg frame";
+    server_group_broadcast(ew, group_id, buf, jw.len);
 
     return NULL;
 }
 
 const char* 
-server_delete_group_msg(UNUSED eworker_t* ew, 
-                        UNUSED client_t* client,
-                        UNUSED json_object* payload, 
-                        UNUSED json_object* respond_json)
+server_delete_group_msg_db(eworker_t* ew, u32 msg_id, u32 user_id)
 {
-    json_object* msg_id_json;
-    u32 msg_id;
-    u32 user_id = client->dbuser->user_id;
-
-    RET_IF_JSON_BAD(msg_id_json, payload, "msg_id", json_type_int);
-    msg_id = json_object_get_int(msg_id_json);
-
     dbcmd_ctx_t ctx = {
         .exec = delete_msg_result,
         .param.del_msg.msg_id = msg_id
@@ -751,15 +822,30 @@ server_delete_group_msg(UNUSED eworker_t* ew,
     return NULL;
 }
 
+const char* 
+server_delete_group_msg(eworker_t* ew, 
+                        client_t* client,
+                        const cmd_delete_msg_t* args, 
+                        UNUSED json_object* respond_json)
+{
+    const u32 msg_id = args->msg_id;
+    const u32 user_id = client->user->user_id;
+
+    /* Not inserted yet, runs once the write-behind writer has */
+    if (server_wal_delete_msg(ew, client, msg_id, user_id))
+        return NULL;
+    return server_delete_group_msg_db(ew, msg_id, user_id);
+}
+
 static const char* 
-delete_group_result(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
+delete_group_result(eworker_t* ew, dbcmd_ctx_t* ctx)
 {
     json_object* resp;
     dbcmd_ctx_t* base = ctx;
     dbcmd_ctx_t* attach_ctx = ctx->next;
     dbcmd_ctx_t* member_ids_ctx = attach_ctx->next;
-    json_object** attach_array;
-    size_t        attach_array_len;
+    dbuser_file_t** files;
+    size_t        n_files;
     u32*        member_ids;
     size_t      n_members;
     u32 group_id;
@@ -770,26 +856,28 @@ delete_group_result(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
         warn("group_id is 0!\n");
     }
 
+    files = attach_ctx->data;
+    n_files = attach_ctx->data_size;
+
     while (ctx)
     {
         debug("group_id: %u -- ctx->ret: %d\n", group_id, ctx->ret);
         if (ctx->ret == DB_ASYNC_ERROR)
+        {
+            for (size_t i = 0; i < n_files; i++)
+                free(files[i]);
             return "Failed to delete group";
+        }
         ctx = ctx->next;
     }
     ctx = base;
 
-    attach_array = attach_ctx->data;
-    attach_array_len = attach_ctx->data_size;
-
     member_ids = member_ids_ctx->data;
     n_members = member_ids_ctx->data_size;
 
-    for (size_t i = 0; i < attach_array_len; i++)
-    {
-        json_object* attach_json = attach_array[i];
-        server_delete_attachments_json(ew, attach_json);
-    }
+    for (size_t i = 0; i < n_files; i++)
+        server_delete_file(ew, files[i]);
+    server_msg_cache_drop(&ew->server->msg_cache, group_id);
 
     resp = json_object_new_object();
     json_object_object_add(resp, "cmd", 
@@ -837,20 +925,16 @@ get_group_owner(eworker_t* ew, dbcmd_ctx_t* gowner_ctx)
 
 const char* 
 server_delete_group(eworker_t* ew, 
-                    UNUSED client_t* client, 
-                    json_object* payload, 
+                    client_t* client, 
+                    const cmd_delete_group_t* args, 
                     UNUSED json_object* resp_json)
 {
-    json_object* group_id_json;
-    u32 group_id;
-
-    RET_IF_JSON_BAD(group_id_json, payload, "group_id", json_type_int);
-    group_id = json_object_get_int(group_id_json);
+    const u32 group_id = args->group_id;
 
     dbcmd_ctx_t ctx = {
         .exec = get_group_owner,
         .param.group_owner.group_id = group_id,
-        .param.group_owner.user_id = client->dbuser->user_id,
+        .param.group_owner.user_id = client->user->user_id,
     };
     if (!db_async_get_group_owner(&ew->db, group_id, &ctx))
         return "Error: async-get-group-owner";
@@ -860,42 +944,30 @@ server_delete_group(eworker_t* ew,
 static const char*
 do_get_group_member_ids(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
 {
-    u32 group_id;
-    const char* member_ids_str;
-    json_object* resp;
+    char prefix[64];
+    i32 prefix_len;
+    const char* member_ids_json;
 
     if (ctx->ret == DB_ASYNC_ERROR)
         return "Failed to get group member IDs";
 
-    group_id = ctx->param.member_ids.group_id;
-    member_ids_str = ctx->param.member_ids.ids_json;
-    resp = json_object_new_object();
-    json_object_object_add(resp, "cmd",
-                           json_object_new_string("get_member_ids"));
-    json_object_object_add(resp, "group_id",
-                           json_object_new_int(group_id));
-    json_object_object_add(resp, "member_ids",
-                           json_tokener_parse(member_ids_str));
-
-    ws_json_send(ctx->client, resp);
-
-    json_object_put(resp);
+    member_ids_json = ctx->param.member_ids.ids_json;
+    prefix_len = snprintf(prefix, sizeof(prefix), 
+                          "{\"cmd\":\"get_member_ids\",\"group_id\":%u,\"member_ids\":",
+                          ctx->param.member_ids.group_id);
 
+    ws_json_splice(ctx->client, prefix, prefix_len, member_ids_json, strlen(member_ids_json));
     return NULL;
 }
 
 const char* 
 server_get_group_member_ids(eworker_t* ew,
                             UNUSED client_t* client, 
-                            json_object* payload, 
+                            const cmd_get_member_ids_t* args, 
                             UNUSED json_object* resp_json)
 {
-    json_object* group_id_json;
-    u32 group_id;
-
-    RET_IF_JSON_BAD(group_id_json, payload, "group_id", json_type_int);
+    const u32 group_id = args->group_id;
 
-    group_id = json_object_get_int(group_id_json);
     dbcmd_ctx_t ctx = {
         .exec = do_get_group_member_ids,
         .param.member_ids.group_id = group_id
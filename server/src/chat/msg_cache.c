@@ -0,0 +1,398 @@
+#include "chat/msg_cache.h"
+#include "server_websocket.h"
+#include "server_json.h"
+
+#define CACHE_PREFIX_MAX    64
+#define CACHE_MSG_BASE      160     /* Keys, ints, null */
+
+static void
+ring_unlink(msg_cache_t* cache, msg_ring_t* ring)
+{
+    if (ring->prev)
+        ring->prev->next = ring->next;
+    else
+        cache->head = ring->next;
+    if (ring->next)
+        ring->next->prev = ring->prev;
+    else
+        cache->tail = ring->prev;
+    ring->prev = ring->next = NULL;
+}
+
+static void
+ring_touch(msg_cache_t* cache, msg_ring_t* ring)
+{
+    if (cache->head == ring)
+        return;
+    /* Not the head, so linked only if it has a prev */
+    if (ring->prev)
+        ring_unlink(cache, ring);
+    ring->next = cache->head;
+    if (cache->head)
+        cache->head->prev = ring;
+    else
+        cache->tail = ring;
+    cache->head = ring;
+}
+
+static void
+ring_clear(msg_ring_t* ring)
+{
+    for (u32 i = 0; i < ring->n; i++)
+        free(ring->msgs[i]);
+    ring->n = 0;
+    ring->complete = false;
+    ring->has_all = false;
+}
+
+static void
+ring_del(msg_cache_t* cache, msg_ring_t* ring)
+{
+    ring_unlink(cache, ring);
+    server_ght_del(&cache->rings, ring->group_id);
+    ring_clear(ring);
+    free(ring);
+    cache->count--;
+}
+
+static void
+cache_evict(msg_cache_t* cache)
+{
+    msg_ring_t* ring = cache->tail;
+    msg_ring_t* prev;
+
+    /* Rings with a seed in flight stay, the cache may go over for a bit */
+    for (; ring && cache->count > MSG_CACHE_GROUPS; ring = prev)
+    {
+        prev = ring->prev;
+        if (ring->seeding)
+            continue;
+        ring_del(cache, ring);
+        cache->evicted++;
+    }
+}
+
+static msg_ring_t*
+ring_new(msg_cache_t* cache, u32 group_id)
+{
+    msg_ring_t* ring;
+
+    if ((ring = calloc(1, sizeof(msg_ring_t))) == NULL)
+    {
+        error("msg ring calloc: %s\n", ERRSTR);
+        return NULL;
+    }
+    ring->group_id = group_id;
+    ring->gen = ++cache->next_gen;
+    if (!server_ght_insert(&cache->rings, group_id, ring))
+    {
+        free(ring);
+        return NULL;
+    }
+    cache->count++;
+    ring_touch(cache, ring);
+    cache_evict(cache);
+    return ring;
+}
+
+/* Keeps it sorted, newest first. False if `msg` wasn't taken. */
+static bool
+ring_insert(msg_ring_t* ring, cache_msg_t* msg)
+{
+    u32 i;
+
+    for (i = 0; i < ring->n && ring->msgs[i]->msg_id > msg->msg_id; i++)
+        ;
+    if (i < ring->n && ring->msgs[i]->msg_id == msg->msg_id)
+        return false;
+    if (ring->n == MSG_CACHE_DEPTH)
+    {
+        ring->has_all = false;
+        if (i == ring->n)
+            return false;
+        free(ring->msgs[--ring->n]);
+    }
+    memmove(ring->msgs + i + 1, ring->msgs + i, (ring->n - i) * sizeof(cache_msg_t*));
+    ring->msgs[i] = msg;
+    ring->n++;
+    return true;
+}
+
+bool
+server_msg_cache_init(msg_cache_t* cache)
+{
+    memset(cache, 0, sizeof(msg_cache_t));
+    if (server_ght_init(&cache->rings, MSG_CACHE_GROUPS, NULL) == false)
+        return false;
+    pthread_mutex_init(&cache->mutex, NULL);
+    return true;
+}
+
+void
+server_msg_cache_stats(msg_cache_t* cache)
+{
+    u64 total;
+
+    if (cache->rings.table == NULL)
+        return;
+
+    pthread_mutex_lock(&cache->mutex);
+    total = cache->hits + cache->misses;
+    info("msg cache: groups: %zu, hits: %lu, misses: %lu (%.1f%% hit), evicted: %lu\n",
+         cache->count, cache->hits, cache->misses,
+         (total) ? cache->hits * 100.0 / total : 0.0, cache->evicted);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void
+server_msg_cache_free(msg_cache_t* cache)
+{
+    msg_ring_t* next;
+
+    if (cache->rings.table == NULL)
+        return;
+
+    server_msg_cache_stats(cache);
+
+    for (msg_ring_t* ring = cache->head; ring; ring = next)
+    {
+        next = ring->next;
+        ring_clear(ring);
+        free(ring);
+    }
+    cache->head = cache->tail = NULL;
+    server_ght_destroy(&cache->rings);
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+cache_msg_t*
+server_msg_cache_entry(u32 msg_id, const char* json, size_t len)
+{
+    cache_msg_t* msg;
+
+    if ((msg = malloc(sizeof(cache_msg_t) + len)) == NULL)
+    {
+        error("cache msg malloc: %s\n", ERRSTR);
+        return NULL;
+    }
+    msg->msg_id = msg_id;
+    msg->len = len;
+    memcpy(msg->json, json, len);
+    return msg;
+}
+
+bool
+server_msg_cache_send(msg_cache_t* cache, client_t* client, u32 group_id, 
+                      u32 limit, u32 offset, u32 before_msg_id)
+{
+    msg_ring_t* ring;
+    u64 end;
+    u32 last;
+    size_t size;
+    size_t len;
+    char* buf = NULL;
+
+    pthread_mutex_lock(&cache->mutex);
+    ring = server_ght_get(&cache->rings, group_id);
+    if (ring && before_msg_id)
+    {
+        /* The ring is contiguous, the page starts at the first one older */
+        for (offset = 0; offset < ring->n && ring->msgs[offset]->msg_id >= before_msg_id; offset++)
+            ;
+    }
+    end = (u64)offset + limit;
+    if (ring == NULL || !ring->complete || (end > ring->n && !ring->has_all))
+    {
+        cache->misses++;
+        pthread_mutex_unlock(&cache->mutex);
+        return false;
+    }
+    ring_touch(cache, ring);
+    cache->hits++;
+
+    last = (end < ring->n) ? end : ring->n;
+    size = WS_HDR_MAX + CACHE_PREFIX_MAX + 2;
+    for (u32 i = offset; i < last; i++)
+        size += ring->msgs[i]->len + 1;
+
+    if ((buf = malloc(size)))
+    {
+        len = snprintf(buf + WS_HDR_MAX, CACHE_PREFIX_MAX,
+                       "{\"cmd\":\"get_group_msgs\",\"group_id\":%u,\"messages\":[",
+                       group_id);
+        for (u32 i = offset; i < last; i++)
+        {
+            if (i > offset)
+                buf[WS_HDR_MAX + len++] = ',';
+            memcpy(buf + WS_HDR_MAX + len, ring->msgs[i]->json, ring->msgs[i]->len);
+            len += ring->msgs[i]->len;
+        }
+        memcpy(buf + WS_HDR_MAX + len, "]}", 2);
+        len += 2;
+    }
+    else
+        error("msg cache page malloc: %s\n", ERRSTR);
+    pthread_mutex_unlock(&cache->mutex);
+
+    if (buf == NULL)
+        return false;
+    ws_send_json_reserved(client, buf, len, NULL);
+    free(buf);
+    return true;
+}
+
+u32
+server_msg_cache_seed_begin(msg_cache_t* cache, u32 group_id)
+{
+    msg_ring_t* ring;
+    u32 gen = 0;
+
+    pthread_mutex_lock(&cache->mutex);
+    if ((ring = server_ght_get(&cache->rings, group_id)) == NULL)
+        ring = ring_new(cache, group_id);
+    if (ring)
+    {
+        ring->seeding++;
+        gen = ring->gen;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return gen;
+}
+
+void
+server_msg_cache_seed(msg_cache_t* cache, u32 group_id, u32 gen,
+                      cache_msg_t** rows, u32 n, bool has_all)
+{
+    msg_ring_t* ring;
+    const u32 oldest = (rows && n) ? rows[n - 1]->msg_id : 0;
+    bool was_complete;
+    u32 i;
+
+    pthread_mutex_lock(&cache->mutex);
+    ring = server_ght_get(&cache->rings, group_id);
+    if (ring && ring->seeding)
+        ring->seeding--;
+    /* Deleted from since, or dropped altogether */
+    if (ring == NULL || ring->gen != gen || rows == NULL)
+        goto out;
+
+    /* Pushes that came while it ran are already in, merge the rest */
+    was_complete = ring->complete;
+    ring->has_all = has_all || (was_complete && ring->has_all);
+    for (i = 0; i < n; i++)
+        if (ring_insert(ring, rows[i]))
+            rows[i] = NULL;
+
+    /*
+     * A push older than the oldest row (it committed late) says nothing
+     * about what's between them, only what the seed covers counts.
+     */
+    if (!was_complete && !has_all)
+    {
+        while (ring->n && ring->msgs[ring->n - 1]->msg_id < oldest)
+            free(ring->msgs[--ring->n]);
+    }
+    ring->complete = true;
+out:
+    pthread_mutex_unlock(&cache->mutex);
+    for (i = 0; rows && i < n; i++)
+        free(rows[i]);
+    free(rows);
+}
+
+void
+server_msg_cache_push(msg_cache_t* cache, const dbmsg_t* msg)
+{
+    json_writer_t jw;
+    char timestamp[DB_MSG_TIMESTAMP_MAX];
+    size_t timestamp_len = strnlen(msg->timestamp, DB_MSG_TIMESTAMP_MAX - 1);
+    size_t attachments_len = (msg->attachments) ? strlen(msg->attachments) : 0;
+    size_t size;
+    char* buf;
+    cache_msg_t* entry;
+    msg_ring_t* ring;
+
+    /* Cheap miss, nobody asked for this group's history */
+    pthread_mutex_lock(&cache->mutex);
+    ring = server_ght_get(&cache->rings, msg->group_id);
+    pthread_mutex_unlock(&cache->mutex);
+    if (ring == NULL)
+        return;
+
+    size = CACHE_MSG_BASE + JW_STR_MAX(msg->content_len)
+         + attachments_len + JW_STR_MAX(timestamp_len);
+    if ((buf = malloc(size)) == NULL)
+    {
+        error("msg cache push malloc: %s\n", ERRSTR);
+        return;
+    }
+
+    /* Same keys, order and timestamp format as row_to_json() */
+    memcpy(timestamp, msg->timestamp, timestamp_len);
+    timestamp[timestamp_len] = 0x00;
+    if (timestamp_len > 10 && timestamp[10] == ' ')
+        timestamp[10] = 'T';
+
+    jw_init(&jw, buf, size);
+    jw_obj_begin(&jw);
+    jw_key_int(&jw, "msg_id", msg->msg_id);
+    jw_key_int(&jw, "user_id", msg->user_id);
+    jw_key_int(&jw, "group_id", msg->group_id);
+    jw_key(&jw, "content");
+    jw_str_len(&jw, msg->content, msg->content_len);
+    jw_key(&jw, "timestamp");
+    jw_str_len(&jw, timestamp, timestamp_len);
+    if (attachments_len)
+        jw_key_raw(&jw, "attachments", msg->attachments, attachments_len);
+    else
+        jw_key_raw(&jw, "attachments", "[]", 2);
+    if (msg->parent_msg_id)
+        jw_key_int(&jw, "parent_msg_id", msg->parent_msg_id);
+    else
+        jw_key_raw(&jw, "parent_msg_id", "null", 4);
+    jw_obj_end(&jw);
+
+    entry = (jw.overflow) ? NULL : server_msg_cache_entry(msg->msg_id, buf, jw.len);
+    free(buf);
+    if (entry == NULL)
+        return;
+
+    pthread_mutex_lock(&cache->mutex);
+    ring = server_ght_get(&cache->rings, msg->group_id);
+    /* Older than a complete ring's oldest, can't be sure nothing is between */
+    if (ring && ring->complete && !ring->has_all && ring->n &&
+        msg->msg_id < ring->msgs[ring->n - 1]->msg_id)
+        ring = NULL;
+    if (ring && ring_insert(ring, entry))
+    {
+        ring_touch(cache, ring);
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    free(entry);
+}
+
+void
+server_msg_cache_invalidate(msg_cache_t* cache, u32 group_id)
+{
+    msg_ring_t* ring;
+
+    pthread_mutex_lock(&cache->mutex);
+    if ((ring = server_ght_get(&cache->rings, group_id)))
+    {
+        ring_clear(ring);
+        ring->gen = ++cache->next_gen;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void
+server_msg_cache_drop(msg_cache_t* cache, u32 group_id)
+{
+    msg_ring_t* ring;
+
+    pthread_mutex_lock(&cache->mutex);
+    if ((ring = server_ght_get(&cache->rings, group_id)))
+        ring_del(cache, ring);
+    pthread_mutex_unlock(&cache->mutex);
+}
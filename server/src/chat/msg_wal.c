@@ -0,0 +1,970 @@
+#include "chat/msg_wal.h"
+#include "chat/db_group.h"
+#include "chat/db_array.h"
+#include "server.h"
+#include "server_websocket.h"
+#include <libpq-fe.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define WAL_SUM_OFFSET  offsetof(wal_hdr_t, msg_id)
+#define WAL_COLS        6   /* insert_msgs.sql: $1..$6 */
+
+_Static_assert(offsetof(wal_rec_t, data) == offsetof(wal_rec_t, hdr) + sizeof(wal_hdr_t),
+               "wal_rec_t: record has to be contiguous");
+
+typedef struct
+{
+    compute_job_t   job;
+    msg_wal_t*      wal;
+    wal_rec_t*      rec;
+    dbmsg_t*        msg;
+    u32*            member_ids;
+    size_t          n_members;
+    bool            logged;     /* In a segment, the writer takes it */
+    bool            synced;     /* ...and on disk, it can go out */
+} wal_append_t;
+
+typedef struct
+{
+    size_t  unpersisted;
+} wal_group_t;
+
+/* delete_msg parked on a record, back to its eworker once it's inserted */
+typedef struct wal_delete
+{
+    compute_job_t   job;
+    u32             msg_id;
+    u32             user_id;
+    struct wal_delete* next;
+} wal_delete_t;
+
+static u32
+wal_sum(const void* data, size_t size)
+{
+    const u8* p = data;
+    u32 hash = 2166136261u;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static u32
+wal_rec_sum(const wal_hdr_t* hdr)
+{
+    return wal_sum((const u8*)hdr + WAL_SUM_OFFSET, hdr->size - WAL_SUM_OFFSET);
+}
+
+static void
+wal_segment_path(const msg_wal_t* wal, u32 seq, char* out)
+{
+    snprintf(out, PATH_MAX, "%s/%08u.wal", wal->dir, seq);
+}
+
+static bool
+wal_write(i32 fd, const void* buf, size_t size)
+{
+    const char* p = buf;
+    ssize_t n;
+
+    while (size)
+    {
+        if ((n = write(fd, p, size)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error("WAL write: %s\n", ERRSTR);
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* A new segment's name has to survive a crash too */
+static void
+wal_sync_dir(const msg_wal_t* wal)
+{
+    i32 fd;
+
+    if ((fd = open(wal->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    {
+        error("WAL open %s: %s\n", wal->dir, ERRSTR);
+        return;
+    }
+    if (fsync(fd) == -1)
+        error("WAL fsync %s: %s\n", wal->dir, ERRSTR);
+    close(fd);
+}
+
+/* log_mutex */
+static wal_segment_t*
+wal_segment_open(msg_wal_t* wal)
+{
+    char path[PATH_MAX];
+    wal_segment_t* seg;
+
+    if ((seg = calloc(1, sizeof(wal_segment_t))) == NULL)
+    {
+        error("WAL segment calloc: %s\n", ERRSTR);
+        return NULL;
+    }
+    seg->seq = wal->next_seq++;
+    wal_segment_path(wal, seg->seq, path);
+
+    seg->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR);
+    if (seg->fd == -1)
+    {
+        error("WAL open %s: %s\n", path, ERRSTR);
+        free(seg);
+        return NULL;
+    }
+    wal_sync_dir(wal);
+
+    if (wal->seg_tail)
+        wal->seg_tail->next = seg;
+    else
+        wal->segs = seg;
+    wal->seg_tail = seg;
+    return seg;
+}
+
+/* log_mutex, every record in `seg` is in the database */
+static void
+wal_segment_done(msg_wal_t* wal, wal_segment_t* seg)
+{
+    char path[PATH_MAX];
+    wal_segment_t** prev;
+
+    /* Still appended to, start it over */
+    if (seg == wal->seg_tail)
+    {
+        if (seg->size && ftruncate(seg->fd, 0) == -1)
+            error("WAL ftruncate segment %u: %s\n", seg->seq, ERRSTR);
+        else
+            seg->size = 0;
+        return;
+    }
+
+    for (prev = &wal->segs; *prev != seg; prev = &(*prev)->next)
+        ;
+    *prev = seg->next;
+
+    wal_segment_path(wal, seg->seq, path);
+    if (unlink(path) == -1)
+        error("WAL unlink %s: %s\n", path, ERRSTR);
+    close(seg->fd);
+    free(seg);
+}
+
+static void
+wal_close_segments(msg_wal_t* wal)
+{
+    char path[PATH_MAX];
+    wal_segment_t* seg;
+    wal_segment_t* next;
+
+    for (seg = wal->segs; seg; seg = next)
+    {
+        next = seg->next;
+        close(seg->fd);
+        /* Left over ones get replayed next time */
+        wal_segment_path(wal, seg->seq, path);
+        if (seg->pending == 0 && unlink(path) == -1)
+            error("WAL unlink %s: %s\n", path, ERRSTR);
+        free(seg);
+    }
+    wal->segs = wal->seg_tail = NULL;
+}
+
+static void
+wal_free_recs(wal_rec_t* rec)
+{
+    wal_rec_t* next;
+
+    for (; rec; rec = next)
+    {
+        next = rec->next;
+        free(rec);
+    }
+}
+
+/* Under wal->mutex */
+static bool
+wal_group_add(msg_wal_t* wal, u32 group_id, bool add)
+{
+    wal_group_t* group;
+
+    if ((group = server_ght_get(&wal->groups, group_id)) == NULL)
+    {
+        if (!add || (group = calloc(1, sizeof(wal_group_t))) == NULL)
+            return false;
+        if (!server_ght_insert(&wal->groups, group_id, group))
+        {
+            free(group);
+            return false;
+        }
+    }
+    if (add)
+        group->unpersisted++;
+    else if (--group->unpersisted == 0)
+        server_ght_del(&wal->groups, group_id);
+    return true;
+}
+
+/*
+ * Writer: done with `batch`, the deletes waiting on it go to their eworkers.
+ * Not `inserted` (stopping), they're cancelled, the log still has it.
+ */
+static void
+wal_batch_done(msg_wal_t* wal, wal_rec_t* batch, bool inserted)
+{
+    wal_delete_t* deletes = NULL;
+    wal_delete_t* wd;
+    wal_delete_t* next;
+
+    pthread_mutex_lock(&wal->mutex);
+    for (wal_rec_t* rec = batch; rec; rec = rec->next)
+    {
+        wal_group_add(wal, rec->hdr.group_id, false);
+        for (wd = rec->deletes; wd; wd = next)
+        {
+            next = wd->next;
+            wd->next = deletes;
+            deletes = wd;
+        }
+        rec->deletes = NULL;
+    }
+    wal->batch = NULL;
+    pthread_mutex_unlock(&wal->mutex);
+
+    for (wd = deletes; wd; wd = next)
+    {
+        next = wd->next;
+        if (inserted)
+            server_compute_post(&wd->job);
+        else
+        {
+            wd->job.status = COMPUTE_CANCELLED;
+            wd->job.done(wd->job.ew, NULL, &wd->job);
+        }
+    }
+}
+
+/* Writer: `rec` and the rest are in the database */
+static void
+wal_release(msg_wal_t* wal, wal_rec_t* rec)
+{
+    wal_rec_t* next;
+
+    pthread_mutex_lock(&wal->log_mutex);
+    for (; rec; rec = next)
+    {
+        next = rec->next;
+        if (rec->seg && --rec->seg->pending == 0)
+            wal_segment_done(wal, rec->seg);
+        atomic_fetch_sub(&wal->unpersisted, 1);
+        free(rec);
+    }
+    pthread_mutex_unlock(&wal->log_mutex);
+}
+
+/* 1 inserted, 0 refused by the database, -1 couldn't ask it */
+static i32
+wal_insert(msg_wal_t* wal, db_array_t* cols, wal_rec_t* rec, size_t n)
+{
+    const db_stmt_t* stmt = wal->db.cmd->stmts + DB_STMT_INSERT_MSGS;
+    const char* vals[WAL_COLS];
+    const wal_hdr_t* hdr = &rec->hdr;
+    PGresult* res;
+    i32 ret;
+
+    for (i32 c = 0; c < WAL_COLS; c++)
+        db_array_begin(cols + c);
+    for (size_t i = 0; i < n; i++, rec = rec->next)
+    {
+        hdr = &rec->hdr;
+        db_array_int(cols + 0, hdr->msg_id);
+        db_array_int(cols + 1, hdr->user_id);
+        db_array_int(cols + 2, hdr->group_id);
+        db_array_str(cols + 3, rec->data, hdr->content_len);
+        db_array_str(cols + 4, rec->data + hdr->content_len, hdr->attachments_len);
+        db_array_str(cols + 5, hdr->timestamp, strnlen(hdr->timestamp, DB_MSG_TIMESTAMP_MAX));
+    }
+    for (i32 c = 0; c < WAL_COLS; c++)
+    {
+        if (!db_array_end(cols + c))
+        {
+            error("WAL insert: out of memory\n");
+            return -1;
+        }
+        vals[c] = cols[c].data;
+    }
+
+    /* Not prepared, it would be gone after a PQreset() */
+    res = PQexecParams(wal->db.conn, stmt->sql, WAL_COLS, NULL, vals, NULL, NULL, DB_FMT_TEXT);
+    if (PQresultStatus(res) == PGRES_TUPLES_OK)
+        ret = 1;
+    else if (PQstatus(wal->db.conn) != CONNECTION_OK)
+    {
+        error("WAL insert: %s\n", PQerrorMessage(wal->db.conn));
+        PQreset(wal->db.conn);
+        ret = -1;
+    }
+    else
+    {
+        if (n == 1)
+            warn("WAL: msg_id %u refused: %s\n",
+                 hdr->msg_id, PQresultErrorMessage(res));
+        ret = 0;
+    }
+    PQclear(res);
+    return ret;
+}
+
+/* Writer: false if the database can't be reached, try again later */
+static bool
+wal_persist(msg_wal_t* wal, db_array_t* cols, wal_rec_t* batch, size_t n)
+{
+    size_t n_refused = 0;
+    i32 ret;
+
+    if ((ret = wal_insert(wal, cols, batch, n)) == -1)
+        return false;
+
+    /* One bad row fails them all, find out which */
+    if (ret == 0 && n > 1)
+    {
+        for (wal_rec_t* rec = batch; rec; rec = rec->next)
+        {
+            if ((ret = wal_insert(wal, cols, rec, 1)) == -1)
+                return false;
+            n_refused += (ret == 0);
+        }
+    }
+    else if (ret == 0)
+        n_refused = 1;
+
+    wal->n_persisted += n - n_refused;
+    wal->n_dropped += n_refused;
+    wal->n_batches++;
+    return true;
+}
+
+static void*
+wal_main(void* arg)
+{
+    msg_wal_t* wal = arg;
+    db_array_t cols[WAL_COLS] = {0};
+    wal_rec_t* batch;
+    wal_rec_t* last;
+    size_t n;
+    bool stop;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&wal->mutex);
+        while (wal->head == NULL && !wal->stop)
+            pthread_cond_wait(&wal->cond, &wal->mutex);
+        if ((batch = wal->head) == NULL)
+        {
+            pthread_mutex_unlock(&wal->mutex);
+            break;
+        }
+
+        /* Whatever queued up while the last INSERT ran */
+        for (n = 1, last = batch; n < WAL_BATCH_MAX && last->next; n++)
+            last = last->next;
+        if ((wal->head = last->next) == NULL)
+            wal->tail = NULL;
+        last->next = NULL;
+        wal->count -= n;
+        wal->batch = batch;
+        stop = wal->stop;
+        pthread_mutex_unlock(&wal->mutex);
+
+        if (wal_persist(wal, cols, batch, n))
+        {
+            wal_batch_done(wal, batch, true);
+            wal_release(wal, batch);
+        }
+        else if (stop)
+        {
+            /* Still in the log, replayed on the next start */
+            wal_batch_done(wal, batch, false);
+            wal_free_recs(batch);
+        }
+        else
+        {
+            pthread_mutex_lock(&wal->mutex);
+            if ((last->next = wal->head) == NULL)
+                wal->tail = last;
+            wal->head = batch;
+            wal->batch = NULL;
+            wal->count += n;
+            pthread_mutex_unlock(&wal->mutex);
+            sleep(WAL_RETRY_SEC);
+        }
+    }
+
+    for (i32 c = 0; c < WAL_COLS; c++)
+        db_array_free(cols + c);
+    return NULL;
+}
+
+static void
+wal_enqueue(msg_wal_t* wal, wal_rec_t* rec)
+{
+    rec->next = NULL;
+
+    pthread_mutex_lock(&wal->mutex);
+    if (wal->tail)
+        wal->tail->next = rec;
+    else
+        wal->head = rec;
+    wal->tail = rec;
+    if (++wal->count > wal->high_water)
+        wal->high_water = wal->count;
+    pthread_cond_signal(&wal->cond);
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+/* Assigns `msg` its msg_id & timestamp */
+static wal_rec_t*
+wal_rec_new(msg_wal_t* wal, dbmsg_t* msg)
+{
+    const char* attachments = (msg->attachments) ? msg->attachments : "[]";
+    const size_t attachments_len = strlen(attachments);
+    struct timespec ts;
+    wal_rec_t* rec;
+
+    if ((rec = malloc(sizeof(wal_rec_t) + msg->content_len + attachments_len)) == NULL)
+    {
+        error("WAL record malloc: %s\n", ERRSTR);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&wal->mutex);
+    if (!wal_group_add(wal, msg->group_id, true))
+    {
+        pthread_mutex_unlock(&wal->mutex);
+        error("WAL group count: out of memory\n");
+        free(rec);
+        return NULL;
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    atomic_fetch_add(&wal->unpersisted, 1);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    msg->msg_id = atomic_fetch_add(&wal->next_id, 1);
+    db_timestamp_str((ts.tv_sec - DB_PG_EPOCH_OFFSET) * DB_USEC + ts.tv_nsec / 1000,
+                     msg->timestamp, DB_MSG_TIMESTAMP_MAX);
+
+    rec->next = NULL;
+    rec->seg = NULL;
+    rec->deletes = NULL;
+    memset(&rec->hdr, 0, sizeof(wal_hdr_t));
+    rec->hdr.size = sizeof(wal_hdr_t) + msg->content_len + attachments_len;
+    rec->hdr.msg_id = msg->msg_id;
+    rec->hdr.user_id = msg->user_id;
+    rec->hdr.group_id = msg->group_id;
+    rec->hdr.content_len = msg->content_len;
+    rec->hdr.attachments_len = attachments_len;
+    strncpy(rec->hdr.timestamp, msg->timestamp, DB_MSG_TIMESTAMP_MAX - 1);
+    memcpy(rec->data, msg->content, msg->content_len);
+    memcpy(rec->data + msg->content_len, attachments, attachments_len);
+    rec->hdr.sum = wal_rec_sum(&rec->hdr);
+
+    return rec;
+}
+
+/* I/O thread */
+static void
+wal_append_run(UNUSED compute_thread_t* ct, compute_job_t* job)
+{
+    wal_append_t* aj = (wal_append_t*)job;
+    msg_wal_t* wal = aj->wal;
+    wal_rec_t* rec = aj->rec;
+    wal_segment_t* seg;
+
+    pthread_mutex_lock(&wal->log_mutex);
+    seg = wal->seg_tail;
+    if (seg->size >= WAL_SEGMENT_MAX && wal_segment_open(wal))
+        seg = wal->seg_tail;
+
+    if (wal_write(seg->fd, &rec->hdr, rec->hdr.size))
+    {
+        seg->size += rec->hdr.size;
+        seg->pending++;
+        rec->seg = seg;
+        aj->logged = true;
+    }
+    /* Replay stops at a torn record, don't leave one in front of the next */
+    else if (ftruncate(seg->fd, seg->size) == -1)
+        error("WAL ftruncate segment %u: %s\n", seg->seq, ERRSTR);
+    pthread_mutex_unlock(&wal->log_mutex);
+
+    /* Pending keeps `seg` around */
+    if (aj->logged)
+    {
+        if (fdatasync(seg->fd) == -1)
+            error("WAL fdatasync segment %u: %s\n", seg->seq, ERRSTR);
+        else
+            aj->synced = true;
+    }
+}
+
+static void
+wal_append_done(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    wal_append_t* aj = (wal_append_t*)job;
+    char* buf;
+    size_t len;
+
+    /* Logged is as good as inserted, even if it can't go out */
+    if (aj->logged)
+        wal_enqueue(aj->wal, aj->rec);
+    else
+    {
+        pthread_mutex_lock(&aj->wal->mutex);
+        wal_group_add(aj->wal, aj->rec->hdr.group_id, false);
+        pthread_mutex_unlock(&aj->wal->mutex);
+        atomic_fetch_sub(&aj->wal->unpersisted, 1);
+        free(aj->rec);
+    }
+
+    if (job->status == COMPUTE_CANCELLED)
+        goto out;
+
+    if (!aj->synced)
+    {
+        ws_json_send_error(client, "Failed to insert message");
+        goto out;
+    }
+    server_msg_cache_push(&ew->server->msg_cache, aj->msg);
+    if ((buf = server_msg_to_frame(aj->msg, &len)))
+    {
+        server_group_send_frame(ew, aj->member_ids, aj->n_members, buf, len);
+        free(buf);
+    }
+out:
+    server_free_msg(ew, aj->msg);
+    free(aj->member_ids);
+    free(aj);
+}
+
+static const char*
+do_wal_group_msg(eworker_t* ew, dbcmd_ctx_t* ctx)
+{
+    msg_wal_t* wal = &ew->server->wal;
+    dbmsg_t* msg = ctx->param.ptr;
+    const u32* member_ids = ctx->data;
+    wal_append_t* aj;
+    size_t i;
+
+    if (ctx->ret == DB_ASYNC_ERROR)
+    {
+        server_free_msg(ew, msg);
+        return "Failed to insert message";
+    }
+
+    /* The foreign key would have checked it */
+    for (i = 0; i < ctx->data_size && member_ids[i] != msg->user_id; i++)
+        ;
+    if (i == ctx->data_size)
+    {
+        server_free_msg(ew, msg);
+        return "Not a group member";
+    }
+
+    if ((aj = calloc(1, sizeof(wal_append_t))) == NULL)
+    {
+        error("WAL append calloc: %s\n", ERRSTR);
+        server_free_msg(ew, msg);
+        return "Internal error: wal-append";
+    }
+    if ((aj->rec = wal_rec_new(wal, msg)) == NULL)
+    {
+        free(aj);
+        server_free_msg(ew, msg);
+        return "Internal error: wal-append";
+    }
+    aj->wal = wal;
+    aj->msg = msg;
+    aj->member_ids = ctx->data;
+    aj->n_members = ctx->data_size;
+    ctx->data = NULL;
+
+    aj->job.run = wal_append_run;
+    aj->job.done = wal_append_done;
+    server_io_submit(ew, ctx->client, &aj->job);
+    return NULL;
+}
+
+static void
+wal_delete_done(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    wal_delete_t* wd = (wal_delete_t*)job;
+    const char* err;
+
+    /* Inserted (or refused) by now, same as any other delete */
+    if (job->status != COMPUTE_CANCELLED &&
+        (err = server_delete_group_msg_db(ew, wd->msg_id, wd->user_id)))
+        ws_json_send_error(client, err);
+    free(wd);
+}
+
+static wal_rec_t*
+wal_find(wal_rec_t* rec, u32 msg_id)
+{
+    for (; rec; rec = rec->next)
+        if (rec->hdr.msg_id == msg_id)
+            return rec;
+    return NULL;
+}
+
+bool
+server_wal_delete_msg(eworker_t* ew, client_t* client, u32 msg_id, u32 user_id)
+{
+    msg_wal_t* wal = &ew->server->wal;
+    wal_delete_t* wd;
+    wal_rec_t* rec;
+
+    /* Goes out only once it's queued, nobody knows its msg_id before */
+    if (!wal->enabled || atomic_load(&wal->unpersisted) == 0)
+        return false;
+
+    if ((wd = calloc(1, sizeof(wal_delete_t))) == NULL)
+    {
+        error("WAL delete calloc: %s\n", ERRSTR);
+        return false;
+    }
+    wd->job.done = wal_delete_done;
+    wd->job.ew = ew;
+    wd->job.client_hd = (client) ? client->hd : CLIENT_HD_NONE;
+    wd->msg_id = msg_id;
+    wd->user_id = user_id;
+
+    pthread_mutex_lock(&wal->mutex);
+    if ((rec = wal_find(wal->batch, msg_id)) || (rec = wal_find(wal->head, msg_id)))
+    {
+        wd->next = rec->deletes;
+        rec->deletes = wd;
+    }
+    pthread_mutex_unlock(&wal->mutex);
+
+    if (rec == NULL)
+        free(wd);
+    return rec != NULL;
+}
+
+bool
+server_wal_group_msg(eworker_t* ew, dbmsg_t* msg)
+{
+    dbcmd_ctx_t ctx = {
+        .exec = do_wal_group_msg,
+        .flags = DB_CTX_NO_JSON,
+        .param.ptr = msg
+    };
+
+    if (db_async_get_group_member_ids(&ew->db, msg->group_id, &ctx))
+        return true;
+    server_free_msg(ew, msg);
+    return false;
+}
+
+static bool
+wal_read_file(const char* path, char** data, size_t* size)
+{
+    struct stat st;
+    ssize_t n;
+    size_t off = 0;
+    i32 fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        error("WAL open %s: %s\n", path, ERRSTR);
+        return false;
+    }
+    if (fstat(fd, &st) == -1 || (*data = malloc(st.st_size + 1)) == NULL)
+    {
+        error("WAL read %s: %s\n", path, ERRSTR);
+        close(fd);
+        return false;
+    }
+    while (off < (size_t)st.st_size &&
+           (n = read(fd, *data + off, st.st_size - off)) != 0)
+    {
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+        {
+            error("WAL read %s: %s\n", path, ERRSTR);
+            free(*data);
+            close(fd);
+            return false;
+        }
+        off += n;
+    }
+    close(fd);
+    *size = off;
+    return true;
+}
+
+/* Whatever a crash left in `path` into the database */
+static bool
+wal_replay_segment(msg_wal_t* wal, db_array_t* cols, const char* path, size_t* n_msgs)
+{
+    char* data;
+    size_t size;
+    size_t off = 0;
+    wal_hdr_t hdr;
+    wal_rec_t* head = NULL;
+    wal_rec_t** tail = &head;
+    wal_rec_t* rec;
+    size_t n = 0;
+    bool ret = false;
+
+    if (!wal_read_file(path, &data, &size))
+        return false;
+
+    while (off + sizeof(wal_hdr_t) <= size)
+    {
+        memcpy(&hdr, data + off, sizeof(wal_hdr_t));
+        if (hdr.size > size - off ||
+            hdr.size != sizeof(wal_hdr_t) + (size_t)hdr.content_len + hdr.attachments_len ||
+            wal_sum(data + off + WAL_SUM_OFFSET, hdr.size - WAL_SUM_OFFSET) != hdr.sum)
+            break;
+
+        if ((rec = malloc(sizeof(wal_rec_t) + hdr.size - sizeof(wal_hdr_t))) == NULL)
+        {
+            error("WAL record malloc: %s\n", ERRSTR);
+            goto out;
+        }
+        memcpy(&rec->hdr, data + off, hdr.size);
+        rec->hdr.timestamp[DB_MSG_TIMESTAMP_MAX - 1] = 0x00;
+        rec->next = NULL;
+        rec->seg = NULL;
+        rec->deletes = NULL;
+        *tail = rec;
+        tail = &rec->next;
+        off += hdr.size;
+
+        if (hdr.msg_id >= atomic_load(&wal->next_id))
+            atomic_store(&wal->next_id, hdr.msg_id + 1);
+
+        if (++n == WAL_BATCH_MAX)
+        {
+            if (!wal_persist(wal, cols, head, n))
+                goto out;
+            wal_free_recs(head);
+            head = NULL;
+            tail = &head;
+            *n_msgs += n;
+            n = 0;
+        }
+    }
+    if (off < size)
+        warn("WAL %s: %zu bytes of a torn record dropped\n", path, size - off);
+
+    if (n && !wal_persist(wal, cols, head, n))
+        goto out;
+    *n_msgs += n;
+    ret = true;
+out:
+    wal_free_recs(head);
+    free(data);
+    return ret;
+}
+
+static i32
+wal_cmp_seq(const void* a, const void* b)
+{
+    u32 x = *(const u32*)a;
+    u32 y = *(const u32*)b;
+
+    return (x > y) - (x < y);
+}
+
+static bool
+wal_replay(msg_wal_t* wal)
+{
+    DIR* dir;
+    struct dirent* ent;
+    char path[PATH_MAX];
+    char* end;
+    u32* seqs = NULL;
+    u32* tmp;
+    size_t n_seqs = 0;
+    size_t n_msgs = 0;
+    size_t cap = 0;
+    db_array_t cols[WAL_COLS] = {0};
+    bool ret = false;
+
+    if ((dir = opendir(wal->dir)) == NULL)
+    {
+        error("WAL opendir %s: %s\n", wal->dir, ERRSTR);
+        return false;
+    }
+    while ((ent = readdir(dir)))
+    {
+        u32 seq = strtoul(ent->d_name, &end, 10);
+        if (end == ent->d_name || strcmp(end, ".wal"))
+            continue;
+
+        if (n_seqs == cap)
+        {
+            cap = (cap) ? cap * 2 : 16;
+            if ((tmp = realloc(seqs, cap * sizeof(u32))) == NULL)
+            {
+                error("WAL realloc: %s\n", ERRSTR);
+                goto out;
+            }
+            seqs = tmp;
+        }
+        seqs[n_seqs++] = seq;
+    }
+
+    qsort(seqs, n_seqs, sizeof(u32), wal_cmp_seq);
+    for (size_t i = 0; i < n_seqs; i++)
+    {
+        wal_segment_path(wal, seqs[i], path);
+        if (!wal_replay_segment(wal, cols, path, &n_msgs))
+        {
+            fatal("WAL replay of %s failed, messages are still in it\n", path);
+            goto out;
+        }
+        if (unlink(path) == -1)
+            error("WAL unlink %s: %s\n", path, ERRSTR);
+        wal->next_seq = seqs[i] + 1;
+    }
+    if (n_seqs)
+        info("WAL: %zu messages replayed from %zu segments\n", n_msgs, n_seqs);
+    ret = true;
+out:
+    for (i32 c = 0; c < WAL_COLS; c++)
+        db_array_free(cols + c);
+    free(seqs);
+    closedir(dir);
+    return ret;
+}
+
+/* Carry on from Messages' own sequence */
+static bool
+wal_seed(msg_wal_t* wal)
+{
+    PGresult* res;
+    u32 next_id;
+    bool ret = false;
+
+    res = PQexec(wal->db.conn,
+                 "SELECT GREATEST((SELECT COALESCE(MAX(msg_id), 0) FROM Messages), "
+                                 "(SELECT last_value FROM messages_msg_id_seq));");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+        error("WAL seed msg_id: %s\n", PQresultErrorMessage(res));
+        goto out;
+    }
+    next_id = strtoul(PQgetvalue(res, 0, 0), NULL, 10) + 1;
+    if (next_id > atomic_load(&wal->next_id))
+        atomic_store(&wal->next_id, next_id);
+    info("Write-behind messages, next msg_id: %u\n", atomic_load(&wal->next_id));
+    ret = true;
+out:
+    PQclear(res);
+    return ret;
+}
+
+bool
+server_wal_init(server_t* server)
+{
+    msg_wal_t* wal = &server->wal;
+
+    if (!server->conf.write_behind)
+        return true;
+
+    wal->dir = server->conf.wal_dir;
+    atomic_store(&wal->next_id, 1);
+    pthread_mutex_init(&wal->log_mutex, NULL);
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->cond, NULL);
+
+    if (!server_io_mkdirs(wal->dir))
+        return false;
+
+    wal->db.cmd = &server->db_commands;
+    if (!server_db_open(&wal->db, server->conf.database, DB_DEFAULT))
+        return false;
+    if (server_ght_init(&wal->groups, 64, free) == false)
+    {
+        server_db_close(&wal->db);
+        return false;
+    }
+
+    if (!wal_replay(wal) || !wal_seed(wal) || wal_segment_open(wal) == NULL)
+        goto err;
+
+    if (pthread_create(&wal->pth, NULL, wal_main, wal) != 0)
+    {
+        fatal("pthread_create WAL writer failed: %s\n", ERRSTR);
+        goto err;
+    }
+    pthread_setname_np(wal->pth, "wal");
+    wal->enabled = true;
+    return true;
+err:
+    wal_close_segments(wal);
+    server_db_close(&wal->db);
+    server_ght_destroy(&wal->groups);
+    return false;
+}
+
+void
+server_wal_free(server_t* server)
+{
+    msg_wal_t* wal = &server->wal;
+
+    if (!wal->enabled)
+        return;
+
+    pthread_mutex_lock(&wal->mutex);
+    wal->stop = true;
+    pthread_cond_signal(&wal->cond);
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_join(wal->pth, NULL);
+
+    /* Deletes it handed back after the eworkers stopped */
+    for (size_t i = 0; i < server->tm.n_workers; i++)
+        server_compute_cancel_done(server->tm.workers + i);
+
+    info("Write-behind: %lu messages in %lu batches, refused: %lu, queue high water: %zu\n",
+         wal->n_persisted, wal->n_batches, wal->n_dropped, wal->high_water);
+
+    wal_close_segments(wal);
+    server_db_close(&wal->db);
+    server_ght_destroy(&wal->groups);
+    pthread_cond_destroy(&wal->cond);
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_mutex_destroy(&wal->log_mutex);
+    wal->enabled = false;
+}
+
+bool
+server_wal_group_settled(server_t* server, u32 group_id)
+{
+    msg_wal_t* wal = &server->wal;
+    bool settled;
+
+    if (!wal->enabled || atomic_load(&wal->unpersisted) == 0)
+        return true;
+
+    pthread_mutex_lock(&wal->mutex);
+    settled = server_ght_get(&wal->groups, group_id) == NULL;
+    pthread_mutex_unlock(&wal->mutex);
+    return settled;
+}
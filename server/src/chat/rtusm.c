@@ -4,6 +4,7 @@
 #include "chat/db_user.h"
 #include "chat/db.h"
 #include "server_websocket.h"
+#include "server_json.h"
 
 const char* const rtusm_status_str[RTUSM_STATUS_LEN] = {
     "offline",
@@ -20,7 +21,9 @@ do_rtusm_broadcast(eworker_t* ew, dbcmd_ctx_t* ctx)
     u32* user_ids;
     rtusm_t* status;
     rtusm_new_t new;
-    json_object* json;
+    json_writer_t jw;
+    mp_buf_t mp = {0};
+    char buf[WS_HDR_MAX + 256 + JW_STR_MAX(DB_PFP_HASH_MAX)];
     const char* status_str;
     const char* pfp_hash = ctx->param.rtusm.pfp_hash;
 
@@ -37,45 +40,44 @@ do_rtusm_broadcast(eworker_t* ew, dbcmd_ctx_t* ctx)
     user_id = ctx->param.rtusm.user_id;
     status_str = rtusm_status_str[status->status];
 
-    json = json_object_new_object();
-    json_object_object_add(json, "cmd",
-                           json_object_new_string("rtusm"));
-    json_object_object_add(json, "user_id",
-                           json_object_new_int(user_id));
+    jw_init(&jw, buf + WS_HDR_MAX, sizeof(buf) - WS_HDR_MAX);
+    jw_obj_begin(&jw);
+    jw_key_str(&jw, "cmd", "rtusm");
+    jw_key_int(&jw, "user_id", user_id);
     if (new.status)
-    {
-        json_object_object_add(json, "status",
-                               json_object_new_string(status_str));
-    }
+        jw_key_str(&jw, "status", status_str);
 
     if (new.typing && status->typing_group_id)
     {
-        json_object_object_add(json, "typing",
-                               json_object_new_boolean(status->typing));
-        json_object_object_add(json, "typing_group_id",
-                               json_object_new_int(status->typing_group_id));
+        jw_key_bool(&jw, "typing", status->typing);
+        jw_key_int(&jw, "typing_group_id", status->typing_group_id);
     }
 
     if (new.pfp)
+        jw_key_str(&jw, "pfp_name", pfp_hash);
+    jw_obj_end(&jw);
+
+    if (jw.overflow)
     {
-        json_object_object_add(json, "pfp_name",
-                               json_object_new_string(pfp_hash));
+        error("rtusm JSON overflow\n");
+        free((void*)pfp_hash);
+        return NULL;
     }
 
     for (size_t i = 0; i < size; i++)
     {
         client_t* connected_client = server_get_client_user_id(ew->server, user_ids[i]);
         if (connected_client)
-            ws_json_send(connected_client, json);
+            ws_send_json_reserved(connected_client, buf, jw.len, &mp);
     }
+    free(mp.data);
 
-    json_object_put(json);
     free((void*)pfp_hash);
     return NULL;
 }
 
 static void 
-rtusm_broadcast(eworker_t* ew, dbuser_t* user, rtusm_new_t new)
+rtusm_broadcast(eworker_t* ew, user_t* user, rtusm_new_t new)
 {
     const char* pfp_hash = (new.pfp) ? strndup(user->pfp_hash, DB_PFP_HASH_MAX) : NULL;
     dbcmd_ctx_t ctx = {
@@ -89,7 +91,7 @@ rtusm_broadcast(eworker_t* ew, dbuser_t* user, rtusm_new_t new)
 }
 
 void    
-server_rtusm_set_user_status(eworker_t* ew, dbuser_t* user, enum rtusm_status status)
+server_rtusm_set_user_status(eworker_t* ew, user_t* user, enum rtusm_status status)
 {
     if (!ew || !user)
         return;
@@ -98,7 +100,7 @@ server_rtusm_set_user_status(eworker_t* ew, dbuser_t* user, enum rtusm_status st
 }
 
 void    
-server_rtusm_user_disconnect(eworker_t* ew, dbuser_t* user)
+server_rtusm_user_disconnect(eworker_t* ew, user_t* user)
 {
     user->rtusm.status = USER_OFFLINE;
     user->rtusm.typing_group_id = 0;
@@ -114,7 +116,7 @@ server_rtusm_user_disconnect(eworker_t* ew, dbuser_t* user)
 }
 
 void    
-server_rtusm_user_connect(eworker_t* ew, dbuser_t* user)
+server_rtusm_user_connect(eworker_t* ew, user_t* user)
 {
     user->rtusm.status = USER_ONLINE;
 
@@ -134,7 +136,7 @@ rtusm_get_status_str(enum rtusm_status status)
 }
 
 void    
-server_rtusm_user_pfp_change(eworker_t* ew, dbuser_t* user)
+server_rtusm_user_pfp_change(eworker_t* ew, user_t* user)
 {
     const rtusm_new_t new = {
         .status = 0,
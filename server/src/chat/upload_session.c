@@ -0,0 +1,759 @@
+#include "chat/upload_session.h"
+#include "chat/upload_token.h"
+#include "chat/user_upload.h"
+#include "chat/db_userfile.h"
+#include "server.h"
+#include <dirent.h>
+#include <inttypes.h>
+
+#define UPLOAD_URL      "/upload/session"
+#define UPLOAD_URL_LEN  (sizeof(UPLOAD_URL) - 1)
+#define UPLOAD_ID_LEN   16  /* Hex */
+
+typedef struct 
+{
+    compute_job_t       job;
+    upload_session_t*   us;
+    u8*                 data;
+    size_t              len;
+    bool                ok;
+} upload_chunk_job_t;
+
+/* Sniffed on the compute pool, then finished on the I/O stage */
+typedef struct 
+{
+    compute_job_t       job;
+    upload_session_t*   us;
+    file_store_t*       store;
+    const char*         base;   /* Store directory of mime_type */
+    bool                fsync;
+    bool                ok;
+    char                mime_type[DB_MIME_TYPE_LEN];
+    char                hash[SERVER_HASH256_STR_SIZE];
+} upload_final_job_t;
+
+static void
+upload_dir(const server_t* server, char* out)
+{
+    snprintf(out, PATH_MAX, "%s/" UPLOAD_DIR, server->conf.file_dir);
+}
+
+bool
+server_upload_init(server_t* server)
+{
+    upload_table_t* table = &server->uploads;
+    char dir_path[PATH_MAX];
+    char path[PATH_MAX];
+    struct dirent* ent;
+    size_t n_stale = 0;
+    DIR* dir;
+
+    if (server_ght_init(&table->ht, 16, NULL) == false)
+        return false;
+    pthread_mutex_init(&table->mutex, NULL);
+
+    upload_dir(server, dir_path);
+    if (!server_io_mkdirs(dir_path))
+        return false;
+
+    /* Uploads don't outlive the server */
+    if ((dir = opendir(dir_path)) == NULL)
+    {
+        error("opendir %s failed: %s\n", dir_path, ERRSTR);
+        return false;
+    }
+    while ((ent = readdir(dir)))
+    {
+        if (ent->d_name[0] == '.')
+            continue;
+        if (snprintf(path, PATH_MAX, "%s/%s", dir_path, ent->d_name) >= PATH_MAX)
+        {
+            warn("Uploads: %s/%s: path too long\n", dir_path, ent->d_name);
+            continue;
+        }
+        if (unlink(path) == 0)
+            n_stale++;
+    }
+    closedir(dir);
+
+    if (n_stale)
+        info("Uploads: removed %zu unfinished\n", n_stale);
+    return true;
+}
+
+static void
+upload_session_free(eworker_t* ew, upload_session_t* us, bool unlink_tmp)
+{
+    char dir[PATH_MAX];
+
+    /* Created by the first chunk */
+    if (unlink_tmp && (us->fd != -1 || us->offset))
+    {
+        upload_dir(ew->server, dir);
+        server_io_unlink(ew, dir, strrchr(us->path, '/') + 1);
+    }
+    if (us->fd != -1)
+        close(us->fd);
+    free(us);
+}
+
+void
+server_upload_free(eworker_t* ew, upload_table_t* table)
+{
+    server_ght_t* ht = &table->ht;
+
+    if (ht->table == NULL)
+        return;
+    GHT_FOREACH(upload_session_t* us, ht, {
+        upload_session_free(ew, us, false);
+    });
+    server_ght_destroy(ht);
+    pthread_mutex_destroy(&table->mutex);
+}
+
+/* Exclusive until upload_release(), NULL and `code` if it can't be */
+static upload_session_t*
+upload_claim(upload_table_t* table, u64 id, u16* code)
+{
+    upload_session_t* us;
+
+    pthread_mutex_lock(&table->mutex);
+    if ((us = server_ght_get(&table->ht, id)) == NULL)
+        *code = HTTP_CODE_NOT_FOUND;
+    else if (us->busy)
+    {
+        *code = HTTP_CODE_CONFLICT;
+        us = NULL;
+    }
+    else
+        us->busy = true;
+    pthread_mutex_unlock(&table->mutex);
+
+    return us;
+}
+
+static void
+upload_release(eworker_t* ew, upload_session_t* us)
+{
+    upload_table_t* table = &ew->server->uploads;
+    bool dropped;
+
+    pthread_mutex_lock(&table->mutex);
+    us->busy = false;
+    dropped = us->dropped;
+    pthread_mutex_unlock(&table->mutex);
+
+    if (dropped)
+        upload_session_free(ew, us, true);
+}
+
+/* Finished with, true if it was dropped meanwhile */
+static bool
+upload_remove(eworker_t* ew, upload_session_t* us)
+{
+    upload_table_t* table = &ew->server->uploads;
+    bool dropped;
+
+    pthread_mutex_lock(&table->mutex);
+    if ((dropped = us->dropped) == false)
+        server_ght_del(&table->ht, us->id);
+    pthread_mutex_unlock(&table->mutex);
+
+    return dropped;
+}
+
+void
+server_upload_drop_token(eworker_t* ew, u32 token)
+{
+    upload_table_t* table = &ew->server->uploads;
+    server_ght_t* ht = &table->ht;
+    upload_session_t* drop = NULL;
+    upload_session_t* free_list = NULL;
+    upload_session_t* next;
+
+    if (ht->table == NULL)
+        return;
+
+    pthread_mutex_lock(&table->mutex);
+    GHT_FOREACH(upload_session_t* us, ht, {
+        if (us->token == token)
+        {
+            us->next = drop;
+            drop = us;
+        }
+    });
+    for (; drop; drop = next)
+    {
+        next = drop->next;
+        server_ght_del(ht, drop->id);
+        /* Its job frees it */
+        if (drop->busy)
+            drop->dropped = true;
+        else
+        {
+            drop->next = free_list;
+            free_list = drop;
+        }
+    }
+    pthread_mutex_unlock(&table->mutex);
+
+    for (; free_list; free_list = next)
+    {
+        next = free_list->next;
+        upload_session_free(ew, free_list, true);
+    }
+}
+
+static void
+upload_respond(client_t* client, u16 code, const char* msg, 
+               const char* name, size_t val)
+{
+    char val_str[32];
+    http_t* resp;
+
+    if (client == NULL)
+        return;
+    resp = http_new_resp(code, msg, NULL, 0);
+    if (name)
+    {
+        snprintf(val_str, sizeof(val_str), "%zu", val);
+        http_add_header(resp, name, val_str);
+    }
+    http_send(client, resp);
+    http_free(resp);
+}
+
+static bool
+upload_header_size(const http_t* http, const char* name, size_t* out)
+{
+    const http_header_t* header;
+    char* endptr;
+
+    if ((header = http_get_header(http, name)) == NULL)
+        return false;
+    errno = 0;
+    *out = strtoull(header->val, &endptr, 10);
+    return errno == 0 && endptr != header->val && *endptr == 0x00;
+}
+
+/* /upload/session/<id> */
+static bool
+upload_url_id(const http_t* http, u64* id)
+{
+    const char* str = http->req.url + UPLOAD_URL_LEN;
+    char* endptr;
+
+    if (*str != '/')
+        return false;
+    str++;
+    *id = strtoull(str, &endptr, 16);
+    return endptr - str == UPLOAD_ID_LEN && *endptr == 0x00 && *id;
+}
+
+static void
+upload_touch_token(server_t* server, u32 token)
+{
+    upload_token_t* ut;
+
+    if ((ut = server_get_upload_token(server, token)))
+        server_touch_upload_token(server, ut);
+}
+
+static void
+upload_create(eworker_t* ew, client_t* client, const http_t* http)
+{
+    server_t* server = ew->server;
+    upload_table_t* table = &server->uploads;
+    server_ght_t* ht = &table->ht;
+    upload_token_t* ut;
+    upload_session_t* us;
+    const char* err = NULL;
+    u16 code = HTTP_CODE_BAD_REQ;
+    size_t pending = 0;
+    size_t length;
+    size_t index;
+    char val[PATH_MAX];
+    http_t* resp;
+
+    ut = server_check_upload_token(server, http, NULL);
+    if (ut == NULL || ut->type != UT_MSG_ATTACHMENT)
+    {
+        upload_respond(client, code, "Upload-Token failed", NULL, 0);
+        return;
+    }
+    if (!upload_header_size(http, "Attach-Index", &index) || index >= ut->msg_state.total)
+    {
+        upload_respond(client, code, "Invalid Attach-Index", NULL, 0);
+        return;
+    }
+    if (!upload_header_size(http, "Upload-Length", &length) || length == 0)
+    {
+        upload_respond(client, code, "Invalid Upload-Length", NULL, 0);
+        return;
+    }
+    if (length > server->conf.upload_max)
+    {
+        upload_respond(client, HTTP_CODE_TOO_LARGE, "Upload too large", 
+                       "Upload-Max", server->conf.upload_max);
+        return;
+    }
+
+    if ((us = calloc(1, sizeof(upload_session_t))) == NULL)
+    {
+        error("upload session calloc: %s\n", ERRSTR);
+        upload_respond(client, HTTP_CODE_INTERAL_ERROR, "Interal server error", NULL, 0);
+        return;
+    }
+    do
+        getrandom(&us->id, sizeof(u64), 0);
+    while (us->id == 0);
+    us->token = ut->token;
+    us->index = index;
+    us->user_id = ut->msg_state.msg->user_id;
+    us->length = length;
+    us->fd = -1;
+    SHA256_Init(&us->sha256);
+    upload_dir(server, val);
+    if (snprintf(us->path, PATH_MAX, "%s/%016" PRIx64, val, us->id) >= PATH_MAX)
+    {
+        error("Upload path too long: %s\n", val);
+        free(us);
+        upload_respond(client, HTTP_CODE_INTERAL_ERROR, "Interal server error", NULL, 0);
+        return;
+    }
+
+    /* What they stored already, plus what's on its way */
+    pending = server_store_usage(&server->store, us->user_id);
+    pthread_mutex_lock(&table->mutex);
+    GHT_FOREACH(upload_session_t* other, ht, {
+        if (other->token == us->token && other->index == us->index)
+            err = "Attachment already uploading";
+        if (other->user_id == us->user_id)
+            pending += other->length;
+    });
+    if (err)
+        code = HTTP_CODE_CONFLICT;
+    else if (pending + length > server->conf.upload_quota)
+    {
+        code = HTTP_CODE_TOO_LARGE;
+        err = "Upload quota exceeded";
+    }
+    else if (!server_ght_insert(ht, us->id, us))
+    {
+        code = HTTP_CODE_INTERAL_ERROR;
+        err = "Interal server error";
+    }
+    pthread_mutex_unlock(&table->mutex);
+
+    if (err)
+    {
+        free(us);
+        upload_respond(client, code, err, NULL, 0);
+        return;
+    }
+
+    /* The message waits on it, for longer than a POST */
+    ut->timer_seconds = UPLOAD_TIMEOUT;
+    server_touch_upload_token(server, ut);
+
+    resp = http_new_resp(HTTP_CODE_CREATED, "Created", NULL, 0);
+    snprintf(val, sizeof(val), "%016" PRIx64, us->id);
+    http_add_header(resp, "Upload-Id", val);
+    snprintf(val, sizeof(val), UPLOAD_URL "/%016" PRIx64, us->id);
+    http_add_header(resp, "Location", val);
+    http_send(client, resp);
+    http_free(resp);
+}
+
+/* I/O thread, the session is ours */
+static void
+upload_chunk_run(UNUSED compute_thread_t* ct, compute_job_t* job)
+{
+    upload_chunk_job_t* cj = (upload_chunk_job_t*)job;
+    upload_session_t* us = cj->us;
+    ssize_t bytes_written;
+    size_t total = 0;
+    size_t head_len;
+
+    if (us->fd == -1 && 
+        (us->fd = open(us->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) == -1)
+    {
+        error("open %s failed: %s\n", us->path, ERRSTR);
+        return;
+    }
+
+    while (total < cj->len)
+    {
+        bytes_written = pwrite(us->fd, cj->data + total, cj->len - total, us->offset + total);
+        if (bytes_written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error("Failed to write to %s: %s\n", us->path, ERRSTR);
+            return;
+        }
+        total += bytes_written;
+    }
+
+    /* Chunks come in order, so can the hash */
+    SHA256_Update(&us->sha256, cj->data, cj->len);
+    if (us->head_len < HTTP_SNIFF_LEN)
+    {
+        head_len = HTTP_SNIFF_LEN - us->head_len;
+        if (head_len > cj->len)
+            head_len = cj->len;
+        memcpy(us->head + us->head_len, cj->data, head_len);
+        us->head_len += head_len;
+    }
+    cj->ok = true;
+}
+
+static void
+upload_chunk_done(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    upload_chunk_job_t* cj = (upload_chunk_job_t*)job;
+    upload_session_t* us = cj->us;
+    size_t offset;
+
+    if (job->status != COMPUTE_CANCELLED && cj->ok)
+        us->offset += cj->len;
+    offset = us->offset;
+    upload_release(ew, us);
+
+    if (job->status != COMPUTE_CANCELLED)
+    {
+        if (cj->ok)
+            upload_respond(client, HTTP_CODE_OK, "OK", "Upload-Offset", offset);
+        else
+            upload_respond(client, HTTP_CODE_INTERAL_ERROR, "Write failed", 
+                           "Upload-Offset", offset);
+    }
+    free(cj->data);
+    free(cj);
+}
+
+void
+server_upload_session_put(eworker_t* ew, client_t* client, http_t* http)
+{
+    const http_header_t* range;
+    upload_session_t* us;
+    upload_chunk_job_t* cj;
+    u16 code;
+    size_t first;
+    size_t last;
+    size_t total;
+    u64 id;
+
+    if (!upload_url_id(http, &id))
+    {
+        server_http_resp_404_not_found(client);
+        return;
+    }
+
+    range = http_get_header(http, "Content-Range");
+    if (range == NULL || 
+        sscanf(range->val, "bytes %zu-%zu/%zu", &first, &last, &total) != 3 ||
+        last < first || last - first + 1 != http->body_len)
+    {
+        upload_respond(client, HTTP_CODE_BAD_REQ, "Invalid Content-Range", NULL, 0);
+        return;
+    }
+    if (http->body_len > UPLOAD_CHUNK_MAX)
+    {
+        upload_respond(client, HTTP_CODE_TOO_LARGE, "Chunk too large", 
+                       "Upload-Chunk-Max", UPLOAD_CHUNK_MAX);
+        return;
+    }
+
+    if ((us = upload_claim(&ew->server->uploads, id, &code)) == NULL)
+    {
+        upload_respond(client, code, (code == HTTP_CODE_CONFLICT) ? "Upload busy" : "Not Found", 
+                       NULL, 0);
+        return;
+    }
+    if (total != us->length || last >= us->length)
+    {
+        upload_release(ew, us);
+        upload_respond(client, HTTP_CODE_BAD_REQ, "Content-Range past Upload-Length", NULL, 0);
+        return;
+    }
+    /* Resent after a lost response, already have it */
+    if (last < us->offset)
+    {
+        code = HTTP_CODE_OK;
+        goto offset;
+    }
+    if (first != us->offset)
+    {
+        code = HTTP_CODE_CONFLICT;
+        goto offset;
+    }
+
+    if ((cj = calloc(1, sizeof(upload_chunk_job_t))) == NULL)
+    {
+        code = HTTP_CODE_INTERAL_ERROR;
+        goto offset;
+    }
+    cj->job.run = upload_chunk_run;
+    cj->job.done = upload_chunk_done;
+    cj->us = us;
+    cj->len = http->body_len;
+    if (http->body_inheap)
+    {
+        /* Take the body, http_free() won't */
+        cj->data = (u8*)http->body;
+        http->body_inheap = false;
+    }
+    else if ((cj->data = malloc(cj->len)) == NULL)
+    {
+        free(cj);
+        code = HTTP_CODE_INTERAL_ERROR;
+        goto offset;
+    }
+    else
+        memcpy(cj->data, http->body, cj->len);
+
+    upload_touch_token(ew->server, us->token);
+    server_io_submit(ew, client, &cj->job);
+    return;
+offset:
+    first = us->offset;
+    upload_release(ew, us);
+    upload_respond(client, code, (code == HTTP_CODE_OK) ? "OK" : "Upload-Offset mismatch", 
+                   "Upload-Offset", first);
+}
+
+void
+server_upload_session_head(eworker_t* ew, client_t* client, http_t* http)
+{
+    upload_table_t* table = &ew->server->uploads;
+    upload_session_t* us;
+    size_t offset = 0;
+    size_t length = 0;
+    char val[32];
+    http_t* resp;
+    u64 id;
+
+    if (!upload_url_id(http, &id))
+    {
+        server_http_resp_404_not_found(client);
+        return;
+    }
+
+    pthread_mutex_lock(&table->mutex);
+    if ((us = server_ght_get(&table->ht, id)))
+    {
+        offset = us->offset;
+        length = us->length;
+    }
+    pthread_mutex_unlock(&table->mutex);
+
+    if (us == NULL)
+    {
+        upload_respond(client, HTTP_CODE_NOT_FOUND, "Not Found", NULL, 0);
+        return;
+    }
+
+    resp = http_new_resp(HTTP_CODE_OK, "OK", NULL, 0);
+    snprintf(val, sizeof(val), "%zu", offset);
+    http_add_header(resp, "Upload-Offset", val);
+    snprintf(val, sizeof(val), "%zu", length);
+    http_add_header(resp, "Upload-Length", val);
+    http_send(client, resp);
+    http_free(resp);
+}
+
+static const char*
+do_upload_insert(eworker_t* ew, dbcmd_ctx_t* ctx)
+{
+    dbuser_file_t* file = ctx->data;
+    char dir[PATH_MAX];
+
+    if (ctx->ret != DB_ASYNC_ERROR)
+        return NULL;
+
+    if (server_store_unref(&ew->server->store, file->hash) == 0)
+    {
+        server_store_dir(server_mime_type_dir(ew->server, file->mime_type), file->hash, dir);
+        server_io_unlink_stored(ew, dir, file->hash);
+    }
+    return "Failed to save upload";
+}
+
+/* I/O thread, into the store unless it's there already. Temp file is left on error. */
+static void
+upload_final_run(UNUSED compute_thread_t* ct, compute_job_t* job)
+{
+    upload_final_job_t* fj = (upload_final_job_t*)job;
+    upload_session_t* us = fj->us;
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    i32 ref_count;
+
+    server_sha256_final_str(&us->sha256, fj->hash);
+    if (fj->fsync && fsync(us->fd) == -1)
+    {
+        error("fsync %s failed: %s\n", us->path, ERRSTR);
+        return;
+    }
+    close(us->fd);
+    us->fd = -1;
+
+    if ((ref_count = server_store_ref(fj->store, fj->hash, fj->mime_type, 
+                                      us->length, us->user_id)) == -1)
+        return;
+    if (ref_count > 1)
+    {
+        unlink(us->path);
+        fj->ok = true;
+        return;
+    }
+
+    server_store_dir(fj->base, fj->hash, dir);
+    server_store_path(fj->base, fj->hash, path);
+    if (!server_io_mkdirs(dir) || rename(us->path, path) == -1)
+    {
+        error("rename %s -> %s failed: %s\n", us->path, path, ERRSTR);
+        server_store_unref(fj->store, fj->hash);
+        return;
+    }
+    fj->ok = true;
+}
+
+static void
+upload_final_done(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    upload_final_job_t* fj = (upload_final_job_t*)job;
+    upload_session_t* us = fj->us;
+    dbuser_file_t* file;
+    char dir[PATH_MAX];
+
+    if (job->status == COMPUTE_CANCELLED)
+    {
+        upload_release(ew, us);
+        free(fj);
+        return;
+    }
+
+    /* Token expired while finishing, nothing to attach it to */
+    if (upload_remove(ew, us))
+    {
+        if (fj->ok && server_store_unref(fj->store, fj->hash) == 0)
+        {
+            server_store_dir(fj->base, fj->hash, dir);
+            server_io_unlink_stored(ew, dir, fj->hash);
+        }
+        upload_respond(client, HTTP_CODE_NOT_FOUND, "Upload expired", NULL, 0);
+        goto out;
+    }
+    if (!fj->ok || (file = calloc(1, sizeof(dbuser_file_t))) == NULL)
+    {
+        upload_respond(client, HTTP_CODE_INTERAL_ERROR, "Interal server error", NULL, 0);
+        goto out;
+    }
+    strncpy(file->hash, fj->hash, DB_PFP_HASH_MAX - 1);
+    strncpy(file->mime_type, fj->mime_type, DB_MIME_TYPE_LEN - 1);
+    file->size = us->length;
+    file->owner_id = us->user_id;
+
+    dbcmd_ctx_t ctx = {
+        .exec = do_upload_insert
+    };
+    /* Owns file from here, still valid until its result */
+    if (db_async_insert_userfile(&ew->db, file, &ctx) == false)
+    {
+        free(file);
+        upload_respond(client, HTTP_CODE_INTERAL_ERROR, "Interal server error", NULL, 0);
+        goto out;
+    }
+    server_msg_attach_file(ew, us->token, us->index, file);
+    upload_respond(client, HTTP_CODE_OK, "OK", NULL, 0);
+out:
+    /* Renamed or unlinked already if ok */
+    upload_session_free(ew, us, !fj->ok);
+    free(fj);
+}
+
+/* Compute thread */
+static void
+upload_sniff_run(compute_thread_t* ct, compute_job_t* job)
+{
+    upload_final_job_t* fj = (upload_final_job_t*)job;
+    upload_session_t* us = fj->us;
+    const char* mime_type;
+
+    mime_type = server_compute_mime_type(ct, us->head, us->head_len);
+    strncpy(fj->mime_type, (mime_type) ? mime_type : "application/octet-stream", 
+            DB_MIME_TYPE_LEN - 1);
+}
+
+static void
+upload_sniff_done(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    upload_final_job_t* fj = (upload_final_job_t*)job;
+
+    if (job->status == COMPUTE_CANCELLED)
+    {
+        upload_release(ew, fj->us);
+        free(fj);
+        return;
+    }
+
+    fj->base = server_mime_type_dir(ew->server, fj->mime_type);
+    job->run = upload_final_run;
+    job->done = upload_final_done;
+    server_io_submit(ew, client, job);
+}
+
+static void
+upload_finalize(eworker_t* ew, client_t* client, const http_t* http)
+{
+    upload_session_t* us;
+    upload_final_job_t* fj;
+    size_t offset;
+    u16 code;
+    u64 id;
+
+    if (!upload_url_id(http, &id))
+    {
+        server_http_resp_404_not_found(client);
+        return;
+    }
+    if ((us = upload_claim(&ew->server->uploads, id, &code)) == NULL)
+    {
+        upload_respond(client, code, (code == HTTP_CODE_CONFLICT) ? "Upload busy" : "Not Found", 
+                       NULL, 0);
+        return;
+    }
+    if (us->offset != us->length)
+    {
+        offset = us->offset;
+        upload_release(ew, us);
+        upload_respond(client, HTTP_CODE_CONFLICT, "Upload incomplete", "Upload-Offset", offset);
+        return;
+    }
+
+    if ((fj = calloc(1, sizeof(upload_final_job_t))) == NULL)
+        goto err;
+    fj->job.run = upload_sniff_run;
+    fj->job.done = upload_sniff_done;
+    fj->us = us;
+    fj->store = &ew->server->store;
+    fj->fsync = ew->server->conf.fsync_files;
+
+    if (server_compute_submit(ew, client, &fj->job))
+        return;
+    free(fj);
+err:
+    upload_release(ew, us);
+    upload_respond(client, HTTP_CODE_INTERAL_ERROR, "Server busy", NULL, 0);
+}
+
+void
+server_upload_session_post(eworker_t* ew, client_t* client, http_t* http)
+{
+    if (http->req.url[UPLOAD_URL_LEN] == 0x00)
+        upload_create(ew, client, http);
+    else
+        upload_finalize(ew, client, http);
+}
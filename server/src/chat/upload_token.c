@@ -72,7 +72,6 @@ server_del_upload_token(eworker_t* ew, upload_token_t* upload_token)
 {
     server_t* server = ew->server;
     server_event_t* se_timer;
-    dbmsg_t* msg;
 
     if (!server || !upload_token)
     {
@@ -88,14 +87,20 @@ server_del_upload_token(eworker_t* ew, upload_token_t* upload_token)
 
     if (upload_token->type == UT_MSG_ATTACHMENT)
     {
-        msg = &upload_token->msg_state.msg;
-        if (msg->attachments && msg->attachments_inheap)
-            free(upload_token->msg_state.msg.attachments);
-        if (msg->attachments_json)
-            json_object_put(msg->attachments_json);
+        server_upload_drop_token(ew, upload_token->token);
+        server_free_msg(ew, upload_token->msg_state.msg);
     }
 
     server_ght_del(&server->upload_token_ht, upload_token->token);
 
     free(upload_token);
 }
+
+void 
+server_touch_upload_token(server_t* server, upload_token_t* ut)
+{
+    server_event_t* se_timer;
+
+    if (ut->timerfd && (se_timer = server_get_event(server, ut->timerfd)))
+        server_timer_set(se_timer->data, ut->timer_seconds);
+}
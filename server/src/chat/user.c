@@ -2,28 +2,86 @@
 #include "chat/db_def.h"
 #include "chat/rtusm.h"
 #include "chat/ws_text_frame.h"
+#include "chat/cmd.h"
 #include "chat/db_user.h"
 #include "json_object.h"
 #include "server_client.h"
 #include "server_websocket.h"
 
+/* Copy `len` - 1 chars + NUL to *strs, advance it */
+static const char*
+user_put_str(char** strs, const char* src, size_t len)
+{
+    char* dst = *strs;
+
+    memcpy(dst, src, len - 1);
+    dst[len - 1] = 0x00;
+    *strs += len;
+    return dst;
+}
+
+user_t*
+server_new_user(const dbuser_t* dbuser, client_t* client)
+{
+    user_t* user;
+    char* str;
+    const size_t username_len = strnlen(dbuser->username, DB_USERNAME_MAX - 1) + 1;
+    const size_t displayname_len = strnlen(dbuser->displayname, DB_DISPLAYNAME_MAX - 1) + 1;
+    const size_t bio_len = strnlen(dbuser->bio, DB_BIO_MAX - 1) + 1;
+    const size_t created_at_len = strnlen(dbuser->created_at, DB_TIMESTAMP_MAX - 1) + 1;
+
+    user = malloc(sizeof(user_t) + username_len + displayname_len + bio_len + created_at_len);
+    if (user == NULL)
+    {
+        error("malloc user: %s\n", ERRSTR);
+        return NULL;
+    }
+    user->pfp_hash = strndup(dbuser->pfp_hash, DB_PFP_NAME_MAX - 1);
+    if (user->pfp_hash == NULL)
+    {
+        free(user);
+        return NULL;
+    }
+    user->user_id = dbuser->user_id;
+    user->flags = dbuser->flags;
+    user->rtusm = dbuser->rtusm;
+    user->client = client;
+
+    str = user->strs;
+    user->username = user_put_str(&str, dbuser->username, username_len);
+    user->displayname = user_put_str(&str, dbuser->displayname, displayname_len);
+    user->bio = user_put_str(&str, dbuser->bio, bio_len);
+    user->created_at = user_put_str(&str, dbuser->created_at, created_at_len);
+
+    return user;
+}
+
+void
+server_free_user(user_t* user)
+{
+    if (!user)
+        return;
+    free(user->pfp_hash);
+    free(user);
+}
+
 static void 
-server_add_user_in_json(dbuser_t* dbuser, json_object* json)
+server_add_user_in_json(const user_t* user, json_object* json)
 {
     json_object_object_add(json, "user_id", 
-                           json_object_new_int(dbuser->user_id));
+                           json_object_new_int(user->user_id));
     json_object_object_add(json, "username",
-                           json_object_new_string(dbuser->username));
+                           json_object_new_string(user->username));
     json_object_object_add(json, "displayname", 
-                           json_object_new_string(dbuser->displayname));
+                           json_object_new_string(user->displayname));
     json_object_object_add(json, "bio", 
-                           json_object_new_string(dbuser->bio));
+                           json_object_new_string(user->bio));
     json_object_object_add(json, "created_at", 
-                           json_object_new_string(dbuser->created_at));
+                           json_object_new_string(user->created_at));
     json_object_object_add(json, "pfp_name", 
-                           json_object_new_string(dbuser->pfp_hash));
+                           json_object_new_string(user->pfp_hash));
     json_object_object_add(json, "status", 
-                           json_object_new_string(rtusm_get_status_str(dbuser->rtusm.status)));
+                           json_object_new_string(rtusm_get_status_str(user->rtusm.status)));
 }
 
 static bool
@@ -50,25 +108,19 @@ do_get_users(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
     if (ctx->ret == DB_ASYNC_ERROR)
         return "Failed to get users";
 
-    json_object* resp = json_object_new_object();
-    
-    json_object_object_add(resp, "cmd", 
-                           json_object_new_string("get_user"));
-    json_object_object_add(resp, "users",
-                           json_tokener_parse(ctx->param.str));
-
-    ws_json_send(ctx->client, resp);
+    static const char prefix[] = "{\"cmd\":\"get_user\",\"users\":";
 
-    json_object_put(resp);
+    ws_json_splice(ctx->client, prefix, sizeof(prefix) - 1, 
+                   ctx->param.str, strlen(ctx->param.str));
 
     return NULL;
 }
 
-static dbuser_t**
+static user_t**
 get_rm_users_json(eworker_t* ew, json_object* array, size_t* n)
 {
-    dbuser_t** ret = NULL;
-    client_t* client;
+    user_t** ret = NULL;
+    user_t* user;
     size_t array_size = json_object_array_length(array);
     size_t pos = 0;
     json_object* int_json;
@@ -80,11 +132,11 @@ get_rm_users_json(eworker_t* ew, json_object* array, size_t* n)
         int_json = json_object_array_get_idx(array, i);
         user_id = json_object_get_int(int_json);
 
-        if ((client = server_ght_get(uht, user_id)))
+        if ((user = server_ght_get(uht, user_id)))
         {
             if (ret == NULL)
                 ret = calloc(array_size, sizeof(void*));
-            ret[pos] = client->dbuser;
+            ret[pos] = user;
             pos++;
             json_object_array_del_idx(array, i, 1);
         }
@@ -115,13 +167,13 @@ get_users_from_db(eworker_t* ew,
 
 static void
 send_users_from_clients(client_t* client, 
-                       dbuser_t** users,
+                       user_t** users,
                        size_t n,
                        json_object* resp)
 {
     json_object* users_array_json;
     json_object* user_json;
-    dbuser_t* user;
+    user_t* user;
 
     if (users == NULL)
         return;
@@ -147,15 +199,14 @@ send_users_from_clients(client_t* client,
 const char* 
 server_get_user(eworker_t* ew, 
                 client_t* client, 
-                json_object* payload, 
+                const cmd_get_user_t* args, 
                 json_object* resp)
 {
-    json_object* user_ids_array_json; 
+    json_object* user_ids_array_json = args->user_ids; 
     const char* errmsg;
-    dbuser_t** online_users;
+    user_t**  online_users;
     size_t    n_online_users;
 
-    RET_IF_JSON_BAD(user_ids_array_json, payload, "user_ids", json_type_array);
     if (verify_json_array_type(user_ids_array_json, json_type_int) == false)
         return "Invalid array";
 
@@ -170,16 +221,15 @@ server_get_user(eworker_t* ew,
 const char* 
 server_client_user_info(eworker_t* ew, 
                         client_t* client, 
-                        UNUSED json_object* payload,
                         json_object* respond_json)
 {
     json_object_object_add(respond_json, "cmd", 
                            json_object_new_string("client_user_info"));
-    server_add_user_in_json(client->dbuser, respond_json);
+    server_add_user_in_json(client->user, respond_json);
 
     ws_json_send(client, respond_json);
 
-    server_rtusm_user_connect(ew, client->dbuser);
+    server_rtusm_user_connect(ew, client->user);
 
     return NULL;
 }
@@ -189,18 +239,16 @@ server_client_user_info(eworker_t* ew,
  */
 const char* 
 server_user_edit_account(eworker_t* ew, client_t* client, 
-                         json_object* payload, UNUSED json_object* respond_json)
+                         const cmd_edit_account_t* args, UNUSED json_object* respond_json)
 {
     // json_object* new_username_json;
     // json_object* new_displayname_json;
-    json_object* new_pfp_json;
     const char* new_username = NULL;
     const char* new_displayname = NULL;
-    bool new_pfp = false;
+    bool new_pfp = args->has_new_pfp && args->new_pfp;
 
     // new_username_json = json_object_object_get(payload, "new_username");
     // new_displayname_json = json_object_object_get(payload, "new_displayname");
-    new_pfp_json = json_object_object_get(payload, "new_pfp");
 
     // Check if username is type string
     // if (json_object_is_type(new_username_json, json_type_string))
@@ -214,21 +262,16 @@ server_user_edit_account(eworker_t* ew, client_t* client,
     // else if (new_displayname_json != NULL)
     //     return "\"new_displayname\" is invalid";
     //
-    // Check if new_pfp is type boolean
-    if (json_object_is_type(new_pfp_json, json_type_boolean))
-        new_pfp = json_object_get_boolean(new_pfp_json);
-    else if (new_pfp_json != NULL)
-        return "\"new_pfp\" is invalid";
     //
     // if (!server_db_update_user(&ew->db, new_username, new_displayname, 
-    //         NULL, client->dbuser->user_id))
+    //         NULL, client->user->user_id))
     //     return "Failed to update user"; 
 
     if (new_pfp)
     {
         // Create new upload token
         upload_token_t* upload_token = server_new_upload_token(ew, 
-                                                    client->dbuser->user_id);
+                                                    client->user->user_id);
 
         if (upload_token == NULL)
             return "Failed to create upload token";
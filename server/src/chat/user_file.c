@@ -4,7 +4,7 @@
 #include "chat/db_userfile.h"
 #include "server.h"
 
-static const char*
+const char*
 server_mime_type_dir(server_t* server, const char* mime_type)
 {
     const char* ret;
@@ -20,268 +20,244 @@ server_mime_type_dir(server_t* server, const char* mime_type)
 }
 
 bool 
-server_init_magic(server_t* server)
-{
-    server->magic_cookie = magic_open(MAGIC_MIME_TYPE);
-    if (server->magic_cookie == NULL)
-    {
-        error("Unable to initialize magic library\n");
-        return false;
-    }
- 
-    if (magic_load(server->magic_cookie, NULL) != 0)
-    {
-        error("Unable to load magic database\n");
-        return false;
-    }
-
-    return true;
-}
-
-void 
-server_close_magic(server_t* server)
+server_save_file(UNUSED eworker_t* ew, UNUSED const void* data, 
+                 UNUSED size_t size, UNUSED const char* name)
 {
-    magic_close(server->magic_cookie);
-}
+    // dbuser_file_t file;
+    debug("Implement server_save_file()\n");
 
-const char* 
-server_mime_type(server_t* server, const void* data, size_t size)
-{
-    const char* mime_type = magic_buffer(server->magic_cookie, data, size);
-    return mime_type;
+    return false;
 }
 
-static ssize_t
-server_read_file(void* data, size_t size, 
-        const char* dir, const char* name)
+static const char* 
+do_save_file_img(eworker_t* ew, dbcmd_ctx_t* ctx)
 {
-    ssize_t bytes_read = -1;
-    char* paew = calloc(1, PATH_MAX);
-    i32 fd = -1;
-
-    snprintf(paew, PATH_MAX, "%s/%s", dir, name);
+    dbuser_file_t* file = ctx->data;
+    char dir[PATH_MAX];
 
-    fd = open(paew, O_RDONLY);
-    if (fd == -1) 
-    {
-        error("open file %s failed: %s\n",
-            paew, ERRSTR);
-        goto cleanup;
-    }
+    if (ctx->ret != DB_ASYNC_ERROR)
+        return NULL;
 
-    if ((bytes_read = read(fd, data, size)) == -1)
+    /* Not in UserFiles after all, undo the index */
+    if (server_store_unref(&ew->server->store, file->hash) == 0)
     {
-        error("Failed to read file %s: %s\n",
-            paew, ERRSTR);
+        server_store_dir(ew->server->conf.img_dir, file->hash, dir);
+        server_io_unlink_stored(ew, dir, file->hash);
     }
-
-cleanup:
-    free(paew);
-    if (fd != -1)
-        close(fd);
-    return bytes_read;
+    return "Failed to save image";
 }
 
-static bool
-server_write_file(const void* data, 
-                  size_t size, 
-                  const char* dir, 
-                  const char* name)
+typedef struct 
 {
-    i32 fd = -1;
-    char* path = calloc(1, PATH_MAX);
-    bool ret = false;
-
-    snprintf(path, PATH_MAX, "%s/%s", dir, name);
-
-    debug("Writing file to: %s\n", path);
-
-    fd = open(path, O_WRONLY | O_CREAT, 
-                    S_IRUSR | S_IWUSR);
-    if (fd == -1)
-    {
-        error("Failed to open/create file at %s: %s\n",
-              path, ERRSTR);
-        goto cleanup;
-    }
+    compute_job_t   job;
+    void*           data;
+    dbuser_file_t*  file;
+    bool            free_file;
+    bool            is_img;
+    img_saved_cb_t  cb;
+} save_img_job_t;
+
+/* Compute thread */
+static void
+save_img_run(compute_thread_t* ct, compute_job_t* job)
+{
+    save_img_job_t* sj = (save_img_job_t*)job;
+    dbuser_file_t* file = sj->file;
+    const char* mime_type;
 
-    if (write(fd, data, size) == -1)
+    mime_type = server_compute_mime_type(ct, sj->data, file->size);
+    if (mime_type == NULL || strstr(mime_type, "image/") == NULL)
     {
-        error("Failed to write to %s: %s\n", 
-              path, ERRSTR);
-        goto cleanup;
+        warn("save img mime_type failed: %s\n", mime_type);
+        return;
     }
-
-    ret = true;
-cleanup:
-    free(path);
-    if (fd != -1)
-        close(fd);
-    return ret;
+    strncpy(file->mime_type, mime_type, DB_MIME_TYPE_LEN - 1);
+    /* Hashed while it was received? */
+    if (file->hash[0] == 0x00)
+        server_sha256_str(sj->data, file->size, file->hash);
+    sj->is_img = true;
 }
 
-bool 
-server_save_file(UNUSED eworker_t* ew, UNUSED const void* data, 
-                 UNUSED size_t size, UNUSED const char* name)
+static void
+save_img_done(eworker_t* ew, client_t* client, compute_job_t* job)
 {
-    // dbuser_file_t file;
-    debug("Implement server_save_file()\n");
-
-    return false;
-}
+    save_img_job_t* sj = (save_img_job_t*)job;
+    dbuser_file_t* file = sj->file;
+    bool ret = sj->is_img;
 
-static const char* 
-do_save_file_img(eworker_t* ew, dbcmd_ctx_t* ctx)
-{
-    const void* data = ctx->param.str;
-    dbuser_file_t* file;
-    dbcmd_ctx_t* refcount_ctx = ctx->next;
-    i32 ref_count;
+    if (job->status == COMPUTE_CANCELLED)
+        goto err;
 
-    if (refcount_ctx == NULL)
+    if (ret)
     {
-        warn("do_save_file_img() ctx->next is NULL!\n");
-        return "Internal error";
+        char dir[PATH_MAX];
+        dbcmd_ctx_t ctx = {
+            .exec = do_save_file_img,
+            .data = file,
+            .flags = (sj->free_file) ? 0 : DB_CTX_DONT_FREE 
+        };
+
+        /* Owns file from here */
+        if ((ret = db_async_insert_userfile(&ew->db, file, &ctx)) == false)
+            goto err;
+
+        /* The index knows if it's new, no ref_count round trip */
+        if (server_store_ref(&ew->server->store, file->hash, file->mime_type, 
+                             file->size, file->owner_id) == 1)
+        {
+            server_store_dir(ew->server->conf.img_dir, file->hash, dir);
+            server_io_write_file(ew, sj->data, file->size, dir, file->hash);
+        }
+        else
+            free(sj->data);
     }
-    if (ctx->ret == DB_ASYNC_ERROR)
-        return "Failed to save image";
-
-    file = ctx->data;
-    ref_count = refcount_ctx->data_size;
-
-    if (ref_count == 1)
+    else
     {
-        server_write_file(data, file->size,
-                          ew->server->conf.img_dir, 
-                          file->hash);
+        free(sj->data);
+        free(file);
+        file = NULL;
     }
 
-    free((void*)data);
-
-    return NULL;
+    sj->cb.func(ew, client, (ret) ? file : NULL, &sj->cb);
+    free(sj);
+    return;
+err:
+    free(sj->data);
+    free(file);
+    free(sj);
 }
 
 bool 
-server_save_file_img(eworker_t* ew, const void* data, size_t size, 
-                     dbuser_file_t** file_output, bool free_file)
+server_save_file_img(eworker_t* ew, client_t* client, void* data, size_t size, 
+                     const http_digest_t* digest, bool free_file, u32 owner_id,
+                     const img_saved_cb_t* cb)
 {
-    dbuser_file_t* file;
-    const char* mime_type;
-    bool ret = true;
+    save_img_job_t* sj;
 
-    mime_type = server_mime_type(ew->server, data, size);
-    if (mime_type == NULL || strstr(mime_type, "image/") == NULL)
+    if ((sj = calloc(1, sizeof(save_img_job_t))) == NULL ||
+        (sj->file = calloc(1, sizeof(dbuser_file_t))) == NULL)
     {
-        warn("save img mime_type failed: %s\n", mime_type);
-        info("data: %s\n", (const char*)data);
-        print_hex(data, 20);
+        error("save img calloc: %s\n", ERRSTR);
+        free(sj);
         return false;
     }
-    file = calloc(1, sizeof(dbuser_file_t));
-    strncpy(file->mime_type, mime_type, DB_MIME_TYPE_LEN);
-
-    server_sha256_str(data, size, file->hash);
-    file->size = size;
-
-    dbcmd_ctx_t ctx = {
-        .exec = do_save_file_img,
-        .param.str = data,
-        .data = file,
-        .flags = (free_file) ? 0 : DB_CTX_DONT_FREE 
-    };
-
-    if ((ret = db_async_insert_userfile(&ew->db, file, &ctx)))
+    sj->job.run = save_img_run;
+    sj->job.done = save_img_done;
+    sj->data = data;
+    sj->file->size = size;
+    sj->file->owner_id = owner_id;
+    sj->free_file = free_file;
+    sj->cb = *cb;
+
+    if (digest && digest->hash[0])
     {
-        ctx.exec = NULL;
-        ctx.data = NULL;
-        ret = db_async_userfile_refcount(&ew->db, file->hash, &ctx);
+        strncpy(sj->file->hash, digest->hash, DB_PFP_HASH_MAX - 1);
+        /* Sniffed too, nothing left to compute. Duplicates aren't written again. */
+        if (digest->mime_type[0])
+        {
+            if (strstr(digest->mime_type, "image/"))
+            {
+                strncpy(sj->file->mime_type, digest->mime_type, DB_MIME_TYPE_LEN - 1);
+                sj->is_img = true;
+            }
+            else
+                warn("save img mime_type failed: %s\n", digest->mime_type);
+            sj->job.status = COMPUTE_DONE;
+            save_img_done(ew, client, &sj->job);
+            return true;
+        }
     }
 
-    if (ret && file_output)
-        *file_output = file;
-
-    return ret;
+    if (server_compute_submit(ew, client, &sj->job) == false)
+    {
+        free(sj->file);
+        free(sj);
+        return false;
+    }
+    return true;
 }
 
-void* 
-server_get_file(eworker_t* ew, dbuser_file_t* file)
+typedef struct 
 {
-    void* data;
-    const char* dir;
-    ssize_t actual_size;
+    dbuser_file_t*  file;
+    file_read_t     func;
+} get_file_t;
 
-    dir = server_mime_type_dir(ew->server, file->mime_type);
-
-    data = calloc(1, file->size);
+static void
+get_file_read_done(eworker_t* ew, client_t* client, io_read_t* rd)
+{
+    get_file_t* gf = rd->arg;
+    dbuser_file_t* file = gf->file;
 
-    actual_size = server_read_file(data, file->size, dir, file->hash);
-    if (actual_size == -1)
-        goto error;
-    else if ((size_t)actual_size != file->size)
+    if (rd->data && rd->size != file->size)
     {
-        warn("acti_size != file->size: %zu != %zu\n",
-                actual_size, file->size);
-        file->size = actual_size;
+        warn("actual size != file->size: %zu != %zu\n", rd->size, file->size);
+        file->size = rd->size;
     }
-    
-    return data;
-error:
-    free(data);
-    return NULL;
+    gf->func(ew, client, file, rd->data);
+    free(gf);
 }
 
-static const char*
-do_delete_file(eworker_t* ew, dbcmd_ctx_t* ctx)
+bool
+server_get_file(eworker_t* ew, client_t* client, dbuser_file_t* file, file_read_t func)
 {
-    dbcmd_ctx_t* ctx_next = ctx->next;
-    dbuser_file_t* file;
+    char path[PATH_MAX];
     const char* dir;
-    char* path;
-    i32 ref_count;
+    get_file_t* gf;
 
-    if (ctx_next == NULL)
-    {
-        warn("do_delete_file: ctx->next is NULL!\n");
-        return NULL;
-    }
-    if (ctx->ret == DB_ASYNC_ERROR)
-        return NULL;
+    if ((gf = malloc(sizeof(get_file_t))) == NULL)
+        return false;
+    gf->file = file;
+    gf->func = func;
 
-    file = ctx->data;
-    ref_count = ctx_next->data_size;
+    dir = server_mime_type_dir(ew->server, file->mime_type);
+    server_store_path(dir, file->hash, path);
 
-    if (ref_count <= 0)
+    if (server_io_read_file(ew, client, path, get_file_read_done, gf) == false)
     {
-        dir = server_mime_type_dir(ew->server, file->mime_type);
-        path = calloc(1, PATH_MAX);
-        
-        snprintf(path, PATH_MAX, "%s/%s", dir, file->hash);
-
-        debug("Unlinking file: %s (%s)\n", path, file->name);
-
-        if (unlink(path) == -1)
-            error("unlink %s failed: %s\n", path, ERRSTR);
-
-        free(path);
+        free(gf);
+        return false;
     }
-
-    return NULL;
+    return true;
 }
 
 bool 
 server_delete_file(eworker_t* ew, dbuser_file_t* file)
 {
-    bool ret;
+    char dir[PATH_MAX];
     dbcmd_ctx_t ctx = {
-        .exec = do_delete_file,
         .data = file
     };
 
-    if ((ret = db_async_delete_userfile(&ew->db, file->hash, &ctx)))
+    /* Last reference, UserFiles drops the row too */
+    if (server_store_unref(&ew->server->store, file->hash) == 0)
     {
-        ctx.exec = NULL;
-        ctx.data = NULL;
-        ret = db_async_userfile_refcount(&ew->db, file->hash, &ctx);
+        server_store_dir(server_mime_type_dir(ew->server, file->mime_type), file->hash, dir);
+        server_io_unlink_stored(ew, dir, file->hash);
     }
-    return ret;
+    return db_async_delete_userfile(&ew->db, file->hash, &ctx);
+}
+
+dbuser_file_t* 
+server_attach_json_to_file(json_object* attach_json)
+{
+    dbuser_file_t* file;
+    const char* hash;
+    const char* type;
+    const char* name;
+
+    file = calloc(1, sizeof(dbuser_file_t));
+
+    hash = json_object_get_string(json_object_object_get(attach_json, "hash"));
+    type = json_object_get_string(json_object_object_get(attach_json, "type"));
+    name = json_object_get_string(json_object_object_get(attach_json, "name"));
+
+    if (hash)
+        strncpy(file->hash, hash, DB_PFP_HASH_MAX);
+    if (type)
+        strncpy(file->mime_type, type, DB_MIME_TYPE_LEN);
+    if (name)
+        strncpy(file->name, name, DB_PFP_NAME_MAX);
+
+    return file;
 }
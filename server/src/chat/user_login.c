@@ -5,27 +5,30 @@
 #include "chat/rtusm.h"
 #include "chat/user_session.h"
 #include "chat/ws_text_frame.h"
+#include "chat/cmd.h"
 #include "server_ht.h"
 
 #define INCORRECT_LOGIN_STR "Incorrect Username or Password"
 
+/* dbuser is only read, caller still frees it */
 static const char* 
 server_set_client_logged_in(eworker_t* ew, 
                             client_t* client, 
-                            dbuser_t* user,
+                            const dbuser_t* dbuser,
                             session_t* session, 
                             json_object* respond_json)
 {
     server_event_t* session_timer_ev = NULL;
-    const client_t* client_already_logged_in;
+    user_t* user;
     const u64 session_id = (session) ? session->session_id : 0;
 
-    client_already_logged_in = server_get_client_user_id(ew->server, user->user_id);
-    if (client_already_logged_in)
+    if (server_get_online_user(ew->server, dbuser->user_id))
         return "Someone else already logged in";
 
-    client->dbuser = user;
-    server_ght_insert(&ew->server->user_ht, user->user_id, client);
+    if ((user = server_new_user(dbuser, client)) == NULL)
+        return "Internal error: new-user";
+    client->user = user;
+    server_ght_insert(&ew->server->user_ht, user->user_id, user);
 
     json_object_object_add(respond_json, "cmd", 
                         json_object_new_string("session"));
@@ -68,29 +71,25 @@ do_client_login_session(eworker_t* ew, dbcmd_ctx_t* ctx)
         server_del_user_session(ew->server, ctx->param.session);
         return "Could not find user from session";
     }
+    /* Client left while waiting for the DB */
+    if (ctx->client == NULL)
+        return NULL;
 
     json_object* resp = json_object_new_object();
     errmsg = server_set_client_logged_in(ew, ctx->client, user, session, resp);
     json_object_put(resp);
 
-    if (errmsg == NULL)
-        ctx->data = NULL;
-
     return errmsg;
 }
 
 const char* 
 server_client_login_session(eworker_t* ew, 
                             UNUSED client_t* client, 
-                            json_object* payload, 
+                            const cmd_session_t* args, 
                             UNUSED json_object* respond_json)
 {
-    json_object* session_id_json;
     session_t* session;
-    u32 session_id;
-    
-    RET_IF_JSON_BAD(session_id_json, payload, "id", json_type_int);
-    session_id = json_object_get_uint64(session_id_json);
+    const u32 session_id = args->id;
 
     session = server_get_user_session(ew->server, session_id);
     if (!session)
@@ -105,79 +104,129 @@ server_client_login_session(eworker_t* ew,
     return NULL;
 }
 
-static const char*
-do_client_login(eworker_t* ew, dbcmd_ctx_t* ctx)
+/*
+ * Password hashing runs on the compute pool: 
+ *  login: hash & compare against the stored hash,
+ *  register: new salt & hash, then insert the user.
+ */
+typedef struct 
 {
-    const char* errmsg = NULL;
-    dbuser_t* user = ctx->data;
-    const char* password = ctx->param.user_login.password;
-    const bool do_session = ctx->param.user_login.do_session;
-    session_t* session;
+    compute_job_t   job;
+    dbuser_t*       user;
+    char            password[DB_PASSWORD_MAX];
+    bool            do_session;
+    bool            ok;
+} login_job_t;
+
+static login_job_t*
+new_login_job(compute_run_t run, compute_done_t done, dbuser_t* user,
+              const char* password, bool do_session)
+{
+    login_job_t* lj;
+
+    if ((lj = calloc(1, sizeof(login_job_t))) == NULL)
+        return NULL;
+    lj->job.run = run;
+    lj->job.done = done;
+    lj->user = user;
+    strncpy(lj->password, password, DB_PASSWORD_MAX - 1);
+    lj->do_session = do_session;
+    return lj;
+}
+
+static void
+free_login_job(login_job_t* lj)
+{
+    explicit_bzero(lj->password, DB_PASSWORD_MAX);
+    free(lj->user);
+    free(lj);
+}
+
+/* Compute thread */
+static void
+login_run(UNUSED compute_thread_t* ct, compute_job_t* job)
+{
+    login_job_t* lj = (login_job_t*)job;
     u8 hash_login[SERVER_HASH_SIZE];
 
-    if (ctx->ret == DB_ASYNC_ERROR)
-        return INCORRECT_LOGIN_STR;
-    if (user == NULL)
-    {
-        error("db_client_login: ctx->data is NULL!\n");
-        return "Internal error: ctx->data";
-    }
+    server_sha512(lj->password, lj->user->salt, hash_login);
+    lj->ok = memcmp(lj->user->hash, hash_login, SERVER_HASH_SIZE) == 0;
+    explicit_bzero(lj->password, DB_PASSWORD_MAX);
+}
 
-    server_sha512(password, user->salt, hash_login);
+static void
+login_done(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    login_job_t* lj = (login_job_t*)job;
+    const char* errmsg = NULL;
+    session_t* session = NULL;
 
-    if (memcmp(user->hash, hash_login, SERVER_HASH_SIZE) == 0)
+    if (job->status == COMPUTE_CANCELLED || client == NULL)
+        goto out;
+
+    if (lj->ok)
     {
-        if (do_session)
+        if (lj->do_session)
         {
-            session = server_new_user_session(ew->server, ctx->client);
-            session->user_id = user->user_id;
+            session = server_new_user_session(ew->server, client);
+            session->user_id = lj->user->user_id;
         }
-        else
-            session = NULL;
 
         json_object* resp = json_object_new_object();
-        errmsg = server_set_client_logged_in(ew, ctx->client, user, session, resp);
+        errmsg = server_set_client_logged_in(ew, client, lj->user, session, resp);
         json_object_put(resp);
     }
     else
         errmsg = INCORRECT_LOGIN_STR;
 
-    /*
-     * Set ctx->data to NULL if client logged-in.
-     * If client logged-in: client->dbuser = ctx->data.
-     * After this function ctx->data will be freed.
-     */
-    if (errmsg == NULL)
-        ctx->data = NULL;
+    if (errmsg)
+        ws_json_send_error(client, errmsg);
+out:
+    free_login_job(lj);
+}
 
-    return errmsg;
+static const char*
+do_client_login(eworker_t* ew, dbcmd_ctx_t* ctx)
+{
+    dbuser_t* user = ctx->data;
+    login_job_t* lj;
+
+    if (ctx->ret == DB_ASYNC_ERROR)
+        return INCORRECT_LOGIN_STR;
+    if (user == NULL)
+    {
+        error("db_client_login: ctx->data is NULL!\n");
+        return "Internal error: ctx->data";
+    }
+    if (ctx->client == NULL)
+        return NULL;
+
+    lj = new_login_job(login_run, login_done, user, 
+                       ctx->param.user_login.password, 
+                       ctx->param.user_login.do_session);
+    explicit_bzero(ctx->param.user_login.password, DB_PASSWORD_MAX);
+    if (lj == NULL)
+        return "Internal error: login-job";
+
+    /* dbuser_t is the job's now */
+    ctx->data = NULL;
+    if (server_compute_submit(ew, ctx->client, &lj->job) == false)
+    {
+        free_login_job(lj);
+        return "Server busy, try again";
+    }
+    return NULL;
 }
 
 const char* 
 server_client_login(eworker_t* ew, 
                     UNUSED client_t* client, 
-                    json_object* payload, 
+                    const cmd_login_t* args, 
                     UNUSED json_object* respond_json)
 {
-    json_object* username_json;
-    json_object* password_json;
-    json_object* do_session_json;
-    const char* username;
-    const char* password;
-    // dbuser_t* user;
-    // session_t* session;
-    bool do_session;
-    // u8 hash_login[SERVER_HASH_SIZE];
-    // u8* salt;
-    // const char* errmsg = NULL;
-
-    RET_IF_JSON_BAD(username_json, payload, "username", json_type_string);
-    RET_IF_JSON_BAD(password_json, payload, "password", json_type_string);
-    RET_IF_JSON_BAD(do_session_json, payload, "session", json_type_boolean);
-
-    username = json_object_get_string(username_json);
-    password = json_object_get_string(password_json);
-    do_session = json_object_get_boolean(do_session_json);
+    const char* username = args->username;
+    const char* password = args->password;
+    const bool do_session = args->session;
 
     dbcmd_ctx_t ctx;
     memset(&ctx, 0, sizeof(dbcmd_ctx_t));
@@ -201,6 +250,8 @@ do_client_register(eworker_t* ew, dbcmd_ctx_t* ctx)
 
     if (ctx->ret == DB_ASYNC_ERROR)
         return "Username already taken";
+    if (ctx->client == NULL)
+        return NULL;
 
     if (do_session)
     {
@@ -214,55 +265,68 @@ do_client_register(eworker_t* ew, dbcmd_ctx_t* ctx)
     errmsg = server_set_client_logged_in(ew, ctx->client, user, session, resp);
     json_object_put(resp);
 
-    /* See user_login.c:do_client_login() why setting ctx->data to NULL */
-    if (errmsg == NULL)
-        ctx->data = NULL;
-
     return errmsg;
 }
 
+/* Compute thread */
+static void
+register_run(UNUSED compute_thread_t* ct, compute_job_t* job)
+{
+    login_job_t* lj = (login_job_t*)job;
+
+    getrandom(lj->user->salt, SERVER_SALT_SIZE, 0);
+    server_sha512(lj->password, lj->user->salt, lj->user->hash);
+    explicit_bzero(lj->password, DB_PASSWORD_MAX);
+}
+
+static void
+register_done(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    login_job_t* lj = (login_job_t*)job;
+    dbcmd_ctx_t ctx = {
+        .param.user_login.do_session = lj->do_session,
+        .exec = do_client_register,
+    };
+
+    if (job->status == COMPUTE_CANCELLED || client == NULL)
+        goto out;
+
+    if (db_async_insert_user(&ew->db, lj->user, &ctx) == false)
+    {
+        ws_json_send_error(client, "Internal error: async-insert-user");
+        goto out;
+    }
+    /* dbuser_t is the insert's now */
+    lj->user = NULL;
+out:
+    free_login_job(lj);
+}
+
 const char* 
 server_client_register(eworker_t* ew, 
-                       UNUSED client_t* client, 
-                       json_object* payload,
+                       client_t* client, 
+                       const cmd_register_t* args,
                        UNUSED json_object* resp)
 {
-    json_object* username_json;
-    json_object* displayname_json;
-    json_object* password_json;
-    json_object* do_session_json;
-    const char* username;
-    const char* displayname;
-    const char* password;
-    bool do_session;
     dbuser_t* new_user;
-    const char* errmsg = NULL;
-
-    RET_IF_JSON_BAD(username_json,      payload, "username",    json_type_string);
-    RET_IF_JSON_BAD(displayname_json,   payload, "displayname", json_type_string);
-    RET_IF_JSON_BAD(password_json,      payload, "password",    json_type_string);
-    RET_IF_JSON_BAD(do_session_json,    payload, "session",     json_type_boolean);
-
-    username = json_object_get_string(username_json);
-    displayname = json_object_get_string(displayname_json);
-    password = json_object_get_string(password_json);
-    do_session = json_object_get_boolean(do_session_json);
+    login_job_t* lj;
 
-    new_user = calloc(1, sizeof(dbuser_t));
-    strncpy(new_user->username, username, DB_USERNAME_MAX);
-    strncpy(new_user->displayname, displayname, DB_USERNAME_MAX);
+    if ((new_user = calloc(1, sizeof(dbuser_t))) == NULL)
+        return "Internal error: new-user";
+    strncpy(new_user->username, args->username, DB_USERNAME_MAX);
+    strncpy(new_user->displayname, args->displayname, DB_USERNAME_MAX);
 
-    getrandom(new_user->salt, SERVER_SALT_SIZE, 0);
-    server_sha512(password, new_user->salt, new_user->hash);
-
-    dbcmd_ctx_t ctx = {
-        .param.user_login.do_session = do_session,
-        .exec = do_client_register,
-    };
-    if (db_async_insert_user(&ew->db, new_user, &ctx) == false)
+    lj = new_login_job(register_run, register_done, new_user, 
+                       args->password, args->session);
+    if (lj == NULL)
     {
-        errmsg = "Internal error: async-insert-user";
         free(new_user);
+        return "Internal error: register-job";
     }
-    return errmsg;
+    if (server_compute_submit(ew, client, &lj->job) == false)
+    {
+        free_login_job(lj);
+        return "Server busy, try again";
+    }
+    return NULL;
 }
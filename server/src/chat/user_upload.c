@@ -9,17 +9,17 @@
 #include "server.h"
 #include "server_client.h"
 
-static upload_token_t*
+upload_token_t*
 server_check_upload_token(server_t* server, const http_t* http, u32* user_id)
 {
     char* endptr;
     const http_header_t* upload_token_header = http_get_header(http, "Upload-Token");
-    const char* token_str = upload_token_header->val;
-    if (!token_str)
+    if (upload_token_header == NULL)
     {
         error("No Upload-Token in POST request!\n");
         return NULL;
     }
+    const char* token_str = upload_token_header->val;
 
     const u64 token = strtoull(token_str, &endptr, 10);
     if ((errno == ERANGE && (token == ULONG_MAX)) || (errno != 0 && token == 0))
@@ -57,14 +57,17 @@ server_check_upload_token(server_t* server, const http_t* http, u32* user_id)
 static const char*
 update_pfp_result(eworker_t* ew, dbcmd_ctx_t* ctx)
 {
-    dbuser_t* user;
+    user_t* user;
     dbuser_file_t* file;
     dbuser_file_t* old_file;
+    char* pfp_hash;
 
     if (ctx->ret == DB_ASYNC_ERROR)
         return NULL;
 
-    user = ctx->param.ptr;
+    /* user_t is freed with its client, look it up again */
+    if ((user = server_get_online_user(ew->server, ctx->param.user_id)) == NULL)
+        return NULL;
     file = ctx->data;
     old_file = calloc(1, sizeof(dbuser_file_t));
 
@@ -72,22 +75,25 @@ update_pfp_result(eworker_t* ew, dbcmd_ctx_t* ctx)
     strcpy(old_file->mime_type, "image/");
     server_delete_file(ew, old_file);
 
-    strncpy(user->pfp_hash, file->hash, DB_PFP_HASH_MAX);
+    if ((pfp_hash = strndup(file->hash, DB_PFP_HASH_MAX)) == NULL)
+        return NULL;
+    free(user->pfp_hash);
+    user->pfp_hash = pfp_hash;
     server_rtusm_user_pfp_change(ew, user);
 
     return NULL;
 }
 
 static bool 
-update_user_pfp(eworker_t* ew, dbuser_t* user, dbuser_file_t* file)
+update_user_pfp(eworker_t* ew, u32 user_id, dbuser_file_t* file)
 {
     bool ret;
     dbcmd_ctx_t ctx = {
         .exec = update_pfp_result,
-        .param.ptr = user,
+        .param.user_id = user_id,
         .data = file
     };
-    ret = db_async_update_user(&ew->db, NULL, NULL, file->hash, user->user_id, &ctx);
+    ret = db_async_update_user(&ew->db, NULL, NULL, file->hash, user_id, &ctx);
     return !ret;
     // bool failed = false;
     // if (!server_db_update_user(&ew->db, NULL, NULL, hash, user->user_id))
@@ -106,15 +112,56 @@ update_user_pfp(eworker_t* ew, dbuser_t* user, dbuser_file_t* file)
     // return failed;
 }
 
+static void
+pfp_img_saved(eworker_t* ew, client_t* client, dbuser_file_t* file, const img_saved_cb_t* cb)
+{
+    http_t* resp;
+
+    if (file && !update_user_pfp(ew, cb->id, file))
+        resp = http_new_resp(HTTP_CODE_OK, "OK", NULL, 0);
+    else
+        resp = http_new_resp(HTTP_CODE_INTERAL_ERROR, "Interal server error", NULL, 0);
+
+    if (client)
+        http_send(client, resp);
+    http_free(resp);
+}
+
+/* 
+ * The body, for a save that outlives the request. Taken if the http owns it,
+ * else copied: a body that came in one read is in the eworker's recv buffer.
+ */
+static void*
+upload_take_body(const http_t* http)
+{
+    void* data;
+
+    if (http->body_inheap)
+    {
+        ((http_t*)http)->body_inheap = false;
+        return http->body;
+    }
+    if ((data = malloc(http->body_len)) == NULL)
+    {
+        error("upload body malloc: %s\n", ERRSTR);
+        return NULL;
+    }
+    memcpy(data, http->body, http->body_len);
+    return data;
+}
+
 static void 
 server_handle_user_pfp_update(eworker_t* ew, client_t* client, const http_t* http, u32 user_id)
 {
     http_t* resp = NULL;
-    dbuser_t* user = NULL;
-    client_t* user_client;
-    bool failed = false;
+    user_t* user = NULL;
+    void* data;
     const char* post_img_cmd = "/img/";
     size_t post_img_cmd_len = strlen(post_img_cmd);
+    const img_saved_cb_t cb = {
+        .func = pfp_img_saved,
+        .id = user_id
+    };
 
     if (strncmp(http->req.url, post_img_cmd, post_img_cmd_len) != 0)
     {
@@ -122,65 +169,113 @@ server_handle_user_pfp_update(eworker_t* ew, client_t* client, const http_t* htt
         goto respond;
     }
 
-    user_client = server_get_client_user_id(ew->server, user_id);
-    if (!user_client)
+    user = server_get_online_user(ew->server, user_id);
+    if (!user)
     {
         warn("User %u not found.\n", user_id);
-        failed = true;
         goto respond;
     }
-    user = user_client->dbuser;
-
-    dbuser_file_t* file;
 
-    if (server_save_file_img(ew, http->body, http->body_len, &file, false))
-        failed = update_user_pfp(ew, user, file);
-    else
-    {
-        failed = true;
-    }
+    if ((data = upload_take_body(http)) == NULL)
+        goto respond;
+    /* Body is the save's now, pfp_img_saved() responds */
+    if (server_save_file_img(ew, client, data, http->body_len, 
+                             http->buf.digest, false, user_id, &cb))
+        return;
+    free(data);
 respond:
     if (!resp)
-    {
-        if (failed)
-            resp = http_new_resp(HTTP_CODE_INTERAL_ERROR, "Interal server error", NULL, 0);
-        else
-        {
-            resp = http_new_resp(HTTP_CODE_OK, "OK", NULL, 0);
-            ((http_t*)http)->body_inheap = false;
-        }
-    }
+        resp = http_new_resp(HTTP_CODE_INTERAL_ERROR, "Interal server error", NULL, 0);
 
     http_send(client, resp);
     http_free(resp);
 }
 
-static const char*
-do_insert_msg_after(eworker_t* ew, dbcmd_ctx_t* ctx)
+static void
+upload_token_finished(eworker_t* ew, upload_token_t* ut)
 {
     server_event_t* se;
-    dbmsg_t* msg;
-    upload_token_t* ut = ctx->param.ptr;
-    if (ctx->ret == DB_ASYNC_ERROR)
-        goto clear;
 
-    msg = ctx->data;
-    server_get_send_group_msg(ew, msg);
-clear:
     if ((se = server_get_event(ew->server, ut->timerfd)))
         server_del_event(ew, se);
     else
         server_del_upload_token(ew, ut);
+}
+
+static const char*
+do_insert_msg_after(eworker_t* ew, dbcmd_ctx_t* ctx)
+{
+    dbmsg_t* msg;
+    upload_token_t* ut = ctx->param.ptr;
+
+    if (ctx->ret != DB_ASYNC_ERROR)
+    {
+        msg = ctx->data;
+        server_get_send_group_msg(ew, msg);
+    }
+    upload_token_finished(ew, ut);
     ctx->data = NULL;
     return NULL; 
 }
 
+bool
+server_msg_attach_file(eworker_t* ew, u32 token, size_t index, const dbuser_file_t* file)
+{
+    upload_token_t* ut;
+    dbmsg_t* msg;
+    json_object* attach_json;
+
+    /* Token may have expired while hashing */
+    if ((ut = server_get_upload_token(ew->server, token)) == NULL)
+        return false;
+    msg = ut->msg_state.msg;
+    if ((attach_json = json_object_array_get_idx(msg->attachments_json, index)) == NULL)
+        return false;
+
+    json_object_object_add(attach_json, "hash",
+                           json_object_new_string(file->hash));
+    /* Sniffed, it's what the file's directory goes by */
+    if (file->mime_type[0])
+        json_object_object_add(attach_json, "type",
+                               json_object_new_string(file->mime_type));
+
+    ut->msg_state.current++;
+    if (ut->msg_state.current >= ut->msg_state.total)
+    {
+        msg->attachments = (char*)json_object_to_json_string(msg->attachments_json);
+        if (ew->server->conf.write_behind)
+        {
+            /* The log has it from here */
+            ut->msg_state.msg = NULL;
+            server_wal_group_msg(ew, msg);
+            upload_token_finished(ew, ut);
+            return true;
+        }
+
+        dbcmd_ctx_t ctx = {
+            .exec = do_insert_msg_after,
+            .param.ptr = ut,
+            .client = NULL
+        };
+        db_async_insert_group_msg(&ew->db, msg, &ctx);
+    }
+    return true;
+}
+
+static void
+attach_img_saved(eworker_t* ew, UNUSED client_t* client, dbuser_file_t* file, 
+                 const img_saved_cb_t* cb)
+{
+    if (file)
+        server_msg_attach_file(ew, cb->id, cb->index, file);
+}
+
 static void 
 server_handle_msg_attach(eworker_t* ew, client_t* client, 
                          const http_t* http, upload_token_t* ut)
 {
     http_t* resp = NULL;
-    dbmsg_t* msg = &ut->msg_state.msg;
+    dbmsg_t* msg = ut->msg_state.msg;
     size_t attach_index = 0;
     char* endptr;
     http_header_t* attach_index_header = http_get_header(http, "Attach-Index");
@@ -210,30 +305,17 @@ server_handle_msg_attach(eworker_t* ew, client_t* client,
     attach_json = json_object_array_get_idx(msg->attachments_json, attach_index);
     if (attach_json)
     {
-        dbuser_file_t* file = NULL;
-        if (server_save_file_img(ew, http->body, http->body_len, &file, true))
-        {
-            json_object_object_add(attach_json, "hash",
-                                   json_object_new_string(file->hash));
-
-            ut->msg_state.current++;
-            if (ut->msg_state.current >= ut->msg_state.total)
-            {
-                msg->attachments = (char*)json_object_to_json_string(msg->attachments_json);
-                dbcmd_ctx_t ctx = {
-                    .exec = do_insert_msg_after,
-                    .param.ptr = ut,
-                    .client = NULL
-                };
-                db_async_insert_group_msg(&ew->db, msg, &ctx);
-            }
-
-            /*
-             * Hacky set http->body_inheap to false so the body wont be freed.
-             * Why? server_save_file_img() will free it in do_save_file_img()
-             */
-            ((http_t*)http)->body_inheap = false;
-        }
+        const img_saved_cb_t cb = {
+            .func = attach_img_saved,
+            .id = ut->token,
+            .index = attach_index
+        };
+        /* server_save_file_img() owns it now, frees it in save_img_done() */
+        void* data = upload_take_body(http);
+
+        if (data && !server_save_file_img(ew, client, data, http->body_len, 
+                                          http->buf.digest, true, msg->user_id, &cb))
+            free(data);
     }
     else
         warn("Failed to get json array index: %zu\n", attach_index);
@@ -246,6 +328,192 @@ respond:
     }
 }
 
+/* Parts are buffered whole (for the save), same limit as a whole body */
+#define ATTACH_PART_MAX HTTP_BODY_MAX
+
+/* One multipart/form-data POST with every file of the message */
+typedef struct 
+{
+    u32         token;
+    u32         user_id;    /* Uploader */
+    u32         index;      /* Current attachment */
+    u32         n_files;
+    bool        in_file;
+    bool        too_large;
+    u8*         data;       /* Current part only */
+    size_t      len;
+    size_t      cap;
+    SHA256_CTX  sha256;
+} attach_stream_t;
+
+static void
+attach_part_begin(eworker_t* ew, UNUSED client_t* client, multipart_t* mp)
+{
+    attach_stream_t* as = mp->user;
+    upload_token_t* ut;
+
+    as->in_file = false;
+    if (mp->part.filename[0] == 0x00)
+        return;
+    if ((ut = server_get_upload_token(ew->server, as->token)) == NULL)
+        return;
+    /* "file<index>", the rest may come as resumable uploads */
+    if (sscanf(mp->part.name, "file%u", &as->index) != 1)
+        as->index = as->n_files;
+    if (as->index >= ut->msg_state.total)
+    {
+        warn("Attachment %u/%u, ignored.\n", as->index, ut->msg_state.total);
+        return;
+    }
+    /* Big uploads can take longer than the token's timeout */
+    server_touch_upload_token(ew->server, ut);
+
+    as->in_file = true;
+    SHA256_Init(&as->sha256);
+}
+
+static void
+attach_part_data(UNUSED eworker_t* ew, UNUSED client_t* client, multipart_t* mp,
+                 const u8* data, size_t len)
+{
+    attach_stream_t* as = mp->user;
+    size_t cap = (as->cap) ? as->cap : 4096;
+    u8* new_data;
+
+    if (!as->in_file)
+        return;
+    if (as->len + len > ATTACH_PART_MAX)
+    {
+        warn("Attachment %u too large: over %zu\n", as->index, (size_t)ATTACH_PART_MAX);
+        as->too_large = true;
+        server_multipart_fail(mp);
+        return;
+    }
+    if (as->len + len > as->cap)
+    {
+        while (cap < as->len + len)
+            cap *= 2;
+        if ((new_data = realloc(as->data, cap)) == NULL)
+        {
+            error("attach stream realloc: %s\n", ERRSTR);
+            as->in_file = false;
+            return;
+        }
+        as->data = new_data;
+        as->cap = cap;
+    }
+    memcpy(as->data + as->len, data, len);
+    as->len += len;
+    SHA256_Update(&as->sha256, data, len);
+}
+
+static void
+attach_part_end(eworker_t* ew, client_t* client, multipart_t* mp)
+{
+    attach_stream_t* as = mp->user;
+    http_digest_t digest = {0};
+    const img_saved_cb_t cb = {
+        .func = attach_img_saved,
+        .id = as->token,
+        .index = as->index
+    };
+
+    if (as->in_file)
+    {
+        /* Hashed already, only sniffed on the compute pool */
+        server_sha256_final_str(&as->sha256, digest.hash);
+        if (!server_save_file_img(ew, client, as->data, as->len, &digest, 
+                                  true, as->user_id, &cb))
+            free(as->data);
+        as->n_files++;
+    }
+    else
+        free(as->data);
+    as->in_file = false;
+    as->data = NULL;
+    as->len = as->cap = 0;
+}
+
+static void
+attach_finish(UNUSED eworker_t* ew, client_t* client, multipart_t* mp, bool ok)
+{
+    attach_stream_t* as = mp->user;
+
+    if (client == NULL)
+        return;
+    if (ok && as->n_files)
+        server_http_resp_ok(client, NULL, 0, NULL);
+    else if (as->too_large)
+        server_http_resp_error(client, HTTP_CODE_TOO_LARGE, "Payload Too Large");
+    else
+        server_http_resp_error(client, HTTP_CODE_BAD_REQ, "Bad multipart body");
+}
+
+static void
+attach_stream_free(void* user)
+{
+    attach_stream_t* as = user;
+
+    free(as->data);
+    free(as);
+}
+
+static const multipart_cb_t attach_stream_cb = {
+    .part_begin = attach_part_begin,
+    .part_data = attach_part_data,
+    .part_end = attach_part_end,
+    .finish = attach_finish,
+    .free = attach_stream_free
+};
+
+multipart_t*
+server_user_upload_stream(eworker_t* ew, client_t* client, const http_t* http)
+{
+    char boundary[MULTIPART_BOUNDARY_MAX + 1];
+    const http_header_t* content_type;
+    const char* err = "Upload-Token failed";
+    upload_token_t* ut;
+    attach_stream_t* as;
+    multipart_t* mp;
+
+    ut = server_check_upload_token(ew->server, http, NULL);
+    if (ut == NULL || ut->type != UT_MSG_ATTACHMENT)
+        goto err;
+
+    err = "Bad multipart body";
+    content_type = http_get_header(http, HTTP_HEAD_CONTENT_TYPE);
+    if (content_type == NULL || !server_multipart_boundary(content_type->val, boundary))
+        goto err;
+
+    err = "Interal server error";
+    if ((as = calloc(1, sizeof(attach_stream_t))) == NULL)
+        goto err;
+    as->token = ut->token;
+    as->user_id = ut->msg_state.msg->user_id;
+    if ((mp = server_multipart_new(boundary, &attach_stream_cb, as)) == NULL)
+    {
+        free(as);
+        goto err;
+    }
+    return mp;
+err:
+    server_http_resp_error(client, HTTP_CODE_BAD_REQ, err);
+    return NULL;
+}
+
+/* Whole multipart body came in the first read */
+static void
+server_handle_msg_attach_multipart(eworker_t* ew, client_t* client, const http_t* http)
+{
+    multipart_t* mp;
+
+    if ((mp = server_user_upload_stream(ew, client, http)) == NULL)
+        return;
+    server_multipart_feed(mp, ew, client, http->body, http->body_len);
+    server_multipart_end(mp, ew, client);
+    server_multipart_free(mp);
+}
+
 void 
 server_handle_user_upload(eworker_t* ew, client_t* client, const http_t* http)
 {
@@ -274,7 +542,10 @@ server_handle_user_upload(eworker_t* ew, client_t* client, const http_t* http)
     }
     else if (ut->type == UT_MSG_ATTACHMENT)
     {
-        server_handle_msg_attach(ew, client, http, ut);
+        if (http_get_header(http, "Attach-Index"))
+            server_handle_msg_attach(ew, client, http, ut);
+        else
+            server_handle_msg_attach_multipart(ew, client, http);
     }
     else
     {
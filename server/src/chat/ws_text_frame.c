@@ -1,6 +1,7 @@
 #include "chat/ws_text_frame.h"
 #include "chat/user_login.h"
 #include "chat/cmd.h"
+#include "server_msgpack.h"
 
 bool 
 json_bad(json_object* json, json_type type)
@@ -11,29 +12,16 @@ json_bad(json_object* json, json_type type)
     return !json_object_is_type(json, type);
 }
 
-enum client_recv_status 
-server_ws_handle_text_frame(eworker_t* ew, 
-                            client_t* client, 
-                            char* buf, 
-                            size_t buf_len) 
+static enum client_recv_status 
+server_ws_handle_payload(eworker_t* ew, client_t* client, json_object* payload)
 {
     json_object* cmd_json;
     json_object* respond_json;
-    json_object* payload;
-    json_tokener* tokener;
     const char* error_msg = NULL;
     const char* cmd;
+    size_t cmd_len;
 
     respond_json = json_object_new_object();
-    tokener = json_tokener_new();
-    payload = json_tokener_parse_ex(tokener, buf, buf_len + 1);
-    json_tokener_free(tokener);
-
-    if (!payload)
-    {
-        warn("WS JSON parse failed, message:\n%s\n", buf);
-        return RECV_DISCONNECT;
-    }
 
     cmd_json = json_object_object_get(payload, "cmd");
     if (json_bad(cmd_json, json_type_string))
@@ -43,8 +31,9 @@ server_ws_handle_text_frame(eworker_t* ew,
     }
 
     cmd = json_object_get_string(cmd_json);
+    cmd_len = json_object_get_string_len(cmd_json);
 
-    error_msg = server_exec_chatcmd(cmd, ew, client, payload, respond_json);
+    error_msg = server_exec_chatcmd(cmd, cmd_len, ew, client, payload, respond_json);
 send_error:
     if (error_msg)
     {
@@ -64,3 +53,51 @@ send_error:
 
     return RECV_OK;
 }
+
+enum client_recv_status 
+server_ws_handle_text_frame(eworker_t* ew, 
+                            client_t* client, 
+                            char* buf, 
+                            size_t buf_len) 
+{
+    json_object* payload;
+    json_tokener* tokener;
+
+    tokener = json_tokener_new();
+    payload = json_tokener_parse_ex(tokener, buf, buf_len + 1);
+    json_tokener_free(tokener);
+
+    if (!payload)
+    {
+        warn("WS JSON parse failed, message:\n%s\n", buf);
+        return RECV_DISCONNECT;
+    }
+
+    return server_ws_handle_payload(ew, client, payload);
+}
+
+enum client_recv_status 
+server_ws_handle_binary_frame(eworker_t* ew, 
+                              client_t* client, 
+                              u8* buf, 
+                              size_t buf_len) 
+{
+    json_object* payload;
+
+    if ((client->state & CLIENT_STATE_WS_MSGPACK) == 0)
+    {
+        warn("Client fd:%d sent binary frame without \"%s\" subprotocol.\n",
+             client->addr.sock, WS_PROTO_MSGPACK);
+        return RECV_OK;
+    }
+
+    payload = msgpack_to_json(buf, buf_len);
+    if (!payload || !json_object_is_type(payload, json_type_object))
+    {
+        warn("WS MessagePack decode failed (%zu bytes)\n", buf_len);
+        json_object_put(payload);
+        return RECV_DISCONNECT;
+    }
+
+    return server_ws_handle_payload(ew, client, payload);
+}
@@ -78,13 +78,19 @@ server_cleanup(server_t* server)
         return;
 
     server_tm_shutdown(server);
-    server_ght_destroy(&server->chat_cmd_ht);
+    server_compute_shutdown(&server->compute);
+    server_compute_shutdown(&server->io);
     server_del_all_events(server);
     server_del_all_clients(server);
+    server_client_table_destroy(&server->clients);
     server_del_all_sessions(server);
     server_del_all_upload_tokens(server);
+    server_upload_free(&server->main_ew, &server->uploads);
+    server_wal_free(server);
+    server_msg_cache_free(&server->msg_cache);
     server_db_free(server);
-    server_close_magic(server);
+    server_store_free(&server->store);
+    server_pool_destroy(&server->msg_pool);
 
     SSL_CTX_free(server->ssl_ctx);
 
@@ -109,40 +115,69 @@ server_print_ssl_error(client_t* client, i32 ret, const char* from)
     error("SSL %s: %s\n", from, ERR_error_string(err, NULL));
 }
 
+/* Owner only */
 ssize_t 
-server_send(client_t* client, const void* buf, size_t len)
+server_ssl_send(client_t* client, const void* buf, size_t len)
 {
-    ssize_t bytes_sent = -1;
+    ssize_t bytes_sent;
+
+    if (client->err != CLIENT_ERR_NONE)
+        return -1;
 
-    pthread_mutex_lock(&client->ssl_mutex);
-    if (client->err != CLIENT_ERR_SSL)
+    bytes_sent = SSL_write(client->ssl, buf, len);
+    if (bytes_sent <= 0)
     {
-        bytes_sent = SSL_write(client->ssl, buf, len);
-        if (bytes_sent <= 0)
-        {
-            server_print_ssl_error(client, bytes_sent, "write");
-            server_set_client_err(client, CLIENT_ERR_SSL);
-        }
+        server_print_ssl_error(client, bytes_sent, "write");
+        server_set_client_err(client, CLIENT_ERR_SSL);
     }
-    pthread_mutex_unlock(&client->ssl_mutex);
     return bytes_sent;
 }
 
+ssize_t 
+server_send(client_t* client, const void* buf, size_t len)
+{
+    /* Not ours, or the owner is in the middle of a fragmented message */
+    if (client->owner != eworker_self || client->streams)
+        return server_mailbox_post(client, buf, len) ? (ssize_t)len : -1;
+
+    return server_ssl_send(client, buf, len);
+}
+
+ssize_t 
+server_send_stream(client_t* client, const void* buf, size_t len)
+{
+    if (client->owner != eworker_self)
+        return server_mailbox_post(client, buf, len) ? (ssize_t)len : -1;
+
+    return server_ssl_send(client, buf, len);
+}
+
+/* Owner only */
 ssize_t 
 server_recv(client_t* client, void* buf, size_t len)
 {
-    ssize_t bytes_recv = -1;
+    ssize_t bytes_recv;
 
-    pthread_mutex_lock(&client->ssl_mutex);
-    if (client->err != CLIENT_ERR_SSL)
+    if (client->err != CLIENT_ERR_NONE)
+        return -1;
+
+    bytes_recv = SSL_read(client->ssl, buf, len);
+    if (bytes_recv <= 0)
     {
-        bytes_recv = SSL_read(client->ssl, buf, len);
-        if (bytes_recv <= 0)
-        {
-            server_print_ssl_error(client, bytes_recv, "read");
-            server_set_client_err(client, CLIENT_ERR_SSL);
-        }
+        server_print_ssl_error(client, bytes_recv, "read");
+        server_set_client_err(client, CLIENT_ERR_SSL);
     }
-    pthread_mutex_unlock(&client->ssl_mutex);
     return bytes_recv;
 }
+
+/* 
+ * Decrypted bytes already buffered by SSL, 
+ * epoll won't wake us up for these. 
+ */
+bool
+server_recv_pending(client_t* client)
+{
+    if (client->err == CLIENT_ERR_SSL)
+        return false;
+    return SSL_pending(client->ssl) > 0;
+}
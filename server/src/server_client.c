@@ -7,10 +7,211 @@ server_get_client_fd(server_t* server, i32 fd)
     return server_ght_get(&server->client_ht, fd);
 }
 
+user_t*
+server_get_online_user(server_t* server, u64 id)
+{
+    return server_ght_get(&server->user_ht, id);
+}
+
 client_t*   
 server_get_client_user_id(server_t* server, u64 id)
 {
-    return server_ght_get(&server->user_ht, id);
+    user_t* user = server_ght_get(&server->user_ht, id);
+    return (user) ? user->client : NULL;
+}
+
+#define HD_SLOT(hd)  ((u32)(hd))
+#define HD_GEN(hd)   ((u32)((hd) >> 32))
+
+bool
+server_init_client_table(client_table_t* table)
+{
+    memset(table, 0, sizeof(client_table_t));
+    table->free_head = CLIENT_SLOT_NONE;
+    return pthread_mutex_init(&table->mutex, NULL) == 0;
+}
+
+void
+server_client_table_destroy(client_table_t* table)
+{
+    for (u32 i = 0; i < CLIENT_SLOT_CHUNKS; i++)
+        free(atomic_load(&table->chunks[i]));
+    pthread_mutex_destroy(&table->mutex);
+}
+
+static inline client_slot_t*
+client_slot(client_table_t* table, u32 slot)
+{
+    client_slot_t* chunk = atomic_load(&table->chunks[slot / CLIENT_SLOT_CHUNK]);
+    return (chunk) ? chunk + (slot % CLIENT_SLOT_CHUNK) : NULL;
+}
+
+/* Publish `client` in a slot, sets client->hd */
+static bool
+client_slot_alloc(client_table_t* table, client_t* client)
+{
+    client_slot_t* s;
+    client_slot_t* chunk;
+    u32 slot;
+    u32 gen;
+
+    pthread_mutex_lock(&table->mutex);
+    if ((slot = table->free_head) != CLIENT_SLOT_NONE)
+    {
+        s = client_slot(table, slot);
+        table->free_head = s->next_free;
+    }
+    else
+    {
+        slot = table->n_slots;
+        if (slot / CLIENT_SLOT_CHUNK >= CLIENT_SLOT_CHUNKS)
+        {
+            pthread_mutex_unlock(&table->mutex);
+            error("Client table full (%u)\n", slot);
+            return false;
+        }
+        if (slot % CLIENT_SLOT_CHUNK == 0)
+        {
+            /* Chunks are never moved or freed while running, lookups don't lock. */
+            if ((chunk = calloc(CLIENT_SLOT_CHUNK, sizeof(client_slot_t))) == NULL)
+            {
+                pthread_mutex_unlock(&table->mutex);
+                error("calloc client slots: %s\n", ERRSTR);
+                return false;
+            }
+            atomic_store(&table->chunks[slot / CLIENT_SLOT_CHUNK], chunk);
+        }
+        table->n_slots++;
+        s = client_slot(table, slot);
+    }
+    pthread_mutex_unlock(&table->mutex);
+
+    /* Client before gen, see server_client_get() */
+    atomic_store(&s->client, client);
+    gen = atomic_fetch_add(&s->gen, 1) + 1;
+    client->hd = ((u64)gen << 32) | slot;
+    return true;
+}
+
+static void
+client_slot_release(client_table_t* table, client_hd_t hd)
+{
+    client_slot_t* s;
+
+    if (hd == CLIENT_HD_NONE || (s = client_slot(table, HD_SLOT(hd))) == NULL)
+        return;
+
+    /* Gen before client, every old handle stops resolving first */
+    atomic_fetch_add(&s->gen, 1);
+    atomic_store(&s->client, NULL);
+
+    pthread_mutex_lock(&table->mutex);
+    s->next_free = table->free_head;
+    table->free_head = HD_SLOT(hd);
+    pthread_mutex_unlock(&table->mutex);
+}
+
+client_t*
+server_client_get(server_t* server, client_hd_t hd)
+{
+    client_slot_t* s;
+    client_t* client;
+    const u32 gen = HD_GEN(hd);
+
+    if (hd == CLIENT_HD_NONE || (s = client_slot(&server->clients, HD_SLOT(hd))) == NULL)
+        return NULL;
+
+    if (atomic_load(&s->gen) != gen)
+        return NULL;
+    client = atomic_load(&s->client);
+    /* Slot released & reused in between? */
+    if (atomic_load(&s->gen) != gen)
+        return NULL;
+    return client;
+}
+
+void
+server_client_ref(client_t* client)
+{
+    atomic_fetch_add(&client->refs, 1);
+}
+
+void
+server_client_unref(client_t* client)
+{
+    atomic_fetch_sub(&client->refs, 1);
+}
+
+/* Actually free it, no eworker can see it anymore */
+static void
+client_reclaim(client_t* client)
+{
+    if (client->ssl)
+        SSL_free(client->ssl);
+    if (client->addr.sock != -1)
+        close(client->addr.sock);
+    server_free_user(client->user);
+    server_mailbox_discard(client);
+    free(client);
+}
+
+void
+server_client_online(eworker_t* ew)
+{
+    atomic_store(&ew->qs_epoch, atomic_load(&ew->server->epoch));
+}
+
+/*
+ * Called before epoll_wait(), drops every client_t* this eworker
+ * looked up. Frees retired clients no eworker can still hold:
+ * retired at epoch E, and every online eworker woke up at >= E.
+ */
+void
+server_client_quiescent(eworker_t* ew)
+{
+    server_tm_t* tm = &ew->server->tm;
+    u64 min_epoch = UINT64_MAX;
+    u64 epoch;
+    client_t** prev;
+    client_t* client;
+
+    if (ew->retired)
+    {
+        for (size_t i = 0; i < tm->n_workers; i++)
+        {
+            epoch = atomic_load(&tm->workers[i].qs_epoch);
+            if (epoch && epoch < min_epoch && tm->workers + i != ew)
+                min_epoch = epoch;
+        }
+
+        prev = &ew->retired;
+        while ((client = *prev))
+        {
+            if (client->retired_epoch <= min_epoch && atomic_load(&client->refs) == 0)
+            {
+                *prev = client->retired_next;
+                client_reclaim(client);
+            }
+            else
+                prev = &client->retired_next;
+        }
+    }
+
+    atomic_store(&ew->qs_epoch, 0);
+}
+
+/* Eworkers are stopped */
+void
+server_client_reclaim_all(eworker_t* ew)
+{
+    client_t* client;
+
+    server_mailbox_drop_all(ew);
+    while ((client = ew->retired))
+    {
+        ew->retired = client->retired_next;
+        client_reclaim(client);
+    }
 }
 
 client_t*
@@ -20,22 +221,27 @@ server_accept_client(eworker_t* th)
     server_t* server = th->server;
 
     client = calloc(1, sizeof(client_t));
+    client->owner = th;
     client->addr.len = server->addr_len;
     client->addr.version = server->conf.addr_version;
-    client->addr.addr_ptr = (struct sockaddr*)&client->addr.ipv4;
-    client->addr.sock = accept(server->sock, client->addr.addr_ptr, &client->addr.len);
+    client->addr.sock = accept(server->sock, (struct sockaddr*)&client->addr.ipv4, 
+                               &client->addr.len);
     if (client->addr.sock == -1)
     {
-        error("accept: %s", ERRSTR);
-        goto err;
+        /* Another eworker took it */
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            error("accept: %s\n", ERRSTR);
+        free(client);
+        return NULL;
     }
     if (server_client_ssl_handsake(server, client) == -1)
         goto err;
     server_get_client_info(client);
-    pthread_mutex_init(&client->ssl_mutex, NULL);
+    if (!client_slot_alloc(&server->clients, client))
+        goto err;
     server_ght_insert(&server->client_ht, client->addr.sock, client);
-    if (server_new_event(server, client->addr.sock, client, 
-                         se_read_client, se_close_client) == NULL)
+    if (server_new_owned_event(th, client->addr.sock, client, 
+                               se_read_client, se_close_client) == NULL)
         goto err;
 
     return client;
@@ -53,21 +259,21 @@ server_free_client(eworker_t* ew, client_t* client)
         return;
     server_ght_del(&server->client_ht, client->addr.sock);
 
-    info("Client (fd:%d, IP: %s:%s, host: %s) disconnected.\n", 
-            client->addr.sock, client->addr.ip_str, client->addr.serv, client->addr.host);
-    if (client->dbuser)
-    {
-        if (client->dbuser->user_id)
-            debug("\tUser:%u %s '%s' logged out.\n", 
-                client->dbuser->user_id, client->dbuser->username, client->dbuser->displayname);
-    }
+    info("Client (fd:%d, IP: %s:%u) disconnected.\n", 
+            client->addr.sock, client->addr.ip_str, client->addr.port);
+    if (client->user)
+        debug("\tUser:%u %s '%s' logged out.\n", 
+            client->user->user_id, client->user->username, client->user->displayname);
 
-    if (client->ssl)
-    {
-        if (client->err == CLIENT_ERR_NONE)
-            SSL_shutdown(client->ssl);
-        SSL_free(client->ssl);
-    }
+    /* Unpublish, nobody can look it up after this */
+    client_slot_release(&server->clients, client->hd);
+    if (client->user)
+        server_ght_del(&server->user_ht, client->user->user_id);
+
+    /* Other eworkers may still post to it, owner drops those */
+    if (client->ssl && client->err == CLIENT_ERR_NONE)
+        SSL_shutdown(client->ssl);
+    client->err = CLIENT_ERR_CLOSED;
 
     if (client->session && client->session->timerfd == 0 && ew->server->running)
     {
@@ -84,15 +290,19 @@ server_free_client(eworker_t* ew, client_t* client)
 
     if (client->recv.data)
         free(client->recv.data);
-    if (client->dbuser)
+    client->recv.data = NULL;
+    http_free(client->recv.http);
+    client->recv.http = NULL;
+
+    /* main_ew only frees clients when eworkers are stopped */
+    if (ew == &server->main_ew)
     {
-        server_ght_del(&ew->server->user_ht, client->dbuser->user_id);
-        free(client->dbuser);
+        client_reclaim(client);
+        return;
     }
-    close(client->addr.sock);
-
-    pthread_mutex_destroy(&client->ssl_mutex);
-    free(client);
+    client->retired_epoch = atomic_fetch_add(&server->epoch, 1) + 1;
+    client->retired_next = ew->retired;
+    ew->retired = client;
 }
 
 int 
@@ -116,24 +326,15 @@ server_client_ssl_handsake(server_t* server, client_t* client)
 void 
 server_get_client_info(client_t* client)
 {
-    i32 ret;
-    i32 domain;
-
-    ret = getnameinfo(client->addr.addr_ptr, client->addr.len, client->addr.host, NI_MAXHOST, client->addr.serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
-    if (ret == -1)
-    {
-        error("getnameinfo: %s\n", ERRSTR);
-    }
-
     if (client->addr.version == IPv4)
     {
-        domain = AF_INET;
-        inet_ntop(domain, &client->addr.ipv4.sin_addr, client->addr.ip_str, INET_ADDRSTRLEN);
+        inet_ntop(AF_INET, &client->addr.ipv4.sin_addr, client->addr.ip_str, INET_ADDRSTRLEN);
+        client->addr.port = ntohs(client->addr.ipv4.sin_port);
     }
     else
     {
-        domain = AF_INET6;
-        inet_ntop(domain, &client->addr.ipv6.sin6_addr, client->addr.ip_str, INET6_ADDRSTRLEN);
+        inet_ntop(AF_INET6, &client->addr.ipv6.sin6_addr, client->addr.ip_str, INET6_ADDRSTRLEN);
+        client->addr.port = ntohs(client->addr.ipv6.sin6_port);
     }
 }
 
@@ -0,0 +1,344 @@
+#include "server_compute.h"
+#include "server.h"
+#include "chat/db_pipeline.h"
+#include <sys/eventfd.h>
+#include <time.h>
+
+static u64
+compute_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+compute_latency(compute_pool_t* pool, const compute_job_t* job)
+{
+    u64 latency = compute_now_ns() - job->queued_ns;
+    u64 max = atomic_load(&pool->latency_max_ns);
+
+    atomic_fetch_add(&pool->n_done, 1);
+    atomic_fetch_add(&pool->latency_ns, latency);
+    while (latency > max && 
+           !atomic_compare_exchange_weak(&pool->latency_max_ns, &max, latency))
+        ;
+}
+
+static void
+compute_finish(compute_job_t* job)
+{
+    eworker_t* ew = job->ew;
+    compute_job_t* head = atomic_load(&ew->done);
+
+    /* `job` is the eworker's once it's in */
+    do
+        job->next = head;
+    while (!atomic_compare_exchange_weak(&ew->done, &head, job));
+
+    if (head == NULL && eventfd_write(ew->done_fd, 1) == -1)
+        error("%s: compute eventfd_write: %s\n", ew->name, ERRSTR);
+}
+
+static compute_job_t*
+compute_pop(compute_job_t** head, compute_job_t** tail)
+{
+    compute_job_t* job;
+
+    if ((job = *head))
+    {
+        *head = job->next;
+        if (*head == NULL)
+            *tail = NULL;
+    }
+    return job;
+}
+
+static compute_job_t*
+compute_dequeue(compute_thread_t* ct)
+{
+    compute_pool_t* pool = ct->pool;
+    compute_job_t* job;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (ct->head == NULL && pool->head == NULL && !pool->stop)
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+
+    if ((job = compute_pop(&ct->head, &ct->tail)) ||
+        (job = compute_pop(&pool->head, &pool->tail)))
+        pool->count--;
+    pthread_mutex_unlock(&pool->mutex);
+    return job;
+}
+
+static void*
+compute_main(void* arg)
+{
+    compute_thread_t* ct = arg;
+    compute_pool_t* pool = ct->pool;
+    compute_job_t* job;
+
+    if ((pool->flags & COMPUTE_POOL_MAGIC) == 0)
+        ct->magic = NULL;
+    else if ((ct->magic = magic_open(MAGIC_MIME_TYPE)) == NULL)
+        error("%s: magic_open failed\n", ct->name);
+    else if (magic_load(ct->magic, NULL) != 0)
+    {
+        error("%s: magic_load: %s\n", ct->name, magic_error(ct->magic));
+        magic_close(ct->magic);
+        ct->magic = NULL;
+    }
+
+    /* Stop only once the queue is empty */
+    while ((job = compute_dequeue(ct)))
+    {
+        job->run(ct, job);
+        compute_latency(pool, job);
+        job->status = COMPUTE_DONE;
+        compute_finish(job);
+    }
+
+    if (ct->magic)
+        magic_close(ct->magic);
+    return NULL;
+}
+
+bool
+server_compute_init(compute_pool_t* pool, const char* name, i32 n_threads, u32 flags)
+{
+    compute_thread_t* ct;
+
+    memset(pool, 0, sizeof(compute_pool_t));
+    pool->name = name;
+    pool->flags = flags;
+    if (n_threads <= 0)
+        n_threads = 1;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    if ((pool->threads = calloc(n_threads, sizeof(compute_thread_t))) == NULL)
+    {
+        fatal("calloc compute threads: %s\n", ERRSTR);
+        return false;
+    }
+
+    for (i32 i = 0; i < n_threads; i++)
+    {
+        ct = pool->threads + i;
+        ct->pool = pool;
+        snprintf(ct->name, COMPUTE_NAME_LEN, "%s:%d", name, i);
+        if (pthread_create(&ct->pth, NULL, compute_main, ct) != 0)
+        {
+            fatal("pthread_create compute failed: %s\n", ERRSTR);
+            return false;
+        }
+        pthread_setname_np(ct->pth, ct->name);
+        pool->n_threads++;
+    }
+    return true;
+}
+
+void
+server_compute_shutdown(compute_pool_t* pool)
+{
+    compute_job_t* job = NULL;
+    compute_thread_t* ct;
+
+    if (pool->threads == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    /* Nobody is waiting for these anymore */
+    if ((pool->flags & COMPUTE_POOL_DRAIN) == 0)
+    {
+        /* Threads' own queues too, all in one */
+        for (size_t i = 0; i < pool->n_threads; i++)
+        {
+            ct = pool->threads + i;
+            if (ct->head == NULL)
+                continue;
+            if (pool->tail)
+                pool->tail->next = ct->head;
+            else
+                pool->head = ct->head;
+            pool->tail = ct->tail;
+            ct->head = ct->tail = NULL;
+        }
+        job = pool->head;
+        pool->head = pool->tail = NULL;
+        pool->count = 0;
+    }
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (compute_job_t* next; job; job = next)
+    {
+        next = job->next;
+        job->status = COMPUTE_CANCELLED;
+        job->done(job->ew, NULL, job);
+    }
+
+    for (size_t i = 0; i < pool->n_threads; i++)
+        pthread_join(pool->threads[i].pth, NULL);
+
+    server_compute_stats(pool);
+
+    free(pool->threads);
+    pool->threads = NULL;
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+bool
+server_compute_submit(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    return server_compute_submit_to(&ew->server->compute, ew, client, job);
+}
+
+void
+server_compute_stats(compute_pool_t* pool)
+{
+    const u64 n_done = atomic_load(&pool->n_done);
+    size_t high_water;
+    size_t rejected;
+
+    if (pool->threads == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    high_water = pool->high_water;
+    rejected = pool->rejected;
+    pthread_mutex_unlock(&pool->mutex);
+
+    info("%s pool: threads: %zu, high water: %zu, rejected: %zu, "
+         "done: %lu, avg latency: %luus, max latency: %luus\n",
+         pool->name, pool->n_threads, high_water, rejected, n_done, 
+         (n_done) ? atomic_load(&pool->latency_ns) / n_done / 1000 : 0,
+         atomic_load(&pool->latency_max_ns) / 1000);
+}
+
+static bool
+compute_enqueue(compute_pool_t* pool, eworker_t* ew, client_t* client, 
+                compute_job_t* job, compute_thread_t* lane)
+{
+    compute_job_t** head = (lane) ? &lane->head : &pool->head;
+    compute_job_t** tail = (lane) ? &lane->tail : &pool->tail;
+
+    job->ew = ew;
+    job->client_hd = (client) ? client->hd : CLIENT_HD_NONE;
+    job->status = COMPUTE_PENDING;
+    job->queued_ns = compute_now_ns();
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->stop || (lane == NULL && pool->count >= COMPUTE_QUEUE_MAX))
+    {
+        pool->rejected++;
+        pthread_mutex_unlock(&pool->mutex);
+        warn("%s: %s queue full\n", ew->name, pool->name);
+        return false;
+    }
+
+    if (*tail)
+        (*tail)->next = job;
+    else
+        *head = job;
+    *tail = job;
+    if (++pool->count > pool->high_water)
+        pool->high_water = pool->count;
+
+    /* Only that one thread can take it */
+    if (lane)
+        pthread_cond_broadcast(&pool->cond);
+    else
+        pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return true;
+}
+
+bool
+server_compute_submit_to(compute_pool_t* pool, eworker_t* ew, 
+                         client_t* client, compute_job_t* job)
+{
+    return compute_enqueue(pool, ew, client, job, NULL);
+}
+
+bool
+server_compute_submit_key(compute_pool_t* pool, eworker_t* ew, 
+                          client_t* client, compute_job_t* job, u64 key)
+{
+    return compute_enqueue(pool, ew, client, job, 
+                           pool->threads + key % pool->n_threads);
+}
+
+void
+server_compute_post(compute_job_t* job)
+{
+    job->status = COMPUTE_DONE;
+    compute_finish(job);
+}
+
+/* Newest first -> oldest first */
+static compute_job_t*
+compute_take_done(eworker_t* ew)
+{
+    compute_job_t* job = atomic_exchange(&ew->done, NULL);
+    compute_job_t* fifo = NULL;
+    compute_job_t* next;
+
+    for (; job; job = next)
+    {
+        next = job->next;
+        job->next = fifo;
+        fifo = job;
+    }
+    return fifo;
+}
+
+void
+server_compute_complete(eworker_t* ew)
+{
+    compute_job_t* job;
+    compute_job_t* next;
+    client_t* client;
+    eventfd_t count;
+
+    if (eventfd_read(ew->done_fd, &count) == -1 && errno != EAGAIN)
+        error("%s: compute eventfd_read: %s\n", ew->name, ERRSTR);
+
+    for (job = compute_take_done(ew); job; job = next)
+    {
+        next = job->next;
+        client = server_client_get(ew->server, job->client_hd);
+
+        /* Like an event, done() may queue DB commands for the client */
+        db_pipeline_set_ctx(&ew->db, client);
+        job->done(ew, client, job);
+        db_pipeline_current_done(&ew->db);
+    }
+}
+
+void
+server_compute_cancel_done(eworker_t* ew)
+{
+    compute_job_t* job;
+    compute_job_t* next;
+
+    for (job = compute_take_done(ew); job; job = next)
+    {
+        next = job->next;
+        job->status = COMPUTE_CANCELLED;
+        job->done(ew, NULL, job);
+    }
+}
+
+const char*
+server_compute_mime_type(compute_thread_t* ct, const void* data, size_t size)
+{
+    if (ct->magic == NULL)
+        return NULL;
+    return magic_buffer(ct->magic, data, size);
+}
@@ -18,20 +18,27 @@ server_sha512(const char* secret, u8* salt, u8* hash)
 }
 
 void
-server_sha256_str(const void* data, size_t size, char* output)
+server_sha256_final_str(SHA256_CTX* sha256, char* output)
 {
     u8 hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, data, size);
-    SHA256_Final(hash, &sha256);
+
+    SHA256_Final(hash, sha256);
 
     for (size_t i = 0; i < SHA256_DIGEST_LENGTH; i++)
         sprintf(output + (i * 2), "%02x", hash[i]);
     output[SERVER_HASH256_STR_SIZE - 1] = 0x00;
 }
 
+void
+server_sha256_str(const void* data, size_t size, char* output)
+{
+    SHA256_CTX sha256;
+    
+    SHA256_Init(&sha256);
+    SHA256_Update(&sha256, data, size);
+    server_sha256_final_str(&sha256, output);
+}
+
 char* 
 server_compute_websocket_key(const char* websocket_key)
 {
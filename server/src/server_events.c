@@ -7,7 +7,7 @@
 #include "server_tm.h"
 
 i32
-server_event_add(const server_t* server, server_event_t* se)
+server_event_add(server_event_t* se)
 {
     i32 ret;
 
@@ -19,18 +19,18 @@ server_event_add(const server_t* server, server_event_t* se)
         .events = se->listen_events
     };
 
-    ret = epoll_ctl(server->epfd, EPOLL_CTL_ADD, se->fd, &ev);
+    ret = epoll_ctl(se->epfd, EPOLL_CTL_ADD, se->fd, &ev);
     if (ret == -1)
         error("server_event_add on fd: %d\n", se->fd);
     return ret;
 }
 
 i32
-server_event_remove(const server_t* server, const server_event_t* se)
+server_event_remove(const server_event_t* se)
 {
     i32 ret;
 
-    ret = epoll_ctl(server->epfd, EPOLL_CTL_DEL, se->fd, NULL);
+    ret = epoll_ctl(se->epfd, EPOLL_CTL_DEL, se->fd, NULL);
     if (ret == -1)
         error("server_event_remove on fd: %d\n", se->fd);
 
@@ -38,7 +38,7 @@ server_event_remove(const server_t* server, const server_event_t* se)
 }
 
 i32 
-server_event_rearm(const server_t* server, const server_event_t* se)
+server_event_rearm(const server_event_t* se)
 {
     i32 ret;
 
@@ -47,7 +47,7 @@ server_event_rearm(const server_t* server, const server_event_t* se)
         .events = se->listen_events
     };
 
-    ret = epoll_ctl(server->epfd, EPOLL_CTL_MOD, se->fd, &ev);
+    ret = epoll_ctl(se->epfd, EPOLL_CTL_MOD, se->fd, &ev);
     if (ret == -1)
         error("server_event_rearm() on fd: %d\n", se->fd);
 
@@ -62,75 +62,126 @@ se_accept_conn(eworker_t* th, UNUSED server_event_t* ev)
     if ((client = server_accept_client(th)) == NULL)
         return SE_ERROR;
 
-    info("Client (fd:%d, IP: %s:%s) connected.\n", 
-        client->addr.sock, client->addr.ip_str, client->addr.serv);
+    info("Client (fd:%d, IP: %s:%u) connected.\n", 
+        client->addr.sock, client->addr.ip_str, client->addr.port);
 
     return SE_OK;
 }
 
-enum se_status
-se_read_client(eworker_t* th, server_event_t* ev)
+static void
+client_recv_reset(client_t* client)
+{
+    client->recv.data = NULL;
+    client->recv.len = 0;
+    client->recv.need = 0;
+}
+
+/* Frame bigger than recv_buf, read straight into the carry buffer. */
+static enum client_recv_status
+se_read_client_carry(eworker_t* th, client_t* client)
+{
+    recv_buf_t* recv = &client->recv;
+    ssize_t bytes_recv;
+    enum client_recv_status recv_status;
+    u8* frame;
+    size_t frame_len;
+
+    bytes_recv = server_recv(client, recv->data + recv->len, recv->need - recv->len);
+    if (bytes_recv <= 0)
+        return RECV_DISCONNECT;
+
+    recv->len += bytes_recv;
+    if (recv->len < recv->need)
+        return RECV_OK;
+
+    frame = recv->data;
+    frame_len = recv->need;
+    client_recv_reset(client);
+    recv_status = server_ws_parse(th, client, frame, frame_len);
+    free(frame);
+
+    return recv_status;
+}
+
+static enum client_recv_status
+se_read_client_once(eworker_t* th, client_t* client)
 {
     ssize_t bytes_recv;
     u8* buf;
     size_t buf_size;
     size_t offset = 0;
     http_t* http;
-    client_t* client;
-    enum client_recv_status recv_status = RECV_OK;
 
-    client = ev->data;
     http = client->recv.http;
 
-    db_pipeline_set_ctx(&th->db, client);
-
     if (http)
     {
-        buf = (u8*)http->body + http->buf.total_recv;
         buf_size = http->body_len - http->buf.total_recv;
-    }
-    else
-    {
-        if (!client->recv.data)
+        if (http->buf.stream)
         {
-            client->recv.data = calloc(1, CLIENT_RECV_PAGE);
-            client->recv.data_size = CLIENT_RECV_PAGE - 1;
+            /* Only passes through */
+            buf = th->recv_buf;
+            if (buf_size > th->recv_buf_size)
+                buf_size = th->recv_buf_size;
         }
         else
-            offset = client->recv.offset;
-        buf = client->recv.data;
-        buf_size = client->recv.data_size;
-    }
+            buf = (u8*)http->body + http->buf.total_recv;
+
+        bytes_recv = server_recv(client, buf, buf_size);
+        if (bytes_recv <= 0)
+            return RECV_DISCONNECT;
 
-    bytes_recv = server_recv(client, buf + offset, buf_size - offset);
-    if (bytes_recv <= 0)
-        return SE_CLOSE;
-    else if (http)
-    {
         http->buf.total_recv += bytes_recv;
         verbose("HTTP recv: %zu/%zu\n", http->buf.total_recv, http->body_len);
-        if ((size_t)bytes_recv >= buf_size)
+        if (http->buf.digest || http->buf.stream)
+            server_http_body_recv(th, client, http, buf, bytes_recv);
+        if (http->buf.total_recv >= http->body_len)
         {
-            server_handle_http(th, client, client->recv.http);
             client->recv.http = NULL;
+            server_http_body_complete(th, client, http);
         }
-    }
-    else
-    {
-        if (client->state & CLIENT_STATE_WEBSOCKET) 
-            recv_status = server_ws_parse(th, client, buf, bytes_recv + offset); 
-        else
-            recv_status = server_http_parse(th, client, buf, bytes_recv);
+        return RECV_OK;
     }
 
-    if (recv_status != RECV_DISCONNECT && !client->recv.busy)
+    if (client->recv.need >= th->recv_buf_size)
+        return se_read_client_carry(th, client);
+
+    /* 
+     * Continue the leftover partial frame in recv_buf. 
+     * Last byte is kept for NUL, parsers expect it.
+     */
+    buf = th->recv_buf;
+    buf_size = th->recv_buf_size - 1;
+    if (client->recv.data)
     {
+        offset = client->recv.len;
+        memcpy(buf, client->recv.data, offset);
         free(client->recv.data);
-        client->recv.data = NULL;
-        client->recv.data_size = 0;
-        client->recv.offset = 0;
+        client_recv_reset(client);
     }
 
+    bytes_recv = server_recv(client, buf + offset, buf_size - offset);
+    if (bytes_recv <= 0)
+        return RECV_DISCONNECT;
+    buf[offset + bytes_recv] = 0x00;
+
+    if (client->state & CLIENT_STATE_WEBSOCKET) 
+        return server_ws_parse(th, client, buf, bytes_recv + offset); 
+    return server_http_parse(th, client, buf, bytes_recv);
+}
+
+enum se_status
+se_read_client(eworker_t* th, server_event_t* ev)
+{
+    client_t* client = ev->data;
+    enum client_recv_status recv_status;
+
+    db_pipeline_set_ctx(&th->db, client);
+
+    do {
+        recv_status = se_read_client_once(th, client);
+    } while (recv_status == RECV_OK && server_recv_pending(client));
+
     if (recv_status == RECV_DISCONNECT || recv_status == RECV_ERROR)
         return SE_CLOSE;
 
@@ -144,19 +195,20 @@ se_close_client(eworker_t* th, server_event_t* ev)
 
     if (ev->err == EPIPE)
         server_set_client_err(client, CLIENT_ERR_SSL);
-    else if (client->dbuser && th->server->running)
-        server_rtusm_user_disconnect(th, client->dbuser);
+    else if (client->user && th->server->running)
+        server_rtusm_user_disconnect(th, client->user);
 
     server_free_client(th, client);
     return SE_OK;
 }
 
-server_event_t* 
-server_new_event(server_t* server, 
-                 i32 fd, 
-                 void* data, 
-                 se_read_callback_t read_callback, 
-                 se_close_callback_t close_callback)
+static server_event_t* 
+new_event(server_t* server, 
+          i32 epfd,
+          i32 fd, 
+          void* data, 
+          se_read_callback_t read_callback, 
+          se_close_callback_t close_callback)
 {
     server_event_t* se;
 
@@ -168,6 +220,7 @@ server_new_event(server_t* server,
     }
     
     se = calloc(1, sizeof(server_event_t));
+    se->epfd = epfd;
     se->fd = fd;
     se->data = data;
     se->read = read_callback;
@@ -179,19 +232,39 @@ server_new_event(server_t* server,
         error("new_event(): Failed to insert.\n");
         goto err;
     }
-    if (server_event_add(server, se) == -1)
+    if (server_event_add(se) == -1)
     {
         error("ep_addfd %d failed\n", fd);
         goto err;
     }
     return se;
 err:
-    server_event_remove(server, se);
+    server_event_remove(se);
     server_ght_del(&server->event_ht, fd);
     free(se);
     return NULL;
 }
 
+server_event_t* 
+server_new_event(server_t* server, 
+                 i32 fd, 
+                 void* data, 
+                 se_read_callback_t read_callback, 
+                 se_close_callback_t close_callback)
+{
+    return new_event(server, server->epfd, fd, data, read_callback, close_callback);
+}
+
+server_event_t* 
+server_new_owned_event(eworker_t* ew, 
+                       i32 fd, 
+                       void* data, 
+                       se_read_callback_t read_callback, 
+                       se_close_callback_t close_callback)
+{
+    return new_event(ew->server, ew->client_epfd, fd, data, read_callback, close_callback);
+}
+
 void 
 server_del_event(eworker_t* th, server_event_t* se)
 {
@@ -204,7 +277,9 @@ server_del_event(eworker_t* th, server_event_t* se)
         return;
     }
 
-    server_event_remove(server, se);
+    /* Eworkers' own epoll fds are gone at shutdown, close() does it anyway */
+    if (server->running)
+        server_event_remove(se);
     if (se->close)
         se->close(th, se);
     else
@@ -227,7 +302,6 @@ void
 server_process_event(eworker_t* ew, server_event_t* se)
 {
     enum se_status ret;
-    server_t* server = ew->server;
     const u32 ev = se->ep_events;
     const i32 fd = se->fd;
 
@@ -247,7 +321,7 @@ server_process_event(eworker_t* ew, server_event_t* se)
         if (ret == SE_CLOSE || ret == SE_ERROR)
             server_del_event(ew, se);
         else if (se->listen_events & EPOLLONESHOT)
-            server_event_rearm(server, se);
+            server_event_rearm(se);
     }
     else
         warn("Not handled fd: %d, ev: 0x%x\n", fd, ev);
@@ -2,17 +2,30 @@
 #include "chat/db.h"
 #include "chat/db_def.h"
 #include "chat/db_pipeline.h"
+#include "chat/db_group.h"
 #include "server_events.h"
 #include "server_tm.h"
 #include "server.h"
 #include <libpq-fe.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+_Thread_local eworker_t* eworker_self = NULL;
 
 static void*
 eworker_main(void* arg)
 {
-    if (server_eworker_init(arg) == false)
+    eworker_t* ew = arg;
+
+    if (server_eworker_init(ew) == false)
+    {
+        fatal("%s: init failed, shutting down.\n", ew->name);
+        server_eworker_cleanup(ew);
+        ew->server->tm.state |= TM_STATE_SHUTDOWN;
+        kill(getpid(), SIGTERM);
         return NULL;
+    }
     server_eworker_async_run(arg);
     server_eworker_cleanup(arg);
     return NULL;
@@ -26,18 +39,14 @@ eworker_prep_event(eworker_t* ew, server_event_t* se)
 }
 
 static void 
-eworker_wait_for_events(eworker_t* ew)
+eworker_wait_for_events(eworker_t* ew, i32 epfd)
 {
-    const server_t* server = ew->server;
     const struct epoll_event* event;
     server_event_t* se;
     i32 nfds;
-    i32 timeout;
-
-    /* Block if pipeline is empty, else return immediately. */
-    timeout = (ew->db.queue.count == 0) ? -1 : 0;
 
-    nfds = epoll_wait(server->epfd, ew->ep_events, EWORKER_MAX_EVENTS, timeout);
+    /* Called when server->epfd or client_epfd is readable, never block. */
+    nfds = epoll_wait(epfd, ew->ep_events, EWORKER_MAX_EVENTS, 0);
     if (nfds == -1)
     {
         error("%s: epoll_wait: %s",
@@ -55,6 +64,114 @@ eworker_wait_for_events(eworker_t* ew)
     }
 }
 
+static i32
+eworker_ctl(eworker_t* ew, i32 op, i32 fd, u32 events)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.fd = fd
+    };
+
+    if (epoll_ctl(ew->epfd, op, fd, &ev) == -1)
+    {
+        error("%s: epoll_ctl(%d, %d): %s\n",
+              ew->name, op, fd, ERRSTR);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Flush pending libpq output, wait for EPOLLOUT on db.fd
+ * if the socket buffer is full.
+ */
+static void
+eworker_db_flush(eworker_t* ew)
+{
+    u32 events = EPOLLIN;
+    i32 ret;
+
+    if ((ret = PQflush(ew->db.conn)) == -1)
+        error("%s: PQflush: %s\n", 
+              ew->name, PQerrorMessage(ew->db.conn));
+    else if (ret == 1)
+        events |= EPOLLOUT;
+
+    if (events != ew->db_events && 
+        eworker_ctl(ew, EPOLL_CTL_MOD, ew->db.fd, events) == 0)
+        ew->db_events = events;
+}
+
+/*
+ * Backpressure: Too much in-flight, only wait for DB results
+ * (and mail) and let other eworkers take new events. 
+ * Our own clients wait.
+ */
+static void
+eworker_backpressure(eworker_t* ew)
+{
+    const i32 server_epfd = ew->server->epfd;
+    const i32 sock = ew->server->sock;
+    const bool over = ew->db.queue.count >= DB_PIPELINE_BACKPRESSURE;
+
+    if (over == ew->backpressure)
+        return;
+
+    if (over)
+    {
+        ew->db.queue.metrics.backpressure++;
+        eworker_ctl(ew, EPOLL_CTL_DEL, sock, 0);
+        eworker_ctl(ew, EPOLL_CTL_DEL, server_epfd, 0);
+        eworker_ctl(ew, EPOLL_CTL_DEL, ew->client_epfd, 0);
+    }
+    else
+    {
+        eworker_ctl(ew, EPOLL_CTL_ADD, sock, EPOLLIN | EPOLLEXCLUSIVE);
+        eworker_ctl(ew, EPOLL_CTL_ADD, server_epfd, EPOLLIN);
+        eworker_ctl(ew, EPOLL_CTL_ADD, ew->client_epfd, EPOLLIN);
+    }
+    ew->backpressure = over;
+}
+
+static bool
+eworker_stats_timer(eworker_t* ew)
+{
+    struct itimerspec it = {
+        .it_value.tv_sec = ew->server->conf.stats_interval,
+        .it_interval.tv_sec = ew->server->conf.stats_interval
+    };
+
+    if ((ew->stats_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+    {
+        error("%s: timerfd_create: %s\n", ew->name, ERRSTR);
+        return false;
+    }
+    if (timerfd_settime(ew->stats_fd, 0, &it, NULL) == -1)
+    {
+        error("%s: timerfd_settime: %s\n", ew->name, ERRSTR);
+        return false;
+    }
+    return eworker_ctl(ew, EPOLL_CTL_ADD, ew->stats_fd, EPOLLIN) == 0;
+}
+
+static void
+eworker_stats_expired(eworker_t* ew)
+{
+    u64 exp;
+
+    if (read(ew->stats_fd, &exp, sizeof(u64)) == -1 && errno != EAGAIN)
+        error("%s: read stats timer: %s\n", ew->name, ERRSTR);
+    server_eworker_stats(ew);
+
+    /* Shared ones, once */
+    if (ew == ew->server->tm.workers)
+    {
+        server_compute_stats(&ew->server->compute);
+        server_compute_stats(&ew->server->io);
+        server_msg_cache_stats(&ew->server->msg_cache);
+    }
+}
+
 bool 
 server_create_eworker(server_t* server, eworker_t* ew, size_t i)
 {
@@ -75,12 +192,57 @@ bool
 server_eworker_init(eworker_t* ew)
 {
     ew->tid = gettid();
+    eworker_self = ew;
+
+    ew->recv_buf_size = EWORKER_RECV_BUF_SIZE;
+    if ((ew->recv_buf = malloc(ew->recv_buf_size)) == NULL)
+    {
+        error("%s: malloc recv_buf: %s\n", ew->name, ERRSTR);
+        return false;
+    }
+
     if (!server_db_open(&ew->db, ew->server->conf.database, 
-                        DB_PIPELINE | DB_NONBLOCK))
+                        DB_PIPELINE | DB_NONBLOCK | DB_PREPARE))
+        return false;
+
+    if ((ew->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+        (ew->client_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        error("%s: epoll_create1: %s\n",
+              ew->name, ERRSTR);
+        return false;
+    }
+
+    ew->stats_fd = -1;
+    if ((ew->mail_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+        (ew->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        error("%s: eventfd: %s\n",
+              ew->name, ERRSTR);
+        return false;
+    }
+
+    /*
+     * server->epfd & client_epfd are nested in our own epoll set, 
+     * so we block on client events & DB results at the same time.
+     * The listen socket is in every eworker's set, EPOLLEXCLUSIVE wakes
+     * one of us per connection, not all. (Not on server->epfd, the kernel
+     * refuses it on an epoll fd.)
+     */
+    ew->db_events = EPOLLIN;
+    if (eworker_ctl(ew, EPOLL_CTL_ADD, ew->db.fd, ew->db_events) == -1 ||
+        eworker_ctl(ew, EPOLL_CTL_ADD, ew->server->sock, EPOLLIN | EPOLLEXCLUSIVE) == -1 ||
+        eworker_ctl(ew, EPOLL_CTL_ADD, ew->server->epfd, EPOLLIN) == -1 ||
+        eworker_ctl(ew, EPOLL_CTL_ADD, ew->client_epfd, EPOLLIN) == -1 ||
+        eworker_ctl(ew, EPOLL_CTL_ADD, ew->mail_fd, EPOLLIN) == -1 ||
+        eworker_ctl(ew, EPOLL_CTL_ADD, ew->done_fd, EPOLLIN) == -1)
+        return false;
+
+    if (ew->server->conf.stats_interval > 0 && !eworker_stats_timer(ew))
         return false;
 
     PQpipelineSync(ew->db.conn);
-    db_process_results(ew);
+    eworker_db_flush(ew);
 
     debug("%s up & running!\n", ew->name);
     return true;
@@ -91,35 +253,79 @@ server_eworker_async_run(eworker_t* ew)
 {
     server_t* server = ew->server;
     server_tm_t* tm = &server->tm;
-    // server_db_t* db = &ew->db;
-    struct pollfd pfd = {
-        .fd = ew->db.fd,
-        .events = POLLIN
-    };
-    i32 ret;
+    struct epoll_event events[5];
+    i32 nfds;
+    i32 fd;
 
     while ((tm->state & TM_STATE_SHUTDOWN) == 0)
     {
-        if ((ret = poll(&pfd, 1, 0)) == -1) 
+        /* Holds no client_t* while waiting */
+        server_client_quiescent(ew);
+        nfds = epoll_wait(ew->epfd, events, 5, -1);
+        server_client_online(ew);
+
+        if (nfds == -1)
         {
-            error("poll: %s\n", ERRSTR);
+            if (errno == EINTR)
+                continue;
+            error("%s: epoll_wait: %s\n", 
+                  ew->name, ERRSTR);
             tm->state |= TM_STATE_SHUTDOWN;
             break;
         }
 
-        // debug("tid: %d\n\tret: %d\n\tdb->queue: %d\n", 
-        //       ew->tid, ret, db->queue.count);
-
-        if (ret > 0)
-            db_process_results(ew);
+        for (i32 i = 0; i < nfds; i++)
+        {
+            fd = events[i].data.fd;
+            if (fd == ew->db.fd)
+                db_process_results(ew);
+            else if (fd == ew->mail_fd)
+                server_mailbox_deliver(ew);
+            else if (fd == ew->done_fd)
+                server_compute_complete(ew);
+            else if (fd == ew->stats_fd)
+                eworker_stats_expired(ew);
+            else if (fd == server->sock)
+                se_accept_conn(ew, NULL);
+            else
+                eworker_wait_for_events(ew, fd);
+        }
 
-        eworker_wait_for_events(ew);
+        db_flush_group_msgs(ew);
+        eworker_db_flush(ew);
+        eworker_backpressure(ew);
     }
 }
 
+void
+server_eworker_stats(eworker_t* ew)
+{
+    const plq_metrics_t* m = &ew->db.queue.metrics;
+
+    info("%s pipeline: in flight: %zu, total: %lu, high water: %zu, size: %zu, "
+         "grows: %zu, backpressure: %zu\n",
+         ew->name, ew->db.queue.count, m->total, m->high_water, ew->db.queue.size, 
+         m->grows, m->backpressure);
+    info("%s msg batches: %lu, rows: %lu\n", 
+         ew->name, ew->db.msg_batch.batches, ew->db.msg_batch.total);
+}
+
 void 
 server_eworker_cleanup(eworker_t* ew)
 {
+    server_eworker_stats(ew);
+
+    if (ew->epfd > 0)
+        close(ew->epfd);
+    if (ew->client_epfd > 0)
+        close(ew->client_epfd);
+    if (ew->mail_fd > 0)
+        close(ew->mail_fd);
+    if (ew->done_fd > 0)
+        close(ew->done_fd);
+    if (ew->stats_fd > 0)
+        close(ew->stats_fd);
+    free(ew->recv_buf);
     server_db_close(&ew->db);
     debug("%s shutdown.\n", ew->name);
 }
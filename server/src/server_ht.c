@@ -259,7 +259,9 @@ server_ght_del(server_ght_t* ht, u64 key)
     {
         if (bucket->key == key)
         {
-            prev->next = NULL;
+            /* Next one is moved into `bucket`, keep it linked */
+            if (bucket->next == NULL)
+                prev->next = NULL;
             ght_del_bucket(ht, bucket);
             goto unlock;
         }
@@ -1,5 +1,6 @@
 #include "server_http.h"
 #include "server.h"
+#include "server_msgpack.h"
 
 #define NAME_CMP(x) !strncmp(header->name, x, HTTP_HEAD_NAME_LEN)
 
@@ -167,6 +168,18 @@ parse_url(http_t* http, char* url)
     strncpy(http->req.url, path, HTTP_URL_LEN);
 }
 
+static bool
+http_is_multipart(const http_t* http)
+{
+    char boundary[MULTIPART_BOUNDARY_MAX + 1];
+    const http_header_t* content_type;
+
+    if (http->type != HTTP_REQUEST || strncmp(http->req.method, "POST", HTTP_METHOD_LEN))
+        return false;
+    content_type = http_get_header(http, HTTP_HEAD_CONTENT_TYPE);
+    return content_type && server_multipart_boundary(content_type->val, boundary);
+}
+
 static http_t* 
 parse_http(client_t* client, char* buf, size_t buf_len) 
 {
@@ -285,13 +298,25 @@ parse_http(client_t* client, char* buf, size_t buf_len)
     {
         if (http->body_len > actual_body_len)
         {
+            /* Parsed as it's received, held a part at a time at most */
+            if (http_is_multipart(http))
+                http->buf.stream = true;
+            else if (http->body_len > HTTP_BODY_MAX)
+            {
+                warn("HTTP body too large: %zu\n", http->body_len);
+                server_http_resp_error(client, HTTP_CODE_TOO_LARGE, "Payload Too Large");
+                http_free(http);
+                return NULL;
+            }
             http->buf.missing = true;
             http->buf.total_recv = actual_body_len;
+            client->recv.http = http;
+            if (http->buf.stream)
+                return http;
             char* new_body = calloc(1, http->body_len);
             memcpy(new_body, http->body, actual_body_len);
             http->body = new_body;
             http->body_inheap = true;
-            client->recv.http = http;
         }
     }
 
@@ -335,6 +360,8 @@ http_free(http_t* http)
 
     if (http->body && http->body_inheap)
         free(http->body);
+    free(http->buf.digest);
+    server_multipart_free(http->buf.multipart);
 
     free(http);
 }
@@ -353,7 +380,7 @@ http_get_header(const http_t* http, const char* name)
     return NULL;
 }
 
-static void 
+void 
 http_add_header(http_t* http, const char* name, const char* val)
 {
     if (!http || !name || !val)
@@ -387,13 +414,41 @@ http_add_header(http_t* http, const char* name, const char* val)
     strncpy(to_header->val, val, HTTP_HEAD_VAL_LEN);
 }
 
+/* Client offers a comma separated subprotocol list, pick ours if it's there. */
+static bool
+http_ws_wants_msgpack(const http_t* req_http)
+{
+    const http_header_t* proto;
+    char list[HTTP_HEAD_VAL_LEN];
+    char* saveptr;
+    char* token;
+
+    proto = http_get_header(req_http, HTTP_HEAD_WS_PROTO);
+    if (proto == NULL)
+        return false;
+
+    strncpy(list, proto->val, HTTP_HEAD_VAL_LEN - 1);
+    list[HTTP_HEAD_VAL_LEN - 1] = 0x00;
+
+    for (token = strtok_r(list, ", ", &saveptr); token; 
+         token = strtok_r(NULL, ", ", &saveptr))
+    {
+        if (!strcmp(token, WS_PROTO_MSGPACK))
+            return true;
+    }
+    return false;
+}
+
 static void 
 server_upgrade_client_to_websocket(client_t* client, http_t* req_http)
 {
+    const bool msgpack = http_ws_wants_msgpack(req_http);
     http_t* http = http_new_resp(HTTP_CODE_SW_PROTO, "Switching Protocols", NULL, 0);
     http_add_header(http, "Connection", HTTP_HEAD_CONN_UPGRADE);
     http_add_header(http, "Upgrade", "websocket");
     http_add_header(http, HTTP_HEAD_WS_ACCEPT, req_http->websocket_key);
+    if (msgpack)
+        http_add_header(http, HTTP_HEAD_WS_PROTO, WS_PROTO_MSGPACK);
 
     for (size_t i = 0; i < http->n_params; i++)
     {
@@ -402,7 +457,11 @@ server_upgrade_client_to_websocket(client_t* client, http_t* req_http)
     }
 
     if (http_send(client, http) != -1)
+    {
         client->state |= CLIENT_STATE_WEBSOCKET;
+        if (msgpack)
+            client->state |= CLIENT_STATE_WS_MSGPACK;
+    }
     http_free(http);
     free(req_http->websocket_key);
 }
@@ -516,9 +575,13 @@ server_handle_http_req(eworker_t* th, client_t* client, http_t* http)
     enum client_recv_status ret = RECV_OK;
 
     if (!HTTP_CMP_METHOD("GET"))
-        server_handle_http_get(th->server, client, http);
+        server_handle_http_get(th, client, http);
     else if (!HTTP_CMP_METHOD("POST"))
         server_handle_http_post(th, client, http);
+    else if (!HTTP_CMP_METHOD("PUT"))
+        server_handle_http_put(th, client, http);
+    else if (!HTTP_CMP_METHOD("HEAD"))
+        server_handle_http_head(th, client, http);
     else
     {
         warn("Need to implement '%s' HTTP request.\n", http->req.method);
@@ -577,6 +640,11 @@ server_http_parse(eworker_t* th, client_t* client, u8* buf, size_t buf_len)
 
     if (!http->buf.missing)
         ret = server_handle_http(th, client, http);
+    else if (http->type == HTTP_REQUEST && !strncmp(http->req.method, "POST", HTTP_METHOD_LEN))
+    {
+        if (!server_http_body_begin(th, client, http))
+            ret = RECV_ERROR;
+    }
 
     return ret;
 }
@@ -593,12 +661,12 @@ http_send(client_t* client, http_t* http)
     ssize_t bytes_sent = 0;
     http_to_str_t to_str = http_to_str(http);
 
-    verbose("HTTP send to fd:%d (%s:%s), len: %zu\n%s\n", client->addr.sock, client->addr.ip_str, client->addr.serv, to_str.len, to_str.str);
+    verbose("HTTP send to fd:%d (%s:%u), len: %zu\n%s\n", client->addr.sock, client->addr.ip_str, client->addr.port, to_str.len, to_str.str);
 
     if ((bytes_sent = server_send(client, to_str.str, to_str.len)) == -1)
     {
-        error("HTTP send to (fd: %d, IP: %s:%s): %s\n",
-            client->addr.sock, client->addr.ip_str, client->addr.serv, ERRSTR
+        error("HTTP send to (fd: %d, IP: %s:%u): %s\n",
+            client->addr.sock, client->addr.ip_str, client->addr.port, ERRSTR
         );
     }
 
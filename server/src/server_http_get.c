@@ -2,14 +2,327 @@
 #include "server_http.h"
 #include "server_util.h"
 
+#define SNIFF_MIME_LEN 128
+#define UPLOAD_CACHE_CONTROL "public, max-age=31536000, immutable"
+#define UPLOAD_READ_MAX     (2 * KIB * KIB)   /* Read & sent at a time, ranges are cut to it */
+
+/* No content type from the extension, let libmagic sniff it on the compute pool */
+typedef struct 
+{
+    compute_job_t   job;
+    char*           content;
+    size_t          content_len;
+    char            content_type[SNIFF_MIME_LEN];
+} sniff_job_t;
+
+static void
+sniff_run(compute_thread_t* ct, compute_job_t* job)
+{
+    sniff_job_t* sj = (sniff_job_t*)job;
+    const char* mime_type;
+
+    if ((mime_type = server_compute_mime_type(ct, sj->content, sj->content_len)))
+        strncpy(sj->content_type, mime_type, SNIFF_MIME_LEN - 1);
+}
+
+static void
+sniff_done(UNUSED eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    sniff_job_t* sj = (sniff_job_t*)job;
+
+    if (job->status != COMPUTE_CANCELLED && client)
+        server_http_resp_ok(client, sj->content, sj->content_len, sj->content_type);
+    free(sj->content);
+    free(sj);
+}
+
+static bool
+server_http_get_sniff(eworker_t* ew, client_t* client, char* content, 
+                      size_t content_len, const char* content_type)
+{
+    sniff_job_t* sj;
+
+    if ((sj = calloc(1, sizeof(sniff_job_t))) == NULL)
+        return false;
+    sj->job.run = sniff_run;
+    sj->job.done = sniff_done;
+    sj->content = content;
+    sj->content_len = content_len;
+    strncpy(sj->content_type, content_type, SNIFF_MIME_LEN - 1);
+
+    if (server_compute_submit(ew, client, &sj->job) == false)
+    {
+        free(sj);
+        return false;
+    }
+    return true;
+}
+
+static void
+http_get_read_done(eworker_t* ew, client_t* client, io_read_t* rd)
+{
+    const char* content_type;
+
+    if (client == NULL)
+    {
+        free(rd->data);
+        return;
+    }
+    if (rd->data == NULL)
+    {
+        server_http_resp_404_not_found(client);
+        return;
+    }
+
+    content_type = server_get_content_type(rd->path);
+    if (strcmp(content_type, "application/octet-stream") == 0 &&
+        server_http_get_sniff(ew, client, rd->data, rd->size, content_type))
+    {
+        verbose("Got file (sniffing): '%s'\n", rd->path);
+        return;
+    }
+
+    verbose("Got file (%s): '%s'\n", content_type, rd->path);
+    server_http_resp_ok(client, rd->data, rd->size, content_type);
+    free(rd->data);
+}
+
+/* Uploads are named by their hash, they never change */
+typedef struct 
+{
+    char    etag[SERVER_HASH256_STR_SIZE + 2];
+    char    content_type[DB_MIME_TYPE_LEN];
+    bool    range;
+    size_t  sent;   /* Whole file, bigger than a chunk: body sent so far */
+} upload_get_t;
+
+static void
+upload_add_cache_headers(http_t* resp, const char* etag)
+{
+    http_add_header(resp, "ETag", etag);
+    http_add_header(resp, "Cache-Control", UPLOAD_CACHE_CONTROL);
+    http_add_header(resp, "Accept-Ranges", "bytes");
+}
+
+/* 
+ * Uploads are whatever users sent, served from our origin. Only raster images 
+ * and video may show inline, the rest (HTML, SVG, ...) is a download.
+ */
+static bool
+upload_inline_type(const char* content_type)
+{
+    static const char* const inline_types[] = {
+        "image/png", "image/jpeg", "image/gif", "image/webp", 
+        "image/avif", "image/bmp", "video/", NULL
+    };
+
+    for (size_t i = 0; inline_types[i]; i++)
+        if (strncmp(content_type, inline_types[i], strlen(inline_types[i])) == 0)
+            return true;
+    return false;
+}
+
+static void
+upload_add_content_headers(http_t* resp, const char* content_type)
+{
+    http_add_header(resp, HTTP_HEAD_CONTENT_TYPE, content_type);
+    http_add_header(resp, "X-Content-Type-Options", "nosniff");
+    if (!upload_inline_type(content_type))
+        http_add_header(resp, "Content-Disposition", "attachment");
+}
+
+/* "bytes=a-b", "bytes=a-" or "bytes=-n". Anything else (multiple ranges too) is ignored. */
+static bool
+http_parse_range(const char* val, i64* offset, size_t* len)
+{
+    const char* str;
+    char* end;
+    u64 first;
+    u64 last;
+
+    if (strncmp(val, "bytes=", 6) != 0 || strchr(val, ','))
+        return false;
+    str = val + 6;
+    errno = 0;
+
+    if (*str == '-')
+    {
+        last = strtoull(str + 1, &end, 10);
+        if (end == str + 1 || *end || errno || last == 0 || last > INT64_MAX)
+            return false;
+        *offset = -(i64)last;
+        *len = 0;
+        return true;
+    }
+
+    first = strtoull(str, &end, 10);
+    if (end == str || *end != '-' || errno || first > INT64_MAX)
+        return false;
+    str = end + 1;
+    *offset = first;
+    *len = 0;
+    if (*str == 0x00)
+        return true;
+
+    last = strtoull(str, &end, 10);
+    if (end == str || *end || errno || last < first)
+        return false;
+    *len = last - first + 1;
+    return true;
+}
+
+static void upload_chunk_done(eworker_t* ew, client_t* client, io_read_t* rd);
+
+/* Content-Length went out already, all we can do is hang up. Its read gets EOF. */
+static void
+upload_hang_up(client_t* client)
+{
+    shutdown(client->addr.sock, SHUT_RDWR);
+}
+
+/* 
+ * Whole file, a chunk at a time: each one is sent once it's read, 
+ * the next is read after. False when it's done (or failed).
+ */
+static bool
+upload_send_chunk(eworker_t* ew, client_t* client, io_read_t* rd)
+{
+    upload_get_t* ug = rd->arg;
+
+    if (server_send(client, rd->data, rd->size) == -1)
+        return false;
+    ug->sent += rd->size;
+    if (ug->sent >= rd->file_size)
+        return false;
+    if (server_io_read_range(ew, client, rd->path, ug->sent, UPLOAD_READ_MAX, 
+                             upload_chunk_done, ug))
+        return true;
+    upload_hang_up(client);
+    return false;
+}
+
+static void
+upload_chunk_done(eworker_t* ew, client_t* client, io_read_t* rd)
+{
+    upload_get_t* ug = rd->arg;
+
+    if (client && rd->size == 0)
+    {
+        /* Gone or cut short since the first chunk */
+        upload_hang_up(client);
+    }
+    else if (client && upload_send_chunk(ew, client, rd))
+        ug = NULL;
+    free(rd->data);
+    free(ug);
+}
+
+static void
+upload_read_done(eworker_t* ew, client_t* client, io_read_t* rd)
+{
+    upload_get_t* ug = rd->arg;
+    char val[HTTP_HEAD_VAL_LEN];
+    http_t* resp;
+
+    if (client == NULL)
+        goto out;
+    if (rd->data == NULL)
+    {
+        if (rd->err != ERANGE)
+        {
+            server_http_resp_404_not_found(client);
+            goto out;
+        }
+        resp = http_new_resp(HTTP_CODE_RANGE_NOT_SAT, "Range Not Satisfiable", NULL, 0);
+        snprintf(val, HTTP_HEAD_VAL_LEN, "bytes */%zu", rd->file_size);
+        http_add_header(resp, "Content-Range", val);
+        http_add_header(resp, HTTP_HEAD_CONTENT_LEN, "0");
+    }
+    else if (ug->range && rd->size)
+    {
+        resp = http_new_resp(HTTP_CODE_PARTIAL, "Partial Content", rd->data, rd->size);
+        snprintf(val, HTTP_HEAD_VAL_LEN, "bytes %zu-%zu/%zu", 
+                 (size_t)rd->offset, (size_t)rd->offset + rd->size - 1, rd->file_size);
+        http_add_header(resp, "Content-Range", val);
+    }
+    else if (rd->size < rd->file_size)
+    {
+        /* Too big for one read, the body follows in chunks */
+        resp = http_new_resp(HTTP_CODE_OK, "OK", NULL, 0);
+        snprintf(val, HTTP_HEAD_VAL_LEN, "%zu", rd->file_size);
+        http_add_header(resp, HTTP_HEAD_CONTENT_LEN, val);
+        upload_add_content_headers(resp, ug->content_type);
+        upload_add_cache_headers(resp, ug->etag);
+        http_send(client, resp);
+        http_free(resp);
+        if (upload_send_chunk(ew, client, rd))
+            ug = NULL;
+        goto out;
+    }
+    else
+        resp = http_new_resp(HTTP_CODE_OK, "OK", rd->data, rd->size);
+
+    upload_add_content_headers(resp, ug->content_type);
+    upload_add_cache_headers(resp, ug->etag);
+    http_send(client, resp);
+    http_free(resp);
+out:
+    free(rd->data);
+    free(ug);
+}
+
+static enum client_recv_status
+http_get_upload(eworker_t* ew, client_t* client, const http_t* http, 
+                const char* path, const char* hash)
+{
+    const http_header_t* header;
+    upload_get_t* ug;
+    http_t* resp;
+    i64 offset = 0;
+    size_t len = 0;
+
+    if ((ug = calloc(1, sizeof(upload_get_t))) == NULL)
+        goto err;
+    snprintf(ug->etag, sizeof(ug->etag), "\"%s\"", hash);
+
+    /* Same hash, same bytes: any match is still fresh */
+    header = http_get_header(http, "If-None-Match");
+    if (header && (strstr(header->val, hash) || !strcmp(header->val, "*")))
+    {
+        resp = http_new_resp(HTTP_CODE_NOT_MODIFIED, "Not Modified", NULL, 0);
+        upload_add_cache_headers(resp, ug->etag);
+        http_send(client, resp);
+        http_free(resp);
+        free(ug);
+        return RECV_OK;
+    }
+
+    if (!server_store_mime_type(&ew->server->store, hash, ug->content_type))
+        strcpy(ug->content_type, "application/octet-stream");
+    if ((header = http_get_header(http, "Range")))
+        ug->range = http_parse_range(header->val, &offset, &len);
+    if (!ug->range)
+        offset = 0;
+    /* A range past a chunk gets the chunk (206 says so), they ask for the rest */
+    if (len == 0 || len > UPLOAD_READ_MAX)
+        len = UPLOAD_READ_MAX;
+
+    if (server_io_read_range(ew, client, path, offset, len, upload_read_done, ug))
+        return RECV_OK;
+err:
+    free(ug);
+    server_http_resp_error(client, HTTP_CODE_INTERAL_ERROR, "Internal server error");
+    return RECV_ERROR;
+}
+
 enum client_recv_status 
-server_handle_http_get(server_t* server, client_t* client, http_t* http)
+server_handle_http_get(eworker_t* ew, client_t* client, http_t* http)
 {    
+    server_t* server = ew->server;
+
     char path[PATH_MAX];
     memset(path, 0, PATH_MAX);
-    i32 fd;
-    size_t content_len;
-    char* content;
+    const char* upload_hash;
     size_t url_len = strnlen(http->req.url, HTTP_URL_LEN);
 
     if (server_http_url_checks(http) == -1)
@@ -23,7 +336,10 @@ server_handle_http_get(server_t* server, client_t* client, http_t* http)
         snprintf(path, PATH_MAX, "%s%s%s", server->conf.root_dir, http->req.url, "index.html"); 
     else
         snprintf(path, PATH_MAX, "%s%s", server->conf.root_dir, http->req.url); 
-    
+    /* Uploads are fanned out on disk, not in their URLs */
+    if ((upload_hash = server_store_resolve(server, path)))
+        return http_get_upload(ew, client, http, path, upload_hash);
+
     i32 isdir = file_isdir(path);
     if (isdir == -1)
     {
@@ -33,36 +349,11 @@ server_handle_http_get(server_t* server, client_t* client, http_t* http)
     else if (isdir)
         strcat(path, "/index.html");
 
-    const char* content_type = server_get_content_type(path);
-
-    fd = open(path, O_RDONLY);
-    if (fd == -1)
-    {
-        error("GET request of '%s' failed: %s\n", path, ERRSTR);
-        server_http_resp_404_not_found(client);
-        return RECV_ERROR;
-    }
-    content_len = fdsize(fd);
-    content = malloc(content_len);
-    if (read(fd, content, content_len) == -1)
+    if (server_io_read_file(ew, client, path, http_get_read_done, NULL) == false)
     {
-        error("read '%s' failed: %s\n", path, ERRSTR);
-        close(fd);
-        server_http_resp_404_not_found(client);
+        server_http_resp_error(client, HTTP_CODE_INTERAL_ERROR, "Internal server error");
         return RECV_ERROR;
     }
-    close(fd);
-
-    if (strcmp(content_type, "application/octet-stream") == 0)
-    {
-        const char* temp = server_mime_type(server, content, content_len);
-        if (temp)
-            content_type = temp;
-    }
-
-    verbose("Got file (%s): '%s'\n", content_type, path);
-    server_http_resp_ok(client, content, content_len, content_type);
-    free(content);
 
     return RECV_OK;
 }
@@ -1,12 +1,194 @@
 #include "server.h"
 #include "chat/user_upload.h"
+#include "chat/upload_session.h"
 
 /*
- * Currently only the chat-backend will handle HTTP POST requests.
+ * Currently only the chat-backend will handle HTTP POST/PUT/HEAD requests.
  */
 
+#define UPLOAD_SESSION_URL "/upload/session"
+
+static bool
+http_is_upload_session(const http_t* http)
+{
+    const size_t len = sizeof(UPLOAD_SESSION_URL) - 1;
+
+    return !strncmp(http->req.url, UPLOAD_SESSION_URL, len) && 
+           (http->req.url[len] == 0x00 || http->req.url[len] == '/');
+}
+
+void 
+server_handle_http_post(eworker_t* th, client_t* client, http_t* http)
+{
+    if (http_is_upload_session(http))
+        server_upload_session_post(th, client, http);
+    else
+        server_handle_user_upload(th, client, http);
+}
+
+void 
+server_handle_http_put(eworker_t* th, client_t* client, http_t* http)
+{
+    if (http_is_upload_session(http))
+        server_upload_session_put(th, client, http);
+    else
+        server_http_resp_404_not_found(client);
+}
+
 void 
-server_handle_http_post(eworker_t* th, client_t* client, const http_t* http)
+server_handle_http_head(eworker_t* th, client_t* client, http_t* http)
+{
+    if (http_is_upload_session(http))
+        server_upload_session_head(th, client, http);
+    else
+        server_http_resp_404_not_found(client);
+}
+
+typedef struct body_sniff_job
+{
+    compute_job_t   job;
+    http_t*         http;   /* Body completed before the sniff did */
+    char            mime_type[HTTP_MIME_TYPE_LEN];
+    size_t          len;
+    u8              data[];
+} body_sniff_job_t;
+
+/* Compute thread */
+static void
+body_sniff_run(compute_thread_t* ct, compute_job_t* job)
 {
-    server_handle_user_upload(th, client, http);
+    body_sniff_job_t* sj = (body_sniff_job_t*)job;
+    const char* mime_type;
+
+    if ((mime_type = server_compute_mime_type(ct, sj->data, sj->len)))
+        strncpy(sj->mime_type, mime_type, HTTP_MIME_TYPE_LEN - 1);
+}
+
+static void
+body_sniff_done(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    body_sniff_job_t* sj = (body_sniff_job_t*)job;
+    http_t* http = sj->http;
+    http_digest_t* digest;
+
+    if (job->status == COMPUTE_CANCELLED)
+    {
+        http_free(sj->http);
+        free(sj);
+        return;
+    }
+
+    /* Still receiving, unless the client left or moved on */
+    if (http == NULL && client)
+        http = client->recv.http;
+    if (http && (digest = http->buf.digest) && digest->sniff == sj)
+    {
+        memcpy(digest->mime_type, sj->mime_type, HTTP_MIME_TYPE_LEN);
+        digest->sniff = NULL;
+    }
+
+    if (sj->http)
+    {
+        if (client)
+            server_handle_http(ew, client, sj->http);
+        else
+            http_free(sj->http);
+    }
+    free(sj);
+}
+
+static void
+body_sniff(eworker_t* ew, client_t* client, http_t* http)
+{
+    http_digest_t* digest = http->buf.digest;
+    size_t len = (http->body_len < HTTP_SNIFF_LEN) ? http->body_len : HTTP_SNIFF_LEN;
+    body_sniff_job_t* sj;
+
+    if (digest->sniff_sent || http->buf.total_recv < len)
+        return;
+    digest->sniff_sent = true;
+
+    if ((sj = malloc(sizeof(body_sniff_job_t) + len)) == NULL)
+    {
+        error("body sniff malloc: %s\n", ERRSTR);
+        return;
+    }
+    sj->job.run = body_sniff_run;
+    sj->job.done = body_sniff_done;
+    sj->http = NULL;
+    sj->mime_type[0] = 0x00;
+    sj->len = len;
+    memcpy(sj->data, http->body, len);
+
+    /* Full queue is fine, the upload sniffs the whole body later */
+    if (server_compute_submit(ew, client, &sj->job) == false)
+        free(sj);
+    else
+        digest->sniff = sj;
+}
+
+bool 
+server_http_body_begin(eworker_t* ew, client_t* client, http_t* http)
+{
+    http_digest_t* digest;
+
+    if (http->buf.stream)
+    {
+        if ((http->buf.multipart = server_user_upload_stream(ew, client, http)) == NULL)
+            return false;
+        server_multipart_feed(http->buf.multipart, ew, client, 
+                              http->body, http->buf.total_recv);
+        /* Pointed into the read buffer */
+        http->body = NULL;
+        return true;
+    }
+
+    if ((digest = calloc(1, sizeof(http_digest_t))) == NULL)
+    {
+        error("calloc http digest: %s\n", ERRSTR);
+        return true;
+    }
+    SHA256_Init(&digest->sha256);
+    http->buf.digest = digest;
+
+    server_http_body_recv(ew, client, http, http->body, http->buf.total_recv);
+    return true;
+}
+
+void 
+server_http_body_recv(eworker_t* ew, client_t* client, http_t* http,
+                      const void* data, size_t len)
+{
+    if (http->buf.multipart)
+    {
+        server_multipart_feed(http->buf.multipart, ew, client, data, len);
+        return;
+    }
+    SHA256_Update(&http->buf.digest->sha256, data, len);
+    body_sniff(ew, client, http);
+}
+
+void 
+server_http_body_complete(eworker_t* ew, client_t* client, http_t* http)
+{
+    http_digest_t* digest = http->buf.digest;
+
+    if (http->buf.multipart)
+    {
+        server_multipart_end(http->buf.multipart, ew, client);
+        http_free(http);
+        return;
+    }
+
+    if (digest)
+    {
+        server_sha256_final_str(&digest->sha256, digest->hash);
+        if (digest->sniff)
+        {
+            /* body_sniff_done() handles it */
+            digest->sniff->http = http;
+            return;
+        }
+    }
+    server_handle_http(ew, client, http);
 }
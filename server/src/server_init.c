@@ -3,7 +3,6 @@
 #include "server.h"
 #include "server_events.h"
 #include "server_ht.h"
-#include "chat/cmd.h"
 #include <sys/eventfd.h>
 
 #define LISTEN_BACKLOG 100
@@ -32,6 +31,26 @@ server_default_config(void)
                            json_object_new_string("chitychat"));
     json_object_object_add(config, "thread_pool",
                            json_object_new_int(-1));
+    json_object_object_add(config, "footprint",
+                           json_object_new_boolean(false));
+    json_object_object_add(config, "compute_threads",
+                           json_object_new_int(-1));
+    json_object_object_add(config, "io_threads",
+                           json_object_new_int(4));
+    json_object_object_add(config, "fsync_files",
+                           json_object_new_boolean(true));
+    json_object_object_add(config, "upload_max",
+                           json_object_new_int64(1024LL * KIB * KIB));
+    json_object_object_add(config, "upload_quota",
+                           json_object_new_int64(4096LL * KIB * KIB));
+    json_object_object_add(config, "ws_frame_max",
+                           json_object_new_int64(HTTP_BODY_MAX));
+    json_object_object_add(config, "write_behind",
+                           json_object_new_boolean(false));
+    json_object_object_add(config, "wal_dir",
+                           json_object_new_string("server/wal"));
+    json_object_object_add(config, "stats_interval",
+                           json_object_new_int(60));
 
     return config;
 }
@@ -62,6 +81,10 @@ print_help(const char* exe_path)
         "  -d, --database-name=NAME\tPostgreSQL database name\n"\
         "  -T, --thread-pool=N\t\tSet the number of threads for the thread pool,\n"\
         "\t\t\t\tUse -1 (default) to automatically determine the number based on system threads.\n"\
+        "  -C, --compute-threads=N\tThreads for hashing & MIME sniffing,\n"\
+        "\t\t\t\tUse -1 (default) for half the system threads.\n"\
+        "  -I, --io-threads=N\t\tThreads for file reads & writes (default 4)\n"\
+        "  -F, --footprint\t\tLow memory per idle connection (release OpenSSL buffers)\n"\
         "  -6, --ipv6\t\t\tUse IPv6\n"\
         "  -4, --ipv4\t\t\tUse IPv4\n",
         exe_path
@@ -83,10 +106,13 @@ server_argv(server_t* server, int argc, char* const* argv)
         {"fork", 0, NULL, 'f'},
         {"help", 0, NULL, 'h'},
         {"thread-pool", required_argument, NULL, 'T'},
+        {"footprint", 0, NULL, 'F'},
+        {"compute-threads", required_argument, NULL, 'C'},
+        {"io-threads", required_argument, NULL, 'I'},
         {NULL, 0, NULL, 0}
     };
 
-    while ((opt = getopt_long(argc, argv, "T:p:d:v46hf", long_opts, NULL)) != -1)
+    while ((opt = getopt_long(argc, argv, "T:C:I:p:d:v46hfF", long_opts, NULL)) != -1)
     {
         switch (opt)
         {
@@ -127,6 +153,15 @@ server_argv(server_t* server, int argc, char* const* argv)
             case 'T':
                 server->conf.thread_pool = atoi(optarg);
                 break;
+            case 'F':
+                server->conf.footprint = true;
+                break;
+            case 'C':
+                server->conf.compute_threads = atoi(optarg);
+                break;
+            case 'I':
+                server->conf.io_threads = atoi(optarg);
+                break;
             case '?':
                 error("Unknown or missing argument\n");
                 return false;
@@ -136,6 +171,18 @@ server_argv(server_t* server, int argc, char* const* argv)
     return true;
 }
 
+/* No trailing '/', the store compares request paths against it */
+static void
+config_trim_dir(char* dir)
+{
+    size_t len = strnlen(dir, CONFIG_PATH_LEN - 1);
+
+    for (; len > 1; len--)
+        if (dir[len - 1] != '/')
+            break;
+    dir[len] = 0x00;
+}
+
 static bool        
 server_load_config(server_t* server, int argc, char* const* argv)
 {
@@ -153,6 +200,16 @@ server_load_config(server_t* server, int argc, char* const* argv)
     json_object* database;
     json_object* log_level_json;
     json_object* thread_pool_json;
+    json_object* footprint_json;
+    json_object* compute_threads_json;
+    json_object* io_threads_json;
+    json_object* fsync_files_json;
+    json_object* upload_max_json;
+    json_object* upload_quota_json;
+    json_object* ws_frame_max_json;
+    json_object* write_behind_json;
+    json_object* wal_dir_json;
+    json_object* stats_interval_json;
     const char* root_dir_str;
     const char* img_dir_str;
     const char* vid_dir_str;
@@ -261,6 +318,47 @@ server_load_config(server_t* server, int argc, char* const* argv)
     thread_pool_str = json_object_get_string(thread_pool_json);
     server->conf.thread_pool = atoi(thread_pool_str);
 
+    footprint_json = JSON_GET("footprint");
+    if (footprint_json)
+        server->conf.footprint = json_object_get_boolean(footprint_json);
+
+    compute_threads_json = JSON_GET("compute_threads");
+    server->conf.compute_threads = (compute_threads_json) 
+        ? json_object_get_int(compute_threads_json) : -1;
+
+    io_threads_json = JSON_GET("io_threads");
+    server->conf.io_threads = (io_threads_json) 
+        ? json_object_get_int(io_threads_json) : 4;
+
+    fsync_files_json = JSON_GET("fsync_files");
+    server->conf.fsync_files = (fsync_files_json) 
+        ? json_object_get_boolean(fsync_files_json) : true;
+
+    upload_max_json = JSON_GET("upload_max");
+    server->conf.upload_max = (upload_max_json) 
+        ? (size_t)json_object_get_int64(upload_max_json) : 1024LL * KIB * KIB;
+
+    upload_quota_json = JSON_GET("upload_quota");
+    server->conf.upload_quota = (upload_quota_json) 
+        ? (size_t)json_object_get_int64(upload_quota_json) : 4096LL * KIB * KIB;
+
+    ws_frame_max_json = JSON_GET("ws_frame_max");
+    server->conf.ws_frame_max = (ws_frame_max_json) 
+        ? (size_t)json_object_get_int64(ws_frame_max_json) : HTTP_BODY_MAX;
+
+    write_behind_json = JSON_GET("write_behind");
+    server->conf.write_behind = (write_behind_json) 
+        ? json_object_get_boolean(write_behind_json) : false;
+
+    wal_dir_json = JSON_GET("wal_dir");
+    strncpy(server->conf.wal_dir, 
+            (wal_dir_json) ? json_object_get_string(wal_dir_json) : "server/wal", 
+            CONFIG_PATH_LEN - 1);
+
+    stats_interval_json = JSON_GET("stats_interval");
+    server->conf.stats_interval = (stats_interval_json) 
+        ? json_object_get_int(stats_interval_json) : 60;
+
     log_level_json = JSON_GET("log_level");
     if (log_level_json)
     {
@@ -292,28 +390,23 @@ server_load_config(server_t* server, int argc, char* const* argv)
     if (!server_argv(server, argc, argv))
         return false;
 
-    verbose("Setting log level: %d\n", log_level);
-
-    server->conf.sql_schema = "server/sql/schema.sql";
-
-    server->conf.sql_insert_user = "server/sql/insert_user.sql";
-    server->conf.sql_select_user = "server/sql/select_user.sql";
+    config_trim_dir(server->conf.img_dir);
+    config_trim_dir(server->conf.vid_dir);
+    config_trim_dir(server->conf.file_dir);
 
-    server->conf.sql_insert_group = "server/sql/insert_group.sql";
-    server->conf.sql_select_group = "server/sql/select_group.sql";
-
-    server->conf.sql_insert_groupmember_code = "server/sql/insert_groupmember_code.sql";
-    server->conf.sql_select_groupmember = "server/sql/select_groupmember.sql";
-
-    server->conf.sql_insert_msg = "server/sql/insert_msg.sql";
-    server->conf.sql_select_msg = "server/sql/select_msg.sql";
-
-    server->conf.sql_update_user = "server/sql/update_user.sql";
+    verbose("Setting log level: %d\n", log_level);
 
-    server->conf.sql_insert_userfiles = "server/sql/insert_userfiles.sql";
+    /* Other SQL files are listed in DB_STMT_LIST (chat/db_def.h) */
+    server->conf.sql_schema = DB_SQL_DIR "schema.sql";
 
     if (server->conf.thread_pool == -1)
         server->conf.thread_pool = server_tm_system_threads();
+    if (server->conf.compute_threads == -1)
+        server->conf.compute_threads = server_tm_system_threads() / 2;
+    if (server->conf.compute_threads < 1)
+        server->conf.compute_threads = 1;
+    if (server->conf.io_threads < 1)
+        server->conf.io_threads = 1;
 
     return true;
 }
@@ -362,7 +455,8 @@ server_init_socket(server_t* server)
 
     server->addr = (struct sockaddr*)&server->addr_in;
 
-    server->sock = socket(domain, SOCK_STREAM, 0);
+    /* Non-blocking: more than one eworker may wake for a connection */
+    server->sock = socket(domain, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (server->sock == -1)
     {
         fatal("socket: %s\n", strerror(errno));
@@ -397,10 +491,7 @@ server_init_epoll(server_t* server)
         fatal("epoll_create1: %s\n", ERRSTR);
         return false;
     }
-
-    if (server_new_event(server, server->sock, NULL, se_accept_conn, NULL) == NULL)
-        return false;
-    
+    /* server->sock is in each eworker's own set, see server_eworker_init() */
     return true;
 }
 
@@ -421,6 +512,12 @@ server_init_ssl(server_t* server)
 
     SSL_CTX_set_options(server->ssl_ctx, SSL_OP_SINGLE_DH_USE);
     SSL_CTX_set_ecdh_auto(server->ssl_ctx, 1);
+    /* 
+     * Idle connections don't keep ~34 KB of OpenSSL read/write buffers,
+     * they're allocated again on the next read/write.
+     */
+    if (server->conf.footprint)
+        SSL_CTX_set_mode(server->ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
     if (SSL_CTX_use_certificate_file(server->ssl_ctx, "server/server.crt", SSL_FILETYPE_PEM) <= 0)
     {
         error("SSL cert failed: %s\n", ERRSTR);
@@ -455,9 +552,6 @@ server_init_ht(server_t* server)
     if (server_ght_init(&server->upload_token_ht, ht_size, NULL) == false)
         return false;
 
-    if (server_init_chatcmd(server) == false)
-        return false;
-
     return true;
 }
 
@@ -493,7 +587,7 @@ server_init_eventfd(server_t* server)
      * in this case we don't, we want all threads get this event.
      */
     se->listen_events = EPOLLIN;
-    if (server_event_rearm(server, se) == -1)
+    if (server_event_rearm(se) == -1)
         return false;
 
     return true;
@@ -534,6 +628,14 @@ server_init(int argc, char* const* argv)
     if (!server_init_ht(server))
         goto error;
 
+    // Init memory pools
+    server_pool_init(&server->msg_pool, POOL_MAX_FREE);
+
+    // Init client handle slots
+    if (!server_init_client_table(&server->clients))
+        goto error;
+    atomic_store(&server->epoch, 1);
+
     // Init Linux's Event Poll
     if (!server_init_epoll(server))
         goto error;
@@ -542,8 +644,30 @@ server_init(int argc, char* const* argv)
     if (!server_init_db(server))
         goto error;
 
-    // Init libmagic (for file mime types)
-    if (!server_init_magic(server))
+    // Init file store index (hash -> ref_count, mirrors UserFiles)
+    if (!server_store_init(server))
+        goto error;
+
+    // Init resumable uploads (temp files of the last run are removed)
+    if (!server_upload_init(server))
+        goto error;
+
+    // Init write-behind messages (replays the log of the last run)
+    if (!server_wal_init(server))
+        goto error;
+
+    // Init recent message cache (get_group_msgs)
+    if (!server_msg_cache_init(&server->msg_cache))
+        goto error;
+
+    // Init compute pool (hashing, libmagic for file mime types)
+    if (!server_compute_init(&server->compute, "compute", 
+                             server->conf.compute_threads, COMPUTE_POOL_MAGIC))
+        goto error;
+
+    // Init file I/O stage (upload writes, unlinks, reads)
+    if (!server_compute_init(&server->io, "io", 
+                             server->conf.io_threads, COMPUTE_POOL_DRAIN))
         goto error;
 
     // Init OpenSSL
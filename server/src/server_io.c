@@ -0,0 +1,328 @@
+#include "server_io.h"
+#include "server.h"
+#include "chat/file_store.h"
+#include <sys/stat.h>
+
+typedef struct 
+{
+    compute_job_t   job;
+    void*           data;
+    size_t          size;
+    bool            fsync;
+    bool            ok;
+    char            dir[CONFIG_PATH_LEN];
+    char            name[NAME_MAX];
+} io_write_t;
+
+typedef struct 
+{
+    compute_job_t   job;
+    file_store_t*   store;  /* Stored file, only if it's still unreferenced */
+    char            hash[NAME_MAX];
+    char            path[PATH_MAX];
+} io_unlink_t;
+
+static void
+io_run_inline(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    /* Slow, but nothing gets lost */
+    job->ew = ew;
+    job->client_hd = (client) ? client->hd : CLIENT_HD_NONE;
+    job->run(NULL, job);
+    job->status = COMPUTE_DONE;
+    job->done(ew, client, job);
+}
+
+void 
+server_io_submit(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    if (!server_compute_submit_to(&ew->server->io, ew, client, job))
+        io_run_inline(ew, client, job);
+}
+
+/* Writes and unlinks of one name run in order, on the same I/O thread */
+static void
+io_submit_name(eworker_t* ew, compute_job_t* job, const char* name)
+{
+    u64 key = 0xcbf29ce484222325ULL;  /* FNV-1a */
+
+    for (; *name; name++)
+        key = (key ^ (u8)*name) * 0x100000001b3ULL;
+
+    if (!server_compute_submit_key(&ew->server->io, ew, NULL, job, key))
+        io_run_inline(ew, NULL, job);
+}
+
+static bool
+io_write_all(i32 fd, const u8* data, size_t size)
+{
+    ssize_t bytes_written;
+
+    while (size)
+    {
+        if ((bytes_written = write(fd, data, size)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += bytes_written;
+        size -= bytes_written;
+    }
+    return true;
+}
+
+bool
+server_io_mkdirs(const char* path)
+{
+    char tmp[PATH_MAX];
+    char* p;
+    char c;
+
+    strncpy(tmp, path, PATH_MAX - 1);
+    tmp[PATH_MAX - 1] = 0x00;
+
+    for (p = tmp + 1; ; p++)
+    {
+        if (*p != '/' && *p != 0x00)
+            continue;
+        c = *p;
+        *p = 0x00;
+        if (mkdir(tmp, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 && errno != EEXIST)
+        {
+            error("mkdir %s failed: %s\n", tmp, ERRSTR);
+            return false;
+        }
+        if ((*p = c) == 0x00)
+            break;
+    }
+    return true;
+}
+
+/* I/O thread */
+static void
+io_write_run(UNUSED compute_thread_t* ct, compute_job_t* job)
+{
+    io_write_t* wj = (io_write_t*)job;
+    char tmp_path[PATH_MAX];
+    char path[PATH_MAX];
+    i32 fd;
+
+    snprintf(tmp_path, PATH_MAX, "%s/.%s.XXXXXX", wj->dir, wj->name);
+    snprintf(path, PATH_MAX, "%s/%s", wj->dir, wj->name);
+
+    debug("Writing file to: %s\n", path);
+
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    /* First file in its fan-out directory */
+    if (fd == -1 && errno == ENOENT && server_io_mkdirs(wj->dir))
+    {
+        snprintf(tmp_path, PATH_MAX, "%s/.%s.XXXXXX", wj->dir, wj->name);
+        fd = mkostemp(tmp_path, O_CLOEXEC);
+    }
+    if (fd == -1)
+    {
+        error("Failed to create temp file %s: %s\n", tmp_path, ERRSTR);
+        return;
+    }
+
+    if (io_write_all(fd, wj->data, wj->size) == false)
+        error("Failed to write to %s: %s\n", tmp_path, ERRSTR);
+    else if (wj->fsync && fsync(fd) == -1)
+        error("fsync %s failed: %s\n", tmp_path, ERRSTR);
+    else if (rename(tmp_path, path) == -1)
+        error("rename %s -> %s failed: %s\n", tmp_path, path, ERRSTR);
+    else
+        wj->ok = true;
+
+    close(fd);
+    if (!wj->ok)
+        unlink(tmp_path);
+}
+
+static void
+io_write_done(UNUSED eworker_t* ew, UNUSED client_t* client, compute_job_t* job)
+{
+    io_write_t* wj = (io_write_t*)job;
+
+    if (job->status != COMPUTE_CANCELLED && !wj->ok)
+        warn("File %s/%s not saved.\n", wj->dir, wj->name);
+    free(wj->data);
+    free(wj);
+}
+
+void 
+server_io_write_file(eworker_t* ew, void* data, size_t size, 
+                     const char* dir, const char* name)
+{
+    io_write_t* wj;
+
+    if ((wj = calloc(1, sizeof(io_write_t))) == NULL)
+    {
+        error("io write calloc: %s\n", ERRSTR);
+        free(data);
+        return;
+    }
+    wj->job.run = io_write_run;
+    wj->job.done = io_write_done;
+    wj->data = data;
+    wj->size = size;
+    wj->fsync = ew->server->conf.fsync_files;
+    strncpy(wj->dir, dir, CONFIG_PATH_LEN - 1);
+    strncpy(wj->name, name, NAME_MAX - 1);
+
+    io_submit_name(ew, &wj->job, wj->name);
+}
+
+/* I/O thread */
+static void
+io_unlink_run(UNUSED compute_thread_t* ct, compute_job_t* job)
+{
+    io_unlink_t* uj = (io_unlink_t*)job;
+
+    debug("Unlinking file: %s\n", uj->path);
+
+    if (uj->store)
+        server_store_unlink(uj->store, uj->hash, uj->path);
+    else if (unlink(uj->path) == -1)
+        error("unlink %s failed: %s\n", uj->path, ERRSTR);
+}
+
+static void
+io_unlink_done(UNUSED eworker_t* ew, UNUSED client_t* client, compute_job_t* job)
+{
+    free(job);
+}
+
+static void
+io_unlink(eworker_t* ew, const char* dir, const char* name, file_store_t* store)
+{
+    io_unlink_t* uj;
+
+    if ((uj = calloc(1, sizeof(io_unlink_t))) == NULL)
+    {
+        error("io unlink calloc: %s\n", ERRSTR);
+        return;
+    }
+    uj->job.run = io_unlink_run;
+    uj->job.done = io_unlink_done;
+    uj->store = store;
+    strncpy(uj->hash, name, NAME_MAX - 1);
+    snprintf(uj->path, PATH_MAX, "%s/%s", dir, name);
+
+    io_submit_name(ew, &uj->job, uj->hash);
+}
+
+void 
+server_io_unlink(eworker_t* ew, const char* dir, const char* name)
+{
+    io_unlink(ew, dir, name, NULL);
+}
+
+void 
+server_io_unlink_stored(eworker_t* ew, const char* dir, const char* hash)
+{
+    io_unlink(ew, dir, hash, &ew->server->store);
+}
+
+/* I/O thread */
+static void
+io_read_run(UNUSED compute_thread_t* ct, compute_job_t* job)
+{
+    io_read_t* rd = (io_read_t*)job;
+    ssize_t bytes_read;
+    size_t total = 0;
+    i32 fd;
+
+    if ((fd = open(rd->path, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        rd->err = errno;
+        return;
+    }
+
+    rd->file_size = fdsize(fd);
+    if (rd->offset < 0)
+        rd->offset = ((size_t)-rd->offset < rd->file_size) ? (i64)rd->file_size + rd->offset : 0;
+    else if ((size_t)rd->offset >= rd->file_size && rd->offset)
+    {
+        rd->err = ERANGE;
+        goto out;
+    }
+    if (rd->len == 0 || rd->offset + rd->len > rd->file_size)
+        rd->len = rd->file_size - rd->offset;
+
+    if ((rd->data = malloc(rd->len + 1)) == NULL)
+    {
+        rd->err = errno;
+        goto out;
+    }
+
+    while (total < rd->len)
+    {
+        bytes_read = pread(fd, rd->data + total, rd->len - total, rd->offset + total);
+        if (bytes_read == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            rd->err = errno;
+            free(rd->data);
+            rd->data = NULL;
+            goto out;
+        }
+        if (bytes_read == 0)
+            break;
+        total += bytes_read;
+    }
+    rd->size = total;
+out:
+    close(fd);
+}
+
+static void
+io_read_done(eworker_t* ew, client_t* client, compute_job_t* job)
+{
+    io_read_t* rd = (io_read_t*)job;
+
+    if (job->status == COMPUTE_CANCELLED)
+    {
+        free(rd->data);
+        rd->data = NULL;
+        rd->err = ECANCELED;
+        client = NULL;
+    }
+    else if (rd->data == NULL && rd->err != ERANGE)
+        error("read '%s' failed: %s\n", rd->path, strerror(rd->err));
+
+    rd->func(ew, client, rd);
+    free(rd);
+}
+
+bool 
+server_io_read_file(eworker_t* ew, client_t* client, const char* path, 
+                    io_read_done_t func, void* arg)
+{
+    return server_io_read_range(ew, client, path, 0, 0, func, arg);
+}
+
+bool 
+server_io_read_range(eworker_t* ew, client_t* client, const char* path, 
+                     i64 offset, size_t len, io_read_done_t func, void* arg)
+{
+    io_read_t* rd;
+
+    if ((rd = calloc(1, sizeof(io_read_t))) == NULL)
+    {
+        error("io read calloc: %s\n", ERRSTR);
+        return false;
+    }
+    rd->job.run = io_read_run;
+    rd->job.done = io_read_done;
+    rd->func = func;
+    rd->arg = arg;
+    rd->offset = offset;
+    rd->len = len;
+    strncpy(rd->path, path, PATH_MAX - 1);
+
+    server_io_submit(ew, client, &rd->job);
+    return true;
+}
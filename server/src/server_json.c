@@ -0,0 +1,219 @@
+#include "server_json.h"
+
+static inline void
+jw_put(json_writer_t* jw, const char* data, size_t len)
+{
+    if (jw->len + len > jw->size)
+    {
+        jw->overflow = true;
+        return;
+    }
+    memcpy(jw->buf + jw->len, data, len);
+    jw->len += len;
+}
+
+static inline void
+jw_putc(json_writer_t* jw, char c)
+{
+    if (jw->len >= jw->size)
+    {
+        jw->overflow = true;
+        return;
+    }
+    jw->buf[jw->len++] = c;
+}
+
+/* Separator before a value */
+static inline void
+jw_sep(json_writer_t* jw)
+{
+    if (jw->after_key)
+        jw->after_key = false;
+    else if (jw->comma)
+        jw_putc(jw, ',');
+}
+
+void
+jw_init(json_writer_t* jw, char* buf, size_t size)
+{
+    jw->buf = buf;
+    jw->len = 0;
+    jw->size = size;
+    jw->overflow = false;
+    jw->comma = false;
+    jw->after_key = false;
+}
+
+void
+jw_obj_begin(json_writer_t* jw)
+{
+    jw_sep(jw);
+    jw_putc(jw, '{');
+    jw->comma = false;
+}
+
+void
+jw_obj_end(json_writer_t* jw)
+{
+    jw_putc(jw, '}');
+    jw->comma = true;
+}
+
+void
+jw_arr_begin(json_writer_t* jw)
+{
+    jw_sep(jw);
+    jw_putc(jw, '[');
+    jw->comma = false;
+}
+
+void
+jw_arr_end(json_writer_t* jw)
+{
+    jw_putc(jw, ']');
+    jw->comma = true;
+}
+
+static void
+jw_escape(json_writer_t* jw, const char* str, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char* run = str;
+    const char* end = str + len;
+    char esc[6];
+    size_t esc_len;
+
+    jw_putc(jw, '"');
+
+    for (const char* c = str; c < end; c++)
+    {
+        const u8 ch = *c;
+
+        if (ch >= 0x20 && ch != '"' && ch != '\\')
+            continue;
+
+        /* Flush unescaped run */
+        jw_put(jw, run, c - run);
+        run = c + 1;
+
+        esc[0] = '\\';
+        esc_len = 2;
+        switch (ch)
+        {
+            case '"':  esc[1] = '"';  break;
+            case '\\': esc[1] = '\\'; break;
+            case '\b': esc[1] = 'b';  break;
+            case '\f': esc[1] = 'f';  break;
+            case '\n': esc[1] = 'n';  break;
+            case '\r': esc[1] = 'r';  break;
+            case '\t': esc[1] = 't';  break;
+            default:
+                esc[1] = 'u';
+                esc[2] = '0';
+                esc[3] = '0';
+                esc[4] = hex[ch >> 4];
+                esc[5] = hex[ch & 0x0F];
+                esc_len = 6;
+                break;
+        }
+        jw_put(jw, esc, esc_len);
+    }
+    jw_put(jw, run, end - run);
+
+    jw_putc(jw, '"');
+}
+
+void
+jw_key(json_writer_t* jw, const char* key)
+{
+    jw_sep(jw);
+    jw_escape(jw, key, strlen(key));
+    jw_putc(jw, ':');
+    jw->after_key = true;
+}
+
+void
+jw_str_len(json_writer_t* jw, const char* str, size_t len)
+{
+    jw_sep(jw);
+    if (str)
+        jw_escape(jw, str, len);
+    else
+        jw_put(jw, "null", 4);
+    jw->comma = true;
+}
+
+void
+jw_str(json_writer_t* jw, const char* str)
+{
+    jw_str_len(jw, str, (str) ? strlen(str) : 0);
+}
+
+void
+jw_int(json_writer_t* jw, i64 val)
+{
+    char num[24];
+    char* p = num + sizeof(num);
+    u64 uval = (val < 0) ? -(u64)val : (u64)val;
+
+    do {
+        *--p = '0' + (uval % 10);
+        uval /= 10;
+    } while (uval);
+    if (val < 0)
+        *--p = '-';
+
+    jw_sep(jw);
+    jw_put(jw, p, (num + sizeof(num)) - p);
+    jw->comma = true;
+}
+
+void
+jw_bool(json_writer_t* jw, bool val)
+{
+    jw_sep(jw);
+    if (val)
+        jw_put(jw, "true", 4);
+    else
+        jw_put(jw, "false", 5);
+    jw->comma = true;
+}
+
+void
+jw_raw(json_writer_t* jw, const char* json, size_t len)
+{
+    jw_sep(jw);
+    if (json && len)
+        jw_put(jw, json, len);
+    else
+        jw_put(jw, "null", 4);
+    jw->comma = true;
+}
+
+void
+jw_key_str(json_writer_t* jw, const char* key, const char* str)
+{
+    jw_key(jw, key);
+    jw_str(jw, str);
+}
+
+void
+jw_key_int(json_writer_t* jw, const char* key, i64 val)
+{
+    jw_key(jw, key);
+    jw_int(jw, val);
+}
+
+void
+jw_key_bool(json_writer_t* jw, const char* key, bool val)
+{
+    jw_key(jw, key);
+    jw_bool(jw, val);
+}
+
+void
+jw_key_raw(json_writer_t* jw, const char* key, const char* json, size_t len)
+{
+    jw_key(jw, key);
+    jw_raw(jw, json, len);
+}
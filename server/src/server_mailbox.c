@@ -0,0 +1,128 @@
+#include "server_mailbox.h"
+#include "server.h"
+#include <sys/eventfd.h>
+
+bool
+server_mailbox_post(client_t* client, const void* buf, size_t len)
+{
+    eworker_t* owner = client->owner;
+    client_mail_t* mail;
+    client_mail_t* mail_head;
+    client_t* head;
+
+    if ((mail = malloc(sizeof(client_mail_t) + len)) == NULL)
+    {
+        error("mailbox malloc: %s\n", ERRSTR);
+        return false;
+    }
+    mail->len = len;
+    memcpy(mail->data, buf, len);
+
+    mail_head = atomic_load(&client->mail);
+    do
+        mail->next = mail_head;
+    while (!atomic_compare_exchange_weak(&client->mail, &mail_head, mail));
+
+    /* Already queued on the owner, it will see this one too */
+    if (atomic_exchange(&client->mail_queued, true))
+        return true;
+
+    /* Owner drops the reference after delivery */
+    server_client_ref(client);
+    head = atomic_load(&owner->mail);
+    do
+        client->mail_next = head;
+    while (!atomic_compare_exchange_weak(&owner->mail, &head, client));
+
+    /* Only the first one in an empty queue has to wake the owner */
+    if (head == NULL && eventfd_write(owner->mail_fd, 1) == -1)
+        error("%s: mailbox eventfd_write: %s\n", owner->name, ERRSTR);
+    return true;
+}
+
+/* Newest first -> oldest first */
+static client_mail_t*
+mailbox_take(client_t* client)
+{
+    client_mail_t* mail = atomic_exchange(&client->mail, NULL);
+    client_mail_t* fifo = NULL;
+    client_mail_t* next;
+
+    while (mail)
+    {
+        next = mail->next;
+        mail->next = fifo;
+        fifo = mail;
+        mail = next;
+    }
+    return fifo;
+}
+
+void
+server_mailbox_flush(client_t* client)
+{
+    client_mail_t* mail = mailbox_take(client);
+    client_mail_t* next;
+
+    for (; mail; mail = next)
+    {
+        next = mail->next;
+        if (client->err == CLIENT_ERR_NONE)
+            server_ssl_send(client, mail->data, mail->len);
+        free(mail);
+    }
+}
+
+void
+server_mailbox_discard(client_t* client)
+{
+    client_mail_t* mail = mailbox_take(client);
+    client_mail_t* next;
+
+    for (; mail; mail = next)
+    {
+        next = mail->next;
+        free(mail);
+    }
+}
+
+void
+server_mailbox_deliver(eworker_t* ew)
+{
+    client_t* client;
+    client_t* next;
+    eventfd_t count;
+
+    /* Reset before taking the queue, so no wakeup gets lost */
+    if (eventfd_read(ew->mail_fd, &count) == -1 && errno != EAGAIN)
+        error("%s: mailbox eventfd_read: %s\n", ew->name, ERRSTR);
+
+    client = atomic_exchange(&ew->mail, NULL);
+    for (; client; client = next)
+    {
+        next = client->mail_next;
+        /* Posts from here on queue it again */
+        atomic_store(&client->mail_queued, false);
+
+        /* Mid-stream, ws_stream_end() flushes it */
+        if (client->streams == 0)
+            server_mailbox_flush(client);
+        server_client_unref(client);
+    }
+}
+
+void
+server_mailbox_drop_all(eworker_t* ew)
+{
+    client_t* client;
+    client_t* next;
+
+    client = atomic_exchange(&ew->mail, NULL);
+    for (; client; client = next)
+    {
+        next = client->mail_next;
+        atomic_store(&client->mail_queued, false);
+        server_mailbox_discard(client);
+        server_client_unref(client);
+    }
+}
@@ -0,0 +1,840 @@
+#include "server_msgpack.h"
+#include <endian.h>
+
+typedef struct
+{
+    const u8* p;
+    const u8* end;
+    u32 depth;
+} mp_reader_t;
+
+/* JSON null is a NULL json_object, return value tells the errors. */
+static bool mp_read(mp_reader_t* r, json_object** out);
+
+static inline bool
+mp_have(const mp_reader_t* r, size_t n)
+{
+    return (size_t)(r->end - r->p) >= n;
+}
+
+static bool
+mp_read_uint(mp_reader_t* r, size_t n, u64* out)
+{
+    if (!mp_have(r, n))
+        return false;
+
+    switch (n)
+    {
+        case 1:
+            *out = r->p[0];
+            break;
+        case 2:
+        {
+            u16 v;
+            memcpy(&v, r->p, 2);
+            *out = be16toh(v);
+            break;
+        }
+        case 4:
+        {
+            u32 v;
+            memcpy(&v, r->p, 4);
+            *out = be32toh(v);
+            break;
+        }
+        case 8:
+        {
+            u64 v;
+            memcpy(&v, r->p, 8);
+            *out = be64toh(v);
+            break;
+        }
+        default:
+            return false;
+    }
+    r->p += n;
+    return true;
+}
+
+static json_object*
+mp_read_str(mp_reader_t* r, size_t len)
+{
+    json_object* str;
+
+    if (!mp_have(r, len) || len > INT32_MAX)
+        return NULL;
+
+    str = json_object_new_string_len((const char*)r->p, len);
+    r->p += len;
+    return str;
+}
+
+static json_object*
+mp_read_array(mp_reader_t* r, size_t n)
+{
+    json_object* array;
+    json_object* val;
+
+    /* Each element is at least 1 byte */
+    if (!mp_have(r, n))
+        return NULL;
+
+    array = json_object_new_array_ext(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!mp_read(r, &val))
+            goto err;
+        json_object_array_add(array, val);
+    }
+    return array;
+err:
+    json_object_put(array);
+    return NULL;
+}
+
+static bool
+mp_read_key(mp_reader_t* r, char* key)
+{
+    u64 len;
+    u8 type;
+
+    if (!mp_have(r, 1))
+        return false;
+    type = *r->p++;
+
+    if ((type & 0xE0) == 0xA0)
+        len = type & 0x1F;
+    else if (type == 0xD9)
+    {
+        if (!mp_read_uint(r, 1, &len))
+            return false;
+    }
+    else if (type == 0xDA)
+    {
+        if (!mp_read_uint(r, 2, &len))
+            return false;
+    }
+    else
+        return false;
+
+    if (len >= MSGPACK_KEY_MAX || !mp_have(r, len))
+        return false;
+
+    memcpy(key, r->p, len);
+    key[len] = 0x00;
+    r->p += len;
+    return true;
+}
+
+static json_object*
+mp_read_map(mp_reader_t* r, size_t n)
+{
+    json_object* object;
+    json_object* val;
+    char key[MSGPACK_KEY_MAX];
+
+    /* Each key-value is at least 2 bytes */
+    if (n > (size_t)(r->end - r->p) / 2)
+        return NULL;
+
+    object = json_object_new_object();
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!mp_read_key(r, key))
+            goto err;
+        if (!mp_read(r, &val))
+            goto err;
+        json_object_object_add(object, key, val);
+    }
+    return object;
+err:
+    json_object_put(object);
+    return NULL;
+}
+
+static bool
+mp_read(mp_reader_t* r, json_object** out)
+{
+    json_object* ret = NULL;
+    u64 n;
+    u8 type;
+
+    *out = NULL;
+    if (!mp_have(r, 1) || r->depth >= MSGPACK_MAX_DEPTH)
+        return false;
+    type = *r->p++;
+
+    /* Fixed types, nil */
+    if (type <= 0x7F || type >= 0xE0)
+    {
+        *out = json_object_new_int64((i8)type);
+        return true;
+    }
+    if ((type & 0xE0) == 0xA0)
+        return (*out = mp_read_str(r, type & 0x1F)) != NULL;
+    if (type == 0xC0)
+        return true;
+
+    r->depth++;
+    if ((type & 0xF0) == 0x90)
+    {
+        ret = mp_read_array(r, type & 0x0F);
+        goto out;
+    }
+    if ((type & 0xF0) == 0x80)
+    {
+        ret = mp_read_map(r, type & 0x0F);
+        goto out;
+    }
+
+    switch (type)
+    {
+        case 0xC2:
+        case 0xC3:
+            ret = json_object_new_boolean(type == 0xC3);
+            break;
+        case 0xCA:
+        {
+            f32 f;
+            u32 v;
+            if (!mp_read_uint(r, 4, &n))
+                break;
+            v = n;
+            memcpy(&f, &v, sizeof(f));
+            ret = json_object_new_double(f);
+            break;
+        }
+        case 0xCB:
+        {
+            f64 d;
+            if (!mp_read_uint(r, 8, &n))
+                break;
+            memcpy(&d, &n, sizeof(d));
+            ret = json_object_new_double(d);
+            break;
+        }
+        case 0xCC: /* uint 8..64 */
+        case 0xCD:
+        case 0xCE:
+        case 0xCF:
+            if (!mp_read_uint(r, 1 << (type - 0xCC), &n) || n > INT64_MAX)
+                break;
+            ret = json_object_new_int64(n);
+            break;
+        case 0xD0: /* int 8..64 */
+            if (mp_read_uint(r, 1, &n))
+                ret = json_object_new_int64((i8)n);
+            break;
+        case 0xD1:
+            if (mp_read_uint(r, 2, &n))
+                ret = json_object_new_int64((i16)n);
+            break;
+        case 0xD2:
+            if (mp_read_uint(r, 4, &n))
+                ret = json_object_new_int64((i32)n);
+            break;
+        case 0xD3:
+            if (mp_read_uint(r, 8, &n))
+                ret = json_object_new_int64((i64)n);
+            break;
+        case 0xC4: /* bin 8..32, as string */
+        case 0xC5:
+        case 0xC6:
+            if (mp_read_uint(r, 1 << (type - 0xC4), &n))
+                ret = mp_read_str(r, n);
+            break;
+        case 0xD9: /* str 8..32 */
+        case 0xDA:
+        case 0xDB:
+            if (mp_read_uint(r, 1 << (type - 0xD9), &n))
+                ret = mp_read_str(r, n);
+            break;
+        case 0xDC: /* array 16, 32 */
+        case 0xDD:
+            if (mp_read_uint(r, (type == 0xDC) ? 2 : 4, &n))
+                ret = mp_read_array(r, n);
+            break;
+        case 0xDE: /* map 16, 32 */
+        case 0xDF:
+            if (mp_read_uint(r, (type == 0xDE) ? 2 : 4, &n))
+                ret = mp_read_map(r, n);
+            break;
+        default:
+            /* ext types not supported */
+            break;
+    }
+out:
+    r->depth--;
+    *out = ret;
+    return ret != NULL;
+}
+
+json_object*
+msgpack_to_json(const u8* buf, size_t len)
+{
+    json_object* json;
+    mp_reader_t r = {
+        .p = buf,
+        .end = buf + len,
+        .depth = 0
+    };
+
+    if (!mp_read(&r, &json))
+        return NULL;
+    if (r.p != r.end)
+    {
+        warn("msgpack: %zu trailing bytes\n", (size_t)(r.end - r.p));
+        json_object_put(json);
+        return NULL;
+    }
+    return json;
+}
+
+static void
+mp_put(mp_buf_t* mp, const void* data, size_t len)
+{
+    if (mp->err)
+        return;
+
+    if (mp->len + len > mp->size)
+    {
+        size_t new_size = (mp->size) ? mp->size * 2 : 256;
+        u8* new_data;
+
+        while (new_size < mp->len + len)
+            new_size *= 2;
+
+        new_data = realloc(mp->data, mp->reserved + new_size);
+        if (new_data == NULL)
+        {
+            error("msgpack realloc: %s\n", ERRSTR);
+            mp->err = true;
+            return;
+        }
+        mp->data = new_data;
+        mp->size = new_size;
+    }
+    memcpy(mp->data + mp->reserved + mp->len, data, len);
+    mp->len += len;
+}
+
+static inline void
+mp_put_u8(mp_buf_t* mp, u8 v)
+{
+    mp_put(mp, &v, 1);
+}
+
+/* Type byte + big-endian value of `n` bytes */
+static void
+mp_put_typed(mp_buf_t* mp, u8 type, u64 v, size_t n)
+{
+    u8 tmp[1 + sizeof(u64)];
+
+    tmp[0] = type;
+    for (size_t i = 0; i < n; i++)
+        tmp[1 + i] = v >> (8 * (n - 1 - i));
+    mp_put(mp, tmp, 1 + n);
+}
+
+static void
+mp_put_int(mp_buf_t* mp, i64 v)
+{
+    if (v >= 0)
+    {
+        if (v <= 0x7F)
+            mp_put_u8(mp, v);
+        else if (v <= UINT8_MAX)
+            mp_put_typed(mp, 0xCC, v, 1);
+        else if (v <= UINT16_MAX)
+            mp_put_typed(mp, 0xCD, v, 2);
+        else if (v <= UINT32_MAX)
+            mp_put_typed(mp, 0xCE, v, 4);
+        else
+            mp_put_typed(mp, 0xCF, v, 8);
+    }
+    else
+    {
+        if (v >= -32)
+            mp_put_u8(mp, (u8)v);
+        else if (v >= INT8_MIN)
+            mp_put_typed(mp, 0xD0, (u8)v, 1);
+        else if (v >= INT16_MIN)
+            mp_put_typed(mp, 0xD1, (u16)v, 2);
+        else if (v >= INT32_MIN)
+            mp_put_typed(mp, 0xD2, (u32)v, 4);
+        else
+            mp_put_typed(mp, 0xD3, (u64)v, 8);
+    }
+}
+
+/* Smallest str/array/map header for `len` into `out`, returns its size */
+static size_t
+mp_len_hdr(u8* out, u8 fix, size_t fix_max, u8 type8, u8 type16, u8 type32, size_t len)
+{
+    size_t n;
+
+    if (len <= fix_max)
+    {
+        out[0] = fix | len;
+        return 1;
+    }
+    if (type8 && len <= UINT8_MAX)
+    {
+        out[0] = type8;
+        n = 1;
+    }
+    else if (len <= UINT16_MAX)
+    {
+        out[0] = type16;
+        n = 2;
+    }
+    else
+    {
+        out[0] = type32;
+        n = 4;
+    }
+    for (size_t i = 0; i < n; i++)
+        out[1 + i] = len >> (8 * (n - 1 - i));
+    return 1 + n;
+}
+
+static void
+mp_put_len(mp_buf_t* mp, u8 fix, size_t fix_max, u8 type8, u8 type16, u8 type32, size_t len)
+{
+    u8 hdr[MP_LEN_HDR_MAX];
+
+    mp_put(mp, hdr, mp_len_hdr(hdr, fix, fix_max, type8, type16, type32, len));
+}
+
+/* Length not known yet: room for the longest header, see mp_end_len() */
+static size_t
+mp_begin_len(mp_buf_t* mp)
+{
+    static const u8 room[MP_LEN_HDR_MAX];
+
+    mp_put(mp, room, MP_LEN_HDR_MAX);
+    return mp->len;
+}
+
+/* Writes the real header before `at`, what's after moves up to it */
+static void
+mp_end_len(mp_buf_t* mp, size_t at, u8 fix, size_t fix_max, u8 type8, u8 type16, u8 type32, size_t len)
+{
+    u8* body;
+    u8 hdr[MP_LEN_HDR_MAX];
+    size_t n;
+
+    if (mp->err)
+        return;
+    body = mp->data + mp->reserved + at;
+    n = mp_len_hdr(hdr, fix, fix_max, type8, type16, type32, len);
+    memmove(body - MP_LEN_HDR_MAX + n, body, mp->len - at);
+    memcpy(body - MP_LEN_HDR_MAX, hdr, n);
+    mp->len -= MP_LEN_HDR_MAX - n;
+}
+
+static void
+mp_write(mp_buf_t* mp, json_object* json, u32 depth)
+{
+    if (depth >= MSGPACK_MAX_DEPTH)
+    {
+        mp->err = true;
+        return;
+    }
+
+    switch (json_object_get_type(json))
+    {
+        case json_type_null:
+            mp_put_u8(mp, 0xC0);
+            break;
+        case json_type_boolean:
+            mp_put_u8(mp, json_object_get_boolean(json) ? 0xC3 : 0xC2);
+            break;
+        case json_type_int:
+            mp_put_int(mp, json_object_get_int64(json));
+            break;
+        case json_type_double:
+        {
+            f64 d = json_object_get_double(json);
+            u64 v;
+            memcpy(&v, &d, sizeof(v));
+            mp_put_typed(mp, 0xCB, v, 8);
+            break;
+        }
+        case json_type_string:
+        {
+            size_t len = json_object_get_string_len(json);
+            mp_put_len(mp, 0xA0, 31, 0xD9, 0xDA, 0xDB, len);
+            mp_put(mp, json_object_get_string(json), len);
+            break;
+        }
+        case json_type_array:
+        {
+            size_t n = json_object_array_length(json);
+            mp_put_len(mp, 0x90, 15, 0, 0xDC, 0xDD, n);
+            for (size_t i = 0; i < n; i++)
+                mp_write(mp, json_object_array_get_idx(json, i), depth + 1);
+            break;
+        }
+        case json_type_object:
+        {
+            mp_put_len(mp, 0x80, 15, 0, 0xDE, 0xDF,
+                       json_object_object_length(json));
+            json_object_object_foreach(json, key, val)
+            {
+                size_t key_len = strlen(key);
+                mp_put_len(mp, 0xA0, 31, 0xD9, 0xDA, 0xDB, key_len);
+                mp_put(mp, key, key_len);
+                mp_write(mp, val, depth + 1);
+            }
+            break;
+        }
+        default:
+            mp->err = true;
+            break;
+    }
+}
+
+bool
+json_to_msgpack(json_object* json, mp_buf_t* mp, size_t reserved)
+{
+    mp->reserved = reserved;
+    mp->len = 0;
+    mp->size = 0;
+    mp->err = false;
+    mp->data = NULL;
+
+    mp_write(mp, json, 0);
+
+    if (mp->err)
+    {
+        free(mp->data);
+        mp->data = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* 
+ * JSON text straight to MessagePack, no json_object in between.
+ * Only what Postgres and json_writer_t write has to come through.
+ */
+typedef struct
+{
+    const char* p;
+    const char* end;
+} jt_reader_t;
+
+static void mp_text_value(mp_buf_t* mp, jt_reader_t* r, u32 depth);
+
+static void
+jt_skip_ws(jt_reader_t* r)
+{
+    while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\n' || *r->p == '\r'))
+        r->p++;
+}
+
+static bool
+jt_hex4(jt_reader_t* r, u32* out)
+{
+    u32 v = 0;
+    char c;
+
+    if (r->end - r->p < 4)
+        return false;
+    for (i32 i = 0; i < 4; i++)
+    {
+        c = *r->p++;
+        if (c >= '0' && c <= '9')
+            v = (v << 4) | (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            v = (v << 4) | (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')
+            v = (v << 4) | (c - 'A' + 10);
+        else
+            return false;
+    }
+    *out = v;
+    return true;
+}
+
+/* \uXXXX, surrogate pairs too, as UTF-8 */
+static bool
+mp_text_unicode(mp_buf_t* mp, jt_reader_t* r)
+{
+    u8 utf8[4];
+    u32 cp;
+    u32 lo;
+
+    if (!jt_hex4(r, &cp) || (cp >= 0xDC00 && cp <= 0xDFFF))
+        return false;
+    if (cp >= 0xD800 && cp <= 0xDBFF)
+    {
+        if (r->end - r->p < 2 || r->p[0] != '\\' || r->p[1] != 'u')
+            return false;
+        r->p += 2;
+        if (!jt_hex4(r, &lo) || lo < 0xDC00 || lo > 0xDFFF)
+            return false;
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+    }
+
+    if (cp < 0x80)
+        mp_put_u8(mp, cp);
+    else if (cp < 0x800)
+    {
+        utf8[0] = 0xC0 | (cp >> 6);
+        utf8[1] = 0x80 | (cp & 0x3F);
+        mp_put(mp, utf8, 2);
+    }
+    else if (cp < 0x10000)
+    {
+        utf8[0] = 0xE0 | (cp >> 12);
+        utf8[1] = 0x80 | ((cp >> 6) & 0x3F);
+        utf8[2] = 0x80 | (cp & 0x3F);
+        mp_put(mp, utf8, 3);
+    }
+    else
+    {
+        utf8[0] = 0xF0 | (cp >> 18);
+        utf8[1] = 0x80 | ((cp >> 12) & 0x3F);
+        utf8[2] = 0x80 | ((cp >> 6) & 0x3F);
+        utf8[3] = 0x80 | (cp & 0x3F);
+        mp_put(mp, utf8, 4);
+    }
+    return true;
+}
+
+/* At the opening '"' */
+static void
+mp_text_str(mp_buf_t* mp, jt_reader_t* r)
+{
+    const size_t at = mp_begin_len(mp);
+    const char* run;
+    char c;
+
+    r->p++;
+    for (;;)
+    {
+        for (run = r->p; r->p < r->end && *r->p != '"' && *r->p != '\\'; r->p++)
+            ;
+        mp_put(mp, run, r->p - run);
+        if (r->end - r->p < 2 && (r->p == r->end || *r->p == '\\'))
+            goto err;
+        if (*r->p++ == '"')
+            break;
+
+        switch ((c = *r->p++))
+        {
+            case '"':
+            case '\\':
+            case '/':
+                mp_put_u8(mp, c);
+                break;
+            case 'b':
+                mp_put_u8(mp, '\b');
+                break;
+            case 'f':
+                mp_put_u8(mp, '\f');
+                break;
+            case 'n':
+                mp_put_u8(mp, '\n');
+                break;
+            case 'r':
+                mp_put_u8(mp, '\r');
+                break;
+            case 't':
+                mp_put_u8(mp, '\t');
+                break;
+            case 'u':
+                if (!mp_text_unicode(mp, r))
+                    goto err;
+                break;
+            default:
+                goto err;
+        }
+    }
+    mp_end_len(mp, at, 0xA0, 31, 0xD9, 0xDA, 0xDB, mp->len - at);
+    return;
+err:
+    mp->err = true;
+}
+
+static void
+mp_text_num(mp_buf_t* mp, jt_reader_t* r)
+{
+    const char* start = r->p;
+    char num[64];
+    bool is_float = false;
+    size_t n;
+    char* end;
+    i64 v;
+    f64 d;
+    u64 bits;
+
+    for (; r->p < r->end; r->p++)
+    {
+        if (*r->p == '.' || *r->p == 'e' || *r->p == 'E')
+            is_float = true;
+        else if (!((*r->p >= '0' && *r->p <= '9') || *r->p == '-' || *r->p == '+'))
+            break;
+    }
+    if ((n = r->p - start) == 0 || n >= sizeof(num))
+    {
+        mp->err = true;
+        return;
+    }
+    memcpy(num, start, n);
+    num[n] = 0x00;
+
+    errno = 0;
+    if (!is_float)
+    {
+        v = strtoll(num, &end, 10);
+        if (*end == 0x00 && errno == 0)
+        {
+            mp_put_int(mp, v);
+            return;
+        }
+    }
+    /* Fractions, exponents & what doesn't fit an i64 */
+    d = strtod(num, &end);
+    if (*end != 0x00)
+    {
+        mp->err = true;
+        return;
+    }
+    memcpy(&bits, &d, sizeof(bits));
+    mp_put_typed(mp, 0xCB, bits, 8);
+}
+
+static bool
+jt_literal(jt_reader_t* r, const char* lit, size_t len)
+{
+    if ((size_t)(r->end - r->p) < len || memcmp(r->p, lit, len) != 0)
+        return false;
+    r->p += len;
+    return true;
+}
+
+/* At the opening '{' or '[' */
+static void
+mp_text_container(mp_buf_t* mp, jt_reader_t* r, u32 depth)
+{
+    const bool obj = (*r->p == '{');
+    const char close = (obj) ? '}' : ']';
+    const size_t at = mp_begin_len(mp);
+    size_t n = 0;
+
+    r->p++;
+    jt_skip_ws(r);
+    if (r->p < r->end && *r->p == close)
+        r->p++;
+    else for (;;)
+    {
+        if (obj)
+        {
+            if (r->p == r->end || *r->p != '"')
+                goto err;
+            mp_text_str(mp, r);
+            jt_skip_ws(r);
+            if (r->p == r->end || *r->p++ != ':')
+                goto err;
+        }
+        mp_text_value(mp, r, depth + 1);
+        if (mp->err)
+            return;
+        n++;
+
+        jt_skip_ws(r);
+        if (r->p == r->end)
+            goto err;
+        if (*r->p == close)
+        {
+            r->p++;
+            break;
+        }
+        if (*r->p++ != ',')
+            goto err;
+        jt_skip_ws(r);
+    }
+
+    if (obj)
+        mp_end_len(mp, at, 0x80, 15, 0, 0xDE, 0xDF, n);
+    else
+        mp_end_len(mp, at, 0x90, 15, 0, 0xDC, 0xDD, n);
+    return;
+err:
+    mp->err = true;
+}
+
+static void
+mp_text_value(mp_buf_t* mp, jt_reader_t* r, u32 depth)
+{
+    jt_skip_ws(r);
+    if (depth >= MSGPACK_MAX_DEPTH || r->p == r->end)
+    {
+        mp->err = true;
+        return;
+    }
+
+    switch (*r->p)
+    {
+        case '{':
+        case '[':
+            mp_text_container(mp, r, depth);
+            break;
+        case '"':
+            mp_text_str(mp, r);
+            break;
+        case 't':
+            if (jt_literal(r, "true", 4))
+                mp_put_u8(mp, 0xC3);
+            else
+                mp->err = true;
+            break;
+        case 'f':
+            if (jt_literal(r, "false", 5))
+                mp_put_u8(mp, 0xC2);
+            else
+                mp->err = true;
+            break;
+        case 'n':
+            if (jt_literal(r, "null", 4))
+                mp_put_u8(mp, 0xC0);
+            else
+                mp->err = true;
+            break;
+        default:
+            mp_text_num(mp, r);
+            break;
+    }
+}
+
+bool
+json_text_to_msgpack(const char* json, size_t len, mp_buf_t* mp, size_t reserved)
+{
+    jt_reader_t r = {
+        .p = json,
+        .end = json + len
+    };
+
+    mp->reserved = reserved;
+    mp->len = 0;
+    mp->size = 0;
+    mp->err = false;
+    mp->data = NULL;
+
+    mp_text_value(mp, &r, 0);
+    jt_skip_ws(&r);
+    if (r.p != r.end)
+        mp->err = true;
+
+    if (mp->err)
+    {
+        error("JSON to msgpack: invalid at byte %zu of %zu\n", (size_t)(r.p - json), len);
+        free(mp->data);
+        mp->data = NULL;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,256 @@
+#include "server_multipart.h"
+
+#define CRLF        "\r\n"
+#define CRLF_LEN    2
+
+bool
+server_multipart_boundary(const char* content_type, char* boundary)
+{
+    const char* str;
+    size_t len;
+
+    if (strncasecmp(content_type, "multipart/form-data", 19) != 0)
+        return false;
+    if ((str = strstr(content_type, "boundary=")) == NULL)
+        return false;
+    str += 9;
+
+    if (*str == '"')
+    {
+        str++;
+        len = strcspn(str, "\"");
+    }
+    else
+        len = strcspn(str, "; \t");
+
+    if (len == 0 || len > MULTIPART_BOUNDARY_MAX)
+        return false;
+    memcpy(boundary, str, len);
+    boundary[len] = 0x00;
+    return true;
+}
+
+multipart_t*
+server_multipart_new(const char* boundary, const multipart_cb_t* cb, void* user)
+{
+    multipart_t* mp;
+
+    if ((mp = calloc(1, sizeof(multipart_t))) == NULL)
+        return NULL;
+    mp->delim_len = snprintf(mp->delim, sizeof(mp->delim), CRLF "--%s", boundary);
+    mp->cb = cb;
+    mp->user = user;
+
+    /* The first delimiter has no CRLF before it, pretend it does */
+    mp->cap = 1024;
+    if ((mp->buf = malloc(mp->cap)) == NULL)
+    {
+        free(mp);
+        return NULL;
+    }
+    memcpy(mp->buf, CRLF, CRLF_LEN);
+    mp->len = CRLF_LEN;
+
+    return mp;
+}
+
+/* `name="val"` out of a header line, `name` must start a parameter */
+static void
+mp_param(const char* line, const char* name, char* out, size_t size)
+{
+    const char* str = line;
+    size_t name_len = strlen(name);
+    size_t len;
+
+    while ((str = strstr(str, name)))
+    {
+        if (str > line && (str[-1] == ' ' || str[-1] == ';') && str[name_len] == '=')
+            break;
+        str += name_len;
+    }
+    if (str == NULL)
+        return;
+    str += name_len + 1;
+
+    if (*str == '"')
+    {
+        str++;
+        len = strcspn(str, "\"");
+    }
+    else
+        len = strcspn(str, "; ");
+    if (len >= size)
+        len = size - 1;
+    memcpy(out, str, len);
+    out[len] = 0x00;
+}
+
+static void
+mp_parse_headers(multipart_t* mp, char* headers)
+{
+    multipart_part_t* part = &mp->part;
+    char* saveptr;
+    char* line;
+    const char* val;
+
+    memset(part, 0, sizeof(multipart_part_t));
+
+    for (line = strtok_r(headers, CRLF, &saveptr); line; line = strtok_r(NULL, CRLF, &saveptr))
+    {
+        if ((val = strchr(line, ':')) == NULL)
+            continue;
+        val++;
+        while (*val == ' ')
+            val++;
+
+        if (strncasecmp(line, "Content-Disposition:", 20) == 0)
+        {
+            mp_param(val, "name", part->name, MULTIPART_NAME_LEN);
+            mp_param(val, "filename", part->filename, MULTIPART_NAME_LEN);
+        }
+        else if (strncasecmp(line, "Content-Type:", 13) == 0)
+            strncpy(part->content_type, val, MULTIPART_TYPE_LEN - 1);
+    }
+}
+
+static bool
+mp_reserve(multipart_t* mp, size_t len)
+{
+    u8* buf;
+    size_t cap = mp->cap;
+
+    if (mp->len + len <= cap)
+        return true;
+    while (cap < mp->len + len)
+        cap *= 2;
+    if ((buf = realloc(mp->buf, cap)) == NULL)
+        return false;
+    mp->buf = buf;
+    mp->cap = cap;
+    return true;
+}
+
+void
+server_multipart_feed(multipart_t* mp, eworker_t* ew, client_t* client,
+                      const void* data, size_t len)
+{
+    const multipart_cb_t* cb = mp->cb;
+    size_t pos = 0;
+    size_t n;
+    u8* hit;
+
+    if (mp->state == MP_EPILOGUE || mp->state == MP_ERROR)
+        return;
+    if (!mp_reserve(mp, len))
+    {
+        error("multipart realloc: %s\n", ERRSTR);
+        mp->state = MP_ERROR;
+        return;
+    }
+    memcpy(mp->buf + mp->len, data, len);
+    mp->len += len;
+
+    while (pos < mp->len)
+    {
+        switch (mp->state)
+        {
+            case MP_PREAMBLE:
+            case MP_DATA:
+                hit = memmem(mp->buf + pos, mp->len - pos, mp->delim, mp->delim_len);
+                if (hit == NULL)
+                {
+                    /* Tail could be the start of a delimiter, keep it */
+                    if (mp->len - pos < mp->delim_len)
+                        goto out;
+                    n = mp->len - pos - (mp->delim_len - 1);
+                    if (mp->state == MP_DATA && n)
+                        cb->part_data(ew, client, mp, mp->buf + pos, n);
+                    pos += n;
+                    goto out;
+                }
+                n = hit - (mp->buf + pos);
+                if (mp->state == MP_DATA)
+                {
+                    if (n)
+                        cb->part_data(ew, client, mp, mp->buf + pos, n);
+                    /* Failed by part_data() */
+                    if (mp->state == MP_ERROR)
+                        break;
+                    cb->part_end(ew, client, mp);
+                }
+                pos += n + mp->delim_len;
+                mp->state = MP_DELIM_END;
+                break;
+            case MP_DELIM_END:
+                if (mp->len - pos < 2)
+                    goto out;
+                if (memcmp(mp->buf + pos, "--", 2) == 0)
+                {
+                    mp->state = MP_EPILOGUE;
+                    pos = mp->len;
+                }
+                else if (memcmp(mp->buf + pos, CRLF, CRLF_LEN) == 0)
+                {
+                    mp->state = MP_HEADERS;
+                    pos += CRLF_LEN;
+                }
+                else
+                    mp->state = MP_ERROR;
+                break;
+            case MP_HEADERS:
+                /* No headers at all */
+                if (mp->len - pos >= CRLF_LEN && memcmp(mp->buf + pos, CRLF, CRLF_LEN) == 0)
+                {
+                    memset(&mp->part, 0, sizeof(multipart_part_t));
+                    pos += CRLF_LEN;
+                }
+                else
+                {
+                    hit = memmem(mp->buf + pos, mp->len - pos, CRLF CRLF, CRLF_LEN * 2);
+                    if (hit == NULL)
+                    {
+                        if (mp->len - pos > MULTIPART_HEADERS_MAX)
+                            mp->state = MP_ERROR;
+                        goto out;
+                    }
+                    *hit = 0x00;
+                    mp_parse_headers(mp, (char*)mp->buf + pos);
+                    pos = (hit - mp->buf) + CRLF_LEN * 2;
+                }
+                mp->n_parts++;
+                mp->state = MP_DATA;
+                cb->part_begin(ew, client, mp);
+                break;
+            case MP_EPILOGUE:
+            case MP_ERROR:
+                pos = mp->len;
+                break;
+        }
+    }
+out:
+    memmove(mp->buf, mp->buf + pos, mp->len - pos);
+    mp->len -= pos;
+}
+
+void
+server_multipart_end(multipart_t* mp, eworker_t* ew, client_t* client)
+{
+    mp->cb->finish(ew, client, mp, mp->state == MP_EPILOGUE);
+}
+
+void
+server_multipart_fail(multipart_t* mp)
+{
+    mp->state = MP_ERROR;
+}
+
+void
+server_multipart_free(multipart_t* mp)
+{
+    if (mp == NULL)
+        return;
+    if (mp->cb->free)
+        mp->cb->free(mp->user);
+    free(mp->buf);
+    free(mp);
+}
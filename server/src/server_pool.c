@@ -0,0 +1,112 @@
+#include "server_pool.h"
+
+#define POOL_CLASS_MALLOC   0xFF
+
+/* Header in front of every block, keeps payload 16-byte aligned */
+struct pool_block
+{
+    union {
+        pool_block_t*   next;   /* While on free list */
+        u8              class;  /* While allocated */
+        max_align_t     align;
+    };
+};
+
+static inline u8
+pool_class(size_t size)
+{
+    u8 class = 0;
+
+    if (size > POOL_MAX_SIZE)
+        return POOL_CLASS_MALLOC;
+    while ((size_t)(POOL_MIN_SIZE << class) < size)
+        class++;
+    return class;
+}
+
+void
+server_pool_init(server_pool_t* pool, u32 max_free)
+{
+    memset(pool, 0, sizeof(server_pool_t));
+    pool->max_free = max_free;
+    pthread_mutex_init(&pool->mutex, NULL);
+}
+
+void
+server_pool_destroy(server_pool_t* pool)
+{
+    pool_block_t* block;
+    pool_block_t* next;
+
+    for (u32 i = 0; i < POOL_CLASSES; i++)
+    {
+        block = pool->free[i];
+        while (block)
+        {
+            next = block->next;
+            free(block);
+            block = next;
+        }
+        pool->free[i] = NULL;
+        pool->n_free[i] = 0;
+    }
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+void*   
+server_pool_alloc(server_pool_t* pool, size_t size)
+{
+    pool_block_t* block = NULL;
+    const u8 class = pool_class(size);
+
+    if (class != POOL_CLASS_MALLOC)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        if ((block = pool->free[class]))
+        {
+            pool->free[class] = block->next;
+            pool->n_free[class]--;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (block == NULL)
+            block = malloc(sizeof(pool_block_t) + (POOL_MIN_SIZE << class));
+    }
+    else
+        block = malloc(sizeof(pool_block_t) + size);
+
+    if (block == NULL)
+    {
+        error("pool alloc %zu: %s\n", size, ERRSTR);
+        return NULL;
+    }
+    block->class = class;
+    return block + 1;
+}
+
+void    
+server_pool_free(server_pool_t* pool, void* ptr)
+{
+    pool_block_t* block;
+    u8 class;
+
+    if (ptr == NULL)
+        return;
+
+    block = (pool_block_t*)ptr - 1;
+    class = block->class;
+
+    if (class != POOL_CLASS_MALLOC)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        if (pool->n_free[class] < pool->max_free)
+        {
+            block->next = pool->free[class];
+            pool->free[class] = block;
+            pool->n_free[class]++;
+            block = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    free(block);
+}
@@ -91,6 +91,16 @@ server_tm_shutdown_threads(server_t* server)
         eworker_t* ew = tm->workers + i;
         pthread_join(ew->pth, NULL);
     }
+
+    /* Compute & I/O jobs complete on eworkers, stop after them */
+    server_compute_shutdown(&server->compute);
+    server_compute_shutdown(&server->io);
+
+    for (size_t i = 0; i < tm->n_workers; i++)
+    {
+        server_compute_cancel_done(tm->workers + i);
+        server_client_reclaim_all(tm->workers + i);
+    }
 }
 
 void    
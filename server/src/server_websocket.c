@@ -1,6 +1,9 @@
 #include "server_websocket.h"
 #include "server.h"
 #include "chat/ws_text_frame.h"
+#include "server_msgpack.h"
+
+static void ws_send_close(client_t* client, u16 code, bool stream);
 
 ssize_t 
 server_ws_pong(client_t* client, const void* payload, size_t len)
@@ -25,62 +28,68 @@ server_ws_parse_check_offset(const ws_t* ws, size_t* offset)
         *offset += WS_MASKKEY_LEN;
 }
 
-enum client_recv_status 
-server_ws_parse(eworker_t* th, client_t* client, 
-                u8* buf, size_t buf_len)
+/* 
+ * Parse frame header. 
+ * Returns false if `buf` doesn't have the whole header yet.
+ */
+static bool
+server_ws_parse_header(ws_t* ws, const u8* buf, size_t buf_len, size_t* offset)
 {
-    ws_t ws;
-    memset(&ws, 0, sizeof(ws_t));
-    size_t offset = sizeof(ws_frame_t);
-    u8* next_buf = NULL;
-    size_t next_size = 0;
-    enum client_recv_status ret = RECV_OK;
+    *offset = sizeof(ws_frame_t);
+    if (buf_len < *offset)
+        return false;
 
-    memcpy(&ws.frame, buf, sizeof(ws_frame_t));
+    memcpy(&ws->frame, buf, sizeof(ws_frame_t));
 
     // Set the payload offset
-    server_ws_parse_check_offset(&ws, &offset);
+    server_ws_parse_check_offset(ws, offset);
+    if (buf_len < *offset)
+        return false;
 
-    if (ws.frame.payload_len == 126)
+    if (ws->frame.payload_len == 126)
     {
-        ws.ext.u16 = WS_PAYLOAD_LEN16(buf);
-        ws.payload_len = (u16)ws.ext.u16;
+        ws->ext.u16 = WS_PAYLOAD_LEN16(buf);
+        ws->payload_len = (u16)ws->ext.u16;
     }
-    else if (ws.frame.payload_len == 127)
+    else if (ws->frame.payload_len == 127)
     {
-        ws.ext.u64 = WS_PAYLOAD_LEN64(buf);
-        ws.payload_len = ws.ext.u64;
+        ws->ext.u64 = WS_PAYLOAD_LEN64(buf);
+        ws->payload_len = ws->ext.u64;
     }
     else
-        ws.payload_len   = ws.frame.payload_len;
+        ws->payload_len   = ws->frame.payload_len;
+
+    return true;
+}
 
-    const size_t total_size = ws.payload_len + offset;
+/* Keep the partial frame for the next read */
+static enum client_recv_status
+server_ws_carry(client_t* client, const u8* buf, size_t buf_len, size_t need)
+{
+    /* +1 for NUL after payload */
+    const size_t size = ((need > buf_len) ? need : buf_len) + 1;
 
-    if (total_size < buf_len)
+    client->recv.data = malloc(size);
+    if (client->recv.data == NULL)
     {
-        /*
-         * If total packet size is less than received buffer size,
-         * that means 2 or more packets in received buffer recv() from client
-         * Calculate the pointer to the next packet in the buffer and its size
-         */
-        next_buf = buf + total_size;
-        next_size = buf_len - total_size;
+        error("Client fd:%d carry buffer malloc(%zu): %s\n", 
+              client->addr.sock, size, ERRSTR);
+        return RECV_ERROR;
     }
-    else if (total_size > buf_len)
-    {
-        /*
-         * If the total packet size is bigger than the recv buffer size
-         *
-         * resize buffer based on the packet header's payload size,
-         * and update client recv information
-         */        
-        client->recv.data = realloc(client->recv.data, total_size);
-        client->recv.data_size = total_size;
-        client->recv.offset = buf_len;
-        client->recv.busy = true;
+    memcpy(client->recv.data, buf, buf_len);
+    client->recv.len = buf_len;
+    client->recv.need = need;
 
-        return RECV_OK;
-    }
+    return RECV_OK;
+}
+
+static enum client_recv_status 
+server_ws_parse_frame(eworker_t* th, client_t* client, 
+                      u8* buf, const ws_t* frame_ws, size_t offset)
+{
+    ws_t ws = *frame_ws;
+    enum client_recv_status ret = RECV_OK;
+    u8 after_payload;
 
     if (ws.frame.mask)
     {
@@ -93,6 +102,13 @@ server_ws_parse(eworker_t* th, client_t* client,
     else
         ws.payload = (char*)buf + offset;
 
+    /* 
+     * NUL terminate payload, buffer always has 1 byte to spare.
+     * It may be the next frame's first byte, so put it back after.
+     */
+    after_payload = ws.payload[ws.payload_len];
+    ws.payload[ws.payload_len] = 0x00;
+
     switch (ws.frame.opcode)
     {
         case WS_CONTINUE_FRAME:
@@ -103,10 +119,12 @@ server_ws_parse(eworker_t* th, client_t* client,
                                         ws.payload_len);
             break;
         case WS_BINARY_FRAME:
-            warn("Not handled binary frame: %s\n", ws.payload);
+            ret = server_ws_handle_binary_frame(th, client, (u8*)ws.payload, 
+                                                ws.payload_len);
             break;
         case WS_CLOSE_FRAME:
-            return RECV_DISCONNECT;
+            ret = RECV_DISCONNECT;
+            break;
         case WS_PING_FRAME:
             server_ws_pong(client, ws.payload, ws.payload_len);
             break;
@@ -118,31 +136,83 @@ server_ws_parse(eworker_t* th, client_t* client,
             break;
     }
 
-    if (next_buf && ret == RECV_OK)
-        ret = server_ws_parse(th, client, next_buf, next_size);
-    else
-        client->recv.busy = false;
+    ws.payload[ws.payload_len] = after_payload;
 
     return ret;
 }
 
-ssize_t 
-ws_send_adv(client_t* client, u8 opcode, const char* buf, size_t len, 
-                    const u8* maskkey) 
+enum client_recv_status 
+server_ws_parse(eworker_t* th, client_t* client, 
+                u8* buf, size_t buf_len)
+{
+    ws_t ws;
+    size_t offset;
+    size_t total_size;
+    enum client_recv_status ret = RECV_OK;
+
+    /* recv() may give many frames, or cut one anywhere. */
+    while (buf_len && ret == RECV_OK)
+    {
+        memset(&ws, 0, sizeof(ws_t));
+
+        if (!server_ws_parse_header(&ws, buf, buf_len, &offset))
+            return server_ws_carry(client, buf, buf_len, 0);
+
+        if (ws.payload_len > th->server->conf.ws_frame_max ||
+            ws.payload_len > SIZE_MAX - offset - 1)
+        {
+            warn("Client fd:%d frame too big: %zu\n", 
+                 client->addr.sock, ws.payload_len);
+            ws_send_close(client, WS_CLOSE_TOO_BIG, false);
+            return RECV_DISCONNECT;
+        }
+        total_size = ws.payload_len + offset;
+
+        if (total_size > buf_len)
+            return server_ws_carry(client, buf, buf_len, total_size);
+
+        ret = server_ws_parse_frame(th, client, buf, &ws, offset);
+
+        buf += total_size;
+        buf_len -= total_size;
+    }
+
+    return ret;
+}
+
+#define WS_FRAME_MAX_IOV 8
+
+/* Send one frame, as one server_send() so it's never split up. */
+static ssize_t
+ws_send_frame(client_t* client, bool fin, u8 opcode, 
+              const struct iovec* payload, size_t n, const u8* maskkey,
+              bool stream)
 {
     ssize_t bytes_sent = 0;
-    struct iovec iov[4];
+    struct iovec iov[WS_FRAME_MAX_IOV];
     size_t i = 0;
+    size_t len = 0;
+    size_t buffer_size;
+    void* buffer;
     ws_t ws = {
-        .frame.fin = 1,
+        .frame.fin = fin,
         .frame.rsv1 = 0,
         .frame.rsv2 = 0,
         .frame.rsv3 = 0,
         .frame.opcode = opcode,
         .frame.mask = (maskkey) ? 1 : 0,
-        .frame.payload_len = len
     };
 
+    if (n > WS_FRAME_MAX_IOV - 3)
+    {
+        error("ws_send_frame: Too many iovecs: %zu\n", n);
+        return -1;
+    }
+
+    for (size_t p = 0; p < n; p++)
+        len += payload[p].iov_len;
+    ws.frame.payload_len = len;
+
     iov[i].iov_base = &ws.frame;
     iov[i].iov_len = sizeof(ws_frame_t);
 
@@ -172,40 +242,363 @@ ws_send_adv(client_t* client, u8 opcode, const char* buf, size_t len,
         i++;
         iov[i].iov_base = (u8*)maskkey;
         iov[i].iov_len = WS_MASKKEY_LEN;
-
-        if (buf)
-            mask((u8*)buf, len, maskkey, WS_MASKKEY_LEN);
-
     }
 
-    if (buf)
+    for (size_t p = 0; p < n; p++)
     {
         i++;
-        iov[i].iov_base = (char*)buf;
-        iov[i].iov_len = len;
+        iov[i] = payload[p];
     }
 
     i++;
-    size_t buffer_size;
-    void* buffer = combine_buffers(iov, i, &buffer_size);
+    buffer = combine_buffers(iov, i, &buffer_size);
+
+    if (ws.frame.mask)
+        mask((u8*)buffer + (buffer_size - len), len, maskkey, WS_MASKKEY_LEN);
 
-    bytes_sent = server_send(client, buffer, buffer_size);
+    bytes_sent = (stream) 
+        ? server_send_stream(client, buffer, buffer_size)
+        : server_send(client, buffer, buffer_size);
     free(buffer);
 
     return bytes_sent;
 }
 
+ssize_t 
+ws_sendv(client_t* client, u8 opcode, const struct iovec* payload, size_t n)
+{
+    return ws_send_frame(client, true, opcode, payload, n, NULL, false);
+}
+
+ssize_t 
+ws_send_adv(client_t* client, u8 opcode, const char* buf, size_t len, 
+                    const u8* maskkey) 
+{
+    const struct iovec iov = {
+        .iov_base = (char*)buf,
+        .iov_len = (buf) ? len : 0
+    };
+
+    return ws_send_frame(client, true, opcode, &iov, 1, maskkey, false);
+}
+
+/* `stream`: as ws_send_frame(), from inside a fragmented message */
+static void
+ws_send_close(client_t* client, u16 code, bool stream)
+{
+    const u16 code_be = htons(code);
+    const struct iovec iov = {
+        .iov_base = (void*)&code_be,
+        .iov_len = sizeof(u16)
+    };
+
+    ws_send_frame(client, true, WS_CLOSE_FRAME, &iov, 1, NULL, stream);
+}
+
+void 
+ws_stream_init(ws_stream_t* stream, client_t* client)
+{
+    server_client_ref(client);
+    stream->client = client;
+    stream->owned = (client->owner == eworker_self);
+    stream->opcode = WS_TEXT_FRAME;
+    stream->len = 0;
+    stream->total = 0;
+    stream->err = false;
+    stream->whole = NULL;
+    stream->whole_len = 0;
+    stream->whole_size = 0;
+}
+
+/* MessagePack client, keep it all and encode it at the end */
+static void
+ws_stream_collect(ws_stream_t* stream, const char* buf, size_t len, bool fin)
+{
+    size_t size;
+    char* whole;
+
+    if (stream->err)
+        return;
+
+    if (stream->whole_len + len > WS_STREAM_WHOLE_MAX)
+    {
+        /* Nothing went out, nor can it: hang up */
+        warn("ws stream: MessagePack message over %u bytes, closing client\n", 
+             WS_STREAM_WHOLE_MAX);
+        free(stream->whole);
+        stream->whole = NULL;
+        stream->err = true;
+        ws_send_close(stream->client, WS_CLOSE_TOO_BIG, false);
+        if (stream->owned)
+            server_set_client_err(stream->client, CLIENT_ERR_WS);
+        return;
+    }
+
+    if (stream->whole_len + len > stream->whole_size)
+    {
+        size = (stream->whole_size) ? stream->whole_size : WS_STREAM_CHUNK;
+        while (size < stream->whole_len + len)
+            size *= 2;
+        if ((whole = realloc(stream->whole, WS_HDR_MAX + size)) == NULL)
+        {
+            error("ws stream realloc: %s\n", ERRSTR);
+            stream->err = true;
+            return;
+        }
+        stream->whole = whole;
+        stream->whole_size = size;
+    }
+    memcpy(stream->whole + WS_HDR_MAX + stream->whole_len, buf, len);
+    stream->whole_len += len;
+
+    if (fin && ws_send_json_reserved(stream->client, stream->whole, 
+                                     stream->whole_len, NULL) > 0)
+        stream->total = stream->whole_len;
+    else if (fin)
+        stream->err = true;
+}
+
+static void
+ws_stream_send(ws_stream_t* stream, const char* buf, size_t len, bool fin)
+{
+    client_t* client = stream->client;
+    const struct iovec iov = {
+        .iov_base = (char*)buf,
+        .iov_len = len
+    };
+
+    if (client->state & CLIENT_STATE_WS_MSGPACK)
+    {
+        ws_stream_collect(stream, buf, len, fin);
+        return;
+    }
+
+    /* First fragment, other messages go to the mailbox until the final one. */
+    if (stream->owned && stream->opcode == WS_TEXT_FRAME)
+        client->streams++;
+
+    if (!stream->err &&
+        ws_send_frame(client, fin, stream->opcode, &iov, 1, NULL, true) <= 0)
+        stream->err = true;
+
+    stream->opcode = WS_CONTINUE_FRAME;
+    stream->total += len;
+
+    if (stream->owned && fin && --client->streams == 0)
+        server_mailbox_flush(client);
+}
+
+void 
+ws_stream_write(ws_stream_t* stream, const char* buf, size_t len)
+{
+    if (stream->len + len > WS_STREAM_CHUNK)
+    {
+        ws_stream_send(stream, stream->buf, stream->len, false);
+        stream->len = 0;
+    }
+
+    if (len > WS_STREAM_CHUNK)
+        ws_stream_send(stream, buf, len, false);
+    else
+    {
+        memcpy(stream->buf + stream->len, buf, len);
+        stream->len += len;
+    }
+}
+
+ssize_t 
+ws_stream_end(ws_stream_t* stream)
+{
+    ws_stream_send(stream, stream->buf, stream->len, true);
+    stream->len = 0;
+    free(stream->whole);
+    stream->whole = NULL;
+    server_client_unref(stream->client);
+
+    return (stream->err) ? -1 : (ssize_t)stream->total;
+}
+
+void
+ws_stream_abort(ws_stream_t* stream)
+{
+    free(stream->whole);
+    stream->whole = NULL;
+    server_client_unref(stream->client);
+}
+
+void
+ws_stream_fail(ws_stream_t* stream)
+{
+    client_t* client = stream->client;
+
+    if (stream->total == 0)
+    {
+        ws_stream_abort(stream);
+        return;
+    }
+
+    /* Control frames may come between fragments, the rest never does */
+    if (!stream->err)
+        ws_send_close(client, WS_CLOSE_INTERNAL_ERR, true);
+    stream->len = 0;
+    stream->err = true;
+
+    if (stream->owned)
+    {
+        /* Nothing more goes out, its next read disconnects it */
+        server_set_client_err(client, CLIENT_ERR_WS);
+        if (--client->streams == 0)
+            server_mailbox_flush(client);
+    }
+    server_client_unref(client);
+}
+
 ssize_t 
 ws_send(client_t* client, const char* buf, size_t len)
 {
     return ws_send_adv(client, WS_TEXT_FRAME, buf, len, NULL);
 }
 
+static ssize_t 
+ws_msgpack_send(client_t* client, json_object* json)
+{
+    mp_buf_t mp;
+    ssize_t bytes_sent;
+
+    if (!json_to_msgpack(json, &mp, WS_HDR_MAX))
+        return -1;
+
+    bytes_sent = ws_send_reserved(client, WS_BINARY_FRAME, (char*)mp.data, mp.len);
+    free(mp.data);
+
+    return bytes_sent;
+}
+
 ssize_t 
 ws_json_send(client_t* client, json_object* json)
 {
     size_t len;
-    const char* string = json_object_to_json_string_length(json, 0, &len);
+    const char* string;
+
+    /* Async completion for a client that's gone */
+    if (client == NULL)
+        return -1;
+
+    if (client->state & CLIENT_STATE_WS_MSGPACK)
+        return ws_msgpack_send(client, json);
+
+    string = json_object_to_json_string_length(json, 0, &len);
 
     return ws_send(client, string, len);
 }
+
+ssize_t 
+ws_json_send_error(client_t* client, const char* errmsg)
+{
+    json_object* resp;
+    ssize_t bytes_sent;
+
+    if (client == NULL)
+        return -1;
+
+    resp = json_object_new_object();
+    json_object_object_add(resp, "cmd",
+                           json_object_new_string("error"));
+    json_object_object_add(resp, "error_msg",
+                           json_object_new_string(errmsg));
+    bytes_sent = ws_json_send(client, resp);
+    json_object_put(resp);
+
+    return bytes_sent;
+}
+
+ssize_t 
+ws_json_splice(client_t* client, const char* prefix, size_t prefix_len, 
+               const char* raw_json, size_t raw_json_len)
+{
+    const struct iovec iov[3] = {
+        { .iov_base = (char*)prefix,   .iov_len = prefix_len },
+        { .iov_base = (char*)raw_json, .iov_len = raw_json_len },
+        { .iov_base = "}",             .iov_len = 1 },
+    };
+
+    char* buf;
+    size_t len = 0;
+    ssize_t bytes_sent;
+
+    if (client == NULL)
+        return -1;
+
+    if (!(client->state & CLIENT_STATE_WS_MSGPACK))
+        return ws_sendv(client, WS_TEXT_FRAME, iov, 3);
+
+    if ((buf = malloc(WS_HDR_MAX + prefix_len + raw_json_len + 1)) == NULL)
+    {
+        error("ws json splice malloc: %s\n", ERRSTR);
+        return -1;
+    }
+    for (size_t i = 0; i < 3; i++)
+    {
+        memcpy(buf + WS_HDR_MAX + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    bytes_sent = ws_send_json_reserved(client, buf, len, NULL);
+    free(buf);
+
+    return bytes_sent;
+}
+
+ssize_t 
+ws_send_reserved(client_t* client, u8 opcode, char* buf, size_t len)
+{
+    u8 hdr[WS_HDR_MAX];
+    size_t hdr_len;
+    char* frame;
+
+    hdr[0] = WS_FIN_BIT | opcode;
+    if (len < 126)
+    {
+        hdr[1] = len;
+        hdr_len = 2;
+    }
+    else if (len <= UINT16_MAX)
+    {
+        hdr[1] = 126;
+        swpcpy(hdr + 2, (const u8*)&len, sizeof(u16));
+        hdr_len = 2 + sizeof(u16);
+    }
+    else
+    {
+        hdr[1] = 127;
+        swpcpy(hdr + 2, (const u8*)&len, sizeof(u64));
+        hdr_len = 2 + sizeof(u64);
+    }
+
+    /* Header goes right before the payload, no copy. */
+    frame = buf + WS_HDR_MAX - hdr_len;
+    memcpy(frame, hdr, hdr_len);
+
+    return server_send(client, frame, hdr_len + len);
+}
+
+ssize_t 
+ws_send_json_reserved(client_t* client, char* buf, size_t len, mp_buf_t* mp)
+{
+    mp_buf_t once = {0};
+    ssize_t bytes_sent;
+
+    if (!(client->state & CLIENT_STATE_WS_MSGPACK))
+        return ws_send_reserved(client, WS_TEXT_FRAME, buf, len);
+
+    if (mp == NULL)
+        mp = &once;
+    if (mp->data == NULL && (mp->err || 
+        !json_text_to_msgpack(buf + WS_HDR_MAX, len, mp, WS_HDR_MAX)))
+        return -1;
+
+    bytes_sent = ws_send_reserved(client, WS_BINARY_FRAME, (char*)mp->data, mp->len);
+    if (mp == &once)
+        free(once.data);
+
+    return bytes_sent;
+}
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+
+#                                                  #
+#  bench_eworker_cpu - Server CPU usage benchmark  #
+#                                                  #
+
+"""
+Purpose:
+    Measures the server's CPU usage while idle and while
+    the DB pipeline is loaded.
+
+    Idle:   No requests, eworkers should sleep (~0%).
+    Loaded: One client keeping <depth> "client_groups" requests 
+            (a DB query each) in flight.
+
+    Run it against the old and new server build to compare.
+
+Usage:
+    bench_eworker_cpu.py <server pid> <username> <password> [depth] [seconds]
+"""
+
+import os
+import sys
+import time
+import asyncio
+import websockets
+import json
+import ssl
+
+host = "127.0.0.1"
+port = "8080"
+uri = f"wss://{host}:{port}"
+
+ssl_context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+ssl_context.check_hostname = False
+ssl_context.verify_mode = ssl.CERT_NONE;
+
+def cpu_time(pid: int) -> float:
+    with open(f"/proc/{pid}/stat") as f:
+        # Skip "pid (comm)", comm may contain spaces
+        fields = f.read().rsplit(")", 1)[1].split()
+    utime = int(fields[11])
+    stime = int(fields[12])
+    return (utime + stime) / os.sysconf("SC_CLK_TCK")
+
+async def measure(pid: int, seconds: float) -> float:
+    cpu_start = cpu_time(pid)
+    wall_start = time.monotonic()
+    await asyncio.sleep(seconds)
+    cpu = cpu_time(pid) - cpu_start
+    wall = time.monotonic() - wall_start
+    return cpu / wall * 100
+
+async def client(username: str, password: str, depth: int, stop: asyncio.Event) -> int:
+    login_packet = {
+        "cmd": "login",
+        "username": username,
+        "password": password,
+        "session": False
+    }
+    user_groups_packet = json.dumps({
+        "cmd": "client_groups"
+    })
+    requests = 0
+    async with websockets.connect(uri, ssl=ssl_context) as ws:
+        await ws.send(json.dumps(login_packet))
+        packet = json.loads(await ws.recv())
+        if packet["cmd"] != "session":
+            print("Login failed:", packet)
+            return 0
+
+        while not stop.is_set():
+            for _ in range(depth):
+                await ws.send(user_groups_packet)
+            done = 0
+            while done < depth:
+                packet = json.loads(await ws.recv())
+                if packet["cmd"] == "client_groups":
+                    done += 1
+            requests += depth
+    return requests
+
+async def main(pid: int, username: str, password: str, depth: int, seconds: float) -> int:
+    idle = await measure(pid, seconds)
+    print(f"Idle:   {idle:6.2f}% CPU")
+
+    stop = asyncio.Event()
+    task = asyncio.create_task(client(username, password, depth, stop))
+    # Let the client log in first
+    await asyncio.sleep(1)
+    loaded = await measure(pid, seconds)
+    stop.set()
+    requests = await task
+
+    print(f"Loaded: {loaded:6.2f}% CPU (depth: {depth}, {requests / (seconds + 1):.0f} req/s)")
+    return 0
+
+if __name__ == '__main__':
+    if len(sys.argv) >= 4:
+        pid = int(sys.argv[1])
+        username = sys.argv[2]
+        password = sys.argv[3]
+        depth = int(sys.argv[4]) if len(sys.argv) >= 5 else 16
+        seconds = float(sys.argv[5]) if len(sys.argv) >= 6 else 5
+        ret = asyncio.run(main(pid, username, password, depth, seconds))
+        sys.exit(ret)
+    print("Need server pid, username and password arguments")
+    sys.exit(-1)
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+
+#                                                       #
+#  bench_idle_conns - Server memory per idle connection #
+#                                                       #
+
+"""
+Purpose:
+    Opens <count> WebSocket connections, leaves them idle and
+    reports the server's RSS growth per connection.
+
+    Run the server with and without --footprint to compare.
+    With [user prefix], every connection registers and logs in
+    as <prefix><n> (password: <prefix>), like a real idle client.
+
+    Connections are spread over 127.0.0.x source addresses, one
+    address only has ~28k ephemeral ports. The open file limit
+    of both this script and the server must be above <count>.
+
+Usage:
+    bench_idle_conns.py <server pid> [count=10000,100000] [user prefix]
+"""
+
+import os
+import sys
+import time
+import resource
+import asyncio
+import websockets
+import json
+import ssl
+
+host = "127.0.0.1"
+port = "8080"
+uri = f"wss://{host}:{port}"
+conns_per_addr = 25000
+max_connecting = 256
+
+ssl_context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+ssl_context.check_hostname = False
+ssl_context.verify_mode = ssl.CERT_NONE;
+
+def rss_bytes(pid: int) -> int:
+    with open(f"/proc/{pid}/status") as f:
+        for line in f:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1]) * 1024
+    return 0
+
+def raise_nofile(count: int):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    want = min(hard, count + 1024)
+    if soft < want:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (want, hard))
+    if want < count + 1024:
+        print(f"Warning: RLIMIT_NOFILE hard limit {hard} < {count}")
+
+async def login(ws, username: str):
+    register_packet = {
+        "cmd": "register",
+        "username": username,
+        "displayname": username,
+        "password": username,
+        "session": False
+    }
+    await ws.send(json.dumps(register_packet))
+    packet = json.loads(await ws.recv())
+    if packet["cmd"] == "session":
+        return
+    # Already registered from an earlier run
+    login_packet = {
+        "cmd": "login",
+        "username": username,
+        "password": username,
+        "session": False
+    }
+    await ws.send(json.dumps(login_packet))
+    packet = json.loads(await ws.recv())
+    if packet["cmd"] != "session":
+        raise RuntimeError(f"{username} login failed: {packet}")
+
+async def connect(n: int, prefix: str | None, sem: asyncio.Semaphore):
+    local_addr = (f"127.0.0.{1 + n // conns_per_addr}", 0)
+    async with sem:
+        ws = await websockets.connect(uri, ssl=ssl_context, local_addr=local_addr,
+                                      ping_interval=None, max_queue=1)
+        if prefix:
+            await login(ws, f"{prefix}{n}")
+    return ws
+
+async def run(pid: int, count: int, prefix: str | None) -> list:
+    sem = asyncio.Semaphore(max_connecting)
+    conns = []
+
+    start_rss = rss_bytes(pid)
+    start = time.monotonic()
+    for i in range(0, count, max_connecting):
+        batch = [connect(n, prefix, sem) for n in range(i, min(count, i + max_connecting))]
+        conns += await asyncio.gather(*batch)
+    took = time.monotonic() - start
+
+    # Let the server settle (OpenSSL handshake buffers, etc.)
+    await asyncio.sleep(2)
+    rss = rss_bytes(pid)
+
+    print(f"{count:7} conns in {took:6.1f}s: RSS {start_rss / 1024**2:8.1f} -> {rss / 1024**2:8.1f} MiB, "
+          f"{(rss - start_rss) / count:7.0f} bytes/conn")
+
+    await asyncio.gather(*(ws.close() for ws in conns))
+    # Give the server time to free them before the next round
+    await asyncio.sleep(2)
+
+async def main(pid: int, counts: list, prefix: str | None) -> int:
+    raise_nofile(max(counts))
+    for count in counts:
+        await run(pid, count, prefix)
+    return 0
+
+if __name__ == '__main__':
+    if len(sys.argv) >= 2:
+        pid = int(sys.argv[1])
+        counts = [int(n) for n in sys.argv[2].split(",")] if len(sys.argv) >= 3 else [10000, 100000]
+        prefix = sys.argv[3] if len(sys.argv) >= 4 else None
+        ret = asyncio.run(main(pid, counts, prefix))
+        sys.exit(ret)
+    print("Need server pid argument")
+    sys.exit(-1)
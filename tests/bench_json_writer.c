@@ -0,0 +1,103 @@
+/*
+ * bench_json_writer - json_writer_t vs json-c 
+ *
+ * Builds a typical "group_msg" broadcast N times with both
+ * and prints ns/msg.
+ *
+ * Usage:
+ *  bench_json_writer [iterations]
+ */
+
+#include "server_json.h"
+#include <time.h>
+
+#define DEFAULT_ITER 1000000
+
+static const char* content = "Hello everyone, \"this\" is a pretty typical message.\nWith a newline and some more text to make it look real.";
+static const char* attachments = "[{\"hash\":\"3f1c2b9e0a4d5e6f7a8b9c0d1e2f3a4b5c6d7e8f9a0b1c2d3e4f5a6b7c8d9e0f\",\"name\":\"cat.png\",\"type\":\"image/png\",\"size\":123456}]";
+static const char* timestamp = "2024-03-14 15:09:26.535897";
+
+static f64
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t
+bench_jsonc(size_t iter)
+{
+    size_t total = 0;
+
+    for (size_t i = 0; i < iter; i++)
+    {
+        json_object* json = json_object_new_object();
+        size_t len;
+
+        json_object_object_add(json, "cmd", json_object_new_string("group_msg"));
+        json_object_object_add(json, "msg_id", json_object_new_int(i));
+        json_object_object_add(json, "group_id", json_object_new_int(42));
+        json_object_object_add(json, "user_id", json_object_new_int(69));
+        json_object_object_add(json, "content", json_object_new_string(content));
+        json_object_object_add(json, "attachments", json_tokener_parse(attachments));
+        json_object_object_add(json, "timestamp", json_object_new_string(timestamp));
+        json_object_to_json_string_length(json, 0, &len);
+        total += len;
+
+        json_object_put(json);
+    }
+    return total;
+}
+
+static size_t
+bench_jw(size_t iter)
+{
+    size_t total = 0;
+    char buf[4096];
+    json_writer_t jw;
+
+    for (size_t i = 0; i < iter; i++)
+    {
+        jw_init(&jw, buf, sizeof(buf));
+        jw_obj_begin(&jw);
+        jw_key_str(&jw, "cmd", "group_msg");
+        jw_key_int(&jw, "msg_id", i);
+        jw_key_int(&jw, "group_id", 42);
+        jw_key_int(&jw, "user_id", 69);
+        jw_key_str(&jw, "content", content);
+        jw_key_raw(&jw, "attachments", attachments, strlen(attachments));
+        jw_key_str(&jw, "timestamp", timestamp);
+        jw_obj_end(&jw);
+        total += jw.len;
+    }
+    return total;
+}
+
+int 
+main(int argc, const char** argv)
+{
+    size_t iter = (argc >= 2) ? strtoull(argv[1], NULL, 10) : DEFAULT_ITER;
+    f64 start;
+    f64 jsonc_ns;
+    f64 jw_ns;
+    size_t jsonc_bytes;
+    size_t jw_bytes;
+
+    if (iter == 0)
+        iter = DEFAULT_ITER;
+
+    start = now_ns();
+    jsonc_bytes = bench_jsonc(iter);
+    jsonc_ns = now_ns() - start;
+
+    start = now_ns();
+    jw_bytes = bench_jw(iter);
+    jw_ns = now_ns() - start;
+
+    printf("json-c: %8.1f ns/msg (%zu bytes)\n", jsonc_ns / iter, jsonc_bytes / iter);
+    printf("jw:     %8.1f ns/msg (%zu bytes)\n", jw_ns / iter, jw_bytes / iter);
+    printf("speedup: %.2fx\n", jsonc_ns / jw_ns);
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * bench_msg_history - get_group_msgs latency against scrollback depth
+ *
+ * Fills a Messages-shaped table with `rows` messages spread round-robin
+ * over `groups` groups, then times one page of group 1 at increasing
+ * depths, by OFFSET (select_group_msgs.sql) and by keyset
+ * (select_group_msgs_before.sql). Once with only the msg_id primary key,
+ * once more after the schema.sql index on (group_id, msg_id).
+ *
+ * Uses its own bench_history table, dropped at the end.
+ *
+ * Usage:
+ *  bench_msg_history [database] [rows] [groups]
+ */
+
+#include "common.h"
+#include <libpq-fe.h>
+#include <time.h>
+
+#define DEFAULT_DB      "chitychat"
+#define DEFAULT_ROWS    10000000
+#define DEFAULT_GROUPS  10
+#define PAGE            50
+#define RUNS            5       /* Median of */
+
+static const char* setup_sql =
+    "DROP TABLE IF EXISTS bench_history;"
+    "CREATE TABLE bench_history("
+    "    msg_id int PRIMARY KEY, user_id int, group_id int, content text,"
+    "    timestamp timestamp DEFAULT CURRENT_TIMESTAMP, attachments json DEFAULT null,"
+    "    parent_msg_id int DEFAULT null);";
+
+static const char* fill_sql =
+    "INSERT INTO bench_history (msg_id, user_id, group_id, content, attachments) "
+    "SELECT i, 1 + i % 97, 1 + (i - 1) % $2::int, "
+    "    'Message number ' || i || ', about as long as a typical one.', '[]' "
+    "FROM generate_series(1, $1::int) i;";
+
+static const char* offset_sql =
+    "SELECT row_to_json(msg), msg.msg_id FROM ("
+    "    SELECT * FROM bench_history WHERE group_id = $1::int"
+    "    ORDER BY msg_id DESC LIMIT $2::int OFFSET $3::int) msg;";
+
+static const char* keyset_sql =
+    "SELECT row_to_json(msg), msg.msg_id FROM ("
+    "    SELECT * FROM bench_history WHERE group_id = $1::int AND msg_id < $3::int"
+    "    ORDER BY msg_id DESC LIMIT $2::int) msg;";
+
+static const char* index_sql =
+    "CREATE INDEX bench_history_group_id_msg_id ON bench_history(group_id, msg_id);"
+    "ANALYZE bench_history;";
+
+static f64
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool
+res_ok(PGresult* res, ExecStatusType expect)
+{
+    bool ok = PQresultStatus(res) == expect;
+
+    if (!ok)
+        fprintf(stderr, "%s\n", PQresultErrorMessage(res));
+    PQclear(res);
+    return ok;
+}
+
+static bool
+exec_ok(PGconn* conn, const char* sql)
+{
+    return res_ok(PQexec(conn, sql), PGRES_COMMAND_OK);
+}
+
+static i32
+cmp_f64(const void* a, const void* b)
+{
+    f64 x = *(const f64*)a;
+    f64 y = *(const f64*)b;
+    return (x > y) - (x < y);
+}
+
+/* Median ms of one page, $3 is the offset or the cursor */
+static f64
+bench_page(PGconn* conn, const char* stmt, u32 arg)
+{
+    char arg_str[16];
+    const char* vals[3] = {"1", NULL, arg_str};
+    char page_str[16];
+    f64 runs[RUNS];
+    f64 start;
+    PGresult* res;
+
+    snprintf(page_str, sizeof(page_str), "%d", PAGE);
+    snprintf(arg_str, sizeof(arg_str), "%u", arg);
+    vals[1] = page_str;
+
+    for (i32 i = 0; i < RUNS; i++)
+    {
+        start = now_sec();
+        res = PQexecPrepared(conn, stmt, 3, vals, NULL, NULL, 0);
+        runs[i] = (now_sec() - start) * 1000;
+        if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0)
+            fprintf(stderr, "%s %u: %d rows %s\n", stmt, arg, PQntuples(res),
+                    PQresultErrorMessage(res));
+        PQclear(res);
+    }
+    qsort(runs, RUNS, sizeof(f64), cmp_f64);
+    return runs[RUNS / 2];
+}
+
+int
+main(int argc, const char** argv)
+{
+    const char* dbname = (argc > 1) ? argv[1] : DEFAULT_DB;
+    const u32 total = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_ROWS;
+    const u32 groups = (argc > 3) ? strtoul(argv[3], NULL, 10) : DEFAULT_GROUPS;
+    const u32 per_group = (total - 1) / groups + 1;
+    const u32 depths[] = {0, 1000, 10000, 100000, 250000, 500000, 1000000};
+    const size_t n_depths = sizeof(depths) / sizeof(*depths);
+    f64 ms[2][2][sizeof(depths) / sizeof(*depths)];
+    char total_str[16];
+    char groups_str[16];
+    const char* fill_vals[2] = {total_str, groups_str};
+    char conninfo[256];
+    PGconn* conn;
+    u32 newest;
+    u32 depth;
+    f64 start;
+
+    snprintf(conninfo, sizeof(conninfo), "dbname=%s", dbname);
+    conn = PQconnectdb(conninfo);
+    if (PQstatus(conn) != CONNECTION_OK)
+    {
+        fprintf(stderr, "connect: %s\n", PQerrorMessage(conn));
+        return 1;
+    }
+
+    printf("Filling %u rows over %u groups...\n", total, groups);
+    snprintf(total_str, sizeof(total_str), "%u", total);
+    snprintf(groups_str, sizeof(groups_str), "%u", groups);
+    start = now_sec();
+    if (!exec_ok(conn, setup_sql) ||
+        !res_ok(PQexecParams(conn, fill_sql, 2, NULL, fill_vals, NULL, NULL, 0),
+                PGRES_COMMAND_OK) ||
+        !exec_ok(conn, "ANALYZE bench_history;"))
+        return 1;
+    printf("  %.1fs\n\n", now_sec() - start);
+
+    if (!res_ok(PQprepare(conn, "offset", offset_sql, 3, NULL), PGRES_COMMAND_OK) ||
+        !res_ok(PQprepare(conn, "keyset", keyset_sql, 3, NULL), PGRES_COMMAND_OK))
+        return 1;
+
+    /* Group 1 has msg_id 1, 1 + groups, ..., the one at depth d is newest - d * groups */
+    newest = 1 + (total - 1) / groups * groups;
+
+    for (i32 indexed = 0; indexed < 2; indexed++)
+    {
+        if (indexed && !exec_ok(conn, index_sql))
+            return 1;
+        for (size_t i = 0; i < n_depths; i++)
+        {
+            if ((depth = depths[i]) >= per_group)
+            {
+                ms[indexed][0][i] = ms[indexed][1][i] = -1;
+                continue;
+            }
+            ms[indexed][0][i] = bench_page(conn, "offset", depth);
+            /* Cursor is the msg_id of the last one seen, one above depth d */
+            ms[indexed][1][i] = bench_page(conn, "keyset", newest - depth * groups + 1);
+        }
+    }
+
+    printf("%u rows/group, %d per page, median of %d, ms\n\n", per_group, PAGE, RUNS);
+    printf("%-10s %14s %14s %14s %14s\n", "depth",
+           "offset", "keyset", "offset+index", "keyset+index");
+    for (size_t i = 0; i < n_depths; i++)
+    {
+        if (ms[0][0][i] < 0)
+            break;
+        printf("%-10u %14.3f %14.3f %14.3f %14.3f\n", depths[i],
+               ms[0][0][i], ms[0][1][i], ms[1][0][i], ms[1][1][i]);
+    }
+
+    exec_ok(conn, "DROP TABLE bench_history;");
+    PQfinish(conn);
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * bench_msg_insert - group_msg inserts per second against batch size
+ *
+ * Inserts the same rows one INSERT per message (insert_msg.sql), then
+ * as multi-row INSERTs shaped like insert_msg_batch.sql, `batch` rows
+ * each. Statements are pipelined like an eworker does (a sync after
+ * each, up to WINDOW in flight), every one of them is its own commit.
+ *
+ * Uses its own bench_members/bench_messages tables, dropped at the end.
+ *
+ * Usage:
+ *  bench_msg_insert [database] [rows]
+ */
+
+#include "chat/db_array.h"
+#include <libpq-fe.h>
+#include <time.h>
+
+#define DEFAULT_DB      "chitychat"
+#define DEFAULT_ROWS    20000
+#define WINDOW          32
+#define COLS            4
+
+static const char* content = "Hello everyone, \"this\" is a pretty typical message.\nWith a newline and some more text to make it look real.";
+
+static const char* setup_sql =
+    "DROP TABLE IF EXISTS bench_messages, bench_members;"
+    "CREATE TABLE bench_members("
+    "    user_id int, group_id int, PRIMARY KEY (user_id, group_id));"
+    "INSERT INTO bench_members VALUES (1, 1);"
+    "CREATE TABLE bench_messages("
+    "    msg_id SERIAL PRIMARY KEY, user_id int, group_id int, content text,"
+    "    timestamp timestamp DEFAULT CURRENT_TIMESTAMP, attachments json DEFAULT null,"
+    "    FOREIGN KEY (user_id, group_id) REFERENCES bench_members(user_id, group_id));";
+
+static const char* single_sql =
+    "INSERT INTO bench_messages (user_id, group_id, content, attachments) "
+    "VALUES ($1::int, $2::int, $3::text, $4::json) "
+    "RETURNING msg_id, timestamp;";
+
+static const char* batch_sql =
+    "WITH rows AS ("
+    "    SELECT nextval('bench_messages_msg_id_seq')::int AS msg_id, r.*"
+    "    FROM unnest($1::int[], $2::int[], $3::text[], $4::json[])"
+    "        WITH ORDINALITY AS r(user_id, group_id, content, attachments, n)"
+    "    WHERE EXISTS ("
+    "        SELECT 1 FROM bench_members gm"
+    "        WHERE gm.user_id = r.user_id AND gm.group_id = r.group_id)"
+    "), ins AS ("
+    "    INSERT INTO bench_messages (msg_id, user_id, group_id, content, attachments)"
+    "    SELECT msg_id, user_id, group_id, content, attachments FROM rows"
+    "    RETURNING msg_id, timestamp"
+    ")"
+    "SELECT rows.n::int, ins.msg_id, ins.timestamp FROM rows JOIN ins USING (msg_id);";
+
+static f64
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool
+exec_ok(PGconn* conn, const char* sql)
+{
+    PGresult* res = PQexec(conn, sql);
+    bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+
+    if (!ok)
+        fprintf(stderr, "%s\n", PQresultErrorMessage(res));
+    PQclear(res);
+    return ok;
+}
+
+/* One statement's rows and its sync */
+static size_t
+read_one(PGconn* conn)
+{
+    PGresult* res;
+    size_t rows = 0;
+
+    while ((res = PQgetResult(conn)))
+    {
+        if (PQresultStatus(res) == PGRES_TUPLES_OK)
+            rows += PQntuples(res);
+        else
+            fprintf(stderr, "insert: %s\n", PQresultErrorMessage(res));
+        PQclear(res);
+    }
+    res = PQgetResult(conn);
+    if (PQresultStatus(res) != PGRES_PIPELINE_SYNC)
+        fprintf(stderr, "expected sync, got %s\n", PQresStatus(PQresultStatus(res)));
+    PQclear(res);
+    return rows;
+}
+
+static bool
+send_single(PGconn* conn)
+{
+    const char* vals[COLS] = {"1", "1", content, "[]"};
+
+    return PQsendQueryParams(conn, single_sql, COLS, NULL, vals, NULL, NULL, 0) &&
+           PQpipelineSync(conn);
+}
+
+static bool
+send_batch(PGconn* conn, db_array_t* cols, size_t n)
+{
+    const char* vals[COLS];
+    const size_t content_len = strlen(content);
+
+    for (i32 c = 0; c < COLS; c++)
+        db_array_begin(cols + c);
+    for (size_t i = 0; i < n; i++)
+    {
+        db_array_int(cols + 0, 1);
+        db_array_int(cols + 1, 1);
+        db_array_str(cols + 2, content, content_len);
+        db_array_str(cols + 3, "[]", 2);
+    }
+    for (i32 c = 0; c < COLS; c++)
+    {
+        if (!db_array_end(cols + c))
+            return false;
+        vals[c] = cols[c].data;
+    }
+    return PQsendQueryParams(conn, batch_sql, COLS, NULL, vals, NULL, NULL, 0) &&
+           PQpipelineSync(conn);
+}
+
+/* `batch` 0: one INSERT per row. Rows inserted per second. */
+static f64
+bench(PGconn* conn, db_array_t* cols, size_t total, size_t batch)
+{
+    size_t sent = 0;
+    size_t inserted = 0;
+    size_t in_flight = 0;
+    size_t n;
+    f64 start;
+    bool ok;
+
+    if (!exec_ok(conn, "TRUNCATE bench_messages;"))
+        return 0;
+    PQenterPipelineMode(conn);
+
+    start = now_sec();
+    while (sent < total || in_flight)
+    {
+        if (sent < total && in_flight < WINDOW)
+        {
+            n = (batch == 0) ? 1 : batch;
+            if (n > total - sent)
+                n = total - sent;
+            ok = (batch == 0) ? send_single(conn) : send_batch(conn, cols, n);
+            if (!ok)
+            {
+                fprintf(stderr, "send: %s\n", PQerrorMessage(conn));
+                break;
+            }
+            sent += n;
+            in_flight++;
+            continue;
+        }
+        inserted += read_one(conn);
+        in_flight--;
+    }
+    start = now_sec() - start;
+
+    PQexitPipelineMode(conn);
+    if (inserted != total)
+        fprintf(stderr, "only %zu of %zu rows inserted\n", inserted, total);
+    return inserted / start;
+}
+
+int
+main(int argc, const char** argv)
+{
+    const char* dbname = (argc > 1) ? argv[1] : DEFAULT_DB;
+    const size_t total = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_ROWS;
+    const size_t batches[] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+    db_array_t cols[COLS] = {0};
+    char conninfo[256];
+    PGconn* conn;
+    f64 single;
+    f64 rate;
+
+    snprintf(conninfo, sizeof(conninfo), "dbname=%s", dbname);
+    conn = PQconnectdb(conninfo);
+    if (PQstatus(conn) != CONNECTION_OK)
+    {
+        fprintf(stderr, "connect: %s\n", PQerrorMessage(conn));
+        return 1;
+    }
+    if (!exec_ok(conn, setup_sql))
+        return 1;
+
+    printf("%zu rows, %d statements in flight\n\n", total, WINDOW);
+    printf("%-10s %14s %10s\n", "batch", "rows/s", "speedup");
+
+    single = bench(conn, cols, total, 0);
+    printf("%-10s %14.0f %9.2fx\n", "single", single, 1.0);
+    for (size_t i = 0; i < sizeof(batches) / sizeof(*batches); i++)
+    {
+        rate = bench(conn, cols, total, batches[i]);
+        printf("%-10zu %14.0f %9.2fx\n", batches[i], rate, (single) ? rate / single : 0);
+    }
+
+    exec_ok(conn, "DROP TABLE bench_messages, bench_members;");
+    for (i32 c = 0; c < COLS; c++)
+        db_array_free(cols + c);
+    PQfinish(conn);
+    return 0;
+}
@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+
+# Log in over the binary "chitychat.msgpack" subprotocol.
+# Requires: pip install msgpack
+
+import sys
+import asyncio
+import websockets
+import msgpack
+import json
+import ssl
+
+do_session = True
+host = "127.0.0.1"
+port = "8080"
+uri = f"wss://{host}:{port}"
+subprotocol = "chitychat.msgpack"
+
+ssl_context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+ssl_context.check_hostname = False
+ssl_context.verify_mode = ssl.CERT_NONE;
+
+def decode(data) -> dict:
+    # Pre-built JSON messages still come as text frames
+    if isinstance(data, bytes):
+        return msgpack.unpackb(data)
+    return json.loads(data)
+
+async def main(username: str, password: str) -> int:
+    login_packet: dict = {
+        "cmd": "login",
+        "username": username,
+        "password": password,
+        "session": do_session
+    }
+    ret = -1
+    async with websockets.connect(uri, ssl=ssl_context, subprotocols=[subprotocol]) as ws:
+        if ws.subprotocol != subprotocol:
+            print(f"Server did not accept subprotocol: {ws.subprotocol}")
+            return ret
+        await ws.send(msgpack.packb(login_packet))
+        data = await ws.recv()
+        recv_packet = decode(data)
+        if recv_packet["cmd"] == "session" and isinstance(data, bytes):
+            ret = 0
+        print(f"Recv from server {uri}:\n\t{recv_packet}")
+
+        # Bad command must come back as a binary error
+        await ws.send(msgpack.packb({"cmd": 69}))
+        data = await ws.recv()
+        recv_packet = decode(data)
+        if recv_packet["cmd"] != "error" or not isinstance(data, bytes):
+            ret = -1
+        print(f"Recv from server {uri}:\n\t{recv_packet}")
+    return ret
+
+if __name__ == '__main__':
+    if len(sys.argv) == 3:
+        username = sys.argv[1]
+        password = sys.argv[2]
+        ret = asyncio.run(main(username, password))
+        sys.exit(ret)
+    print("Need username and password arguments")
+    sys.exit(-1)